@@ -0,0 +1,953 @@
+/* Parallel fsck.ext2 - Read-only consistency checker for ext2 images */
+
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define EXT2_MAGIC 0xEF53
+#define EXT2_ROOT_INO 2
+#define EXT2_RESIZE_INO 7
+#define EXT2_GOOD_OLD_FIRST_INO 11
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+#define EXT2_NDIR_BLOCKS 12
+#define EXT2_IND_BLOCK 12
+#define EXT2_DIND_BLOCK 13
+#define EXT2_TIND_BLOCK 14
+#define EXT2_FEATURE_COMPAT_RESIZE_INODE 0x0010
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT2_FEATURE_INCOMPAT_RECOVER 0x0004
+
+#define EXT2_S_IFMT   0xF000
+#define EXT2_S_IFSOCK 0xC000
+#define EXT2_S_IFLNK  0xA000
+#define EXT2_S_IFREG  0x8000
+#define EXT2_S_IFBLK  0x6000
+#define EXT2_S_IFDIR  0x4000
+#define EXT2_S_IFCHR  0x2000
+#define EXT2_S_IFIFO  0x1000
+
+// Exit codes follow fsck(8)
+#define FSCK_OK 0
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+#define FSCK_MAX_THREADS 64
+#define FSCK_DEFAULT_REPORTS 100
+
+typedef struct {
+    u32 s_inodes_count;
+    u32 s_blocks_count;
+    u32 s_r_blocks_count;
+    u32 s_free_blocks_count;
+    u32 s_free_inodes_count;
+    u32 s_first_data_block;
+    u32 s_log_block_size;
+    u32 s_log_frag_size;
+    u32 s_blocks_per_group;
+    u32 s_frags_per_group;
+    u32 s_inodes_per_group;
+    u32 s_mtime;
+    u32 s_wtime;
+    u16 s_mnt_count;
+    u16 s_max_mnt_count;
+    u16 s_magic;
+    u16 s_state;
+    u16 s_errors;
+    u16 s_minor_rev_level;
+    u32 s_lastcheck;
+    u32 s_checkinterval;
+    u32 s_creator_os;
+    u32 s_rev_level;
+    u16 s_def_resuid;
+    u16 s_def_resgid;
+    u32 s_first_ino;
+    u16 s_inode_size;
+    u16 s_block_group_nr;
+    u32 s_feature_compat;
+    u32 s_feature_incompat;
+    u32 s_feature_ro_compat;
+    u8  s_uuid[16];
+    u8  s_volume_name[16];
+    u8  s_last_mounted[64];
+    u32 s_algo_bitmap;
+    u8  s_prealloc_blocks;
+    u8  s_prealloc_dir_blocks;
+    u16 s_reserved_gdt_blocks;
+} __attribute__((packed)) ext2_superblock_t;
+
+typedef struct {
+    u32 bg_block_bitmap;
+    u32 bg_inode_bitmap;
+    u32 bg_inode_table;
+    u16 bg_free_blocks_count;
+    u16 bg_free_inodes_count;
+    u16 bg_used_dirs_count;
+    u16 bg_pad;
+    u8  bg_reserved[12];
+} __attribute__((packed)) ext2_block_group_desc_t;
+
+typedef struct {
+    u16 i_mode;
+    u16 i_uid;
+    u32 i_size;
+    u32 i_atime;
+    u32 i_ctime;
+    u32 i_mtime;
+    u32 i_dtime;
+    u16 i_gid;
+    u16 i_links_count;
+    u32 i_blocks;
+    u32 i_flags;
+    u32 i_osd1;
+    u32 i_block[15];
+    u32 i_generation;
+    u32 i_file_acl;
+    u32 i_dir_acl;
+    u32 i_faddr;
+    u8  i_osd2[12];
+} __attribute__((packed)) ext2_inode_t;
+
+typedef struct {
+    u32 inode;
+    u16 rec_len;
+    u8  name_len;
+    u8  file_type;
+    char name[];
+} __attribute__((packed)) ext2_dir_entry_t;
+
+// Inode state recorded by pass 1
+enum {
+    INODE_UNUSED = 0,
+    INODE_FILE,
+    INODE_DIR,
+    INODE_OTHER,
+};
+
+// Filesystem image and the shared state built up by the passes. Bitmaps
+// and counters written by several workers are updated atomically; every
+// other array has one writer per entry.
+typedef struct {
+    const u8* image;
+    u64 image_size;
+    const ext2_superblock_t* sb;
+    const ext2_block_group_desc_t* gdt;
+    u32 block_size;
+    u32 num_groups;
+    u32 inode_size;
+    u32 first_ino;
+    bool has_filetype;
+    
+    u64* block_used;
+    u8* group_bad;
+    u8* inode_state;
+    u32* link_refs;
+    u32* parent;
+    u32* dotdot;
+    
+    u32 num_threads;
+    u32 next_group;
+    u64 errors;
+    u64 max_reports;
+    pthread_mutex_t report_lock;
+    
+    u64 used_inodes;
+    u64 used_dirs;
+    u64 used_blocks;
+} fsck_t;
+
+typedef struct {
+    const char* name;
+    double ms;
+} fsck_phase_t;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void problem(fsck_t* fs, const char* fmt, ...) {
+    u64 n = __atomic_fetch_add(&fs->errors, 1, __ATOMIC_RELAXED);
+    if (n >= fs->max_reports) {
+        return;
+    }
+    
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&fs->report_lock);
+    vprintf(fmt, args);
+    printf("\n");
+    if (n + 1 == fs->max_reports) {
+        printf("(further problems are counted but not printed)\n");
+    }
+    pthread_mutex_unlock(&fs->report_lock);
+    va_end(args);
+}
+
+static const u8* get_block(fsck_t* fs, u32 block) {
+    return fs->image + (u64)block * fs->block_size;
+}
+
+static bool block_valid(fsck_t* fs, u32 block) {
+    return block >= fs->sb->s_first_data_block && block < fs->sb->s_blocks_count;
+}
+
+static const ext2_inode_t* get_inode(fsck_t* fs, u32 ino) {
+    u32 group = (ino - 1) / fs->sb->s_inodes_per_group;
+    u32 index = (ino - 1) % fs->sb->s_inodes_per_group;
+    u64 offset = (u64)fs->gdt[group].bg_inode_table * fs->block_size + (u64)index * fs->inode_size;
+    return (const ext2_inode_t*)(fs->image + offset);
+}
+
+static u32 group_start(fsck_t* fs, u32 group) {
+    return fs->sb->s_first_data_block + group * fs->sb->s_blocks_per_group;
+}
+
+static u32 group_blocks(fsck_t* fs, u32 group) {
+    if (group == fs->num_groups - 1) {
+        return fs->sb->s_blocks_count - group_start(fs, group);
+    }
+    return fs->sb->s_blocks_per_group;
+}
+
+static bool test_bit(const u8* bitmap, u32 bit) {
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+// Mark a block in use; returns true if it was already claimed
+static bool claim_block(fsck_t* fs, u32 block) {
+    u64 mask = 1ULL << (block % 64);
+    u64 old = __atomic_fetch_or(&fs->block_used[block / 64], mask, __ATOMIC_RELAXED);
+    return (old & mask) != 0;
+}
+
+static bool block_in_use(fsck_t* fs, u32 block) {
+    return (fs->block_used[block / 64] >> (block % 64)) & 1;
+}
+
+static bool is_power_of(u32 n, u32 base) {
+    while (n > 1 && n % base == 0) {
+        n /= base;
+    }
+    return n == 1;
+}
+
+// Groups holding a superblock and descriptor table copy
+static bool group_has_super(fsck_t* fs, u32 group) {
+    if (!(fs->sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+        return true;
+    }
+    return group <= 1 || is_power_of(group, 3) || is_power_of(group, 5) || is_power_of(group, 7);
+}
+
+// Run one pass over all block groups, handing groups out to workers as
+// they become free so uneven groups do not stall a fixed split
+typedef void (*group_fn_t)(fsck_t* fs, u32 group);
+
+typedef struct {
+    fsck_t* fs;
+    group_fn_t fn;
+} worker_arg_t;
+
+static void* group_worker(void* arg) {
+    worker_arg_t* w = (worker_arg_t*)arg;
+    for (;;) {
+        u32 group = __atomic_fetch_add(&w->fs->next_group, 1, __ATOMIC_RELAXED);
+        if (group >= w->fs->num_groups) {
+            break;
+        }
+        w->fn(w->fs, group);
+    }
+    return NULL;
+}
+
+static void run_parallel(fsck_t* fs, group_fn_t fn) {
+    pthread_t threads[FSCK_MAX_THREADS];
+    worker_arg_t arg = { fs, fn };
+    
+    fs->next_group = 0;
+    for (u32 i = 1; i < fs->num_threads; i++) {
+        pthread_create(&threads[i], NULL, group_worker, &arg);
+    }
+    group_worker(&arg);
+    for (u32 i = 1; i < fs->num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Walk an inode's block tree. The callback sees every block with its
+// depth: 0 for data blocks, 1-3 for indirect blocks. Invalid pointers
+// are passed to the callback but not followed.
+typedef void (*block_fn_t)(fsck_t* fs, u32 ino, u32 block, u32 depth, void* arg);
+
+static void walk_indirect(fsck_t* fs, u32 ino, u32 block, u32 depth, block_fn_t fn, void* arg) {
+    fn(fs, ino, block, depth, arg);
+    if (!block_valid(fs, block)) {
+        return;
+    }
+    
+    const u32* ptrs = (const u32*)get_block(fs, block);
+    for (u32 i = 0; i < fs->block_size / 4; i++) {
+        if (ptrs[i] == 0) {
+            continue;
+        }
+        if (depth == 1) {
+            fn(fs, ino, ptrs[i], 0, arg);
+        } else {
+            walk_indirect(fs, ino, ptrs[i], depth - 1, fn, arg);
+        }
+    }
+}
+
+static bool inode_has_blocks(const ext2_inode_t* inode) {
+    // Fast symlinks keep the target in i_block
+    return !((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK && inode->i_blocks == 0);
+}
+
+static void walk_blocks(fsck_t* fs, u32 ino, const ext2_inode_t* inode, block_fn_t fn, void* arg) {
+    if (!inode_has_blocks(inode)) {
+        return;
+    }
+    
+    for (u32 i = 0; i < EXT2_NDIR_BLOCKS; i++) {
+        if (inode->i_block[i] != 0) {
+            fn(fs, ino, inode->i_block[i], 0, arg);
+        }
+    }
+    
+    for (u32 level = 0; level < 3; level++) {
+        u32 block = inode->i_block[EXT2_IND_BLOCK + level];
+        if (block != 0) {
+            walk_indirect(fs, ino, block, level + 1, fn, arg);
+        }
+    }
+}
+
+// Pass 0: group descriptors and the blocks they reserve
+static void check_group_metadata(fsck_t* fs, u32 group) {
+    const ext2_block_group_desc_t* bg = &fs->gdt[group];
+    u32 start = group_start(fs, group);
+    u32 end = start + group_blocks(fs, group);
+    u32 itable_blocks = (fs->sb->s_inodes_per_group * fs->inode_size + fs->block_size - 1) /
+                        fs->block_size;
+    
+    if (group_has_super(fs, group)) {
+        u32 gdt_blocks = (fs->num_groups * sizeof(ext2_block_group_desc_t) + fs->block_size - 1) /
+                         fs->block_size;
+        if (fs->sb->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INODE) {
+            gdt_blocks += fs->sb->s_reserved_gdt_blocks;
+        }
+        for (u32 i = 0; i <= gdt_blocks; i++) {
+            claim_block(fs, start + i);
+        }
+    }
+    
+    if (bg->bg_block_bitmap < start || bg->bg_block_bitmap >= end) {
+        problem(fs, "Group %u: block bitmap %u outside group", group, bg->bg_block_bitmap);
+    } else if (claim_block(fs, bg->bg_block_bitmap)) {
+        problem(fs, "Group %u: block bitmap %u overlaps other metadata", group, bg->bg_block_bitmap);
+    }
+    
+    if (bg->bg_inode_bitmap < start || bg->bg_inode_bitmap >= end) {
+        problem(fs, "Group %u: inode bitmap %u outside group", group, bg->bg_inode_bitmap);
+    } else if (claim_block(fs, bg->bg_inode_bitmap)) {
+        problem(fs, "Group %u: inode bitmap %u overlaps other metadata", group, bg->bg_inode_bitmap);
+    }
+    
+    // Inodes of a group without a usable table are not checked further
+    if (bg->bg_inode_table < start || bg->bg_inode_table + itable_blocks > end) {
+        problem(fs, "Group %u: inode table %u outside group", group, bg->bg_inode_table);
+        fs->group_bad[group] = 1;
+    } else {
+        for (u32 i = 0; i < itable_blocks; i++) {
+            if (claim_block(fs, bg->bg_inode_table + i)) {
+                problem(fs, "Group %u: inode table block %u overlaps other metadata",
+                        group, bg->bg_inode_table + i);
+            }
+        }
+    }
+}
+
+// Pass 1: inodes and the blocks they own
+typedef struct {
+    u64 blocks;
+    u32 bad;
+    u32 dup;
+} inode_blocks_t;
+
+static void claim_inode_block(fsck_t* fs, u32 ino, u32 block, u32 depth, void* arg) {
+    inode_blocks_t* count = (inode_blocks_t*)arg;
+    (void)depth;
+    
+    if (!block_valid(fs, block)) {
+        if (count->bad++ == 0) {
+            problem(fs, "Inode %u: illegal block %u", ino, block);
+        }
+        return;
+    }
+    
+    count->blocks++;
+    if (claim_block(fs, block)) {
+        if (count->dup++ == 0) {
+            problem(fs, "Inode %u: block %u is claimed more than once", ino, block);
+        }
+    }
+}
+
+static void check_inodes(fsck_t* fs, u32 group) {
+    u32 ipg = fs->sb->s_inodes_per_group;
+    if (fs->group_bad[group]) {
+        return;
+    }
+    u64 used = 0;
+    u64 dirs = 0;
+    
+    for (u32 i = 0; i < ipg; i++) {
+        u32 ino = group * ipg + i + 1;
+        const ext2_inode_t* inode = get_inode(fs, ino);
+        
+        if (inode->i_links_count == 0) {
+            continue;
+        }
+        
+        // Reserved inodes other than the root only have their blocks
+        // claimed. The resize inode maps the reserved descriptor blocks,
+        // already claimed in pass 0, through its double indirect block.
+        if (ino < fs->first_ino && ino != EXT2_ROOT_INO) {
+            inode_blocks_t count = {0};
+            if (ino == EXT2_RESIZE_INO) {
+                if (inode->i_block[EXT2_DIND_BLOCK] != 0) {
+                    claim_inode_block(fs, ino, inode->i_block[EXT2_DIND_BLOCK], 2, &count);
+                }
+            } else {
+                walk_blocks(fs, ino, inode, claim_inode_block, &count);
+            }
+            continue;
+        }
+        
+        u16 type = inode->i_mode & EXT2_S_IFMT;
+        switch (type) {
+            case EXT2_S_IFREG:
+                fs->inode_state[ino] = INODE_FILE;
+                break;
+            case EXT2_S_IFDIR:
+                fs->inode_state[ino] = INODE_DIR;
+                dirs++;
+                break;
+            case EXT2_S_IFLNK:
+            case EXT2_S_IFCHR:
+            case EXT2_S_IFBLK:
+            case EXT2_S_IFIFO:
+            case EXT2_S_IFSOCK:
+                fs->inode_state[ino] = INODE_OTHER;
+                break;
+            default:
+                problem(fs, "Inode %u: bad mode 0%o", ino, inode->i_mode);
+                continue;
+        }
+        used++;
+        
+        if (inode->i_dtime != 0) {
+            problem(fs, "Inode %u: in use but has deletion time set", ino);
+        }
+        
+        inode_blocks_t count = {0};
+        walk_blocks(fs, ino, inode, claim_inode_block, &count);
+        
+        // Extended attribute blocks may be shared, so only their range is checked
+        if (inode->i_file_acl != 0) {
+            if (block_valid(fs, inode->i_file_acl)) {
+                claim_block(fs, inode->i_file_acl);
+                count.blocks++;
+            } else {
+                problem(fs, "Inode %u: illegal extended attribute block %u", ino, inode->i_file_acl);
+            }
+        }
+        
+        u64 sectors = count.blocks * (fs->block_size / 512);
+        if (inode_has_blocks(inode) && sectors != inode->i_blocks) {
+            problem(fs, "Inode %u: i_blocks is %u, should be %llu", ino, inode->i_blocks,
+                    (unsigned long long)sectors);
+        }
+        
+        if (type == EXT2_S_IFDIR) {
+            if (inode->i_size == 0 || inode->i_size % fs->block_size != 0) {
+                problem(fs, "Directory %u: bad size %u", ino, inode->i_size);
+            }
+            if (inode->i_block[0] == 0) {
+                problem(fs, "Directory %u: has no blocks", ino);
+            }
+        }
+    }
+    
+    __atomic_fetch_add(&fs->used_inodes, used, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fs->used_dirs, dirs, __ATOMIC_RELAXED);
+}
+
+// Pass 2: directory entries of the directories in a group
+static u8 mode_to_file_type(u16 mode) {
+    switch (mode & EXT2_S_IFMT) {
+        case EXT2_S_IFREG:  return 1;
+        case EXT2_S_IFDIR:  return 2;
+        case EXT2_S_IFCHR:  return 3;
+        case EXT2_S_IFBLK:  return 4;
+        case EXT2_S_IFIFO:  return 5;
+        case EXT2_S_IFSOCK: return 6;
+        case EXT2_S_IFLNK:  return 7;
+        default:            return 0;
+    }
+}
+
+typedef struct {
+    u32 index;
+    u32 size;
+} dir_walk_t;
+
+static void check_dir_block(fsck_t* fs, u32 dir, u32 block, u32 depth, void* arg) {
+    dir_walk_t* walk = (dir_walk_t*)arg;
+    if (depth != 0 || !block_valid(fs, block)) {
+        return;
+    }
+    
+    u32 index = walk->index++;
+    if ((u64)index * fs->block_size >= walk->size) {
+        return;
+    }
+    
+    const u8* data = get_block(fs, block);
+    u32 offset = 0;
+    u32 slot = 0;
+    
+    while (offset < fs->block_size) {
+        const ext2_dir_entry_t* entry = (const ext2_dir_entry_t*)(data + offset);
+        u32 name_len = entry->name_len;
+        
+        if (entry->rec_len < 8 || entry->rec_len % 4 != 0 ||
+            offset + entry->rec_len > fs->block_size || 8 + name_len > entry->rec_len) {
+            problem(fs, "Directory %u: corrupt entry at block %u offset %u", dir, index, offset);
+            return;
+        }
+        
+        bool is_dot = (name_len == 1 && entry->name[0] == '.');
+        bool is_dotdot = (name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+        
+        if (index == 0 && slot == 0 && !(is_dot && entry->inode == dir)) {
+            problem(fs, "Directory %u: first entry is not '.'", dir);
+        }
+        if (index == 0 && slot == 1 && !is_dotdot) {
+            problem(fs, "Directory %u: second entry is not '..'", dir);
+        }
+        
+        u32 target = entry->inode;
+        if (target != 0) {
+            if (target > fs->sb->s_inodes_count) {
+                problem(fs, "Directory %u: entry '%.*s' has bad inode %u", dir, name_len,
+                        entry->name, target);
+            } else if (fs->inode_state[target] == INODE_UNUSED) {
+                if (target >= fs->first_ino || target == EXT2_ROOT_INO) {
+                    problem(fs, "Directory %u: entry '%.*s' points to unused inode %u", dir,
+                            name_len, entry->name, target);
+                }
+            } else {
+                __atomic_fetch_add(&fs->link_refs[target], 1, __ATOMIC_RELAXED);
+                
+                const ext2_inode_t* inode = get_inode(fs, target);
+                if (fs->has_filetype && entry->file_type != mode_to_file_type(inode->i_mode)) {
+                    problem(fs, "Directory %u: entry '%.*s' has file type %u, inode %u is %u",
+                            dir, name_len, entry->name, entry->file_type, target,
+                            mode_to_file_type(inode->i_mode));
+                }
+                
+                if (is_dotdot) {
+                    fs->dotdot[dir] = target;
+                } else if (!is_dot && fs->inode_state[target] == INODE_DIR) {
+                    u32 expected = 0;
+                    if (!__atomic_compare_exchange_n(&fs->parent[target], &expected, dir, false,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                        problem(fs, "Directory %u: linked from both %u and %u", target,
+                                expected, dir);
+                    }
+                }
+            }
+        }
+        
+        offset += entry->rec_len;
+        slot++;
+    }
+}
+
+static void check_directories(fsck_t* fs, u32 group) {
+    u32 ipg = fs->sb->s_inodes_per_group;
+    if (fs->group_bad[group]) {
+        return;
+    }
+    
+    for (u32 i = 0; i < ipg; i++) {
+        u32 ino = group * ipg + i + 1;
+        if (fs->inode_state[ino] != INODE_DIR) {
+            continue;
+        }
+        
+        const ext2_inode_t* inode = get_inode(fs, ino);
+        dir_walk_t walk = { 0, inode->i_size };
+        walk_blocks(fs, ino, inode, check_dir_block, &walk);
+    }
+}
+
+// Pass 3: every directory must reach the root through its parents
+static void check_connectivity(fsck_t* fs) {
+    u32 count = fs->sb->s_inodes_count;
+    u8* reached = calloc(count + 1, 1);
+    
+    fs->parent[EXT2_ROOT_INO] = EXT2_ROOT_INO;
+    reached[EXT2_ROOT_INO] = 1;
+    
+    if (fs->inode_state[EXT2_ROOT_INO] != INODE_DIR) {
+        problem(fs, "Root inode is not a directory");
+    }
+    
+    for (u32 ino = 1; ino <= count; ino++) {
+        if (fs->inode_state[ino] != INODE_DIR) {
+            continue;
+        }
+        
+        if (fs->dotdot[ino] != fs->parent[ino] && fs->parent[ino] != 0) {
+            problem(fs, "Directory %u: '..' is %u, should be %u", ino, fs->dotdot[ino],
+                    fs->parent[ino]);
+        }
+        
+        // Walk up until a directory already known to be reachable, marking
+        // the path as visited (2) to catch loops
+        u32 cur = ino;
+        while (cur != 0 && reached[cur] == 0) {
+            reached[cur] = 2;
+            cur = fs->parent[cur];
+        }
+        
+        bool ok = (cur != 0 && reached[cur] == 1);
+        if (!ok) {
+            problem(fs, "Directory %u: not connected to the root", ino);
+        }
+        
+        for (cur = ino; cur != 0 && reached[cur] == 2; cur = fs->parent[cur]) {
+            reached[cur] = ok ? 1 : 3;
+        }
+    }
+    
+    free(reached);
+}
+
+// Pass 4: link counts against the directory references found in pass 2
+static void check_link_counts(fsck_t* fs, u32 group) {
+    u32 ipg = fs->sb->s_inodes_per_group;
+    if (fs->group_bad[group]) {
+        return;
+    }
+    
+    for (u32 i = 0; i < ipg; i++) {
+        u32 ino = group * ipg + i + 1;
+        if (fs->inode_state[ino] == INODE_UNUSED) {
+            continue;
+        }
+        
+        const ext2_inode_t* inode = get_inode(fs, ino);
+        if (fs->link_refs[ino] == 0) {
+            problem(fs, "Inode %u: not referenced by any directory", ino);
+        } else if (fs->link_refs[ino] != inode->i_links_count) {
+            problem(fs, "Inode %u: link count is %u, should be %u", ino, inode->i_links_count,
+                    fs->link_refs[ino]);
+        }
+    }
+}
+
+// Pass 5: on-disk bitmaps and free counts against what passes 0-2 found
+static void check_bitmaps(fsck_t* fs, u32 group) {
+    const ext2_block_group_desc_t* bg = &fs->gdt[group];
+    u32 start = group_start(fs, group);
+    u32 blocks = group_blocks(fs, group);
+    u32 ipg = fs->sb->s_inodes_per_group;
+    
+    if (block_valid(fs, bg->bg_block_bitmap)) {
+        const u8* bitmap = get_block(fs, bg->bg_block_bitmap);
+        u32 free_blocks = 0;
+        u32 missing = 0;
+        u32 extra = 0;
+        
+        for (u32 i = 0; i < blocks; i++) {
+            bool on_disk = test_bit(bitmap, i);
+            bool used = block_in_use(fs, start + i);
+            if (!used) {
+                free_blocks++;
+            }
+            if (used && !on_disk && missing++ == 0) {
+                problem(fs, "Group %u: block %u in use but free in bitmap", group, start + i);
+            }
+            if (!used && on_disk && extra++ == 0) {
+                problem(fs, "Group %u: block %u free but marked in bitmap", group, start + i);
+            }
+        }
+        if (missing > 1 || extra > 1) {
+            problem(fs, "Group %u: %u blocks missing from and %u extra in bitmap", group,
+                    missing, extra);
+        }
+        
+        for (u32 i = blocks; i < fs->block_size * 8; i++) {
+            if (!test_bit(bitmap, i)) {
+                problem(fs, "Group %u: padding at end of block bitmap is not set", group);
+                break;
+            }
+        }
+        
+        if (bg->bg_free_blocks_count != free_blocks) {
+            problem(fs, "Group %u: free blocks count is %u, should be %u", group,
+                    bg->bg_free_blocks_count, free_blocks);
+        }
+        __atomic_fetch_add(&fs->used_blocks, blocks - free_blocks, __ATOMIC_RELAXED);
+    }
+    
+    if (block_valid(fs, bg->bg_inode_bitmap)) {
+        const u8* bitmap = get_block(fs, bg->bg_inode_bitmap);
+        u32 free_inodes = 0;
+        u32 dirs = 0;
+        u32 mismatched = 0;
+        
+        for (u32 i = 0; i < ipg; i++) {
+            u32 ino = group * ipg + i + 1;
+            bool used = fs->inode_state[ino] != INODE_UNUSED || ino < fs->first_ino;
+            bool on_disk = test_bit(bitmap, i);
+            
+            if (!on_disk) {
+                free_inodes++;
+            }
+            if (fs->inode_state[ino] == INODE_DIR) {
+                dirs++;
+            }
+            if (used != on_disk && mismatched++ == 0) {
+                problem(fs, "Group %u: inode %u is %s but %s in bitmap", group, ino,
+                        used ? "in use" : "free", on_disk ? "marked" : "free");
+            }
+        }
+        if (mismatched > 1) {
+            problem(fs, "Group %u: %u inode bitmap differences", group, mismatched);
+        }
+        
+        if (bg->bg_free_inodes_count != free_inodes) {
+            problem(fs, "Group %u: free inodes count is %u, should be %u", group,
+                    bg->bg_free_inodes_count, free_inodes);
+        }
+        if (bg->bg_used_dirs_count != dirs) {
+            problem(fs, "Group %u: directories count is %u, should be %u", group,
+                    bg->bg_used_dirs_count, dirs);
+        }
+    }
+}
+
+static void check_totals(fsck_t* fs) {
+    u64 free_blocks = 0;
+    u64 free_inodes = 0;
+    for (u32 g = 0; g < fs->num_groups; g++) {
+        free_blocks += fs->gdt[g].bg_free_blocks_count;
+        free_inodes += fs->gdt[g].bg_free_inodes_count;
+    }
+    
+    if (fs->sb->s_free_blocks_count != free_blocks) {
+        problem(fs, "Superblock: free blocks count is %u, groups say %llu",
+                fs->sb->s_free_blocks_count, (unsigned long long)free_blocks);
+    }
+    if (fs->sb->s_free_inodes_count != free_inodes) {
+        problem(fs, "Superblock: free inodes count is %u, groups say %llu",
+                fs->sb->s_free_inodes_count, (unsigned long long)free_inodes);
+    }
+}
+
+static int open_image(fsck_t* fs, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open image");
+        return -1;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 2048) {
+        printf("Error: Image too small\n");
+        close(fd);
+        return -1;
+    }
+    
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map image");
+        return -1;
+    }
+    
+    fs->image = (const u8*)map;
+    fs->image_size = st.st_size;
+    fs->sb = (const ext2_superblock_t*)(fs->image + 1024);
+    
+    const ext2_superblock_t* sb = fs->sb;
+    if (sb->s_magic != EXT2_MAGIC) {
+        printf("Error: Bad magic number in superblock\n");
+        return -1;
+    }
+    
+    if (sb->s_log_block_size > 2 || sb->s_blocks_per_group == 0 || sb->s_inodes_per_group == 0) {
+        printf("Error: Corrupt superblock geometry\n");
+        return -1;
+    }
+    
+    fs->block_size = 1024 << sb->s_log_block_size;
+    if ((u64)sb->s_blocks_count * fs->block_size > fs->image_size) {
+        printf("Error: Image is shorter than the filesystem (%u blocks)\n", sb->s_blocks_count);
+        return -1;
+    }
+    
+    fs->num_groups = (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1) /
+                     sb->s_blocks_per_group;
+    if ((u64)fs->num_groups * sb->s_inodes_per_group != sb->s_inodes_count) {
+        printf("Error: Inode count %u does not match %u groups of %u\n", sb->s_inodes_count,
+               fs->num_groups, sb->s_inodes_per_group);
+        return -1;
+    }
+    
+    if (sb->s_rev_level == 0) {
+        fs->inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+        fs->first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    } else {
+        fs->inode_size = sb->s_inode_size;
+        fs->first_ino = sb->s_first_ino;
+        fs->has_filetype = (sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) != 0;
+    }
+    
+    // This checker does not replay the journal; mounting the image does
+    if (sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_RECOVER) {
+        printf("Warning: journal needs recovery, checking the unreplayed filesystem\n");
+    }
+    
+    fs->gdt = (const ext2_block_group_desc_t*)get_block(fs, sb->s_first_data_block + 1);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    fsck_t fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    fs.max_reports = FSCK_DEFAULT_REPORTS;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "j:m:")) != -1) {
+        switch (opt) {
+            case 'j':
+                fs.num_threads = atoi(optarg);
+                break;
+            case 'm':
+                fs.max_reports = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    
+    if (optind != argc - 1) {
+        printf("Usage: %s [-j threads] [-m max_reports] <image_file>\n", argv[0]);
+        return FSCK_ERROR;
+    }
+    
+    if (fs.num_threads < 1) fs.num_threads = 1;
+    if (fs.num_threads > FSCK_MAX_THREADS) fs.num_threads = FSCK_MAX_THREADS;
+    
+    double total_start = now_ms();
+    if (open_image(&fs, argv[optind]) < 0) {
+        return FSCK_ERROR;
+    }
+    
+    u32 inodes = fs.sb->s_inodes_count;
+    fs.block_used = calloc((fs.sb->s_blocks_count + 63) / 64, sizeof(u64));
+    fs.group_bad = calloc(fs.num_groups, 1);
+    fs.inode_state = calloc(inodes + 1, 1);
+    fs.link_refs = calloc(inodes + 1, sizeof(u32));
+    fs.parent = calloc(inodes + 1, sizeof(u32));
+    fs.dotdot = calloc(inodes + 1, sizeof(u32));
+    if (!fs.block_used || !fs.group_bad || !fs.inode_state || !fs.link_refs || !fs.parent || !fs.dotdot) {
+        printf("Error: Out of memory\n");
+        return FSCK_ERROR;
+    }
+    pthread_mutex_init(&fs.report_lock, NULL);
+    
+    printf("Checking %s: %u blocks, %u inodes, %u groups, %u threads\n", argv[optind],
+           fs.sb->s_blocks_count, inodes, fs.num_groups, fs.num_threads);
+    
+    fsck_phase_t phases[6];
+    double start;
+    
+    // Blocks before the first data block (the boot block) are never free
+    for (u32 b = 0; b < fs.sb->s_first_data_block; b++) {
+        claim_block(&fs, b);
+    }
+    
+    start = now_ms();
+    run_parallel(&fs, check_group_metadata);
+    phases[0] = (fsck_phase_t){ "Pass 0: group metadata", now_ms() - start };
+    
+    start = now_ms();
+    run_parallel(&fs, check_inodes);
+    phases[1] = (fsck_phase_t){ "Pass 1: inodes and blocks", now_ms() - start };
+    
+    start = now_ms();
+    run_parallel(&fs, check_directories);
+    phases[2] = (fsck_phase_t){ "Pass 2: directory structure", now_ms() - start };
+    
+    start = now_ms();
+    check_connectivity(&fs);
+    phases[3] = (fsck_phase_t){ "Pass 3: connectivity", now_ms() - start };
+    
+    start = now_ms();
+    run_parallel(&fs, check_link_counts);
+    phases[4] = (fsck_phase_t){ "Pass 4: reference counts", now_ms() - start };
+    
+    start = now_ms();
+    run_parallel(&fs, check_bitmaps);
+    check_totals(&fs);
+    phases[5] = (fsck_phase_t){ "Pass 5: bitmaps and counts", now_ms() - start };
+    
+    double total_ms = now_ms() - total_start;
+    
+    printf("%s: %llu/%u inodes (%llu directories), %llu/%u blocks\n", argv[optind],
+           (unsigned long long)fs.used_inodes, inodes, (unsigned long long)fs.used_dirs,
+           (unsigned long long)fs.used_blocks, fs.sb->s_blocks_count);
+    
+    printf("Timing:\n");
+    for (u32 i = 0; i < 6; i++) {
+        printf("  %-28s %10.2f ms\n", phases[i].name, phases[i].ms);
+    }
+    printf("  %-28s %10.2f ms (%.1f MB/s)\n", "total", total_ms,
+           total_ms > 0 ? (double)fs.sb->s_blocks_count * fs.block_size / (1024.0 * 1024.0) /
+                          (total_ms / 1000.0) : 0.0);
+    
+    if (fs.errors > 0) {
+        printf("%llu problems found\n", (unsigned long long)fs.errors);
+        return FSCK_UNCORRECTED;
+    }
+    
+    printf("Filesystem is clean\n");
+    return FSCK_OK;
+}
@@ -1,10 +1,15 @@
 /* Simple mkfs.ext2 - Creates a minimal ext2 filesystem image */
 
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <time.h>
+#include <unistd.h>
 
 typedef uint8_t  u8;
 typedef uint16_t u16;
@@ -16,6 +21,20 @@ typedef uint64_t u64;
 #define EXT2_S_IFREG 0x8000
 #define EXT2_S_IFDIR 0x4000
 #define EXT2_FT_DIR 2
+#define EXT2_DYNAMIC_REV 1
+#define EXT2_GOOD_OLD_FIRST_INO 11
+#define EXT2_LOST_FOUND_INO 11
+#define EXT2_JOURNAL_INO 8
+#define EXT2_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT2_INODE_SIZE 128
+#define EXT2_INODE_RATIO 4096
+#define EXT3_JNL_BACKUP_BLOCKS 1
+
+// JBD2 journal superblock (big-endian on disk)
+#define JBD2_MAGIC 0xC03B3998
+#define JBD2_SUPERBLOCK_V2 4
+#define JBD2_MIN_BLOCKS 1024
 
 typedef struct {
     u32 s_inodes_count;
@@ -62,11 +81,13 @@ typedef struct {
     u32 s_last_orphan;
     u32 s_hash_seed[4];
     u8  s_def_hash_version;
-    u8  s_reserved_char_pad;
+    u8  s_jnl_backup_type;
     u16 s_reserved_word_pad;
     u32 s_default_mount_opts;
     u32 s_first_meta_bg;
-    u8  s_reserved[760];
+    u32 s_mkfs_time;
+    u32 s_jnl_blocks[17];
+    u8  s_reserved[688];
 } __attribute__((packed)) ext2_superblock_t;
 
 typedef struct {
@@ -109,18 +130,325 @@ typedef struct {
     char name[255];
 } __attribute__((packed)) ext2_dir_entry_t;
 
-void create_ext2_image(const char* filename, u32 size_mb) {
-    printf("Creating ext2 image: %s (%u MB)\n", filename, size_mb);
+// Image layout, computed once before anything is written
+typedef struct {
+    u32 block_size;
+    u32 total_blocks;
+    u32 first_data_block;
+    u32 blocks_per_group;
+    u32 inodes_per_group;
+    u32 num_groups;
+    u32 gdt_blocks;
+    u32 inode_table_blocks;
+    u32 root_dir_block;
+    u32 lost_found_block;
+    u32 journal_blocks;
+    u32 journal_meta_blocks;
+    u32 journal_start;
+} mkfs_layout_t;
+
+// Per-phase timing for the benchmark report
+typedef struct {
+    const char* name;
+    double ms;
+} mkfs_phase_t;
+
+#define MKFS_MAX_PHASES 8
+
+static mkfs_phase_t phases[MKFS_MAX_PHASES];
+static u32 num_phases;
+static u64 metadata_blocks_written;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void phase_end(const char* name, double start) {
+    if (num_phases < MKFS_MAX_PHASES) {
+        phases[num_phases].name = name;
+        phases[num_phases].ms = now_ms() - start;
+        num_phases++;
+    }
+}
+
+static u32 group_start(const mkfs_layout_t* l, u32 group) {
+    return l->first_data_block + group * l->blocks_per_group;
+}
+
+static u32 group_blocks(const mkfs_layout_t* l, u32 group) {
+    if (group == l->num_groups - 1) {
+        return l->total_blocks - group_start(l, group);
+    }
+    return l->blocks_per_group;
+}
+
+// Superblock, descriptor table copy, two bitmaps and the inode table
+static u32 group_overhead(const mkfs_layout_t* l) {
+    return 1 + l->gdt_blocks + 2 + l->inode_table_blocks;
+}
+
+static u32 group_block_bitmap(const mkfs_layout_t* l, u32 group) {
+    return group_start(l, group) + 1 + l->gdt_blocks;
+}
+
+static u32 group_inode_table(const mkfs_layout_t* l, u32 group) {
+    return group_block_bitmap(l, group) + 2;
+}
+
+// Default journal size, following mke2fs
+static u32 journal_default_blocks(u32 total_blocks) {
+    if (total_blocks < 32768) return 1024;
+    if (total_blocks < 256 * 1024) return 4096;
+    if (total_blocks < 512 * 1024) return 8192;
+    if (total_blocks < 4096 * 1024) return 16384;
+    return 32768;
+}
+
+// Indirect blocks needed to map a journal of the given length
+static u32 journal_meta_blocks(u32 blocks, u32 block_size) {
+    u32 apb = block_size / 4;
+    u32 meta = 0;
+    if (blocks > 12) {
+        meta++;
+    }
+    if (blocks > 12 + apb) {
+        meta += 1 + (blocks - 12 - apb + apb - 1) / apb;
+    }
+    return meta;
+}
+
+static int compute_layout(mkfs_layout_t* l, u64 size_bytes, u32 block_size, u32 journal_blocks) {
+    memset(l, 0, sizeof(*l));
+    
+    u64 blocks = size_bytes / block_size;
+    if (blocks > 0xFFFFFFFFULL) {
+        printf("Error: Image too large for %u-byte blocks\n", block_size);
+        return -1;
+    }
+    
+    l->block_size = block_size;
+    l->total_blocks = (u32)blocks;
+    l->first_data_block = (block_size == 1024) ? 1 : 0;
+    l->blocks_per_group = block_size * 8;
+    
+    u32 inodes_per_block = block_size / EXT2_INODE_SIZE;
+    u64 ipg = (u64)l->blocks_per_group * block_size / EXT2_INODE_RATIO;
+    ipg = (ipg + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+    if (ipg > block_size * 8) ipg = block_size * 8;
+    l->inodes_per_group = (u32)ipg;
+    l->inode_table_blocks = l->inodes_per_group / inodes_per_block;
+    
+    // A short last group that cannot hold its own metadata is dropped
+    for (;;) {
+        l->num_groups = (l->total_blocks - l->first_data_block + l->blocks_per_group - 1) /
+                        l->blocks_per_group;
+        l->gdt_blocks = (l->num_groups * sizeof(ext2_block_group_desc_t) + block_size - 1) /
+                        block_size;
+        
+        u32 last = group_blocks(l, l->num_groups - 1);
+        if (last >= group_overhead(l) + 50 || l->num_groups == 1) {
+            break;
+        }
+        l->total_blocks -= last;
+    }
+    
+    if (group_blocks(l, 0) < group_overhead(l) + 2) {
+        printf("Error: Image too small\n");
+        return -1;
+    }
+    
+    l->root_dir_block = group_inode_table(l, 0) + l->inode_table_blocks;
+    l->lost_found_block = l->root_dir_block + 1;
+    
+    // The journal is one contiguous run in group 0, shrunk to fit
+    if (journal_blocks > 0) {
+        u32 room = group_blocks(l, 0) - group_overhead(l) - 2;
+        while (journal_blocks + journal_meta_blocks(journal_blocks, block_size) > room) {
+            journal_blocks -= block_size / 4;
+        }
+        if (journal_blocks < JBD2_MIN_BLOCKS) {
+            printf("Error: Image too small for a journal\n");
+            return -1;
+        }
+        l->journal_blocks = journal_blocks;
+        l->journal_meta_blocks = journal_meta_blocks(journal_blocks, block_size);
+        l->journal_start = l->lost_found_block + 1;
+    }
+    return 0;
+}
+
+static void write_block(FILE* fp, const mkfs_layout_t* l, u32 block, const void* data, u32 len) {
+    fseeko(fp, (off_t)block * l->block_size, SEEK_SET);
+    fwrite(data, 1, len, fp);
+    metadata_blocks_written++;
+}
+
+static void set_bits(u8* bitmap, u32 from, u32 to) {
+    for (u32 i = from; i < to; i++) {
+        bitmap[i / 8] |= (1 << (i % 8));
+    }
+}
+
+static u32 group_used_blocks(const mkfs_layout_t* l, u32 group) {
+    if (group != 0) {
+        return group_overhead(l);
+    }
+    return group_overhead(l) + 2 + l->journal_blocks + l->journal_meta_blocks;
+}
+
+static u32 group_used_inodes(u32 group) {
+    return group == 0 ? EXT2_LOST_FOUND_INO : 0;
+}
+
+static void write_dir_block(FILE* fp, const mkfs_layout_t* l, u32 block, u32 self, u32 parent,
+                            const char* child, u32 child_ino) {
+    u8* data = calloc(1, l->block_size);
+    
+    ext2_dir_entry_t* dot = (ext2_dir_entry_t*)data;
+    dot->inode = self;
+    dot->rec_len = 12;
+    dot->name_len = 1;
+    dot->file_type = EXT2_FT_DIR;
+    dot->name[0] = '.';
+    
+    ext2_dir_entry_t* dotdot = (ext2_dir_entry_t*)(data + 12);
+    dotdot->inode = parent;
+    dotdot->rec_len = l->block_size - 12;
+    dotdot->name_len = 2;
+    dotdot->file_type = EXT2_FT_DIR;
+    dotdot->name[0] = '.';
+    dotdot->name[1] = '.';
+    
+    if (child) {
+        u32 name_len = strlen(child);
+        dotdot->rec_len = 12;
+        
+        ext2_dir_entry_t* entry = (ext2_dir_entry_t*)(data + 24);
+        entry->inode = child_ino;
+        entry->rec_len = l->block_size - 24;
+        entry->name_len = name_len;
+        entry->file_type = EXT2_FT_DIR;
+        memcpy(entry->name, child, name_len);
+    }
+    
+    write_block(fp, l, block, data, l->block_size);
+    free(data);
+}
+
+static void write_inode(FILE* fp, const mkfs_layout_t* l, u32 ino, const ext2_inode_t* inode) {
+    u32 inodes_per_block = l->block_size / EXT2_INODE_SIZE;
+    u32 index = ino - 1;
+    off_t offset = (off_t)(group_inode_table(l, 0) + index / inodes_per_block) * l->block_size +
+                   (index % inodes_per_block) * EXT2_INODE_SIZE;
+    fseeko(fp, offset, SEEK_SET);
+    fwrite(inode, sizeof(ext2_inode_t), 1, fp);
+}
+
+static void write_dir_inode(FILE* fp, const mkfs_layout_t* l, u32 ino, u32 block, u16 links, u16 mode) {
+    ext2_inode_t inode = {0};
+    u32 now = time(NULL);
+    inode.i_mode = EXT2_S_IFDIR | mode;
+    inode.i_size = l->block_size;
+    inode.i_atime = now;
+    inode.i_ctime = now;
+    inode.i_mtime = now;
+    inode.i_links_count = links;
+    inode.i_blocks = l->block_size / 512;
+    inode.i_block[0] = block;
+    write_inode(fp, l, ino, &inode);
+}
+
+static void put_be32(u8* p, u32 value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+// Journal inode: the indirect blocks come first, then the log. Only the
+// mapping is computed here, so the superblock can carry its backup.
+static void journal_inode(const mkfs_layout_t* l, ext2_inode_t* inode) {
+    u32 now = time(NULL);
+    memset(inode, 0, sizeof(*inode));
+    inode->i_mode = EXT2_S_IFREG | 0600;
+    inode->i_size = l->journal_blocks * l->block_size;
+    inode->i_atime = now;
+    inode->i_ctime = now;
+    inode->i_mtime = now;
+    inode->i_links_count = 1;
+    inode->i_blocks = (l->journal_blocks + l->journal_meta_blocks) * (l->block_size / 512);
     
-    u32 block_size = 1024;
-    u32 total_blocks = (size_mb * 1024 * 1024) / block_size;
-    u32 inodes_per_group = 128;
-    u32 blocks_per_group = 8192;
-    u32 total_inodes = total_blocks / 8;
-    if (total_inodes < 32) total_inodes = 32;
+    u32 apb = l->block_size / 4;
+    u32 data = l->journal_start + l->journal_meta_blocks;
+    for (u32 i = 0; i < 12 && i < l->journal_blocks; i++) {
+        inode->i_block[i] = data + i;
+    }
+    if (l->journal_blocks > 12) {
+        inode->i_block[12] = l->journal_start;
+    }
+    if (l->journal_blocks > 12 + apb) {
+        inode->i_block[13] = l->journal_start + 1;
+    }
+}
+
+static void write_journal(FILE* fp, const mkfs_layout_t* l, const ext2_inode_t* inode, const u8* uuid) {
+    u32 apb = l->block_size / 4;
+    u32 data = l->journal_start + l->journal_meta_blocks;
+    u32* map = malloc(l->block_size);
+    
+    if (l->journal_blocks > 12) {
+        memset(map, 0, l->block_size);
+        for (u32 i = 0; i < apb && 12 + i < l->journal_blocks; i++) {
+            map[i] = data + 12 + i;
+        }
+        write_block(fp, l, inode->i_block[12], map, l->block_size);
+    }
     
-    u32 num_groups = (total_blocks + blocks_per_group - 1) / blocks_per_group;
-    if (num_groups == 0) num_groups = 1;
+    if (l->journal_blocks > 12 + apb) {
+        u32 remaining = l->journal_blocks - 12 - apb;
+        u32 indirect = (remaining + apb - 1) / apb;
+        u32* dind = calloc(1, l->block_size);
+        for (u32 k = 0; k < indirect; k++) {
+            dind[k] = inode->i_block[13] + 1 + k;
+            memset(map, 0, l->block_size);
+            for (u32 i = 0; i < apb && k * apb + i < remaining; i++) {
+                map[i] = data + 12 + apb + k * apb + i;
+            }
+            write_block(fp, l, dind[k], map, l->block_size);
+        }
+        write_block(fp, l, inode->i_block[13], dind, l->block_size);
+        free(dind);
+    }
+    free(map);
+    
+    // An empty log: s_start == 0 means nothing to replay
+    u8* jsb = calloc(1, l->block_size);
+    put_be32(jsb + 0, JBD2_MAGIC);
+    put_be32(jsb + 4, JBD2_SUPERBLOCK_V2);
+    put_be32(jsb + 12, l->block_size);
+    put_be32(jsb + 16, l->journal_blocks);
+    put_be32(jsb + 20, 1);
+    put_be32(jsb + 24, 1);
+    memcpy(jsb + 48, uuid, 16);
+    put_be32(jsb + 64, 1);
+    write_block(fp, l, data, jsb, l->block_size);
+    free(jsb);
+    
+    write_inode(fp, l, EXT2_JOURNAL_INO, inode);
+}
+
+void create_ext2_image(const char* filename, u32 size_mb, u32 block_size, u32 journal_blocks) {
+    printf("Creating ext2 image: %s (%u MB, %u-byte blocks)\n", filename, size_mb, block_size);
+    double total_start = now_ms();
+    
+    double start = now_ms();
+    mkfs_layout_t l;
+    if (compute_layout(&l, (u64)size_mb * 1024 * 1024, block_size, journal_blocks) < 0) {
+        exit(1);
+    }
+    phase_end("layout", start);
     
     FILE* fp = fopen(filename, "wb");
     if (!fp) {
@@ -128,131 +456,202 @@ void create_ext2_image(const char* filename, u32 size_mb) {
         exit(1);
     }
     
-    u8* zero_block = calloc(1, block_size);
-    for (u32 i = 0; i < total_blocks; i++) {
-        fwrite(zero_block, 1, block_size, fp);
+    // The file starts out sparse, so inode tables and data blocks are
+    // zero without being written
+    start = now_ms();
+    if (ftruncate(fileno(fp), (off_t)l.total_blocks * block_size) < 0) {
+        perror("Failed to size image");
+        exit(1);
     }
-    free(zero_block);
+    phase_end("allocate", start);
     
+    start = now_ms();
     ext2_superblock_t sb = {0};
-    sb.s_inodes_count = inodes_per_group * num_groups;
-    sb.s_blocks_count = total_blocks;
+    u32 now = time(NULL);
+    sb.s_inodes_count = l.inodes_per_group * l.num_groups;
+    sb.s_blocks_count = l.total_blocks;
     sb.s_r_blocks_count = 0;
-    sb.s_free_blocks_count = total_blocks - 10;
-    sb.s_free_inodes_count = sb.s_inodes_count - 11;
-    sb.s_first_data_block = 1;
-    sb.s_log_block_size = 0;
-    sb.s_log_frag_size = 0;
-    sb.s_blocks_per_group = blocks_per_group;
-    sb.s_frags_per_group = blocks_per_group;
-    sb.s_inodes_per_group = inodes_per_group;
-    sb.s_mtime = time(NULL);
-    sb.s_wtime = time(NULL);
+    sb.s_first_data_block = l.first_data_block;
+    sb.s_log_block_size = (block_size == 1024) ? 0 : (block_size == 2048) ? 1 : 2;
+    sb.s_log_frag_size = sb.s_log_block_size;
+    sb.s_blocks_per_group = l.blocks_per_group;
+    sb.s_frags_per_group = l.blocks_per_group;
+    sb.s_inodes_per_group = l.inodes_per_group;
+    sb.s_mtime = 0;
+    sb.s_wtime = now;
     sb.s_mnt_count = 0;
     sb.s_max_mnt_count = 20;
     sb.s_magic = EXT2_MAGIC;
     sb.s_state = 1;
     sb.s_errors = 1;
     sb.s_minor_rev_level = 0;
-    sb.s_lastcheck = time(NULL);
+    sb.s_lastcheck = now;
     sb.s_checkinterval = 0;
     sb.s_creator_os = 0;
-    sb.s_rev_level = 0;
+    sb.s_rev_level = EXT2_DYNAMIC_REV;
     sb.s_def_resuid = 0;
     sb.s_def_resgid = 0;
-    sb.s_first_ino = 11;
-    sb.s_inode_size = 128;
-    sb.s_block_group_nr = 0;
-    
-    fseek(fp, 1024, SEEK_SET);
-    fwrite(&sb, sizeof(ext2_superblock_t), 1, fp);
-    
-    ext2_block_group_desc_t bg = {0};
-    bg.bg_block_bitmap = 3;
-    bg.bg_inode_bitmap = 4;
-    bg.bg_inode_table = 5;
-    bg.bg_free_blocks_count = total_blocks - 10;
-    bg.bg_free_inodes_count = inodes_per_group - 11;
-    bg.bg_used_dirs_count = 1;
-    
-    fseek(fp, 2048, SEEK_SET);
-    fwrite(&bg, sizeof(ext2_block_group_desc_t), 1, fp);
-    
-    u8* block_bitmap = calloc(1, block_size);
-    for (u32 i = 0; i < 10; i++) {
-        block_bitmap[i / 8] |= (1 << (i % 8));
-    }
-    fseek(fp, 3 * block_size, SEEK_SET);
-    fwrite(block_bitmap, 1, block_size, fp);
-    free(block_bitmap);
+    sb.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    sb.s_inode_size = EXT2_INODE_SIZE;
+    sb.s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+    srand(now);
+    for (u32 i = 0; i < 16; i++) {
+        sb.s_uuid[i] = rand() & 0xFF;
+    }
     
-    u8* inode_bitmap = calloc(1, block_size);
-    for (u32 i = 0; i < 11; i++) {
-        inode_bitmap[i / 8] |= (1 << (i % 8));
+    ext2_inode_t journal = {0};
+    if (l.journal_blocks > 0) {
+        journal_inode(&l, &journal);
+        sb.s_feature_compat |= EXT2_FEATURE_COMPAT_HAS_JOURNAL;
+        sb.s_journal_inum = EXT2_JOURNAL_INO;
+        sb.s_jnl_backup_type = EXT3_JNL_BACKUP_BLOCKS;
+        memcpy(sb.s_jnl_blocks, journal.i_block, sizeof(journal.i_block));
+        sb.s_jnl_blocks[16] = journal.i_size;
     }
-    fseek(fp, 4 * block_size, SEEK_SET);
-    fwrite(inode_bitmap, 1, block_size, fp);
-    free(inode_bitmap);
     
-    ext2_inode_t root_inode = {0};
-    root_inode.i_mode = EXT2_S_IFDIR | 0755;
-    root_inode.i_uid = 0;
-    root_inode.i_gid = 0;
-    root_inode.i_size = block_size;
-    root_inode.i_atime = time(NULL);
-    root_inode.i_ctime = time(NULL);
-    root_inode.i_mtime = time(NULL);
-    root_inode.i_links_count = 2;
-    root_inode.i_blocks = 2;
-    root_inode.i_block[0] = 10;
-    
-    fseek(fp, 5 * block_size + (EXT2_ROOT_INO - 1) * 128, SEEK_SET);
-    fwrite(&root_inode, sizeof(ext2_inode_t), 1, fp);
-    
-    u8* root_dir = calloc(1, block_size);
-    ext2_dir_entry_t* dot = (ext2_dir_entry_t*)root_dir;
-    dot->inode = EXT2_ROOT_INO;
-    dot->rec_len = 12;
-    dot->name_len = 1;
-    dot->file_type = EXT2_FT_DIR;
-    dot->name[0] = '.';
+    ext2_block_group_desc_t* gdt = calloc(l.gdt_blocks, block_size);
+    for (u32 g = 0; g < l.num_groups; g++) {
+        gdt[g].bg_block_bitmap = group_block_bitmap(&l, g);
+        gdt[g].bg_inode_bitmap = group_block_bitmap(&l, g) + 1;
+        gdt[g].bg_inode_table = group_inode_table(&l, g);
+        gdt[g].bg_free_blocks_count = group_blocks(&l, g) - group_used_blocks(&l, g);
+        gdt[g].bg_free_inodes_count = l.inodes_per_group - group_used_inodes(g);
+        gdt[g].bg_used_dirs_count = (g == 0) ? 2 : 0;
+        sb.s_free_blocks_count += gdt[g].bg_free_blocks_count;
+        sb.s_free_inodes_count += gdt[g].bg_free_inodes_count;
+    }
     
-    ext2_dir_entry_t* dotdot = (ext2_dir_entry_t*)(root_dir + 12);
-    dotdot->inode = EXT2_ROOT_INO;
-    dotdot->rec_len = block_size - 12;
-    dotdot->name_len = 2;
-    dotdot->file_type = EXT2_FT_DIR;
-    dotdot->name[0] = '.';
-    dotdot->name[1] = '.';
+    // Every group carries a superblock and descriptor table copy (no sparse_super)
+    u8* sb_block = calloc(1, block_size);
+    for (u32 g = 0; g < l.num_groups; g++) {
+        sb.s_block_group_nr = g;
+        u32 sb_offset = (g == 0 && block_size > 1024) ? 1024 : 0;
+        memset(sb_block, 0, block_size);
+        memcpy(sb_block + sb_offset, &sb, sizeof(sb));
+        
+        u32 block = group_start(&l, g);
+        if (g == 0 && block_size == 1024) {
+            write_block(fp, &l, 1, &sb, sizeof(sb));
+        } else {
+            write_block(fp, &l, block, sb_block, block_size);
+        }
+        
+        for (u32 i = 0; i < l.gdt_blocks; i++) {
+            write_block(fp, &l, block + 1 + i, (u8*)gdt + i * block_size, block_size);
+        }
+    }
+    free(sb_block);
+    free(gdt);
+    phase_end("superblocks", start);
+    
+    // Bits past the end of a group are set, as the kernel and e2fsck expect
+    start = now_ms();
+    u8* block_bitmap = malloc(block_size);
+    u8* inode_bitmap = malloc(block_size);
+    for (u32 g = 0; g < l.num_groups; g++) {
+        memset(block_bitmap, 0, block_size);
+        set_bits(block_bitmap, 0, group_used_blocks(&l, g));
+        set_bits(block_bitmap, group_blocks(&l, g), block_size * 8);
+        write_block(fp, &l, group_block_bitmap(&l, g), block_bitmap, block_size);
+        
+        memset(inode_bitmap, 0, block_size);
+        set_bits(inode_bitmap, 0, group_used_inodes(g));
+        set_bits(inode_bitmap, l.inodes_per_group, block_size * 8);
+        write_block(fp, &l, group_block_bitmap(&l, g) + 1, inode_bitmap, block_size);
+    }
+    free(block_bitmap);
+    free(inode_bitmap);
+    phase_end("bitmaps", start);
     
-    fseek(fp, 10 * block_size, SEEK_SET);
-    fwrite(root_dir, 1, block_size, fp);
-    free(root_dir);
+    start = now_ms();
+    write_dir_inode(fp, &l, EXT2_ROOT_INO, l.root_dir_block, 3, 0755);
+    write_dir_inode(fp, &l, EXT2_LOST_FOUND_INO, l.lost_found_block, 2, 0700);
+    write_dir_block(fp, &l, l.root_dir_block, EXT2_ROOT_INO, EXT2_ROOT_INO,
+                    "lost+found", EXT2_LOST_FOUND_INO);
+    write_dir_block(fp, &l, l.lost_found_block, EXT2_LOST_FOUND_INO, EXT2_ROOT_INO, NULL, 0);
+    phase_end("root directory", start);
     
+    if (l.journal_blocks > 0) {
+        start = now_ms();
+        write_journal(fp, &l, &journal, sb.s_uuid);
+        phase_end("journal", start);
+    }
+    
+    start = now_ms();
+    fflush(fp);
+    fsync(fileno(fp));
     fclose(fp);
+    phase_end("sync", start);
+    
+    double total_ms = now_ms() - total_start;
     
     printf("ext2 image created successfully\n");
-    printf("  Total blocks: %u\n", total_blocks);
+    printf("  Total blocks: %u\n", l.total_blocks);
     printf("  Total inodes: %u\n", sb.s_inodes_count);
-    printf("  Block groups: %u\n", num_groups);
+    printf("  Block groups: %u\n", l.num_groups);
     printf("  Block size: %u\n", block_size);
+    if (l.journal_blocks > 0) {
+        printf("  Journal blocks: %u\n", l.journal_blocks);
+    }
+    
+    printf("Timing:\n");
+    for (u32 i = 0; i < num_phases; i++) {
+        printf("  %-16s %10.2f ms\n", phases[i].name, phases[i].ms);
+    }
+    printf("  %-16s %10.2f ms (%llu metadata blocks, %.1f MB/s)\n", "total", total_ms,
+           (unsigned long long)metadata_blocks_written,
+           total_ms > 0 ? (double)l.total_blocks * block_size / (1024.0 * 1024.0) / (total_ms / 1000.0) : 0.0);
 }
 
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        printf("Usage: %s <image_file> <size_mb>\n", argv[0]);
+    bool journal = false;
+    u32 journal_blocks = 0;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "jJ:")) != -1) {
+        switch (opt) {
+            case 'j':
+                journal = true;
+                break;
+            case 'J':
+                journal = true;
+                journal_blocks = atoi(optarg);
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    
+    int args = argc - optind;
+    if (args != 2 && args != 3) {
+        printf("Usage: %s [-j] [-J journal_blocks] <image_file> <size_mb> [block_size]\n", argv[0]);
         return 1;
     }
     
-    const char* filename = argv[1];
-    u32 size_mb = atoi(argv[2]);
+    const char* filename = argv[optind];
+    u32 size_mb = atoi(argv[optind + 1]);
+    u32 block_size = (args == 3) ? (u32)atoi(argv[optind + 2]) : 1024;
     
-    if (size_mb < 1 || size_mb > 1024) {
-        printf("Error: Size must be between 1 and 1024 MB\n");
+    if (size_mb < 1 || size_mb > 65536) {
+        printf("Error: Size must be between 1 and 65536 MB\n");
+        return 1;
+    }
+    
+    if (block_size != 1024 && block_size != 2048 && block_size != 4096) {
+        printf("Error: Block size must be 1024, 2048 or 4096\n");
+        return 1;
+    }
+    
+    if (journal && journal_blocks == 0) {
+        journal_blocks = journal_default_blocks((u32)((u64)size_mb * 1024 * 1024 / block_size));
+    }
+    if (journal && journal_blocks < JBD2_MIN_BLOCKS) {
+        printf("Error: Journal must have at least %u blocks\n", JBD2_MIN_BLOCKS);
         return 1;
     }
     
-    create_ext2_image(filename, size_mb);
+    create_ext2_image(filename, size_mb, block_size, journal_blocks);
     
     return 0;
 }
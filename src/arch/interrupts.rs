@@ -15,6 +15,8 @@ pub fn init_timer() {
 
 pub extern "C" fn timer_interrupt_handler() {
     scheduler::tick();
+    // Bounds console wakeup latency to one tick even without the UART IRQ
+    crate::syscall::poll_serial_input();
     
     unsafe {
         outb(0x20, 0x20);
@@ -25,6 +27,36 @@ pub extern "C" fn timer_interrupt_handler() {
     }
 }
 
+/// COM1 receive interrupt (IRQ 4): hand the bytes to sleeping readers.
+pub extern "C" fn serial_interrupt_handler() {
+    crate::syscall::poll_serial_input();
+
+    unsafe {
+        outb(0x20, 0x20);
+    }
+}
+
+/// Page-fault error code bit set when the access was a write.
+const PF_WRITE: u64 = 1 << 1;
+
+/// Page fault: demand-fault the page if the running process has an area
+/// covering it, otherwise end the process as with SIGSEGV. `error_code` is
+/// the one the CPU pushed; `page_fault_entry` passes it on.
+#[no_mangle]
+pub extern "C" fn page_fault_handler(error_code: u64) {
+    let addr = unsafe { read_cr2() };
+    let write = error_code & PF_WRITE != 0;
+    if !crate::process::handle_page_fault(crate::memory::VirtAddr::new(addr), write) {
+        crate::syscall::terminate_current(128 + 11);
+    }
+}
+
+unsafe fn read_cr2() -> u64 {
+    let value: u64;
+    core::arch::asm!("mov {}, cr2", out(reg) value, options(nomem, nostack));
+    value
+}
+
 unsafe fn outb(port: u16, value: u8) {
     core::arch::asm!(
         "out dx, al",
@@ -92,7 +124,9 @@ pub static mut IDT: [IdtEntry; 256] = [IdtEntry::missing(); 256];
 
 pub fn init_idt() {
     unsafe {
+        IDT[14].set_handler(page_fault_entry as u64);
         IDT[32].set_handler(timer_interrupt_wrapper as u64);
+        IDT[36].set_handler(serial_interrupt_wrapper as u64);
         
         let idt_descriptor = IdtDescriptor {
             limit: (core::mem::size_of::<[IdtEntry; 256]>() - 1) as u16,
@@ -110,3 +144,52 @@ pub fn init_idt() {
 extern "C" fn timer_interrupt_wrapper() {
     timer_interrupt_handler();
 }
+
+extern "C" fn serial_interrupt_wrapper() {
+    serial_interrupt_handler();
+}
+
+extern "C" {
+    fn page_fault_entry();
+}
+
+// Vector 14 pushes an error code, which a plain C function cannot see or
+// pop. Save the caller-saved registers, hand the code to
+// page_fault_handler, then drop it before iretq.
+#[cfg(target_arch = "x86_64")]
+core::arch::global_asm!(r#"
+    .section .text
+    .global page_fault_entry
+    .type page_fault_entry, @function
+
+page_fault_entry:
+    pushq %rax
+    pushq %rcx
+    pushq %rdx
+    pushq %rsi
+    pushq %rdi
+    pushq %r8
+    pushq %r9
+    pushq %r10
+    pushq %r11
+    // Error code plus five frame words and nine saves leave rsp 8 off
+    // the 16-byte alignment the call needs
+    subq $8, %rsp
+
+    movq 80(%rsp), %rdi
+    call page_fault_handler
+
+    addq $8, %rsp
+    popq %r11
+    popq %r10
+    popq %r9
+    popq %r8
+    popq %rdi
+    popq %rsi
+    popq %rdx
+    popq %rcx
+    popq %rax
+
+    addq $8, %rsp      // drop the error code
+    iretq
+"#, options(att_syntax));
@@ -5,9 +5,12 @@
 /// - Bringing up application processors
 /// - Per-CPU state initialization
 /// - Load balancing setup
+/// - Topology (SMT, package, NUMA node) for the schedulers
 
 use crate::cpu::percpu::{self, CpuInfo};
 use crate::cpu::scheduler_smp;
+use crate::cpu::topology::{self, CpuTopology};
+use crate::memory::numa::NUMA_TOPOLOGY;
 
 #[cfg(target_arch = "x86_64")]
 use crate::x86_64::cpu as x86_cpu;
@@ -29,6 +32,36 @@ pub fn init() {
     
     #[cfg(target_arch = "aarch64")]
     enumerate_cpus_arm64();
+
+    init_topology();
+}
+
+/// Describe every registered CPU's core, package and node for the thread
+/// scheduler's placement and balancing.
+fn init_topology() {
+    let Some(mgr) = percpu::get_cpu_manager() else {
+        return;
+    };
+
+    #[cfg(target_arch = "x86_64")]
+    let (smt_shift, package_shift) = x86_cpu::topology_shifts();
+
+    for cpu_id in 0..mgr.cpu_count() as u32 {
+        let Some(cpu) = mgr.get_cpu(cpu_id) else {
+            continue;
+        };
+        let hw_id = cpu.lock().info.apic_id;
+        let node = NUMA_TOPOLOGY.lock().get_cpu_node(cpu_id).id as u32;
+
+        #[cfg(target_arch = "x86_64")]
+        let cpu_topology = CpuTopology::from_apic_id(hw_id, smt_shift, package_shift, node);
+        #[cfg(target_arch = "aarch64")]
+        let cpu_topology = CpuTopology::from_mpidr(hw_id as u64, node);
+        #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+        let cpu_topology = CpuTopology { core: cpu_id, package: 0, node };
+
+        topology::set_cpu_topology(cpu_id, cpu_topology);
+    }
 }
 
 /// Boot all application processors
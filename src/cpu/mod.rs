@@ -1,3 +1,4 @@
 pub mod percpu;
 pub mod scheduler_smp;
+pub mod topology;
 pub mod init;
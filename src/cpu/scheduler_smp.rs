@@ -1,20 +1,39 @@
 /// SMP-aware Scheduler Implementation
 /// 
-/// Supports per-CPU run queues and load balancing
+/// Supports per-CPU run queues of task references.
+///
+/// Balancing lives with the thread run queues it moves threads between:
+/// see `process::scheduler::steal_work` and `periodic_balance`.
+
+#[cfg(not(test))]
+use alloc::collections::VecDeque;
+
+#[cfg(test)]
+extern crate std;
+#[cfg(test)]
+use std::collections::VecDeque;
 
 use crate::lib_core::spinlock::Spinlock;
-use crate::cpu::percpu::{CpuInfo, MAX_CPUS};
+use crate::cpu::percpu::MAX_CPUS;
 
-/// Per-CPU scheduler run queue
+/// Per-CPU scheduler run queue. It grows with demand, so a burst of
+/// wakeups is never dropped; the only failure is running out of memory.
 pub struct PerCpuRunQueue {
     pub cpu_id: u32,
-    pub tasks: [Option<TaskRef>; MAX_TASKS_PER_QUEUE],
-    pub head: usize,
-    pub tail: usize,
-    pub count: usize,
+    tasks: VecDeque<TaskRef>,
 }
 
-pub const MAX_TASKS_PER_QUEUE: usize = 64;
+/// Capacity a drained queue shrinks back towards.
+const QUEUE_MIN_CAPACITY: usize = 64;
+
+/// Why a task was not queued. The caller still owns it.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum EnqueueError {
+    /// The CPU id is not below `MAX_CPUS`.
+    NoSuchCpu,
+    /// The queue could not grow.
+    OutOfMemory,
+}
 
 #[derive(Debug, Clone, Copy)]
 pub struct TaskRef {
@@ -28,45 +47,41 @@ pub struct MultiCpuScheduler {
 }
 
 impl PerCpuRunQueue {
-    pub fn new(cpu_id: u32) -> Self {
+    pub const fn new(cpu_id: u32) -> Self {
         PerCpuRunQueue {
             cpu_id,
-            tasks: [None; MAX_TASKS_PER_QUEUE],
-            head: 0,
-            tail: 0,
-            count: 0,
+            tasks: VecDeque::new(),
         }
     }
 
-    pub fn enqueue(&mut self, task: TaskRef) -> bool {
-        if self.count >= MAX_TASKS_PER_QUEUE {
-            return false;  // Queue full
-        }
-
-        self.tasks[self.tail] = Some(task);
-        self.tail = (self.tail + 1) % MAX_TASKS_PER_QUEUE;
-        self.count += 1;
-        true
+    pub fn enqueue(&mut self, task: TaskRef) -> Result<(), EnqueueError> {
+        self.tasks
+            .try_reserve(1)
+            .map_err(|_| EnqueueError::OutOfMemory)?;
+        self.tasks.push_back(task);
+        Ok(())
     }
 
     pub fn dequeue(&mut self) -> Option<TaskRef> {
-        if self.count == 0 {
-            return None;
+        let task = self.tasks.pop_front()?;
+        // Hand back what a burst left behind once it has drained
+        let capacity = self.tasks.capacity();
+        if capacity > QUEUE_MIN_CAPACITY && self.tasks.len() < capacity / 4 {
+            self.tasks.shrink_to((capacity / 2).max(QUEUE_MIN_CAPACITY));
         }
-
-        let task = self.tasks[self.head];
-        self.tasks[self.head] = None;
-        self.head = (self.head + 1) % MAX_TASKS_PER_QUEUE;
-        self.count -= 1;
-        task
+        Some(task)
     }
 
     pub fn peek(&self) -> Option<TaskRef> {
-        self.tasks[self.head]
+        self.tasks.front().copied()
+    }
+
+    pub fn len(&self) -> usize {
+        self.tasks.len()
     }
 
     pub fn is_empty(&self) -> bool {
-        self.count == 0
+        self.tasks.is_empty()
     }
 }
 
@@ -82,12 +97,12 @@ impl MultiCpuScheduler {
         }
     }
 
-    pub fn enqueue_task(&self, cpu_id: u32, task: TaskRef) -> bool {
+    pub fn enqueue_task(&self, cpu_id: u32, task: TaskRef) -> Result<(), EnqueueError> {
         if (cpu_id as usize) < MAX_CPUS {
             let mut queue = self.run_queues[cpu_id as usize].lock();
             queue.enqueue(task)
         } else {
-            false
+            Err(EnqueueError::NoSuchCpu)
         }
     }
 
@@ -122,62 +137,6 @@ impl MultiCpuScheduler {
             None
         }
     }
-
-    /// Load balancing: steal tasks from busier CPUs
-    pub fn load_balance(&self, idle_cpu_id: u32) -> Option<TaskRef> {
-        // Simple round-robin work stealing
-        // Try to find a CPU with tasks and steal from it
-        
-        for i in 0..MAX_CPUS {
-            if i as u32 == idle_cpu_id {
-                continue;
-            }
-
-            let mut queue = self.run_queues[i].lock();
-            if !queue.is_empty() {
-                // Try to steal a task
-                if let Some(task) = queue.dequeue() {
-                    return Some(task);
-                }
-            }
-        }
-        
-        None
-    }
-
-    pub fn rebalance_all(&self) {
-        // Try to balance tasks across CPUs
-        // This is a simplified version - more sophisticated algorithms exist
-        
-        let mut total_tasks = 0;
-        let mut active_cpus = 0;
-
-        // Count total tasks and active CPUs
-        for i in 0..MAX_CPUS {
-            let queue = self.run_queues[i].lock();
-            if !queue.is_empty() {
-                active_cpus += 1;
-                total_tasks += queue.count;
-            }
-        }
-
-        if active_cpus == 0 || total_tasks == 0 {
-            return;
-        }
-
-        // Target tasks per CPU
-        let target = (total_tasks + active_cpus - 1) / active_cpus;
-
-        // Move tasks around to balance
-        for i in 0..MAX_CPUS {
-            let mut queue = self.run_queues[i].lock();
-            if queue.count > target {
-                // Too many tasks on this CPU
-                // Would need to move excess to other CPUs
-                // This is simplified - proper implementation would be more complex
-            }
-        }
-    }
 }
 
 pub static mut MULTI_CPU_SCHEDULER: Option<MultiCpuScheduler> = None;
@@ -193,3 +152,32 @@ pub fn get_scheduler() -> Option<&'static MultiCpuScheduler> {
         MULTI_CPU_SCHEDULER.as_ref()
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn task(task_id: u64) -> TaskRef {
+        TaskRef { task_id, priority: 0 }
+    }
+
+    #[test]
+    fn test_queue_grows_past_old_limit_and_keeps_order() {
+        let sched = MultiCpuScheduler::new();
+        for id in 0..10_000 {
+            sched.enqueue_task(3, task(id)).unwrap();
+        }
+        assert_eq!(sched.run_queues[3].lock().len(), 10_000);
+        assert_eq!(
+            sched.enqueue_task(MAX_CPUS as u32, task(0)),
+            Err(EnqueueError::NoSuchCpu)
+        );
+
+        for id in 0..10_000 {
+            assert_eq!(sched.dequeue_task(3).map(|t| t.task_id), Some(id));
+        }
+        assert!(sched.dequeue_task(3).is_none());
+        assert!(sched.run_queues[3].lock().tasks.capacity() <= 2 * QUEUE_MIN_CAPACITY);
+    }
+
+}
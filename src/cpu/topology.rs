@@ -0,0 +1,139 @@
+/// CPU Topology and Scheduler Domains
+///
+/// Records which logical CPUs share a core (SMT siblings), a package and a
+/// NUMA node. It is filled in once at boot from the x2APIC ID layout
+/// (CPUID leaf 0xB) on x86_64 or the MPIDR affinity fields on arm64, and
+/// from the node NUMA setup assigned to each CPU. Both schedulers read it
+/// lock-free to keep threads near their caches and memory.
+
+use core::sync::atomic::{AtomicU32, Ordering};
+
+use crate::cpu::percpu::MAX_CPUS;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct CpuTopology {
+    /// Physical core; SMT siblings share it. Unique across packages.
+    pub core: u32,
+    pub package: u32,
+    pub node: u32,
+}
+
+/// Scheduler domain levels, innermost first. Two CPUs meet at the first
+/// level where they fall in the same group.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum Level {
+    /// Same physical core: shares L1/L2.
+    Smt,
+    /// Same package: shares the last-level cache.
+    Package,
+    /// Same NUMA node: shares local memory.
+    Node,
+    System,
+}
+
+impl CpuTopology {
+    /// Split an x2APIC ID. The low `smt_shift` bits select the thread within
+    /// a core, and the bits from `package_shift` up select the package.
+    pub fn from_apic_id(apic_id: u32, smt_shift: u32, package_shift: u32, node: u32) -> Self {
+        CpuTopology {
+            core: apic_id.checked_shr(smt_shift).unwrap_or(0),
+            package: apic_id.checked_shr(package_shift).unwrap_or(0),
+            node,
+        }
+    }
+
+    /// From MPIDR_EL1. With the MT bit set, Aff0 is the thread and Aff1
+    /// the core; otherwise Aff0 is the core. The level above the core (the
+    /// cluster) is treated as the package.
+    pub fn from_mpidr(mpidr: u64, node: u32) -> Self {
+        let affinity = ((mpidr & 0xFF_FFFF) | ((mpidr >> 8) & 0xFF00_0000)) as u32;
+        let (core, package) = if mpidr & (1 << 24) != 0 {
+            (affinity >> 8, affinity >> 16)
+        } else {
+            (affinity, affinity >> 8)
+        };
+        CpuTopology { core, package, node }
+    }
+}
+
+const UNKNOWN: u32 = u32::MAX;
+
+struct Slot {
+    core: AtomicU32,
+    package: AtomicU32,
+    node: AtomicU32,
+}
+
+const EMPTY_SLOT: Slot = Slot {
+    core: AtomicU32::new(UNKNOWN),
+    package: AtomicU32::new(0),
+    node: AtomicU32::new(0),
+};
+
+static TOPOLOGY: [Slot; MAX_CPUS] = [EMPTY_SLOT; MAX_CPUS];
+
+pub fn set_cpu_topology(cpu_id: u32, topology: CpuTopology) {
+    if let Some(slot) = TOPOLOGY.get(cpu_id as usize) {
+        slot.package.store(topology.package, Ordering::Relaxed);
+        slot.node.store(topology.node, Ordering::Relaxed);
+        slot.core.store(topology.core, Ordering::Release);
+    }
+}
+
+/// Where `cpu_id` sits. A CPU nobody described is its own core in
+/// package 0 on node 0.
+pub fn cpu_topology(cpu_id: u32) -> CpuTopology {
+    let Some(slot) = TOPOLOGY.get(cpu_id as usize) else {
+        return CpuTopology { core: cpu_id, package: 0, node: 0 };
+    };
+    match slot.core.load(Ordering::Acquire) {
+        UNKNOWN => CpuTopology { core: cpu_id, package: 0, node: 0 },
+        core => CpuTopology {
+            core,
+            package: slot.package.load(Ordering::Relaxed),
+            node: slot.node.load(Ordering::Relaxed),
+        },
+    }
+}
+
+/// Innermost domain containing both CPUs.
+pub fn shared_level(a: u32, b: u32) -> Level {
+    let (a, b) = (cpu_topology(a), cpu_topology(b));
+    if a.node != b.node {
+        Level::System
+    } else if a.package != b.package {
+        Level::Node
+    } else if a.core != b.core {
+        Level::Package
+    } else {
+        Level::Smt
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_domains_from_apic_ids() {
+        // Two threads per core, eight logical CPUs per package, one node
+        // per package
+        for apic_id in [0u32, 1, 2, 8, 9] {
+            let node = apic_id >> 3;
+            set_cpu_topology(100 + apic_id, CpuTopology::from_apic_id(apic_id, 1, 3, node));
+        }
+        assert_eq!(shared_level(100, 101), Level::Smt);
+        assert_eq!(shared_level(100, 102), Level::Package);
+        assert_eq!(shared_level(101, 109), Level::System);
+        assert_eq!(shared_level(108, 109), Level::Smt);
+        assert_eq!(cpu_topology(250), CpuTopology { core: 250, package: 0, node: 0 });
+    }
+
+    #[test]
+    fn test_mpidr_affinity() {
+        let plain = CpuTopology::from_mpidr(0x0000_0102, 0);
+        assert_eq!((plain.core, plain.package), (0x0102, 0x01));
+        let threaded = CpuTopology::from_mpidr(0x0100_0301, 0);
+        assert_eq!((threaded.core, threaded.package), (0x03, 0x00));
+    }
+}
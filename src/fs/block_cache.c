@@ -65,9 +65,14 @@ static block_cache_entry_t* cache_find(block_cache_t* cache, u64 block_num) {
     return NULL;
 }
 
-// Find least recently used entry
+// Find least recently used entry that may be evicted. Pinned entries
+// hold uncommitted journal updates and must not reach their home block.
 static block_cache_entry_t* cache_find_lru(block_cache_t* cache) {
-    return cache->lru_tail;
+    block_cache_entry_t* entry = cache->lru_tail;
+    while (entry && entry->pinned) {
+        entry = entry->prev;
+    }
+    return entry;
 }
 
 // Flush a single cache entry
@@ -170,17 +175,17 @@ i32 block_cache_read(block_cache_t* cache, u64 block_num, void* buffer) {
     // Cache miss
     cache->misses++;
     
-    // Find LRU entry to evict
-    entry = cache_find_lru(cache);
-    if (!entry) {
-        // Find first invalid entry
-        for (u32 i = 0; i < BLOCK_CACHE_SIZE; i++) {
-            if (!cache->entries[i].valid) {
-                entry = &cache->entries[i];
-                break;
-            }
+    // Prefer a free entry, then the LRU one
+    entry = NULL;
+    for (u32 i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        if (!cache->entries[i].valid) {
+            entry = &cache->entries[i];
+            break;
         }
     }
+    if (!entry) {
+        entry = cache_find_lru(cache);
+    }
     
     if (!entry) {
         return ERR_BUSY;
@@ -233,17 +238,16 @@ i32 block_cache_write(block_cache_t* cache, u64 block_num, const void* buffer) {
     block_cache_entry_t* entry = cache_find(cache, block_num);
     
     if (!entry) {
-        // Find LRU entry to evict
-        entry = cache_find_lru(cache);
-        if (!entry) {
-            // Find first invalid entry
-            for (u32 i = 0; i < BLOCK_CACHE_SIZE; i++) {
-                if (!cache->entries[i].valid) {
-                    entry = &cache->entries[i];
-                    break;
-                }
+        // Prefer a free entry, then the LRU one
+        for (u32 i = 0; i < BLOCK_CACHE_SIZE; i++) {
+            if (!cache->entries[i].valid) {
+                entry = &cache->entries[i];
+                break;
             }
         }
+        if (!entry) {
+            entry = cache_find_lru(cache);
+        }
         
         if (!entry) {
             return ERR_BUSY;
@@ -277,6 +281,56 @@ i32 block_cache_write(block_cache_t* cache, u64 block_num, const void* buffer) {
     return cache->block_size;
 }
 
+// Read a block straight from the device without caching it (bulk file
+// data). A cached copy is returned instead if present, so data and
+// metadata views of the same block stay coherent.
+i32 block_cache_read_direct(block_cache_t* cache, u64 block_num, void* buffer) {
+    if (!cache || !buffer) {
+        return ERR_INVALID;
+    }
+    
+    block_cache_entry_t* entry = cache_find(cache, block_num);
+    if (entry) {
+        cache->hits++;
+        memcpy(buffer, entry->data, cache->block_size);
+        return cache->block_size;
+    }
+    
+    block_device_ops_t* ops = get_device_ops(cache->block_device);
+    if (!ops || !ops->read_block) {
+        return ERR_INVALID;
+    }
+    
+    return ops->read_block(get_device_data(cache->block_device), block_num, buffer);
+}
+
+// Write a block straight to the device without caching it. A cached copy
+// is updated in place and marked clean so a later eviction cannot write
+// stale contents over it.
+i32 block_cache_write_direct(block_cache_t* cache, u64 block_num, const void* buffer) {
+    if (!cache || !buffer) {
+        return ERR_INVALID;
+    }
+    
+    block_device_ops_t* ops = get_device_ops(cache->block_device);
+    if (!ops || !ops->write_block) {
+        return ERR_INVALID;
+    }
+    
+    i32 result = ops->write_block(get_device_data(cache->block_device), block_num, buffer);
+    if (result < 0) {
+        return result;
+    }
+    
+    block_cache_entry_t* entry = cache_find(cache, block_num);
+    if (entry) {
+        memcpy(entry->data, buffer, cache->block_size);
+        entry->dirty = false;
+    }
+    
+    return result;
+}
+
 // Flush all dirty blocks
 i32 block_cache_flush(block_cache_t* cache) {
     if (!cache) {
@@ -285,7 +339,7 @@ i32 block_cache_flush(block_cache_t* cache) {
     
     i32 errors = 0;
     for (u32 i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        if (cache->entries[i].valid && cache->entries[i].dirty) {
+        if (cache->entries[i].valid && cache->entries[i].dirty && !cache->entries[i].pinned) {
             if (cache_flush_entry(cache, &cache->entries[i]) < 0) {
                 errors++;
             }
@@ -295,6 +349,31 @@ i32 block_cache_flush(block_cache_t* cache) {
     return errors > 0 ? ERR_INVALID : ERR_SUCCESS;
 }
 
+// Pin a cached block so it is neither evicted nor flushed
+i32 block_cache_pin(block_cache_t* cache, u64 block_num) {
+    if (!cache) {
+        return ERR_INVALID;
+    }
+    
+    block_cache_entry_t* entry = cache_find(cache, block_num);
+    if (!entry) {
+        return ERR_NOT_FOUND;
+    }
+    
+    entry->pinned = true;
+    return ERR_SUCCESS;
+}
+
+// Release a pin; the block is written back like any other dirty block
+void block_cache_unpin(block_cache_t* cache, u64 block_num) {
+    if (!cache) return;
+    
+    block_cache_entry_t* entry = cache_find(cache, block_num);
+    if (entry) {
+        entry->pinned = false;
+    }
+}
+
 // Invalidate a specific block
 i32 block_cache_invalidate(block_cache_t* cache, u64 block_num) {
     if (!cache) {
@@ -311,6 +390,7 @@ i32 block_cache_invalidate(block_cache_t* cache, u64 block_num) {
         // Remove from LRU
         lru_remove(cache, entry);
         entry->valid = false;
+        entry->pinned = false;
     }
     
     return ERR_SUCCESS;
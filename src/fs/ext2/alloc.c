@@ -26,6 +26,23 @@ static i32 find_first_zero_bit(u8* bitmap, u32 size) {
     return -1;
 }
 
+// Find next zero bit at or after start, below limit (in bits)
+static i32 find_next_zero_bit(u8* bitmap, u32 limit, u32 start) {
+    u32 bit = start;
+    while (bit < limit) {
+        // Skip fully used bytes in one step
+        if ((bit % 8) == 0 && bitmap[bit / 8] == 0xFF) {
+            bit += 8;
+            continue;
+        }
+        if (!(bitmap[bit / 8] & (1 << (bit % 8)))) {
+            return bit;
+        }
+        bit++;
+    }
+    return -1;
+}
+
 // Set bit in bitmap
 static void set_bit(u8* bitmap, u32 bit) {
     bitmap[bit / 8] |= (1 << (bit % 8));
@@ -41,72 +58,228 @@ static bool test_bit(u8* bitmap, u32 bit) {
     return (bitmap[bit / 8] & (1 << (bit % 8))) != 0;
 }
 
-// Allocate a block
-i32 ext2_alloc_block(ext2_fs_t* fs, u32* block_num) {
+// Check whether a group-relative block is free and reusable; blocks freed
+// by the running journal transaction are not until it commits
+static bool block_available(ext2_fs_t* fs, u8* bitmap, u32 group, u32 bit) {
+    if (test_bit(bitmap, bit)) {
+        return false;
+    }
+    
+    return !ext2_journal_freed(fs, fs->superblock->s_first_data_block +
+                               group * fs->superblock->s_blocks_per_group + bit);
+}
+
+// Find the next available block at or after start, below limit (in bits)
+static i32 find_next_available(ext2_fs_t* fs, u8* bitmap, u32 group, u32 limit, u32 start) {
+    i32 bit = find_next_zero_bit(bitmap, limit, start);
+    while (bit >= 0 && !block_available(fs, bitmap, group, bit)) {
+        bit = find_next_zero_bit(bitmap, limit, bit + 1);
+    }
+    return bit;
+}
+
+// Number of blocks actually present in a group (the last one may be short)
+static u32 group_block_count(ext2_fs_t* fs, u32 group) {
+    u32 first = fs->superblock->s_first_data_block + group * fs->superblock->s_blocks_per_group;
+    u32 count = fs->superblock->s_blocks_count - first;
+    if (count > fs->superblock->s_blocks_per_group) {
+        count = fs->superblock->s_blocks_per_group;
+    }
+    return count;
+}
+
+// Find up to count contiguous free blocks, starting as close to goal as
+// possible, and mark the first mark of them used. The search begins at the
+// goal's block group and walks the remaining groups in order, so related
+// blocks stay together instead of piling into group 0. On success
+// *block_num is the first block of the run and *found its length
+// (1 <= *found <= count).
+static i32 alloc_blocks(ext2_fs_t* fs, u32 goal, u32 count, u32 mark, u32* block_num, u32* found) {
     block_cache_t* cache = (block_cache_t*)fs->block_device;
     
-    // Try each block group
-    for (u32 group = 0; group < fs->num_block_groups; group++) {
+    if (count == 0) {
+        return ERR_INVALID;
+    }
+    
+    if (goal < fs->superblock->s_first_data_block || goal >= fs->superblock->s_blocks_count) {
+        goal = fs->superblock->s_first_data_block;
+    }
+    
+    u32 goal_group = ext2_get_block_group(fs->superblock, goal);
+    u32 goal_bit = (goal - fs->superblock->s_first_data_block) %
+                   fs->superblock->s_blocks_per_group;
+    
+    u8* bitmap = (u8*)malloc(fs->block_size);
+    if (!bitmap) {
+        return ERR_NO_MEMORY;
+    }
+    
+    for (u32 i = 0; i < fs->num_block_groups; i++) {
+        u32 group = (goal_group + i) % fs->num_block_groups;
         if (fs->block_groups[group].bg_free_blocks_count == 0) {
             continue;
         }
         
         // Read block bitmap
         u32 bitmap_block = fs->block_groups[group].bg_block_bitmap;
-        u8* bitmap = (u8*)malloc(fs->block_size);
-        if (!bitmap) {
-            return ERR_NO_MEMORY;
-        }
-        
         i32 result = block_cache_read(cache, bitmap_block, bitmap);
         if (result < 0) {
             free(bitmap);
             return result;
         }
         
-        // Find free block
-        i32 bit = find_first_zero_bit(bitmap, fs->block_size);
-        if (bit < 0 || bit >= (i32)fs->superblock->s_blocks_per_group) {
-            free(bitmap);
+        u32 limit = group_block_count(fs, group);
+        if (limit > fs->block_size * 8) {
+            limit = fs->block_size * 8;
+        }
+        
+        // Search forward from the goal first, then wrap to the start of the group
+        i32 bit = -1;
+        if (i == 0) {
+            bit = find_next_available(fs, bitmap, group, limit, goal_bit);
+        }
+        if (bit < 0) {
+            bit = find_next_available(fs, bitmap, group, limit, 0);
+        }
+        if (bit < 0) {
             continue;
         }
         
-        // Allocate block
-        set_bit(bitmap, bit);
+        // Extend the run while the following blocks are free
+        u32 run = 0;
+        u32 max_run = count;
+        if (max_run > fs->block_groups[group].bg_free_blocks_count) {
+            max_run = fs->block_groups[group].bg_free_blocks_count;
+        }
+        while (run < max_run && (u32)bit + run < limit && block_available(fs, bitmap, group, bit + run)) {
+            run++;
+        }
+        
+        u32 marked = (run < mark) ? run : mark;
+        for (u32 k = 0; k < marked; k++) {
+            set_bit(bitmap, bit + k);
+        }
         
         // Write bitmap back
-        result = block_cache_write(cache, bitmap_block, bitmap);
-        free(bitmap);
+        result = ext2_journal_write(fs, bitmap_block, bitmap);
         if (result < 0) {
+            free(bitmap);
             return result;
         }
+        free(bitmap);
         
         // Update block group descriptor
-        fs->block_groups[group].bg_free_blocks_count--;
+        fs->block_groups[group].bg_free_blocks_count -= marked;
         
         // Update superblock
-        fs->superblock->s_free_blocks_count--;
+        fs->superblock->s_free_blocks_count -= marked;
         
         // Calculate absolute block number
         *block_num = fs->superblock->s_first_data_block + 
                      group * fs->superblock->s_blocks_per_group + bit;
+        *found = run;
         
         fs->dirty = true;
         return ERR_SUCCESS;
     }
     
+    free(bitmap);
+    
+    // Blocks freed by the running transaction are usable once it commits
+    ext2_journal_t* journal = fs->journal;
+    if (journal && journal->freed.count > 0 && !journal->committing) {
+        i32 result = ext2_journal_commit(fs);
+        if (result < 0) {
+            return result;
+        }
+        if (journal->freed.count == 0) {
+            return alloc_blocks(fs, goal, count, mark, block_num, found);
+        }
+    }
+    
     return ERR_NO_MEMORY;
 }
 
-// Free a block
-i32 ext2_free_block(ext2_fs_t* fs, u32 block_num) {
-    if (block_num < fs->superblock->s_first_data_block || 
+// Allocate up to count contiguous blocks near goal. On success *block_num
+// is the first block of the run and *allocated its length
+// (1 <= *allocated <= count).
+i32 ext2_alloc_blocks(ext2_fs_t* fs, u32 goal, u32 count, u32* block_num, u32* allocated) {
+    return alloc_blocks(fs, goal, count, count, block_num, allocated);
+}
+
+// Mark up to count blocks from block_num used, stopping at the first one
+// already taken or at the end of the group
+static i32 claim_blocks(ext2_fs_t* fs, u32 block_num, u32 count, u32* claimed) {
+    *claimed = 0;
+    if (block_num < fs->superblock->s_first_data_block ||
         block_num >= fs->superblock->s_blocks_count) {
+        return ERR_SUCCESS;
+    }
+    
+    u32 group = ext2_get_block_group(fs->superblock, block_num);
+    u32 bit = (block_num - fs->superblock->s_first_data_block) %
+              fs->superblock->s_blocks_per_group;
+    u32 limit = group_block_count(fs, group);
+    if (limit > fs->block_size * 8) {
+        limit = fs->block_size * 8;
+    }
+    
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    u32 bitmap_block = fs->block_groups[group].bg_block_bitmap;
+    u8* bitmap = (u8*)malloc(fs->block_size);
+    if (!bitmap) {
+        return ERR_NO_MEMORY;
+    }
+    
+    i32 result = block_cache_read(cache, bitmap_block, bitmap);
+    if (result < 0) {
+        free(bitmap);
+        return result;
+    }
+    
+    u32 run = 0;
+    while (run < count && bit + run < limit && block_available(fs, bitmap, group, bit + run)) {
+        set_bit(bitmap, bit + run);
+        run++;
+    }
+    
+    if (run > 0) {
+        result = ext2_journal_write(fs, bitmap_block, bitmap);
+        if (result < 0) {
+            free(bitmap);
+            return result;
+        }
+        
+        fs->block_groups[group].bg_free_blocks_count -= run;
+        fs->superblock->s_free_blocks_count -= run;
+        fs->dirty = true;
+    }
+    
+    free(bitmap);
+    *claimed = run;
+    return ERR_SUCCESS;
+}
+
+// Allocate a block
+i32 ext2_alloc_block(ext2_fs_t* fs, u32* block_num) {
+    u32 allocated;
+    return ext2_alloc_blocks(fs, 0, 1, block_num, &allocated);
+}
+
+// Free a run of contiguous blocks (must not cross a block group boundary)
+i32 ext2_free_blocks(ext2_fs_t* fs, u32 block_num, u32 count) {
+    if (count == 0) {
+        return ERR_SUCCESS;
+    }
+    
+    if (block_num < fs->superblock->s_first_data_block || 
+        block_num + count > fs->superblock->s_blocks_count) {
         return ERR_INVALID;
     }
     
     u32 group = ext2_get_block_group(fs->superblock, block_num);
-    if (group >= fs->num_block_groups) {
+    if (group >= fs->num_block_groups ||
+        ext2_get_block_group(fs->superblock, block_num + count - 1) != group) {
         return ERR_INVALID;
     }
     
@@ -127,30 +300,173 @@ i32 ext2_free_block(ext2_fs_t* fs, u32 block_num) {
         return result;
     }
     
-    // Free block
-    if (!test_bit(bitmap, bit)) {
-        console_print("ext2: Warning: freeing already free block\n");
+    // Free blocks
+    u32 freed = 0;
+    for (u32 i = 0; i < count; i++) {
+        if (!test_bit(bitmap, bit + i)) {
+            console_print("ext2: Warning: freeing already free block\n");
+            continue;
+        }
+        clear_bit(bitmap, bit + i);
+        freed++;
     }
     
-    clear_bit(bitmap, bit);
-    
     // Write bitmap back
-    result = block_cache_write(cache, bitmap_block, bitmap);
+    result = ext2_journal_write(fs, bitmap_block, bitmap);
     free(bitmap);
     if (result < 0) {
         return result;
     }
     
+    // Freed blocks may come back as unlogged file data
+    ext2_journal_forget(fs, block_num, count);
+    
     // Update block group descriptor
-    fs->block_groups[group].bg_free_blocks_count++;
+    fs->block_groups[group].bg_free_blocks_count += freed;
     
     // Update superblock
-    fs->superblock->s_free_blocks_count++;
+    fs->superblock->s_free_blocks_count += freed;
     
     fs->dirty = true;
     return ERR_SUCCESS;
 }
 
+// Free a block
+i32 ext2_free_block(ext2_fs_t* fs, u32 block_num) {
+    return ext2_free_blocks(fs, block_num, 1);
+}
+
+// Goal block for new data of an inode: the start of its own block group
+u32 ext2_inode_goal(ext2_fs_t* fs, u32 ino) {
+    if (ino == 0 || ino > fs->superblock->s_inodes_count) {
+        return fs->superblock->s_first_data_block;
+    }
+    
+    u32 group = ext2_get_inode_group(fs->superblock, ino);
+    if (group >= fs->num_block_groups) {
+        return fs->superblock->s_first_data_block;
+    }
+    
+    return fs->superblock->s_first_data_block + group * fs->superblock->s_blocks_per_group;
+}
+
+// Find the preallocation window slot for an inode
+static ext2_prealloc_t* prealloc_slot(ext2_fs_t* fs, u32 ino) {
+    return &fs->prealloc[ino % EXT2_PREALLOC_SLOTS];
+}
+
+// Drop a window. Its blocks were never marked in the bitmap, so there is
+// nothing to give back and nothing leaks if the system goes down first.
+static void prealloc_release(ext2_prealloc_t* window) {
+    window->ino = 0;
+    window->start = 0;
+    window->count = 0;
+}
+
+// Allocate a run of up to count data blocks for a file. The inode's
+// preallocation window is consumed first when the goal continues it;
+// otherwise a free run of count plus reserve blocks is found, count of
+// them are marked used and the rest becomes the new window.
+static i32 alloc_file_run(ext2_fs_t* fs, u32 ino, u32 goal, u32 count, u32 reserve,
+                          u32* block_num, u32* allocated) {
+    ext2_prealloc_t* window = prealloc_slot(fs, ino);
+    if (window->ino == ino && window->count > 0 && window->start == goal) {
+        u32 take = (count < window->count) ? count : window->count;
+        u32 claimed;
+        i32 result = claim_blocks(fs, window->start, take, &claimed);
+        if (result < 0) {
+            return result;
+        }
+        
+        // Another allocation may have taken part of the window
+        if (claimed > 0) {
+            *block_num = window->start;
+            *allocated = claimed;
+            window->start += claimed;
+            window->count -= claimed;
+            if (claimed < take) {
+                prealloc_release(window);
+            }
+            return ERR_SUCCESS;
+        }
+    }
+    
+    // Non-sequential write or slot owned by another inode: drop the old window
+    if (window->ino != 0) {
+        prealloc_release(window);
+    }
+    
+    u32 start, found;
+    i32 result = alloc_blocks(fs, goal, count + reserve, count, &start, &found);
+    if (result < 0) {
+        return result;
+    }
+    
+    u32 take = (count < found) ? count : found;
+    *block_num = start;
+    *allocated = take;
+    if (found > take) {
+        window->ino = ino;
+        window->start = start + take;
+        window->count = found - take;
+    }
+    
+    return ERR_SUCCESS;
+}
+
+static u32 prealloc_blocks(ext2_fs_t* fs) {
+    return fs->superblock->s_prealloc_blocks ?
+           fs->superblock->s_prealloc_blocks : EXT2_PREALLOC_BLOCKS;
+}
+
+// Allocate a run of up to count data blocks for a file, keeping a
+// preallocation window for its next sequential write
+i32 ext2_alloc_file_blocks(ext2_fs_t* fs, u32 ino, u32 goal, u32 count, u32* block_num, u32* allocated) {
+    if (count == 0) {
+        return ERR_INVALID;
+    }
+    
+    if (ino == 0) {
+        return ext2_alloc_blocks(fs, goal, count, block_num, allocated);
+    }
+    
+    return alloc_file_run(fs, ino, goal, count, prealloc_blocks(fs), block_num, allocated);
+}
+
+// Allocate one data block for a file. want is the number of blocks the
+// caller is about to fill; the rest of them are found as one run and kept
+// in the preallocation window.
+i32 ext2_alloc_file_block(ext2_fs_t* fs, u32 ino, u32 goal, u32 want, u32* block_num) {
+    u32 allocated;
+    if (ino == 0) {
+        return ext2_alloc_blocks(fs, goal, 1, block_num, &allocated);
+    }
+    
+    u32 reserve = prealloc_blocks(fs);
+    if (want > reserve + 1) {
+        reserve = want - 1;
+    }
+    
+    return alloc_file_run(fs, ino, goal, 1, reserve, block_num, &allocated);
+}
+
+// Release the preallocation window of an inode (on close, unlink or unmount)
+void ext2_discard_prealloc(ext2_fs_t* fs, u32 ino) {
+    ext2_prealloc_t* window = prealloc_slot(fs, ino);
+    if (window->ino == ino) {
+        prealloc_release(window);
+    }
+}
+
+// Release every preallocation window
+void ext2_discard_all_prealloc(ext2_fs_t* fs) {
+    for (u32 i = 0; i < EXT2_PREALLOC_SLOTS; i++) {
+        if (fs->prealloc[i].ino != 0) {
+            prealloc_release(&fs->prealloc[i]);
+        }
+    }
+}
+
 // Allocate an inode
 i32 ext2_alloc_inode(ext2_fs_t* fs, u32* ino) {
     block_cache_t* cache = (block_cache_t*)fs->block_device;
@@ -185,7 +501,7 @@ i32 ext2_alloc_inode(ext2_fs_t* fs, u32* ino) {
         set_bit(bitmap, bit);
         
         // Write bitmap back
-        result = block_cache_write(cache, bitmap_block, bitmap);
+        result = ext2_journal_write(fs, bitmap_block, bitmap);
         free(bitmap);
         if (result < 0) {
             return result;
@@ -242,7 +558,7 @@ i32 ext2_free_inode(ext2_fs_t* fs, u32 ino) {
     clear_bit(bitmap, bit);
     
     // Write bitmap back
-    result = block_cache_write(cache, bitmap_block, bitmap);
+    result = ext2_journal_write(fs, bitmap_block, bitmap);
     free(bitmap);
     if (result < 0) {
         return result;
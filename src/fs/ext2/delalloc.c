@@ -0,0 +1,225 @@
+/* ext2 Delayed Allocation */
+
+#include "../../include/types.h"
+#include "../../include/ext2.h"
+#include "../../include/block_cache.h"
+#include "../../include/console.h"
+
+extern i32 ext2_set_block_num(ext2_fs_t* fs, ext2_inode_t* inode, u32 file_block, u32 block_num);
+extern u32 ext2_file_block_goal(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, u32 file_block);
+
+// Find the delayed allocation slot for an inode
+static ext2_delalloc_t* delalloc_slot(ext2_fs_t* fs, u32 ino) {
+    return &fs->delalloc[ino % EXT2_DELALLOC_SLOTS];
+}
+
+// Index of the first pending entry with file_block >= the given one
+static u32 delalloc_search(ext2_delalloc_t* da, u32 file_block) {
+    u32 lo = 0;
+    u32 hi = da->count;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (da->file_block[mid] < file_block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Drop the first n entries of a slot (they were placed or discarded)
+static void delalloc_consume(ext2_fs_t* fs, ext2_delalloc_t* da, u32 n) {
+    for (u32 i = n; i < da->count; i++) {
+        da->file_block[i - n] = da->file_block[i];
+    }
+    da->count -= n;
+    fs->delalloc_reserved -= n;
+    
+    if (da->count == 0) {
+        da->ino = 0;
+    }
+}
+
+// Write the dirty pages holding the first n pending blocks of a slot
+static i32 delalloc_write_pages(ext2_fs_t* fs, u32 ino, ext2_delalloc_t* da, u32 n) {
+    page_cache_mapping_t* mapping = page_cache_get_mapping(fs->page_cache, ino, false);
+    if (!mapping) {
+        return ERR_SUCCESS;
+    }
+    
+    u32 blocks_per_page = PAGE_CACHE_PAGE_SIZE / fs->block_size;
+    u64 last = (u64)-1;
+    for (u32 i = 0; i < n; i++) {
+        u64 index = da->file_block[i] / blocks_per_page;
+        if (index == last) {
+            continue;
+        }
+        last = index;
+        
+        page_cache_page_t* page = page_cache_lookup(mapping, index);
+        if (page && page->dirty) {
+            i32 result = page_cache_writeback_page(page);
+            if (result < 0) {
+                return result;
+            }
+        }
+    }
+    
+    return ERR_SUCCESS;
+}
+
+// Check whether a file block is waiting for delayed allocation
+bool ext2_delalloc_pending(ext2_fs_t* fs, u32 ino, u32 file_block) {
+    ext2_delalloc_t* da = delalloc_slot(fs, ino);
+    if (da->ino != ino || da->count == 0) {
+        return false;
+    }
+    
+    u32 idx = delalloc_search(da, file_block);
+    return idx < da->count && da->file_block[idx] == file_block;
+}
+
+// Record a newly written file block without allocating it on disk.
+// ERR_BUSY means the slot belongs to another inode and the caller should
+// allocate immediately instead.
+i32 ext2_delalloc_reserve(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, u32 file_block) {
+    if (ino == 0) {
+        return ERR_BUSY;
+    }
+    
+    // ext2_set_block_num maps up to the double indirect block
+    u32 addrs_per_block = fs->block_size / 4;
+    if (file_block >= 12 + addrs_per_block + addrs_per_block * addrs_per_block) {
+        return ERR_INVALID;
+    }
+    
+    ext2_delalloc_t* da = delalloc_slot(fs, ino);
+    if (da->count > 0 && da->ino != ino) {
+        return ERR_BUSY;
+    }
+    
+    if (da->count == EXT2_DELALLOC_MAX_BLOCKS) {
+        i32 result = ext2_delalloc_flush(fs, ino, inode);
+        if (result < 0) {
+            return result;
+        }
+    }
+    
+    // Every pending block must still fit at write-back; keep one spare
+    // block for a possible indirect block
+    if (fs->superblock->s_free_blocks_count < fs->delalloc_reserved + 2) {
+        return ERR_NO_MEMORY;
+    }
+    
+    // Keep entries sorted; appends (the common case) shift nothing
+    u32 idx = delalloc_search(da, file_block);
+    if (idx < da->count && da->file_block[idx] == file_block) {
+        return ERR_SUCCESS;
+    }
+    
+    for (u32 i = da->count; i > idx; i--) {
+        da->file_block[i] = da->file_block[i - 1];
+    }
+    
+    da->ino = ino;
+    da->file_block[idx] = file_block;
+    da->count++;
+    fs->delalloc_reserved++;
+    
+    return ERR_SUCCESS;
+}
+
+// Place the pending blocks of an inode. Runs of consecutive file blocks
+// are allocated with one call each and mapped; the data itself is written
+// when the page cache writes the dirty pages back. If inode is NULL the
+// live inode or the disk copy is used; either way it is written back
+// with the new mapping.
+i32 ext2_delalloc_flush(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode) {
+    ext2_delalloc_t* da = delalloc_slot(fs, ino);
+    if (da->ino != ino || da->count == 0) {
+        return ERR_SUCCESS;
+    }
+    
+    ext2_inode_t disk_inode;
+    if (!inode) {
+        i32 result = ext2_get_inode(fs, ino, &disk_inode, &inode);
+        if (result < 0) {
+            return result;
+        }
+    }
+    
+    ext2_journal_start(fs);
+    
+    u32 done = 0;
+    i32 result = ERR_SUCCESS;
+    
+    while (done < da->count && result == ERR_SUCCESS) {
+        // Length of the run of consecutive file blocks starting here
+        u32 run = 1;
+        while (done + run < da->count &&
+               da->file_block[done + run] == da->file_block[done] + run) {
+            run++;
+        }
+        
+        u32 goal = ext2_file_block_goal(fs, ino, inode, da->file_block[done]);
+        u32 start, allocated;
+        result = ext2_alloc_file_blocks(fs, ino, goal, run, &start, &allocated);
+        if (result < 0) {
+            break;
+        }
+        
+        for (u32 i = 0; i < allocated; i++) {
+            result = ext2_set_block_num(fs, inode, da->file_block[done], start + i);
+            if (result < 0) {
+                ext2_free_blocks(fs, start + i, allocated - i);
+                break;
+            }
+            result = ERR_SUCCESS;
+            
+            inode->i_blocks += (fs->block_size / 512);
+            done++;
+        }
+    }
+    
+    if (done > 0) {
+        i32 write_result = ext2_write_inode(fs, ino, inode);
+        if (result == ERR_SUCCESS) {
+            result = write_result;
+        }
+    }
+    
+    // Ordered data: the new blocks get their contents before the journal
+    // can commit the mapping that points at them
+    if (result == ERR_SUCCESS && fs->journal) {
+        result = delalloc_write_pages(fs, ino, da, done);
+    }
+    
+    delalloc_consume(fs, da, done);
+    
+    i32 stop = ext2_journal_stop(fs);
+    return result < 0 ? result : stop;
+}
+
+// Write back every inode with pending blocks
+i32 ext2_delalloc_flush_all(ext2_fs_t* fs) {
+    i32 errors = 0;
+    for (u32 i = 0; i < EXT2_DELALLOC_SLOTS; i++) {
+        if (fs->delalloc[i].count > 0 &&
+            ext2_delalloc_flush(fs, fs->delalloc[i].ino, NULL) < 0) {
+            errors++;
+        }
+    }
+    
+    return errors > 0 ? ERR_INVALID : ERR_SUCCESS;
+}
+
+// Forget the pending blocks of an inode (it is being deleted)
+void ext2_delalloc_discard(ext2_fs_t* fs, u32 ino) {
+    ext2_delalloc_t* da = delalloc_slot(fs, ino);
+    if (da->ino != ino) {
+        return;
+    }
+    
+    delalloc_consume(fs, da, da->count);
+}
@@ -17,6 +17,7 @@ extern u64 system_time;
 
 extern i32 ext2_get_block_num(ext2_fs_t* fs, ext2_inode_t* inode, u32 file_block, u32* block_num);
 extern i32 ext2_set_block_num(ext2_fs_t* fs, ext2_inode_t* inode, u32 file_block, u32 block_num);
+extern u32 ext2_file_block_goal(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, u32 file_block);
 
 // Lookup entry in directory
 i32 ext2_lookup(ext2_fs_t* fs, u32 parent_ino, const char* name, u32* ino) {
@@ -74,8 +75,15 @@ i32 ext2_lookup(ext2_fs_t* fs, u32 parent_ino, const char* name, u32* ino) {
     return ERR_NOT_FOUND;
 }
 
-// Read directory entry at index
-i32 ext2_readdir(ext2_fs_t* fs, u32 ino, u64 index, ext2_dir_entry_t* entry) {
+// Called for each live entry of a directory walk with the cursor just
+// past it. A positive return stops the walk before the entry is consumed.
+typedef i32 (*ext2_filldir_t)(ext2_fs_t* fs, void* ctx, ext2_dir_entry_t* entry, u64 next);
+
+// Walk the live entries of a directory from *pos, a byte offset into it,
+// leaving *pos at the first entry not consumed. Each directory block is
+// read once; a cursor that no longer falls on an entry boundary (the
+// block changed since it was saved) resumes at the next entry after it.
+static i32 ext2_dir_walk(ext2_fs_t* fs, u32 ino, u64* pos, ext2_filldir_t fill, void* ctx) {
     ext2_inode_t inode;
     i32 result = ext2_read_inode(fs, ino, &inode);
     if (result < 0) {
@@ -92,13 +100,15 @@ i32 ext2_readdir(ext2_fs_t* fs, u32 ino, u64 index, ext2_dir_entry_t* entry) {
         return ERR_NO_MEMORY;
     }
     
-    u32 num_blocks = (inode.i_size + fs->block_size - 1) / fs->block_size;
-    u64 current_index = 0;
-    
-    for (u32 i = 0; i < num_blocks; i++) {
+    while (*pos < inode.i_size) {
+        u32 file_block = *pos / fs->block_size;
+        u32 resume = *pos % fs->block_size;
+        u64 base = (u64)file_block * fs->block_size;
+        
         u32 block_num;
-        result = ext2_get_block_num(fs, &inode, i, &block_num);
+        result = ext2_get_block_num(fs, &inode, file_block, &block_num);
         if (result < 0 || block_num == 0) {
+            *pos = base + fs->block_size;
             continue;
         }
         
@@ -108,32 +118,163 @@ i32 ext2_readdir(ext2_fs_t* fs, u32 ino, u64 index, ext2_dir_entry_t* entry) {
             return result;
         }
         
+        // Walk from the start of the block so a stale cursor cannot land
+        // inside an entry
         u32 offset = 0;
         while (offset < fs->block_size) {
-            ext2_dir_entry_t* dir_entry = (ext2_dir_entry_t*)(block_buffer + offset);
-            
-            if (dir_entry->rec_len == 0) {
+            ext2_dir_entry_t* entry = (ext2_dir_entry_t*)(block_buffer + offset);
+            if (entry->rec_len < 8 || offset + entry->rec_len > fs->block_size) {
                 break;
             }
             
-            if (dir_entry->inode != 0) {
-                if (current_index == index) {
-                    memcpy(entry, dir_entry, sizeof(ext2_dir_entry_t));
+            u32 next = offset + entry->rec_len;
+            if (offset >= resume && entry->inode != 0) {
+                result = fill(fs, ctx, entry, base + next);
+                if (result != 0) {
+                    *pos = base + offset;
                     free(block_buffer);
-                    return ERR_SUCCESS;
+                    return result < 0 ? result : ERR_SUCCESS;
                 }
-                current_index++;
             }
-            
-            offset += dir_entry->rec_len;
+            offset = next;
         }
+        
+        *pos = base + fs->block_size;
     }
     
     free(block_buffer);
-    return ERR_NOT_FOUND;
+    return ERR_SUCCESS;
+}
+
+// Stop at the first entry and copy it out, NUL-terminating the name when
+// there is room for it
+static i32 ext2_fill_one(ext2_fs_t* fs, void* ctx, ext2_dir_entry_t* entry, u64 next) {
+    (void)fs;
+    (void)next;
+    ext2_dir_entry_t* out = (ext2_dir_entry_t*)ctx;
+    memcpy(out, entry, 8 + entry->name_len);
+    if (entry->name_len < EXT2_NAME_LEN) {
+        out->name[entry->name_len] = '\0';
+    }
+    return 1;
+}
+
+// Read the directory entry at *pos and advance *pos past it. Start with
+// *pos = 0; ERR_NOT_FOUND marks the end of the directory.
+i32 ext2_readdir_next(ext2_fs_t* fs, u32 ino, u64* pos, ext2_dir_entry_t* entry) {
+    entry->inode = 0;
+    i32 result = ext2_dir_walk(fs, ino, pos, ext2_fill_one, entry);
+    if (result < 0) {
+        return result;
+    }
+    
+    if (entry->inode == 0) {
+        return ERR_NOT_FOUND;
+    }
+    
+    *pos += entry->rec_len;
+    return ERR_SUCCESS;
+}
+
+// Read directory entry at index. Each call walks from the start of the
+// directory; listings should use ext2_readdir_next() or ext2_getdents().
+i32 ext2_readdir(ext2_fs_t* fs, u32 ino, u64 index, ext2_dir_entry_t* entry) {
+    u64 pos = 0;
+    for (u64 i = 0;; i++) {
+        i32 result = ext2_readdir_next(fs, ino, &pos, entry);
+        if (result < 0 || i == index) {
+            return result;
+        }
+    }
+}
+
+// getdents file types, indexed by EXT2_FT_*
+static const u8 ext2_ft_to_dt[] = {
+    EXT2_DT_UNKNOWN, EXT2_DT_REG, EXT2_DT_DIR, EXT2_DT_CHR,
+    EXT2_DT_BLK, EXT2_DT_FIFO, EXT2_DT_SOCK, EXT2_DT_LNK,
+};
+
+// File type of an entry, from the inode when the entry does not carry it
+static u8 ext2_entry_dt(ext2_fs_t* fs, ext2_dir_entry_t* entry) {
+    if (entry->file_type != EXT2_FT_UNKNOWN && entry->file_type <= EXT2_FT_SYMLINK) {
+        return ext2_ft_to_dt[entry->file_type];
+    }
+    
+    ext2_inode_t inode;
+    if (ext2_read_inode(fs, entry->inode, &inode) < 0) {
+        return EXT2_DT_UNKNOWN;
+    }
+    
+    switch (inode.i_mode & 0xF000) {
+        case EXT2_S_IFREG:  return EXT2_DT_REG;
+        case EXT2_S_IFDIR:  return EXT2_DT_DIR;
+        case EXT2_S_IFLNK:  return EXT2_DT_LNK;
+        case EXT2_S_IFCHR:  return EXT2_DT_CHR;
+        case EXT2_S_IFBLK:  return EXT2_DT_BLK;
+        case EXT2_S_IFIFO:  return EXT2_DT_FIFO;
+        case EXT2_S_IFSOCK: return EXT2_DT_SOCK;
+        default:            return EXT2_DT_UNKNOWN;
+    }
+}
+
+typedef struct ext2_getdents_ctx {
+    u8* buffer;
+    u32 size;
+    u32 used;
+    bool full;
+} ext2_getdents_ctx_t;
+
+// Append one record, or stop when the buffer is full
+static i32 ext2_fill_dirent(ext2_fs_t* fs, void* ctx, ext2_dir_entry_t* entry, u64 next) {
+    ext2_getdents_ctx_t* gd = (ext2_getdents_ctx_t*)ctx;
+    u32 reclen = (EXT2_DIRENT_NAME_OFFSET + entry->name_len + 1 + 7) & ~7;
+    if (gd->used + reclen > gd->size) {
+        gd->full = true;
+        return 1;
+    }
+    
+    ext2_dirent_t* d = (ext2_dirent_t*)(gd->buffer + gd->used);
+    d->d_ino = entry->inode;
+    d->d_off = next;
+    d->d_reclen = reclen;
+    d->d_type = ext2_entry_dt(fs, entry);
+    memcpy(d->d_name, entry->name, entry->name_len);
+    d->d_name[entry->name_len] = '\0';
+    
+    gd->used += reclen;
+    return 0;
+}
+
+// Fill buffer with as many ext2_dirent_t records as fit, starting at the
+// cursor *pos (0 for the first call) and advancing it. Returns the number
+// of bytes used, 0 at the end of the directory, or ERR_INVALID when the
+// buffer cannot hold the next entry.
+i32 ext2_getdents(ext2_fs_t* fs, u32 ino, u64* pos, void* buffer, u32 size) {
+    ext2_getdents_ctx_t gd = { (u8*)buffer, size, 0, false };
+    i32 result = ext2_dir_walk(fs, ino, pos, ext2_fill_dirent, &gd);
+    if (result < 0) {
+        return result;
+    }
+    
+    if (gd.full && gd.used == 0) {
+        return ERR_INVALID;
+    }
+    
+    return gd.used;
+}
+
+// Fill in a directory entry
+static void ext2_fill_dir_entry(ext2_dir_entry_t* entry, u32 ino, u16 rec_len, const char* name,
+                                u32 name_len, u8 file_type) {
+    entry->inode = ino;
+    entry->rec_len = rec_len;
+    entry->name_len = name_len;
+    entry->file_type = file_type;
+    memcpy(entry->name, name, name_len);
 }
 
-// Add directory entry
+// Add directory entry. Free space is taken from unused entries and the
+// slack after live ones; a full directory grows by one block.
 static i32 ext2_add_dir_entry(ext2_fs_t* fs, u32 parent_ino, const char* name, u32 ino, u8 file_type) {
     ext2_inode_t parent_inode;
     i32 result = ext2_read_inode(fs, parent_ino, &parent_inode);
@@ -152,90 +293,162 @@ static i32 ext2_add_dir_entry(ext2_fs_t* fs, u32 parent_ino, const char* name, u
     }
     
     u32 num_blocks = (parent_inode.i_size + fs->block_size - 1) / fs->block_size;
-    if (num_blocks == 0) {
-        num_blocks = 1;
-    }
     
     for (u32 i = 0; i < num_blocks; i++) {
         u32 block_num;
         result = ext2_get_block_num(fs, &parent_inode, i, &block_num);
+        if (result < 0 || block_num == 0) {
+            continue;
+        }
+        
+        result = block_cache_read(cache, block_num, block_buffer);
+        if (result < 0) {
+            free(block_buffer);
+            return result;
+        }
+        
+        u32 offset = 0;
         
-        if (block_num == 0) {
-            result = ext2_alloc_block(fs, &block_num);
-            if (result < 0) {
+        while (offset < fs->block_size) {
+            ext2_dir_entry_t* entry = (ext2_dir_entry_t*)(block_buffer + offset);
+            
+            if (entry->rec_len == 0) {
+                ext2_fill_dir_entry(entry, ino, fs->block_size - offset, name, name_len, file_type);
+                result = ext2_journal_write(fs, block_num, block_buffer);
                 free(block_buffer);
                 return result;
             }
             
-            result = ext2_set_block_num(fs, &parent_inode, i, block_num);
-            if (result < 0) {
+            if (entry->inode == 0 && entry->rec_len >= required_len) {
+                ext2_fill_dir_entry(entry, ino, entry->rec_len, name, name_len, file_type);
+                result = ext2_journal_write(fs, block_num, block_buffer);
                 free(block_buffer);
                 return result;
             }
             
-            memset(block_buffer, 0, fs->block_size);
-        } else {
-            result = block_cache_read(cache, block_num, block_buffer);
-            if (result < 0) {
+            u32 actual_len = 8 + entry->name_len;
+            actual_len = (actual_len + 3) & ~3;
+            u32 free_space = entry->rec_len - actual_len;
+            
+            if (entry->inode != 0 && free_space >= required_len) {
+                ext2_dir_entry_t* new_entry = (ext2_dir_entry_t*)(block_buffer + offset + actual_len);
+                ext2_fill_dir_entry(new_entry, ino, entry->rec_len - actual_len, name, name_len, file_type);
+                entry->rec_len = actual_len;
+                
+                result = ext2_journal_write(fs, block_num, block_buffer);
                 free(block_buffer);
                 return result;
             }
+            
+            offset += entry->rec_len;
+        }
+    }
+    
+    // No room: append a block holding just the new entry
+    u32 block_num, allocated;
+    u32 goal = ext2_file_block_goal(fs, parent_ino, &parent_inode, num_blocks);
+    result = ext2_alloc_blocks(fs, goal, 1, &block_num, &allocated);
+    if (result < 0) {
+        free(block_buffer);
+        return result;
+    }
+    
+    result = ext2_set_block_num(fs, &parent_inode, num_blocks, block_num);
+    if (result < 0) {
+        ext2_free_block(fs, block_num);
+        free(block_buffer);
+        return result;
+    }
+    
+    memset(block_buffer, 0, fs->block_size);
+    ext2_fill_dir_entry((ext2_dir_entry_t*)block_buffer, ino, fs->block_size, name, name_len, file_type);
+    result = ext2_journal_write(fs, block_num, block_buffer);
+    free(block_buffer);
+    if (result < 0) {
+        return result;
+    }
+    
+    parent_inode.i_size = (num_blocks + 1) * fs->block_size;
+    parent_inode.i_blocks += (fs->block_size / 512);
+    parent_inode.i_mtime = system_time;
+    return ext2_write_inode(fs, parent_ino, &parent_inode);
+}
+
+// Remove directory entry. The space joins the previous entry in the
+// block, or the entry is marked unused when it is first in its block.
+static i32 ext2_remove_dir_entry(ext2_fs_t* fs, u32 parent_ino, const char* name) {
+    ext2_inode_t parent_inode;
+    i32 result = ext2_read_inode(fs, parent_ino, &parent_inode);
+    if (result < 0) {
+        return result;
+    }
+    
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    u32 name_len = strlen(name);
+    
+    u8* block_buffer = (u8*)malloc(fs->block_size);
+    if (!block_buffer) {
+        return ERR_NO_MEMORY;
+    }
+    
+    u32 num_blocks = (parent_inode.i_size + fs->block_size - 1) / fs->block_size;
+    
+    for (u32 i = 0; i < num_blocks; i++) {
+        u32 block_num;
+        result = ext2_get_block_num(fs, &parent_inode, i, &block_num);
+        if (result < 0 || block_num == 0) {
+            continue;
+        }
+        
+        result = block_cache_read(cache, block_num, block_buffer);
+        if (result < 0) {
+            free(block_buffer);
+            return result;
         }
         
+        ext2_dir_entry_t* prev = NULL;
         u32 offset = 0;
         
         while (offset < fs->block_size) {
             ext2_dir_entry_t* entry = (ext2_dir_entry_t*)(block_buffer + offset);
             
             if (entry->rec_len == 0) {
-                entry->inode = ino;
-                entry->rec_len = fs->block_size - offset;
-                entry->name_len = name_len;
-                entry->file_type = file_type;
-                strncpy(entry->name, name, name_len);
-                entry->name[name_len] = '\0';
-                
-                result = block_cache_write(cache, block_num, block_buffer);
-                free(block_buffer);
-                
-                if (i * fs->block_size + offset + required_len > parent_inode.i_size) {
-                    parent_inode.i_size = i * fs->block_size + offset + required_len;
-                    ext2_write_inode(fs, parent_ino, &parent_inode);
-                }
-                
-                return result;
+                break;
             }
             
-            u32 actual_len = 8 + entry->name_len;
-            actual_len = (actual_len + 3) & ~3;
-            u32 free_space = entry->rec_len - actual_len;
-            
-            if (entry->inode != 0 && free_space >= required_len) {
-                ext2_dir_entry_t* new_entry = (ext2_dir_entry_t*)(block_buffer + offset + actual_len);
-                new_entry->inode = ino;
-                new_entry->rec_len = entry->rec_len - actual_len;
-                new_entry->name_len = name_len;
-                new_entry->file_type = file_type;
-                strncpy(new_entry->name, name, name_len);
-                new_entry->name[name_len] = '\0';
-                
-                entry->rec_len = actual_len;
+            if (entry->inode != 0 && entry->name_len == name_len &&
+                strncmp(entry->name, name, name_len) == 0) {
+                if (prev) {
+                    prev->rec_len += entry->rec_len;
+                } else {
+                    entry->inode = 0;
+                }
                 
-                result = block_cache_write(cache, block_num, block_buffer);
+                result = ext2_journal_write(fs, block_num, block_buffer);
                 free(block_buffer);
-                return result;
+                return result < 0 ? result : ERR_SUCCESS;
             }
             
+            prev = entry;
             offset += entry->rec_len;
         }
     }
     
     free(block_buffer);
-    return ERR_NO_MEMORY;
+    return ERR_NOT_FOUND;
+}
+
+// Track directories per block group, as e2fsck expects
+static void ext2_count_dir(ext2_fs_t* fs, u32 ino, i32 delta) {
+    u32 group = (ino - 1) / fs->superblock->s_inodes_per_group;
+    if (group < fs->num_block_groups) {
+        fs->block_groups[group].bg_used_dirs_count += delta;
+        fs->dirty = true;
+    }
 }
 
 // Create file in directory
-i32 ext2_create(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32* ino) {
+static i32 ext2_do_create(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32* ino) {
     i32 result = ext2_alloc_inode(fs, ino);
     if (result < 0) {
         return result;
@@ -269,7 +482,7 @@ i32 ext2_create(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32*
 }
 
 // Create directory
-i32 ext2_mkdir(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32* ino) {
+static i32 ext2_do_mkdir(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32* ino) {
     i32 result = ext2_alloc_inode(fs, ino);
     if (result < 0) {
         return result;
@@ -320,8 +533,7 @@ i32 ext2_mkdir(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32* i
     dotdot->name[0] = '.';
     dotdot->name[1] = '.';
     
-    block_cache_t* cache = (block_cache_t*)fs->block_device;
-    result = block_cache_write(cache, block_num, block_buffer);
+    result = ext2_journal_write(fs, block_num, block_buffer);
     free(block_buffer);
     
     if (result < 0) {
@@ -350,11 +562,30 @@ i32 ext2_mkdir(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32* i
         ext2_write_inode(fs, parent_ino, &parent_inode);
     }
     
+    ext2_count_dir(fs, *ino, 1);
+    
     return ERR_SUCCESS;
 }
 
-// Unlink file from directory
-i32 ext2_unlink(ext2_fs_t* fs, u32 parent_ino, const char* name) {
+// Stop at the first entry other than '.' and '..'
+static i32 ext2_fill_child(ext2_fs_t* fs, void* ctx, ext2_dir_entry_t* entry, u64 next) {
+    (void)fs;
+    (void)next;
+    if (entry->name[0] == '.' &&
+        (entry->name_len == 1 || (entry->name_len == 2 && entry->name[1] == '.'))) {
+        return 0;
+    }
+    *(bool*)ctx = true;
+    return 1;
+}
+
+// Unlink file from directory. A directory must hold nothing but '.' and
+// '..'; those two names themselves cannot be unlinked.
+static i32 ext2_do_unlink(ext2_fs_t* fs, u32 parent_ino, const char* name) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return ERR_INVALID;
+    }
+    
     u32 ino;
     i32 result = ext2_lookup(fs, parent_ino, name, &ino);
     if (result < 0) {
@@ -367,17 +598,75 @@ i32 ext2_unlink(ext2_fs_t* fs, u32 parent_ino, const char* name) {
         return result;
     }
     
+    bool is_dir = (inode.i_mode & 0xF000) == EXT2_S_IFDIR;
+    if (is_dir) {
+        u64 pos = 0;
+        bool has_child = false;
+        result = ext2_dir_walk(fs, ino, &pos, ext2_fill_child, &has_child);
+        if (result < 0) {
+            return result;
+        }
+        if (has_child) {
+            return ERR_NOT_EMPTY;
+        }
+    }
+    
+    result = ext2_remove_dir_entry(fs, parent_ino, name);
+    if (result < 0) {
+        return result;
+    }
+    
+    // A directory also loses its own '.' link and the parent's '..' link
+    if (is_dir) {
+        inode.i_links_count = 1;
+        
+        ext2_inode_t parent_inode;
+        if (ext2_read_inode(fs, parent_ino, &parent_inode) == ERR_SUCCESS) {
+            parent_inode.i_links_count--;
+            ext2_write_inode(fs, parent_ino, &parent_inode);
+        }
+    }
+    
     inode.i_links_count--;
+    inode.i_ctime = system_time;
     if (inode.i_links_count == 0) {
-        for (u32 i = 0; i < 15; i++) {
-            if (inode.i_block[i] != 0) {
-                ext2_free_block(fs, inode.i_block[i]);
-            }
-        }
+        ext2_delalloc_discard(fs, ino);
+        ext2_discard_prealloc(fs, ino);
+        page_cache_release_mapping(fs->page_cache, ino);
+        ext2_free_inode_blocks(fs, &inode);
+        inode.i_dtime = system_time;
+        ext2_write_inode(fs, ino, &inode);
         ext2_free_inode(fs, ino);
+        if (is_dir) {
+            ext2_count_dir(fs, ino, -1);
+        }
     } else {
         ext2_write_inode(fs, ino, &inode);
     }
     
     return ERR_SUCCESS;
 }
+
+// Each directory operation is one journal handle, so a commit never
+// splits it
+
+i32 ext2_create(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32* ino) {
+    ext2_journal_start(fs);
+    i32 result = ext2_do_create(fs, parent_ino, name, mode, ino);
+    i32 stop = ext2_journal_stop(fs);
+    return result < 0 ? result : stop;
+}
+
+i32 ext2_mkdir(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32* ino) {
+    ext2_journal_start(fs);
+    i32 result = ext2_do_mkdir(fs, parent_ino, name, mode, ino);
+    i32 stop = ext2_journal_stop(fs);
+    return result < 0 ? result : stop;
+}
+
+i32 ext2_unlink(ext2_fs_t* fs, u32 parent_ino, const char* name) {
+    ext2_journal_start(fs);
+    i32 result = ext2_do_unlink(fs, parent_ino, name);
+    i32 stop = ext2_journal_stop(fs);
+    return result < 0 ? result : stop;
+}
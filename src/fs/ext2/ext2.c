@@ -16,6 +16,7 @@ extern bool ext2_validate_superblock(ext2_superblock_t* sb);
 extern i32 ext2_read_block_groups(block_cache_t* cache, ext2_superblock_t* sb, 
                                   ext2_block_group_desc_t** bg_out, u32* num_groups);
 extern i32 ext2_write_block_groups(block_cache_t* cache, ext2_block_group_desc_t* bg, u32 num_groups);
+extern const page_cache_ops_t ext2_page_cache_ops;
 
 // Mount ext2 filesystem
 ext2_fs_t* ext2_mount(void* block_device) {
@@ -72,6 +73,46 @@ ext2_fs_t* ext2_mount(void* block_device) {
         return NULL;
     }
     
+    // A log left by a crash is replayed before metadata is used, which
+    // can rewrite the superblock and descriptors read above
+    bool replayed = false;
+    result = ext2_journal_load(fs, &replayed);
+    if (result >= 0 && replayed) {
+        free(fs->block_groups);
+        fs->block_groups = NULL;
+        result = ext2_read_superblock(cache, fs->superblock);
+        if (result >= 0) {
+            result = ext2_read_block_groups(cache, fs->superblock, &fs->block_groups, &fs->num_block_groups);
+        }
+    }
+    if (result < 0) {
+        console_print("ext2: Failed to load journal\n");
+        ext2_journal_destroy(fs);
+        free(fs->block_groups);
+        free(fs->superblock);
+        free(fs);
+        return NULL;
+    }
+    
+    // Until a clean unmount, the on-disk superblock says the log may
+    // hold transactions
+    if (fs->journal) {
+        fs->superblock->s_feature_incompat |= EXT2_FEATURE_INCOMPAT_RECOVER;
+        ext2_write_superblock(cache, fs->superblock);
+        block_cache_flush(cache);
+    }
+    
+    // File data is cached in pages, apart from the metadata block cache
+    fs->page_cache = page_cache_create(fs, &ext2_page_cache_ops, 0);
+    if (!fs->page_cache) {
+        console_print("ext2: Failed to create page cache\n");
+        ext2_journal_destroy(fs);
+        free(fs->block_groups);
+        free(fs->superblock);
+        free(fs);
+        return NULL;
+    }
+    
     console_print("ext2: Number of block groups: ");
     console_print_dec(fs->num_block_groups);
     console_print("\n");
@@ -97,11 +138,44 @@ i32 ext2_umount(ext2_fs_t* fs) {
     
     console_print("ext2: Unmounting filesystem...\n");
     
-    i32 result = ext2_sync(fs);
+    // Place delayed blocks before the preallocation windows are released
+    i32 result = ext2_delalloc_flush_all(fs);
+    if (result < 0) {
+        console_print("ext2: Warning: delayed allocation write-back failed\n");
+    }
+    
+    ext2_discard_all_prealloc(fs);
+    
+    result = ext2_sync(fs);
     if (result < 0) {
         console_print("ext2: Warning: sync failed during unmount\n");
     }
     
+    // Write everything home and mark the log empty
+    if (fs->journal) {
+        result = ext2_journal_checkpoint(fs);
+        if (result < 0) {
+            console_print("ext2: Warning: journal checkpoint failed\n");
+        } else {
+            block_cache_t* cache = (block_cache_t*)fs->block_device;
+            fs->superblock->s_feature_incompat &= ~EXT2_FEATURE_INCOMPAT_RECOVER;
+            ext2_write_superblock(cache, fs->superblock);
+            block_cache_flush(cache);
+        }
+        ext2_journal_destroy(fs);
+    }
+    
+    // Anything still pending could not be written back
+    for (u32 i = 0; i < EXT2_DELALLOC_SLOTS; i++) {
+        if (fs->delalloc[i].count > 0) {
+            ext2_delalloc_discard(fs, fs->delalloc[i].ino);
+        }
+    }
+    
+    if (fs->page_cache) {
+        page_cache_destroy(fs->page_cache);
+    }
+    
     if (fs->block_groups) {
         free(fs->block_groups);
     }
@@ -119,7 +193,30 @@ i32 ext2_umount(ext2_fs_t* fs) {
 
 // Sync filesystem to disk
 i32 ext2_sync(ext2_fs_t* fs) {
-    if (!fs || !fs->dirty) {
+    if (!fs) {
+        return ERR_SUCCESS;
+    }
+    
+    // Delayed blocks get their disk placement now
+    i32 result = ext2_delalloc_flush_all(fs);
+    if (result < 0) {
+        console_print("ext2: Failed to write back delayed blocks\n");
+        return result;
+    }
+    
+    result = page_cache_writeback_all(fs->page_cache);
+    if (result < 0) {
+        console_print("ext2: Failed to write back file pages\n");
+        return result;
+    }
+    
+    // With a journal, metadata is durable once committed: one sequential
+    // log write instead of scattered home writes
+    if (fs->journal) {
+        return ext2_journal_commit(fs);
+    }
+    
+    if (!fs->dirty) {
         return ERR_SUCCESS;
     }
     
@@ -127,7 +224,7 @@ i32 ext2_sync(ext2_fs_t* fs) {
     
     block_cache_t* cache = (block_cache_t*)fs->block_device;
     
-    i32 result = ext2_write_superblock(cache, fs->superblock);
+    result = ext2_write_superblock(cache, fs->superblock);
     if (result < 0) {
         console_print("ext2: Failed to write superblock\n");
         return result;
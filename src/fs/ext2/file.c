@@ -5,8 +5,6 @@
 #include "../../include/block_cache.h"
 #include "../../include/console.h"
 
-extern void* malloc(u64 size);
-extern void free(void* ptr);
 extern void* memset(void* ptr, int value, u64 num);
 extern void* memcpy(void* dest, const void* src, u64 num);
 extern u64 system_time;
@@ -14,8 +12,126 @@ extern u64 system_time;
 extern i32 ext2_get_block_num(ext2_fs_t* fs, ext2_inode_t* inode, u32 file_block, u32* block_num);
 extern i32 ext2_set_block_num(ext2_fs_t* fs, ext2_inode_t* inode, u32 file_block, u32 block_num);
 
+// Fill a page from disk. Unmapped blocks (holes) read as zeros; data of
+// blocks still awaiting delayed allocation only exists in dirty pages,
+// which are never evicted, so it cannot be needed here.
+static i32 ext2_readpage(void* host, u32 ino, u64 index, u8* data) {
+    ext2_fs_t* fs = (ext2_fs_t*)host;
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    
+    ext2_inode_t disk_inode;
+    ext2_inode_t* inode;
+    i32 result = ext2_get_inode(fs, ino, &disk_inode, &inode);
+    if (result < 0) {
+        return result;
+    }
+    
+    u32 blocks_per_page = PAGE_CACHE_PAGE_SIZE / fs->block_size;
+    for (u32 i = 0; i < blocks_per_page; i++) {
+        u8* out = data + i * fs->block_size;
+        
+        u32 block_num;
+        result = ext2_get_block_num(fs, inode, index * blocks_per_page + i, &block_num);
+        if (result < 0 || block_num == 0) {
+            memset(out, 0, fs->block_size);
+            continue;
+        }
+        
+        result = block_cache_read_direct(cache, block_num, out);
+        if (result < 0) {
+            return result;
+        }
+    }
+    
+    return ERR_SUCCESS;
+}
+
+// Write a dirty page to its disk blocks, bypassing the metadata cache.
+// Delayed blocks are placed in the live inode when a file operation holds
+// one, so the mapping is not lost when that caller writes its inode.
+static i32 ext2_writepage(void* host, u32 ino, u64 index, const u8* data) {
+    ext2_fs_t* fs = (ext2_fs_t*)host;
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    
+    ext2_inode_t disk_inode;
+    ext2_inode_t* inode;
+    i32 result = ext2_get_inode(fs, ino, &disk_inode, &inode);
+    if (result < 0) {
+        return result;
+    }
+    
+    u32 blocks_per_page = PAGE_CACHE_PAGE_SIZE / fs->block_size;
+    for (u32 i = 0; i < blocks_per_page; i++) {
+        u32 file_block = index * blocks_per_page + i;
+        
+        u32 block_num;
+        result = ext2_get_block_num(fs, inode, file_block, &block_num);
+        if (result < 0) {
+            return result;
+        }
+        
+        // Blocks still awaiting delayed allocation get placed first
+        if (block_num == 0 && ext2_delalloc_pending(fs, ino, file_block)) {
+            result = ext2_delalloc_flush(fs, ino, inode);
+            if (result < 0) {
+                return result;
+            }
+            ext2_get_block_num(fs, inode, file_block, &block_num);
+        }
+        
+        if (block_num == 0) {
+            continue;
+        }
+        
+        result = block_cache_write_direct(cache, block_num, data + i * fs->block_size);
+        if (result < 0) {
+            return result;
+        }
+    }
+    
+    return ERR_SUCCESS;
+}
+
+const page_cache_ops_t ext2_page_cache_ops = {
+    .readpage = ext2_readpage,
+    .writepage = ext2_writepage,
+};
+
+// Make room in a full page cache: place every delayed block and write all
+// dirty pages so clean ones can be evicted. The caller's in-memory inode
+// is used for its own file so its mapping is not lost.
+static i32 ext2_reclaim_pages(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode) {
+    i32 result = ext2_delalloc_flush(fs, ino, inode);
+    if (result < 0) {
+        return result;
+    }
+    
+    result = ext2_delalloc_flush_all(fs);
+    if (result < 0) {
+        return result;
+    }
+    
+    return page_cache_writeback_all(fs->page_cache);
+}
+
+// Get a file page, writing back dirty pages once if the cache is full
+static i32 ext2_get_page(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, page_cache_mapping_t* mapping,
+                         u64 index, bool fill, page_cache_page_t** page) {
+    i32 result = page_cache_get_page(mapping, index, fill, page);
+    if (result != ERR_NO_MEMORY) {
+        return result;
+    }
+    
+    result = ext2_reclaim_pages(fs, ino, inode);
+    if (result < 0) {
+        return result;
+    }
+    
+    return page_cache_get_page(mapping, index, fill, page);
+}
+
 // Read from file
-i32 ext2_read_file(ext2_fs_t* fs, ext2_inode_t* inode, u64 offset, u64 size, void* buffer) {
+i32 ext2_read_file(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, u64 offset, u64 size, void* buffer) {
     if (offset >= inode->i_size) {
         return 0;
     }
@@ -24,41 +140,34 @@ i32 ext2_read_file(ext2_fs_t* fs, ext2_inode_t* inode, u64 offset, u64 size, voi
         size = inode->i_size - offset;
     }
     
-    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    page_cache_mapping_t* mapping = page_cache_get_mapping(fs->page_cache, ino, true);
+    if (!mapping) {
+        return ERR_NO_MEMORY;
+    }
+    
     u8* out = (u8*)buffer;
     u64 bytes_read = 0;
+    i32 result = ERR_SUCCESS;
     
-    u8* block_buffer = (u8*)malloc(fs->block_size);
-    if (!block_buffer) {
-        return ERR_NO_MEMORY;
-    }
+    // Pages filled or written back meanwhile use the caller's inode
+    fs->live_ino = ino;
+    fs->live_inode = inode;
     
     while (size > 0) {
-        u32 file_block = offset / fs->block_size;
-        u32 block_offset = offset % fs->block_size;
-        u32 to_read = fs->block_size - block_offset;
+        u64 index = offset >> PAGE_CACHE_PAGE_SHIFT;
+        u32 page_offset = offset & (PAGE_CACHE_PAGE_SIZE - 1);
+        u32 to_read = PAGE_CACHE_PAGE_SIZE - page_offset;
         if (to_read > size) {
             to_read = size;
         }
         
-        u32 block_num;
-        i32 result = ext2_get_block_num(fs, inode, file_block, &block_num);
+        page_cache_page_t* page;
+        result = ext2_get_page(fs, ino, inode, mapping, index, true, &page);
         if (result < 0) {
-            free(block_buffer);
-            return result;
+            break;
         }
         
-        if (block_num == 0) {
-            memset(out, 0, to_read);
-        } else {
-            result = block_cache_read(cache, block_num, block_buffer);
-            if (result < 0) {
-                free(block_buffer);
-                return result;
-            }
-            
-            memcpy(out, block_buffer + block_offset, to_read);
-        }
+        memcpy(out, page->data + page_offset, to_read);
         
         out += to_read;
         offset += to_read;
@@ -66,68 +175,141 @@ i32 ext2_read_file(ext2_fs_t* fs, ext2_inode_t* inode, u64 offset, u64 size, voi
         bytes_read += to_read;
     }
     
-    free(block_buffer);
+    fs->live_inode = NULL;
+    
+    if (bytes_read == 0 && result < 0) {
+        return result;
+    }
+    
     return bytes_read;
 }
 
-// Write to file
-i32 ext2_write_file(ext2_fs_t* fs, ext2_inode_t* inode, u64 offset, u64 size, const void* buffer) {
-    block_cache_t* cache = (block_cache_t*)fs->block_device;
-    const u8* in = (const u8*)buffer;
-    u64 bytes_written = 0;
+// Pick the goal block for a new file block: right after the previous file
+// block when it is mapped, otherwise the start of the inode's block group
+u32 ext2_file_block_goal(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, u32 file_block) {
+    if (file_block > 0) {
+        u32 prev_block;
+        if (ext2_get_block_num(fs, inode, file_block - 1, &prev_block) == ERR_SUCCESS &&
+            prev_block != 0) {
+            return prev_block + 1;
+        }
+    }
     
-    u8* block_buffer = (u8*)malloc(fs->block_size);
-    if (!block_buffer) {
+    return ext2_inode_goal(fs, ino);
+}
+
+// Give a file block a home before data is copied into its page: it is
+// either mapped already, waiting for delayed allocation, or gets a disk
+// block now when the delayed allocation slot is busy. want is the number
+// of blocks left in this write, used to size an immediate allocation.
+static i32 ext2_prepare_block(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, u32 file_block, u64 want,
+                              bool* fresh) {
+    *fresh = false;
+    u32 block_num;
+    i32 result = ext2_get_block_num(fs, inode, file_block, &block_num);
+    if (result < 0) {
+        return result;
+    }
+    
+    if (block_num != 0 || ext2_delalloc_pending(fs, ino, file_block)) {
+        return ERR_SUCCESS;
+    }
+    
+    result = ext2_delalloc_reserve(fs, ino, inode, file_block);
+    if (result != ERR_BUSY) {
+        return result;
+    }
+    
+    // Ask for the rest of this write in one run so it lands contiguously
+    u32 goal = ext2_file_block_goal(fs, ino, inode, file_block);
+    if (want > fs->superblock->s_blocks_per_group) {
+        want = fs->superblock->s_blocks_per_group;
+    }
+    
+    result = ext2_alloc_file_block(fs, ino, goal, (u32)want, &block_num);
+    if (result < 0) {
+        return result;
+    }
+    
+    result = ext2_set_block_num(fs, inode, file_block, block_num);
+    if (result < 0) {
+        ext2_free_block(fs, block_num);
+        return result;
+    }
+    
+    inode->i_blocks += (fs->block_size / 512);
+    *fresh = true;
+    
+    // Page write-back reads the mapping from disk
+    return ext2_write_inode(fs, ino, inode);
+}
+
+// Write to file. Data goes into dirty page cache pages; disk blocks are
+// placed and written at write-back.
+i32 ext2_write_file(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, u64 offset, u64 size, const void* buffer) {
+    page_cache_mapping_t* mapping = page_cache_get_mapping(fs->page_cache, ino, true);
+    if (!mapping) {
         return ERR_NO_MEMORY;
     }
     
+    const u8* in = (const u8*)buffer;
+    u64 bytes_written = 0;
+    u32 blocks_per_page = PAGE_CACHE_PAGE_SIZE / fs->block_size;
+    i32 result = ERR_SUCCESS;
+    
+    // Blocks allocated right away are logged as one operation
+    ext2_journal_start(fs);
+    u32 old_blocks = inode->i_blocks;
+    
+    // Blocks placed by write-back during this call go into the caller's
+    // inode, which the caller writes after us
+    fs->live_ino = ino;
+    fs->live_inode = inode;
+    
     while (size > 0) {
-        u32 file_block = offset / fs->block_size;
-        u32 block_offset = offset % fs->block_size;
-        u32 to_write = fs->block_size - block_offset;
+        u64 index = offset >> PAGE_CACHE_PAGE_SHIFT;
+        u32 page_offset = offset & (PAGE_CACHE_PAGE_SIZE - 1);
+        u32 to_write = PAGE_CACHE_PAGE_SIZE - page_offset;
         if (to_write > size) {
             to_write = size;
         }
         
-        u32 block_num;
-        i32 result = ext2_get_block_num(fs, inode, file_block, &block_num);
+        // Every block this chunk touches needs a home first
+        u32 first = page_offset / fs->block_size;
+        u32 last = (page_offset + to_write - 1) / fs->block_size;
+        u32 fresh_blocks = 0;
+        for (u32 i = first; i <= last && result == ERR_SUCCESS; i++) {
+            u64 want = (size - (i - first) * fs->block_size + fs->block_size - 1) / fs->block_size;
+            bool fresh;
+            result = ext2_prepare_block(fs, ino, inode, index * blocks_per_page + i, want, &fresh);
+            if (fresh) {
+                fresh_blocks |= 1u << i;
+            }
+        }
         if (result < 0) {
-            free(block_buffer);
-            return result;
+            break;
         }
         
-        if (block_num == 0) {
-            result = ext2_alloc_block(fs, &block_num);
-            if (result < 0) {
-                free(block_buffer);
-                return result;
-            }
-            
-            result = ext2_set_block_num(fs, inode, file_block, block_num);
-            if (result < 0) {
-                ext2_free_block(fs, block_num);
-                free(block_buffer);
-                return result;
-            }
-            
-            inode->i_blocks += (fs->block_size / 512);
+        // A partial page with data on disk must be read before it is modified
+        bool fill = (page_offset != 0 || to_write != PAGE_CACHE_PAGE_SIZE) &&
+                    (index << PAGE_CACHE_PAGE_SHIFT) < inode->i_size;
+        
+        page_cache_page_t* page;
+        result = ext2_get_page(fs, ino, inode, mapping, index, fill, &page);
+        if (result < 0) {
+            break;
         }
         
-        if (block_offset != 0 || to_write != fs->block_size) {
-            result = block_cache_read(cache, block_num, block_buffer);
-            if (result < 0) {
-                free(block_buffer);
-                return result;
+        // A block allocated just now was a hole: the fill read a previous
+        // owner's data from it, so it starts as zeros instead
+        for (u32 i = first; fresh_blocks != 0 && i <= last; i++) {
+            if (fresh_blocks & (1u << i)) {
+                memset(page->data + i * fs->block_size, 0, fs->block_size);
             }
         }
         
-        memcpy(block_buffer + block_offset, in, to_write);
-        
-        result = block_cache_write(cache, block_num, block_buffer);
-        if (result < 0) {
-            free(block_buffer);
-            return result;
-        }
+        memcpy(page->data + page_offset, in, to_write);
+        page_cache_mark_dirty(page);
         
         in += to_write;
         offset += to_write;
@@ -135,7 +317,25 @@ i32 ext2_write_file(ext2_fs_t* fs, ext2_inode_t* inode, u64 offset, u64 size, co
         bytes_written += to_write;
     }
     
-    free(block_buffer);
+    // Ordered data: blocks allocated right away are written before the
+    // journal can commit their mapping. Writing the mapping back places
+    // the delayed blocks too, so place them in the caller's inode first.
+    if (fs->journal && inode->i_blocks != old_blocks) {
+        i32 sync_result = ext2_delalloc_flush(fs, ino, inode);
+        if (sync_result == ERR_SUCCESS) {
+            sync_result = page_cache_writeback(mapping);
+        }
+        if (result == ERR_SUCCESS) {
+            result = sync_result;
+        }
+    }
+    
+    fs->live_inode = NULL;
+    
+    i32 stop = ext2_journal_stop(fs);
+    if (bytes_written == 0 && (result < 0 || stop < 0)) {
+        return result < 0 ? result : stop;
+    }
     
     if (offset > inode->i_size) {
         inode->i_size = offset;
@@ -155,7 +355,6 @@ i32 ext2_read_block(ext2_fs_t* fs, u32 block, void* buffer) {
 
 // Write entire block
 i32 ext2_write_block(ext2_fs_t* fs, u32 block, const void* buffer) {
-    block_cache_t* cache = (block_cache_t*)fs->block_device;
     fs->dirty = true;
-    return block_cache_write(cache, block, buffer);
+    return ext2_journal_write(fs, block, buffer);
 }
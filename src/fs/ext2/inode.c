@@ -88,7 +88,7 @@ i32 ext2_write_inode(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode) {
     memcpy(buffer + offset, inode, sizeof(ext2_inode_t));
     
     // Write block back
-    result = block_cache_write(cache, block, buffer);
+    result = ext2_journal_write(fs, block, buffer);
     free(buffer);
     
     if (result < 0) {
@@ -99,6 +99,18 @@ i32 ext2_write_inode(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode) {
     return ERR_SUCCESS;
 }
 
+// Get the current copy of an inode: the one a file operation in progress
+// holds in memory, otherwise the disk copy read into scratch
+i32 ext2_get_inode(ext2_fs_t* fs, u32 ino, ext2_inode_t* scratch, ext2_inode_t** inode) {
+    if (fs->live_inode && fs->live_ino == ino) {
+        *inode = fs->live_inode;
+        return ERR_SUCCESS;
+    }
+    
+    *inode = scratch;
+    return ext2_read_inode(fs, ino, scratch);
+}
+
 // Get block number for a file block (handles indirect blocks)
 i32 ext2_get_block_num(ext2_fs_t* fs, ext2_inode_t* inode, u32 file_block, u32* block_num) {
     u32 addrs_per_block = fs->block_size / 4;
@@ -187,9 +199,84 @@ i32 ext2_get_block_num(ext2_fs_t* fs, ext2_inode_t* inode, u32 file_block, u32*
     return ERR_INVALID;
 }
 
+// Make sure an indirect block exists in *slot, allocating a zeroed one
+// next to goal when it does not. Sets *created so the caller knows the
+// block holding *slot changed.
+static i32 ext2_ensure_indirect(ext2_fs_t* fs, ext2_inode_t* inode, u32* slot, u32 goal, bool* created) {
+    *created = false;
+    if (*slot != 0) {
+        return ERR_SUCCESS;
+    }
+    
+    u32 indirect_block, allocated;
+    i32 result = ext2_alloc_blocks(fs, goal, 1, &indirect_block, &allocated);
+    if (result < 0) {
+        return result;
+    }
+    
+    u8* zero_block = (u8*)malloc(fs->block_size);
+    if (!zero_block) {
+        ext2_free_block(fs, indirect_block);
+        return ERR_NO_MEMORY;
+    }
+    memset(zero_block, 0, fs->block_size);
+    
+    result = ext2_journal_write(fs, indirect_block, zero_block);
+    free(zero_block);
+    if (result < 0) {
+        ext2_free_block(fs, indirect_block);
+        return result;
+    }
+    
+    *slot = indirect_block;
+    *created = true;
+    inode->i_blocks += (fs->block_size / 512);
+    return ERR_SUCCESS;
+}
+
+// Store one pointer in an indirect block
+static i32 ext2_set_indirect(ext2_fs_t* fs, u32 indirect_block, u32 index, u32 value) {
+    u32* indirect = (u32*)malloc(fs->block_size);
+    if (!indirect) {
+        return ERR_NO_MEMORY;
+    }
+    
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    i32 result = block_cache_read(cache, indirect_block, indirect);
+    if (result < 0) {
+        free(indirect);
+        return result;
+    }
+    
+    indirect[index] = value;
+    result = ext2_journal_write(fs, indirect_block, indirect);
+    free(indirect);
+    return result;
+}
+
+// Read one pointer from an indirect block
+static i32 ext2_get_indirect(ext2_fs_t* fs, u32 indirect_block, u32 index, u32* value) {
+    u32* indirect = (u32*)malloc(fs->block_size);
+    if (!indirect) {
+        return ERR_NO_MEMORY;
+    }
+    
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    i32 result = block_cache_read(cache, indirect_block, indirect);
+    if (result < 0) {
+        free(indirect);
+        return result;
+    }
+    
+    *value = indirect[index];
+    free(indirect);
+    return ERR_SUCCESS;
+}
+
 // Set block number for a file block (handles indirect blocks)
 i32 ext2_set_block_num(ext2_fs_t* fs, ext2_inode_t* inode, u32 file_block, u32 block_num) {
     u32 addrs_per_block = fs->block_size / 4;
+    bool created;
     
     // Direct blocks
     if (file_block < 12) {
@@ -199,50 +286,95 @@ i32 ext2_set_block_num(ext2_fs_t* fs, ext2_inode_t* inode, u32 file_block, u32 b
     
     file_block -= 12;
     
-    // Single indirect
+    // Single indirect, allocated next to the data it maps
     if (file_block < addrs_per_block) {
-        if (inode->i_block[12] == 0) {
-            // Allocate indirect block
-            u32 indirect_block;
-            i32 result = ext2_alloc_block(fs, &indirect_block);
-            if (result < 0) {
-                return result;
-            }
-            inode->i_block[12] = indirect_block;
-            
-            // Zero the indirect block
-            u8* zero_block = (u8*)malloc(fs->block_size);
-            if (!zero_block) {
-                return ERR_NO_MEMORY;
-            }
-            memset(zero_block, 0, fs->block_size);
-            
-            block_cache_t* cache = (block_cache_t*)fs->block_device;
-            result = block_cache_write(cache, indirect_block, zero_block);
-            free(zero_block);
-            if (result < 0) {
-                return result;
-            }
+        u32 indirect_block = inode->i_block[12];
+        i32 result = ext2_ensure_indirect(fs, inode, &indirect_block, block_num, &created);
+        if (result < 0) {
+            return result;
         }
+        inode->i_block[12] = indirect_block;
         
-        u32* indirect = (u32*)malloc(fs->block_size);
-        if (!indirect) {
-            return ERR_NO_MEMORY;
+        return ext2_set_indirect(fs, inode->i_block[12], file_block, block_num);
+    }
+    
+    file_block -= addrs_per_block;
+    
+    // Double indirect
+    if (file_block < addrs_per_block * addrs_per_block) {
+        u32 indirect1_idx = file_block / addrs_per_block;
+        u32 indirect2_idx = file_block % addrs_per_block;
+        
+        u32 indirect_block = inode->i_block[13];
+        i32 result = ext2_ensure_indirect(fs, inode, &indirect_block, block_num, &created);
+        if (result < 0) {
+            return result;
         }
+        inode->i_block[13] = indirect_block;
         
-        block_cache_t* cache = (block_cache_t*)fs->block_device;
-        i32 result = block_cache_read(cache, inode->i_block[12], indirect);
+        u32 indirect2_block;
+        result = ext2_get_indirect(fs, inode->i_block[13], indirect1_idx, &indirect2_block);
         if (result < 0) {
-            free(indirect);
             return result;
         }
         
-        indirect[file_block] = block_num;
-        result = block_cache_write(cache, inode->i_block[12], indirect);
-        free(indirect);
-        return result;
+        result = ext2_ensure_indirect(fs, inode, &indirect2_block, block_num, &created);
+        if (result < 0) {
+            return result;
+        }
+        
+        if (created) {
+            result = ext2_set_indirect(fs, inode->i_block[13], indirect1_idx, indirect2_block);
+            if (result < 0) {
+                return result;
+            }
+        }
+        
+        return ext2_set_indirect(fs, indirect2_block, indirect2_idx, block_num);
     }
     
-    // Double and triple indirect not fully implemented for brevity
+    // Triple indirect not implemented
     return ERR_INVALID;
 }
+
+// Free an indirect block and everything below it; depth 1 maps data blocks
+static void ext2_free_indirect(ext2_fs_t* fs, u32 indirect_block, u32 depth) {
+    u32* indirect = (u32*)malloc(fs->block_size);
+    if (indirect) {
+        block_cache_t* cache = (block_cache_t*)fs->block_device;
+        if (block_cache_read(cache, indirect_block, indirect) >= 0) {
+            for (u32 i = 0; i < fs->block_size / 4; i++) {
+                if (indirect[i] == 0) {
+                    continue;
+                }
+                if (depth > 1) {
+                    ext2_free_indirect(fs, indirect[i], depth - 1);
+                } else {
+                    ext2_free_block(fs, indirect[i]);
+                }
+            }
+        }
+        free(indirect);
+    }
+    
+    ext2_free_block(fs, indirect_block);
+}
+
+// Free every block an inode owns, including indirect blocks
+void ext2_free_inode_blocks(ext2_fs_t* fs, ext2_inode_t* inode) {
+    for (u32 i = 0; i < 12; i++) {
+        if (inode->i_block[i] != 0) {
+            ext2_free_block(fs, inode->i_block[i]);
+            inode->i_block[i] = 0;
+        }
+    }
+    
+    for (u32 level = 0; level < 3; level++) {
+        if (inode->i_block[12 + level] != 0) {
+            ext2_free_indirect(fs, inode->i_block[12 + level], level + 1);
+            inode->i_block[12 + level] = 0;
+        }
+    }
+    
+    inode->i_blocks = 0;
+}
@@ -0,0 +1,886 @@
+/* ext2 Metadata Journal */
+
+// Metadata blocks are logged in the journal inode using the ext3/JBD2
+// on-disk format (no checksums, 32-bit block numbers), so a log left by
+// a crash can also be replayed by e2fsck or Linux. Operations join one
+// running transaction; a commit writes its blocks, revoke records and a
+// commit block sequentially and leaves the home blocks dirty in the block
+// cache. When the log runs low, a checkpoint flushes the cache and
+// empties it.
+
+#include "../../include/types.h"
+#include "../../include/ext2.h"
+#include "../../include/block_cache.h"
+#include "../../include/console.h"
+
+extern void* malloc(u64 size);
+extern void free(void* ptr);
+extern void* memset(void* ptr, int value, u64 num);
+extern void* memcpy(void* dest, const void* src, u64 num);
+extern u64 system_time;
+
+extern i32 ext2_get_block_num(ext2_fs_t* fs, ext2_inode_t* inode, u32 file_block, u32* block_num);
+extern i32 ext2_write_superblock(block_cache_t* cache, ext2_superblock_t* sb);
+extern i32 ext2_write_block_groups(block_cache_t* cache, ext2_block_group_desc_t* bg, u32 num_groups);
+
+// JBD2 block header and block types
+#define JBD2_MAGIC              0xC03B3998
+#define JBD2_DESCRIPTOR_BLOCK   1
+#define JBD2_COMMIT_BLOCK       2
+#define JBD2_SUPERBLOCK_V1      3
+#define JBD2_SUPERBLOCK_V2      4
+#define JBD2_REVOKE_BLOCK       5
+#define JBD2_HEADER_SIZE        12
+#define JBD2_REVOKE_HEADER_SIZE 16
+
+// Descriptor tags without the 64bit or checksum features
+#define JBD2_TAG_SIZE           8
+#define JBD2_UUID_SIZE          16
+#define JBD2_FLAG_ESCAPE        1
+#define JBD2_FLAG_SAME_UUID     2
+#define JBD2_FLAG_LAST_TAG      8
+
+// Journal superblock fields
+#define JBD2_SB_BLOCKSIZE       12
+#define JBD2_SB_MAXLEN          16
+#define JBD2_SB_FIRST           20
+#define JBD2_SB_SEQUENCE        24
+#define JBD2_SB_START           28
+#define JBD2_SB_INCOMPAT        40
+#define JBD2_SB_UUID            48
+#define JBD2_INCOMPAT_REVOKE    0x1
+
+static u32 get_be32(const u8* p) {
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+static void put_be32(u8* p, u32 value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void put_header(u8* block, u32 type, u32 sequence) {
+    put_be32(block, JBD2_MAGIC);
+    put_be32(block + 4, type);
+    put_be32(block + 8, sequence);
+}
+
+// Block maps
+
+static i32 block_map_init(ext2_block_map_t* map, u32 capacity) {
+    u32 size = 16;
+    while (size < capacity * 2) {
+        size <<= 1;
+    }
+    
+    map->keys = (u32*)malloc(size * sizeof(u32));
+    map->values = (u32*)malloc(size * sizeof(u32));
+    if (!map->keys || !map->values) {
+        free(map->keys);
+        free(map->values);
+        map->keys = NULL;
+        map->values = NULL;
+        return ERR_NO_MEMORY;
+    }
+    
+    memset(map->keys, 0, size * sizeof(u32));
+    map->mask = size - 1;
+    map->count = 0;
+    return ERR_SUCCESS;
+}
+
+static void block_map_free(ext2_block_map_t* map) {
+    free(map->keys);
+    free(map->values);
+    map->keys = NULL;
+    map->values = NULL;
+}
+
+static void block_map_clear(ext2_block_map_t* map) {
+    if (map->count > 0) {
+        memset(map->keys, 0, (map->mask + 1) * sizeof(u32));
+        map->count = 0;
+    }
+}
+
+static u32 block_map_slot(ext2_block_map_t* map, u32 key) {
+    u32 slot = (key * 2654435761u) & map->mask;
+    while (map->keys[slot] != 0 && map->keys[slot] != key) {
+        slot = (slot + 1) & map->mask;
+    }
+    return slot;
+}
+
+static bool block_map_get(ext2_block_map_t* map, u32 key, u32* value) {
+    u32 slot = block_map_slot(map, key);
+    if (map->keys[slot] == 0) {
+        return false;
+    }
+    if (value) {
+        *value = map->values[slot];
+    }
+    return true;
+}
+
+static i32 block_map_put(ext2_block_map_t* map, u32 key, u32 value) {
+    u32 slot = block_map_slot(map, key);
+    if (map->keys[slot] == 0) {
+        // Keep the load factor at or below one half
+        if ((map->count + 1) * 2 > map->mask + 1) {
+            ext2_block_map_t grown;
+            if (block_map_init(&grown, map->mask + 1) < 0) {
+                return ERR_NO_MEMORY;
+            }
+            for (u32 i = 0; i <= map->mask; i++) {
+                if (map->keys[i] != 0) {
+                    u32 s = block_map_slot(&grown, map->keys[i]);
+                    grown.keys[s] = map->keys[i];
+                    grown.values[s] = map->values[i];
+                    grown.count++;
+                }
+            }
+            block_map_free(map);
+            *map = grown;
+            slot = block_map_slot(map, key);
+        }
+        map->keys[slot] = key;
+        map->count++;
+    }
+    map->values[slot] = value;
+    return ERR_SUCCESS;
+}
+
+// Linear probing removal: shift later entries of the cluster back
+static void block_map_remove(ext2_block_map_t* map, u32 key) {
+    u32 slot = block_map_slot(map, key);
+    if (map->keys[slot] == 0) {
+        return;
+    }
+    
+    map->keys[slot] = 0;
+    map->count--;
+    
+    u32 next = (slot + 1) & map->mask;
+    while (map->keys[next] != 0) {
+        u32 home = (map->keys[next] * 2654435761u) & map->mask;
+        if (((next - home) & map->mask) >= ((next - slot) & map->mask)) {
+            map->keys[slot] = map->keys[next];
+            map->values[slot] = map->values[next];
+            map->keys[next] = 0;
+            slot = next;
+        }
+        next = (next + 1) & map->mask;
+    }
+}
+
+// Log access
+
+static u32 journal_advance(ext2_journal_t* j, u32 pos, u32 count) {
+    pos += count;
+    while (pos >= j->len) {
+        pos -= j->len - j->first;
+    }
+    return pos;
+}
+
+static i32 journal_read(ext2_fs_t* fs, u32 pos, void* buffer) {
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    return block_cache_read_direct(cache, fs->journal->map[pos], buffer);
+}
+
+static i32 journal_write_log(ext2_fs_t* fs, u32 pos, const void* buffer) {
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    return block_cache_write_direct(cache, fs->journal->map[pos], buffer);
+}
+
+// Record where the live log starts; s_start == 0 means it is empty
+static i32 journal_write_super(ext2_fs_t* fs) {
+    ext2_journal_t* j = fs->journal;
+    i32 result = journal_read(fs, 0, j->buffer);
+    if (result < 0) {
+        return result;
+    }
+    
+    put_be32(j->buffer + JBD2_SB_SEQUENCE, j->start ? j->start_sequence : j->sequence);
+    put_be32(j->buffer + JBD2_SB_START, j->start);
+    return journal_write_log(fs, 0, j->buffer);
+}
+
+// Walk the tags of a descriptor block. Returns the tag count; blocks and
+// flags are stored when the arrays are given.
+static u32 journal_tags(ext2_fs_t* fs, const u8* descriptor, u32* blocks, u32* flags) {
+    u32 count = 0;
+    u32 offset = JBD2_HEADER_SIZE;
+    
+    while (offset + JBD2_TAG_SIZE <= fs->block_size) {
+        u32 tag_flags = get_be32(descriptor + offset + 4) & 0xFFFF;
+        if (blocks) {
+            blocks[count] = get_be32(descriptor + offset);
+            flags[count] = tag_flags;
+        }
+        count++;
+        
+        offset += JBD2_TAG_SIZE;
+        if (!(tag_flags & JBD2_FLAG_SAME_UUID)) {
+            offset += JBD2_UUID_SIZE;
+        }
+        if (tag_flags & JBD2_FLAG_LAST_TAG) {
+            break;
+        }
+    }
+    
+    return count;
+}
+
+// Replay
+
+// Scan the log for committed transactions and collect their revokes,
+// then write every logged block that no later revoke cancels to its home
+// location. Returns the id of the first transaction not replayed.
+static i32 journal_replay(ext2_fs_t* fs, u32* next_sequence) {
+    ext2_journal_t* j = fs->journal;
+    u32 bs = fs->block_size;
+    u32 max_tags = bs / JBD2_TAG_SIZE;
+    
+    ext2_block_map_t revoked;
+    if (block_map_init(&revoked, 64) < 0) {
+        return ERR_NO_MEMORY;
+    }
+    
+    u32* tag_blocks = (u32*)malloc(max_tags * sizeof(u32));
+    u32* tag_flags = (u32*)malloc(max_tags * sizeof(u32));
+    if (!tag_blocks || !tag_flags) {
+        free(tag_blocks);
+        free(tag_flags);
+        block_map_free(&revoked);
+        return ERR_NO_MEMORY;
+    }
+    
+    // Pass 1: find the end of the log. Revokes only count once their
+    // transaction's commit block has been seen.
+    u32 pos = j->start;
+    u32 sequence = j->start_sequence;
+    u32 end_sequence = sequence;
+    u32 scanned = 0;
+    i32 result = ERR_SUCCESS;
+    
+    while (scanned < j->len - j->first) {
+        result = journal_read(fs, pos, j->buffer);
+        if (result < 0) {
+            break;
+        }
+        result = ERR_SUCCESS;
+        
+        if (get_be32(j->buffer) != JBD2_MAGIC || get_be32(j->buffer + 8) != sequence) {
+            break;
+        }
+        
+        u32 type = get_be32(j->buffer + 4);
+        if (type == JBD2_DESCRIPTOR_BLOCK) {
+            u32 tags = journal_tags(fs, j->buffer, NULL, NULL);
+            pos = journal_advance(j, pos, 1 + tags);
+            scanned += 1 + tags;
+        } else if (type == JBD2_REVOKE_BLOCK) {
+            u32 used = get_be32(j->buffer + 12);
+            if (used > bs) {
+                used = bs;
+            }
+            for (u32 off = JBD2_REVOKE_HEADER_SIZE; off + 4 <= used; off += 4) {
+                u32 block = get_be32(j->buffer + off);
+                u32 previous = 0;
+                if (block != 0 && (!block_map_get(&revoked, block, &previous) || previous < sequence)) {
+                    block_map_put(&revoked, block, sequence);
+                }
+            }
+            pos = journal_advance(j, pos, 1);
+            scanned++;
+        } else if (type == JBD2_COMMIT_BLOCK) {
+            sequence++;
+            end_sequence = sequence;
+            pos = journal_advance(j, pos, 1);
+            scanned++;
+        } else {
+            break;
+        }
+    }
+    
+    // Pass 2: replay committed transactions in order
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    u32 replayed = 0;
+    pos = j->start;
+    sequence = j->start_sequence;
+    
+    while (result == ERR_SUCCESS && sequence != end_sequence) {
+        result = journal_read(fs, pos, j->descriptor);
+        if (result < 0) {
+            break;
+        }
+        result = ERR_SUCCESS;
+        
+        u32 type = get_be32(j->descriptor + 4);
+        pos = journal_advance(j, pos, 1);
+        
+        if (type == JBD2_COMMIT_BLOCK) {
+            sequence++;
+            continue;
+        }
+        if (type != JBD2_DESCRIPTOR_BLOCK) {
+            continue;
+        }
+        
+        u32 tags = journal_tags(fs, j->descriptor, tag_blocks, tag_flags);
+        for (u32 i = 0; i < tags; i++) {
+            u32 block = tag_blocks[i];
+            u32 revoke_sequence = 0;
+            bool skip = block_map_get(&revoked, block, &revoke_sequence) &&
+                        revoke_sequence >= sequence && revoke_sequence < end_sequence;
+            
+            if (!skip && block < fs->superblock->s_blocks_count) {
+                result = journal_read(fs, pos, j->buffer);
+                if (result < 0) {
+                    break;
+                }
+                if (tag_flags[i] & JBD2_FLAG_ESCAPE) {
+                    put_be32(j->buffer, JBD2_MAGIC);
+                }
+                result = block_cache_write_direct(cache, block, j->buffer);
+                if (result < 0) {
+                    break;
+                }
+                result = ERR_SUCCESS;
+                replayed++;
+            }
+            pos = journal_advance(j, pos, 1);
+        }
+    }
+    
+    free(tag_blocks);
+    free(tag_flags);
+    block_map_free(&revoked);
+    
+    if (result < 0) {
+        return result;
+    }
+    
+    console_print("ext2: Journal replayed ");
+    console_print_dec(replayed);
+    console_print(" blocks from ");
+    console_print_dec(end_sequence - j->start_sequence);
+    console_print(" transactions\n");
+    
+    *next_sequence = end_sequence;
+    return ERR_SUCCESS;
+}
+
+// Mount
+
+// Map the journal inode and replay a log left by an unclean unmount.
+// Filesystems without a journal (or with one this driver cannot write)
+// mount with fs->journal == NULL and behave as plain ext2.
+i32 ext2_journal_load(ext2_fs_t* fs, bool* replayed) {
+    ext2_superblock_t* sb = fs->superblock;
+    *replayed = false;
+    
+    if (!(sb->s_feature_compat & EXT2_FEATURE_COMPAT_HAS_JOURNAL)) {
+        return ERR_SUCCESS;
+    }
+    
+    bool recover = (sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_RECOVER) != 0;
+    if (sb->s_journal_inum == 0 || sb->s_journal_dev != 0) {
+        console_print("ext2: External journals are not supported\n");
+        return recover ? ERR_INVALID : ERR_SUCCESS;
+    }
+    
+    ext2_inode_t inode;
+    i32 result = ext2_read_inode(fs, sb->s_journal_inum, &inode);
+    if (result < 0) {
+        return result;
+    }
+    
+    u32 blocks = inode.i_size / fs->block_size;
+    if (blocks < 2) {
+        console_print("ext2: Journal inode is too small\n");
+        return recover ? ERR_INVALID : ERR_SUCCESS;
+    }
+    
+    ext2_journal_t* j = (ext2_journal_t*)malloc(sizeof(ext2_journal_t));
+    if (!j) {
+        return ERR_NO_MEMORY;
+    }
+    memset(j, 0, sizeof(ext2_journal_t));
+    fs->journal = j;
+    
+    j->map = (u32*)malloc(blocks * sizeof(u32));
+    j->buffer = (u8*)malloc(fs->block_size);
+    j->descriptor = (u8*)malloc(fs->block_size);
+    if (!j->map || !j->buffer || !j->descriptor) {
+        ext2_journal_destroy(fs);
+        return ERR_NO_MEMORY;
+    }
+    
+    for (u32 i = 0; i < blocks; i++) {
+        result = ext2_get_block_num(fs, &inode, i, &j->map[i]);
+        if (result < 0 || j->map[i] == 0) {
+            console_print("ext2: Journal inode has holes\n");
+            ext2_journal_destroy(fs);
+            return recover ? ERR_INVALID : ERR_SUCCESS;
+        }
+    }
+    
+    j->len = blocks;
+    result = journal_read(fs, 0, j->buffer);
+    if (result < 0) {
+        ext2_journal_destroy(fs);
+        return result;
+    }
+    
+    u32 type = get_be32(j->buffer + 4);
+    u32 incompat = (type == JBD2_SUPERBLOCK_V2) ? get_be32(j->buffer + JBD2_SB_INCOMPAT) : 0;
+    u32 maxlen = get_be32(j->buffer + JBD2_SB_MAXLEN);
+    j->first = get_be32(j->buffer + JBD2_SB_FIRST);
+    j->start_sequence = get_be32(j->buffer + JBD2_SB_SEQUENCE);
+    j->start = get_be32(j->buffer + JBD2_SB_START);
+    memcpy(j->uuid, j->buffer + JBD2_SB_UUID, 16);
+    
+    if (get_be32(j->buffer) != JBD2_MAGIC ||
+        (type != JBD2_SUPERBLOCK_V1 && type != JBD2_SUPERBLOCK_V2) ||
+        get_be32(j->buffer + JBD2_SB_BLOCKSIZE) != fs->block_size ||
+        maxlen > blocks || j->first == 0 || j->first >= maxlen ||
+        (incompat & ~JBD2_INCOMPAT_REVOKE) != 0) {
+        console_print("ext2: Unsupported journal format\n");
+        ext2_journal_destroy(fs);
+        return recover ? ERR_INVALID : ERR_SUCCESS;
+    }
+    j->len = maxlen;
+    
+    j->sequence = j->start_sequence;
+    if (j->start != 0) {
+        if (j->start < j->first || j->start >= j->len) {
+            console_print("ext2: Corrupt journal start\n");
+            ext2_journal_destroy(fs);
+            return ERR_INVALID;
+        }
+        result = journal_replay(fs, &j->sequence);
+        if (result < 0) {
+            console_print("ext2: Journal replay failed\n");
+            ext2_journal_destroy(fs);
+            return result;
+        }
+        *replayed = true;
+    }
+    
+    j->start = 0;
+    j->head = j->first;
+    result = journal_write_super(fs);
+    if (result < 0) {
+        ext2_journal_destroy(fs);
+        return result;
+    }
+    
+    // Pinned blocks must fit in the block cache with room to spare, and
+    // the log must hold at least two full commits
+    u32 gdt_blocks = (fs->num_block_groups * sizeof(ext2_block_group_desc_t) + fs->block_size - 1) /
+                     fs->block_size;
+    u32 tags_per_descriptor = (fs->block_size - JBD2_HEADER_SIZE - JBD2_UUID_SIZE) / JBD2_TAG_SIZE;
+    u32 revokes_per_block = (fs->block_size - JBD2_REVOKE_HEADER_SIZE) / 4;
+    j->tx_capacity = EXT2_JOURNAL_TX_MAX + 1 + gdt_blocks;
+    j->reserve = j->tx_capacity + (j->tx_capacity + tags_per_descriptor - 1) / tags_per_descriptor +
+                 (EXT2_JOURNAL_REVOKE_MAX + revokes_per_block - 1) / revokes_per_block + 1;
+    
+    if (gdt_blocks > EXT2_JOURNAL_MAX_GDT_BLOCKS || j->len - j->first < 2 * j->reserve) {
+        console_print("ext2: Journal disabled for this geometry\n");
+        ext2_journal_destroy(fs);
+        return ERR_SUCCESS;
+    }
+    
+    j->tx_blocks = (u32*)malloc(j->tx_capacity * sizeof(u32));
+    if (!j->tx_blocks ||
+        block_map_init(&j->tx, j->tx_capacity) < 0 ||
+        block_map_init(&j->revoke, EXT2_JOURNAL_REVOKE_MAX) < 0 ||
+        block_map_init(&j->logged, 256) < 0 ||
+        block_map_init(&j->freed, 256) < 0) {
+        ext2_journal_destroy(fs);
+        return ERR_NO_MEMORY;
+    }
+    j->tx_start = system_time;
+    
+    console_print("ext2: Journal: ");
+    console_print_dec(j->len);
+    console_print(" blocks\n");
+    return ERR_SUCCESS;
+}
+
+void ext2_journal_destroy(ext2_fs_t* fs) {
+    ext2_journal_t* j = fs->journal;
+    if (!j) {
+        return;
+    }
+    
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    for (u32 i = 0; j->tx_blocks && i < j->tx_used; i++) {
+        if (j->tx_blocks[i] != 0) {
+            block_cache_unpin(cache, j->tx_blocks[i]);
+        }
+    }
+    
+    block_map_free(&j->tx);
+    block_map_free(&j->revoke);
+    block_map_free(&j->logged);
+    block_map_free(&j->freed);
+    free(j->tx_blocks);
+    free(j->map);
+    free(j->buffer);
+    free(j->descriptor);
+    free(j);
+    fs->journal = NULL;
+}
+
+// Transactions
+
+// Operations bracket their metadata updates so commits only happen
+// between them
+void ext2_journal_start(ext2_fs_t* fs) {
+    if (fs->journal) {
+        fs->journal->handles++;
+    }
+}
+
+// Close an operation. The running transaction is committed once it is
+// large or old enough; until then further operations join it.
+i32 ext2_journal_stop(ext2_fs_t* fs) {
+    ext2_journal_t* j = fs->journal;
+    if (!j || j->handles == 0) {
+        return ERR_SUCCESS;
+    }
+    
+    if (--j->handles > 0) {
+        return ERR_SUCCESS;
+    }
+    
+    if (j->tx.count >= EXT2_JOURNAL_TX_BLOCKS ||
+        (j->tx.count > 0 && system_time - j->tx_start >= EXT2_JOURNAL_COMMIT_SECONDS)) {
+        return ext2_journal_commit(fs);
+    }
+    
+    return ERR_SUCCESS;
+}
+
+// Add a block already written to the block cache to the running
+// transaction. It stays pinned there until the commit.
+i32 ext2_journal_dirty(ext2_fs_t* fs, u32 block) {
+    ext2_journal_t* j = fs->journal;
+    if (!j || block_map_get(&j->tx, block, NULL)) {
+        return ERR_SUCCESS;
+    }
+    
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    i32 result = block_cache_pin(cache, block);
+    if (result < 0) {
+        return result;
+    }
+    
+    // A full transaction is committed even inside an operation; the new
+    // block stays pinned across that commit and opens the next one
+    if (!j->committing && (j->tx.count >= EXT2_JOURNAL_TX_MAX || j->tx_used >= j->tx_capacity)) {
+        result = ext2_journal_commit(fs);
+        if (result < 0) {
+            block_cache_unpin(cache, block);
+            return result;
+        }
+    }
+    
+    if (j->tx_used >= j->tx_capacity) {
+        block_cache_unpin(cache, block);
+        return ERR_BUSY;
+    }
+    
+    result = block_map_put(&j->tx, block, j->tx_used);
+    if (result < 0) {
+        block_cache_unpin(cache, block);
+        return result;
+    }
+    
+    // Logging the block again cancels its revoke in this transaction
+    block_map_remove(&j->revoke, block);
+    j->tx_blocks[j->tx_used++] = block;
+    return ERR_SUCCESS;
+}
+
+// Write a metadata block through the cache and log it
+i32 ext2_journal_write(ext2_fs_t* fs, u32 block, const void* buffer) {
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    i32 result = block_cache_write(cache, block, buffer);
+    if (result < 0) {
+        return result;
+    }
+    
+    result = ext2_journal_dirty(fs, block);
+    if (result < 0) {
+        return result;
+    }
+    
+    return fs->block_size;
+}
+
+// Blocks being freed may be reused for file data, which is not logged.
+// Drop them from the running transaction and revoke copies in the log so
+// a replay cannot write stale metadata over the new contents. Until the
+// free commits, a crash would bring the old owner back, so the blocks are
+// kept from the allocator until then.
+void ext2_journal_forget(ext2_fs_t* fs, u32 block, u32 count) {
+    ext2_journal_t* j = fs->journal;
+    if (!j) {
+        return;
+    }
+    
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    for (u32 b = block; b < block + count; b++) {
+        if (block_map_put(&j->freed, b, 1) < 0 && !j->committing) {
+            ext2_journal_commit(fs);
+        }
+        
+        u32 index;
+        if (block_map_get(&j->tx, b, &index)) {
+            block_map_remove(&j->tx, b);
+            j->tx_blocks[index] = 0;
+            block_cache_unpin(cache, b);
+        }
+        
+        if (!block_map_get(&j->logged, b, NULL)) {
+            continue;
+        }
+        
+        if (!j->committing && j->revoke.count >= EXT2_JOURNAL_REVOKE_MAX) {
+            ext2_journal_commit(fs);
+        }
+        block_map_put(&j->revoke, b, 1);
+    }
+}
+
+// Check whether a block was freed by the running transaction
+bool ext2_journal_freed(ext2_fs_t* fs, u32 block) {
+    ext2_journal_t* j = fs->journal;
+    return j && j->freed.count > 0 && block_map_get(&j->freed, block, NULL);
+}
+
+// Write the running transaction to the log
+static i32 journal_write_transaction(ext2_fs_t* fs) {
+    ext2_journal_t* j = fs->journal;
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    u32 bs = fs->block_size;
+    u32 pos = j->head;
+    i32 result;
+    
+    // Each descriptor is followed by the blocks it tags. The data blocks
+    // go out first so the descriptor can carry their escape flags.
+    u32 i = 0;
+    while (i < j->tx_used) {
+        u32 descriptor_pos = pos;
+        u32 offset = JBD2_HEADER_SIZE;
+        u32 last_tag = 0;
+        pos++;
+        
+        memset(j->descriptor, 0, bs);
+        put_header(j->descriptor, JBD2_DESCRIPTOR_BLOCK, j->sequence);
+        
+        for (; i < j->tx_used; i++) {
+            u32 block = j->tx_blocks[i];
+            if (block == 0) {
+                continue;
+            }
+            
+            bool first_tag = (offset == JBD2_HEADER_SIZE);
+            u32 tag_size = JBD2_TAG_SIZE + (first_tag ? JBD2_UUID_SIZE : 0);
+            if (offset + tag_size > bs) {
+                break;
+            }
+            
+            result = block_cache_read(cache, block, j->buffer);
+            if (result < 0) {
+                return result;
+            }
+            
+            u32 flags = first_tag ? 0 : JBD2_FLAG_SAME_UUID;
+            if (get_be32(j->buffer) == JBD2_MAGIC) {
+                put_be32(j->buffer, 0);
+                flags |= JBD2_FLAG_ESCAPE;
+            }
+            
+            result = journal_write_log(fs, pos++, j->buffer);
+            if (result < 0) {
+                return result;
+            }
+            
+            put_be32(j->descriptor + offset, block);
+            put_be32(j->descriptor + offset + 4, flags);
+            if (first_tag) {
+                memcpy(j->descriptor + offset + JBD2_TAG_SIZE, j->uuid, JBD2_UUID_SIZE);
+            }
+            last_tag = offset;
+            offset += tag_size;
+            j->blocks_logged++;
+        }
+        
+        if (offset == JBD2_HEADER_SIZE) {
+            // Only forgotten blocks were left
+            pos = descriptor_pos;
+            break;
+        }
+        
+        put_be32(j->descriptor + last_tag + 4, get_be32(j->descriptor + last_tag + 4) | JBD2_FLAG_LAST_TAG);
+        result = journal_write_log(fs, descriptor_pos, j->descriptor);
+        if (result < 0) {
+            return result;
+        }
+    }
+    
+    // Revoke records
+    u32 slot = 0;
+    while (j->revoke.count > 0 && slot <= j->revoke.mask) {
+        memset(j->descriptor, 0, bs);
+        put_header(j->descriptor, JBD2_REVOKE_BLOCK, j->sequence);
+        
+        u32 offset = JBD2_REVOKE_HEADER_SIZE;
+        for (; slot <= j->revoke.mask && offset + 4 <= bs; slot++) {
+            if (j->revoke.keys[slot] != 0) {
+                put_be32(j->descriptor + offset, j->revoke.keys[slot]);
+                offset += 4;
+            }
+        }
+        
+        if (offset == JBD2_REVOKE_HEADER_SIZE) {
+            break;
+        }
+        put_be32(j->descriptor + 12, offset);
+        result = journal_write_log(fs, pos++, j->descriptor);
+        if (result < 0) {
+            return result;
+        }
+    }
+    
+    // The commit block makes the transaction durable
+    memset(j->descriptor, 0, bs);
+    put_header(j->descriptor, JBD2_COMMIT_BLOCK, j->sequence);
+    result = journal_write_log(fs, pos++, j->descriptor);
+    if (result < 0) {
+        return result;
+    }
+    
+    j->head = pos;
+    return ERR_SUCCESS;
+}
+
+// Commit the running transaction: one sequential log write for all the
+// operations batched into it. Home blocks are left dirty in the cache.
+i32 ext2_journal_commit(ext2_fs_t* fs) {
+    ext2_journal_t* j = fs->journal;
+    if (!j || j->committing) {
+        return ERR_SUCCESS;
+    }
+    
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    j->committing = true;
+    
+    // Free counts travel with the transaction that changed them
+    i32 result = ERR_SUCCESS;
+    if (fs->dirty) {
+        result = ext2_write_superblock(cache, fs->superblock);
+        if (result >= 0) {
+            result = ext2_journal_dirty(fs, 1);
+        }
+        
+        u32 gdt_blocks = (fs->num_block_groups * sizeof(ext2_block_group_desc_t) + fs->block_size - 1) /
+                         fs->block_size;
+        if (result >= 0) {
+            result = ext2_write_block_groups(cache, fs->block_groups, fs->num_block_groups);
+        }
+        for (u32 i = 0; result >= 0 && i < gdt_blocks; i++) {
+            result = ext2_journal_dirty(fs, 2 + i);
+        }
+        
+        if (result >= 0) {
+            fs->dirty = false;
+        }
+    }
+    
+    if (result >= 0 && (j->tx.count > 0 || j->revoke.count > 0)) {
+        // The journal superblock points at the first transaction
+        if (j->start == 0) {
+            j->start = j->head;
+            j->start_sequence = j->sequence;
+            result = journal_write_super(fs);
+        }
+        if (result >= 0) {
+            result = journal_write_transaction(fs);
+        }
+        
+        if (result >= 0) {
+            for (u32 i = 0; i < j->tx_used; i++) {
+                u32 block = j->tx_blocks[i];
+                if (block != 0) {
+                    block_cache_unpin(cache, block);
+                    block_map_put(&j->logged, block, 1);
+                }
+            }
+            
+            block_map_clear(&j->tx);
+            block_map_clear(&j->revoke);
+            j->tx_used = 0;
+            j->sequence++;
+            j->commits++;
+        }
+    }
+    
+    if (result >= 0) {
+        block_map_clear(&j->freed);
+    }
+    
+    j->tx_start = system_time;
+    j->committing = false;
+    
+    if (result < 0) {
+        console_print("ext2: Journal commit failed\n");
+        return result;
+    }
+    
+    // Keep room for the next full transaction
+    if (j->len - j->head < j->reserve) {
+        return ext2_journal_checkpoint(fs);
+    }
+    
+    return ERR_SUCCESS;
+}
+
+// Commit, write every dirty block home and empty the log
+i32 ext2_journal_checkpoint(ext2_fs_t* fs) {
+    ext2_journal_t* j = fs->journal;
+    if (!j) {
+        return ERR_SUCCESS;
+    }
+    
+    if (j->tx.count > 0 || j->revoke.count > 0 || fs->dirty) {
+        i32 result = ext2_journal_commit(fs);
+        if (result < 0 || j->start == 0) {
+            return result;
+        }
+    }
+    
+    if (j->start == 0) {
+        return ERR_SUCCESS;
+    }
+    
+    block_cache_t* cache = (block_cache_t*)fs->block_device;
+    i32 result = block_cache_flush(cache);
+    if (result < 0) {
+        return result;
+    }
+    
+    j->start = 0;
+    j->head = j->first;
+    block_map_clear(&j->logged);
+    j->checkpoints++;
+    
+    return journal_write_super(fs);
+}
@@ -60,8 +60,16 @@ static i32 ext2_vfs_open(vfs_node_t* node, u32 flags) {
 
 // VFS close callback
 static i32 ext2_vfs_close(vfs_node_t* node) {
-    (void)node;
-    return ERR_SUCCESS;
+    if (!node || !node->fs_data) {
+        return ERR_INVALID;
+    }
+    
+    // Place delayed blocks, then hand unused preallocated blocks back
+    ext2_vfs_data_t* data = (ext2_vfs_data_t*)node->fs_data;
+    i32 result = ext2_delalloc_flush(data->fs, data->ino, NULL);
+    ext2_discard_prealloc(data->fs, data->ino);
+    
+    return result;
 }
 
 // VFS read callback
@@ -78,7 +86,7 @@ static i32 ext2_vfs_read(vfs_node_t* node, u64 offset, u64 size, void* buffer) {
         return result;
     }
     
-    return ext2_read_file(data->fs, &inode, offset, size, buffer);
+    return ext2_read_file(data->fs, data->ino, &inode, offset, size, buffer);
 }
 
 // VFS write callback
@@ -95,7 +103,7 @@ static i32 ext2_vfs_write(vfs_node_t* node, u64 offset, u64 size, const void* bu
         return result;
     }
     
-    result = ext2_write_file(data->fs, &inode, offset, size, buffer);
+    result = ext2_write_file(data->fs, data->ino, &inode, offset, size, buffer);
     if (result > 0) {
         ext2_write_inode(data->fs, data->ino, &inode);
         node->size = inode.i_size;
@@ -175,6 +183,20 @@ static i32 ext2_vfs_readdir(vfs_node_t* dir, u64 index, vfs_node_t* result) {
     return ERR_SUCCESS;
 }
 
+// VFS getdents callback: ext2_dirent_t records from the directory cursor
+static i32 ext2_vfs_getdents(vfs_node_t* dir, u64* pos, void* buffer, u64 size) {
+    if (!dir || !dir->fs_data || !pos || !buffer) {
+        return ERR_INVALID;
+    }
+    
+    ext2_vfs_data_t* dir_data = (ext2_vfs_data_t*)dir->fs_data;
+    if (size > 0x7FFFFFFF) {
+        size = 0x7FFFFFFF;
+    }
+    
+    return ext2_getdents(dir_data->fs, dir_data->ino, pos, buffer, (u32)size);
+}
+
 // VFS mkdir callback
 static i32 ext2_vfs_mkdir(vfs_node_t* parent, const char* name, u64 permissions) {
     if (!parent || !parent->fs_data || !name) {
@@ -251,6 +273,7 @@ static vfs_ops_t ext2_vfs_ops = {
     .sync = ext2_vfs_sync,
     .lookup = ext2_vfs_lookup,
     .readdir = ext2_vfs_readdir,
+    .getdents = ext2_vfs_getdents,
 };
 
 // Create VFS root node for mounted ext2 filesystem
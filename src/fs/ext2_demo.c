@@ -43,7 +43,7 @@ void ext2_demo_create_file(void) {
     u64 data_len = 0;
     while (data[data_len]) data_len++;
     
-    result = ext2_write_file(fs, &inode, 0, data_len, data);
+    result = ext2_write_file(fs, file_ino, &inode, 0, data_len, data);
     if (result < 0) {
         console_print("  Failed to write to file\n");
         return;
@@ -53,8 +53,10 @@ void ext2_demo_create_file(void) {
     console_print_dec(result);
     console_print(" bytes to file\n");
     
-    // Update inode
+    // Update inode, place the delayed blocks and release the preallocation window
     ext2_write_inode(fs, file_ino, &inode);
+    ext2_delalloc_flush(fs, file_ino, NULL);
+    ext2_discard_prealloc(fs, file_ino);
     
     console_print("  File size: ");
     console_print_dec(inode.i_size);
@@ -97,7 +99,7 @@ void ext2_demo_read_file(void) {
     
     // Read the file content
     char buffer[256];
-    result = ext2_read_file(fs, &inode, 0, inode.i_size, buffer);
+    result = ext2_read_file(fs, file_ino, &inode, 0, inode.i_size, buffer);
     if (result < 0) {
         console_print("  Failed to read file\n");
         return;
@@ -120,9 +122,10 @@ void ext2_demo_list_dir(void) {
     
     ext2_dir_entry_t entry;
     u64 index = 0;
+    u64 pos = 0;
     
     while (1) {
-        i32 result = ext2_readdir(fs, EXT2_ROOT_INO, index, &entry);
+        i32 result = ext2_readdir_next(fs, EXT2_ROOT_INO, &pos, &entry);
         if (result < 0) {
             break;
         }
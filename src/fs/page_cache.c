@@ -0,0 +1,542 @@
+/* Page Cache - Per-Inode File Data Cache */
+
+#include "../include/types.h"
+#include "../include/page_cache.h"
+#include "../include/console.h"
+
+extern void* malloc(u64 size);
+extern void free(void* ptr);
+extern void* memset(void* ptr, int value, u64 num);
+
+// Physical frames from the kernel frame allocator (identity mapped)
+extern u64 frame_alloc_page(void);
+extern void frame_free_page(u64 addr);
+
+// Number of pages a radix tree of the given height can index
+static u64 radix_capacity(u32 height) {
+    if (height == 0) {
+        return 0;
+    }
+    if (height * PAGE_CACHE_RADIX_BITS >= 64) {
+        return ~0UL;
+    }
+    return 1UL << (height * PAGE_CACHE_RADIX_BITS);
+}
+
+// Slot of an index at a tree level (level 0 holds the pages)
+static u32 radix_slot(u64 index, u32 level) {
+    return (index >> (level * PAGE_CACHE_RADIX_BITS)) & (PAGE_CACHE_RADIX_SLOTS - 1);
+}
+
+static page_cache_radix_node_t* radix_node_alloc(void) {
+    page_cache_radix_node_t* node = (page_cache_radix_node_t*)malloc(sizeof(page_cache_radix_node_t));
+    if (node) {
+        memset(node, 0, sizeof(page_cache_radix_node_t));
+    }
+    return node;
+}
+
+// Find a page by index
+static page_cache_page_t* radix_lookup(page_cache_mapping_t* mapping, u64 index) {
+    if (!mapping->root || index >= radix_capacity(mapping->height)) {
+        return NULL;
+    }
+    
+    page_cache_radix_node_t* node = mapping->root;
+    for (u32 level = mapping->height - 1; level > 0; level--) {
+        node = (page_cache_radix_node_t*)node->slots[radix_slot(index, level)];
+        if (!node) {
+            return NULL;
+        }
+    }
+    
+    return (page_cache_page_t*)node->slots[radix_slot(index, 0)];
+}
+
+// Insert a page, growing the tree as needed
+static i32 radix_insert(page_cache_mapping_t* mapping, u64 index, page_cache_page_t* page) {
+    // Grow until the index fits; the old root becomes slot 0 of the new one
+    while (index >= radix_capacity(mapping->height)) {
+        if (!mapping->root) {
+            mapping->height++;
+            continue;
+        }
+        
+        page_cache_radix_node_t* node = radix_node_alloc();
+        if (!node) {
+            return ERR_NO_MEMORY;
+        }
+        node->slots[0] = mapping->root;
+        node->count = 1;
+        mapping->root = node;
+        mapping->height++;
+    }
+    
+    if (!mapping->root) {
+        mapping->root = radix_node_alloc();
+        if (!mapping->root) {
+            return ERR_NO_MEMORY;
+        }
+    }
+    
+    page_cache_radix_node_t* node = mapping->root;
+    for (u32 level = mapping->height - 1; level > 0; level--) {
+        u32 slot = radix_slot(index, level);
+        if (!node->slots[slot]) {
+            node->slots[slot] = radix_node_alloc();
+            if (!node->slots[slot]) {
+                return ERR_NO_MEMORY;
+            }
+            node->count++;
+        }
+        node = (page_cache_radix_node_t*)node->slots[slot];
+    }
+    
+    u32 slot = radix_slot(index, 0);
+    if (node->slots[slot]) {
+        return ERR_BUSY;
+    }
+    node->slots[slot] = page;
+    node->count++;
+    
+    return ERR_SUCCESS;
+}
+
+// Remove a page, freeing interior nodes that become empty
+static void radix_delete(page_cache_mapping_t* mapping, u64 index) {
+    page_cache_radix_node_t* path[64 / PAGE_CACHE_RADIX_BITS + 1];
+    
+    if (!mapping->root || index >= radix_capacity(mapping->height)) {
+        return;
+    }
+    
+    page_cache_radix_node_t* node = mapping->root;
+    for (u32 level = mapping->height - 1; level > 0; level--) {
+        path[level] = node;
+        node = (page_cache_radix_node_t*)node->slots[radix_slot(index, level)];
+        if (!node) {
+            return;
+        }
+    }
+    path[0] = node;
+    
+    for (u32 level = 0; level < mapping->height; level++) {
+        node = path[level];
+        u32 slot = radix_slot(index, level);
+        if (!node->slots[slot]) {
+            return;
+        }
+        node->slots[slot] = NULL;
+        node->count--;
+        
+        if (node->count > 0) {
+            return;
+        }
+        
+        free(node);
+        if (level == mapping->height - 1) {
+            mapping->root = NULL;
+            mapping->height = 0;
+            return;
+        }
+    }
+}
+
+// Visit every page in index order
+typedef i32 (*radix_visit_fn)(page_cache_mapping_t* mapping, page_cache_page_t* page);
+
+static i32 radix_walk(page_cache_mapping_t* mapping, page_cache_radix_node_t* node, u32 level,
+                      radix_visit_fn visit) {
+    i32 errors = 0;
+    for (u32 i = 0; i < PAGE_CACHE_RADIX_SLOTS; i++) {
+        if (!node->slots[i]) {
+            continue;
+        }
+        
+        if (level == 0) {
+            if (visit(mapping, (page_cache_page_t*)node->slots[i]) < 0) {
+                errors++;
+            }
+        } else {
+            errors += radix_walk(mapping, (page_cache_radix_node_t*)node->slots[i], level - 1, visit);
+        }
+    }
+    return errors;
+}
+
+// Remove page from LRU list
+static void lru_remove(page_cache_t* cache, page_cache_page_t* page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        cache->lru_head = page->next;
+    }
+    
+    if (page->next) {
+        page->next->prev = page->prev;
+    } else {
+        cache->lru_tail = page->prev;
+    }
+    
+    page->prev = NULL;
+    page->next = NULL;
+}
+
+// Add page to front of LRU list (most recently used)
+static void lru_add_front(page_cache_t* cache, page_cache_page_t* page) {
+    page->prev = NULL;
+    page->next = cache->lru_head;
+    
+    if (cache->lru_head) {
+        cache->lru_head->prev = page;
+    } else {
+        cache->lru_tail = page;
+    }
+    
+    cache->lru_head = page;
+}
+
+// Drop a page from the cache and return its frame
+static void page_free(page_cache_t* cache, page_cache_page_t* page) {
+    lru_remove(cache, page);
+    if (page->dirty) {
+        page->mapping->nr_dirty--;
+    }
+    page->mapping->nr_pages--;
+    cache->nr_pages--;
+    
+    frame_free_page((u64)page->data);
+    free(page);
+}
+
+// Evict the least recently used clean, unmapped page
+static bool page_cache_evict(page_cache_t* cache) {
+    for (page_cache_page_t* page = cache->lru_tail; page; page = page->prev) {
+        if (page->dirty || page->map_count > 0) {
+            continue;
+        }
+        
+        radix_delete(page->mapping, page->index);
+        page_free(cache, page);
+        return true;
+    }
+    
+    return false;
+}
+
+// Create a page cache
+page_cache_t* page_cache_create(void* host, const page_cache_ops_t* ops, u64 max_pages) {
+    page_cache_t* cache = (page_cache_t*)malloc(sizeof(page_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    
+    memset(cache, 0, sizeof(page_cache_t));
+    cache->host = host;
+    cache->ops = ops;
+    cache->max_pages = max_pages ? max_pages : PAGE_CACHE_MAX_PAGES;
+    
+    return cache;
+}
+
+// Destroy a page cache; dirty pages must have been written back and
+// mapped pages unmapped
+void page_cache_destroy(page_cache_t* cache) {
+    if (!cache) return;
+    
+    for (u32 i = 0; i < PAGE_CACHE_HASH_SIZE; i++) {
+        while (cache->mappings[i]) {
+            page_cache_release_mapping(cache, cache->mappings[i]->ino);
+        }
+    }
+    
+    free(cache);
+}
+
+// Find (or create) the mapping of an inode
+page_cache_mapping_t* page_cache_get_mapping(page_cache_t* cache, u32 ino, bool create) {
+    u32 bucket = ino % PAGE_CACHE_HASH_SIZE;
+    for (page_cache_mapping_t* m = cache->mappings[bucket]; m; m = m->hash_next) {
+        if (m->ino == ino) {
+            return m;
+        }
+    }
+    
+    if (!create) {
+        return NULL;
+    }
+    
+    page_cache_mapping_t* mapping = (page_cache_mapping_t*)malloc(sizeof(page_cache_mapping_t));
+    if (!mapping) {
+        return NULL;
+    }
+    
+    memset(mapping, 0, sizeof(page_cache_mapping_t));
+    mapping->cache = cache;
+    mapping->ino = ino;
+    mapping->hash_next = cache->mappings[bucket];
+    cache->mappings[bucket] = mapping;
+    
+    return mapping;
+}
+
+// Find a cached page without filling it
+page_cache_page_t* page_cache_lookup(page_cache_mapping_t* mapping, u64 index) {
+    return mapping ? radix_lookup(mapping, index) : NULL;
+}
+
+// Get a page, creating it if needed. A new page is filled through the
+// readpage callback when fill is set, zeroed otherwise (the caller is
+// about to overwrite it or it lies past end of file). Returns
+// ERR_NO_MEMORY when every page is dirty or mapped and no frame is free;
+// the caller should write back and retry.
+i32 page_cache_get_page(page_cache_mapping_t* mapping, u64 index, bool fill, page_cache_page_t** page_out) {
+    if (!mapping || !page_out) {
+        return ERR_INVALID;
+    }
+    
+    page_cache_t* cache = mapping->cache;
+    page_cache_page_t* page = radix_lookup(mapping, index);
+    
+    if (page) {
+        // Cache hit
+        cache->hits++;
+        lru_remove(cache, page);
+        lru_add_front(cache, page);
+        *page_out = page;
+        return ERR_SUCCESS;
+    }
+    
+    // Cache miss
+    cache->misses++;
+    
+    if (cache->nr_pages >= cache->max_pages && !page_cache_evict(cache)) {
+        return ERR_NO_MEMORY;
+    }
+    
+    u64 frame = frame_alloc_page();
+    if (frame == 0 && page_cache_evict(cache)) {
+        frame = frame_alloc_page();
+    }
+    if (frame == 0) {
+        return ERR_NO_MEMORY;
+    }
+    
+    page = (page_cache_page_t*)malloc(sizeof(page_cache_page_t));
+    if (!page) {
+        frame_free_page(frame);
+        return ERR_NO_MEMORY;
+    }
+    
+    memset(page, 0, sizeof(page_cache_page_t));
+    page->index = index;
+    page->data = (u8*)frame;
+    page->mapping = mapping;
+    
+    if (fill && cache->ops && cache->ops->readpage) {
+        i32 result = cache->ops->readpage(cache->host, mapping->ino, index, page->data);
+        if (result < 0) {
+            frame_free_page(frame);
+            free(page);
+            return result;
+        }
+    } else {
+        memset(page->data, 0, PAGE_CACHE_PAGE_SIZE);
+    }
+    page->uptodate = true;
+    
+    i32 result = radix_insert(mapping, index, page);
+    if (result < 0) {
+        frame_free_page(frame);
+        free(page);
+        return result;
+    }
+    
+    mapping->nr_pages++;
+    cache->nr_pages++;
+    lru_add_front(cache, page);
+    
+    *page_out = page;
+    return ERR_SUCCESS;
+}
+
+// Pin a page for a user mapping and return its frame address, or 0 if it
+// could not be read or allocated. A pinned page is never evicted.
+u64 page_cache_map_page(page_cache_mapping_t* mapping, u64 index) {
+    page_cache_page_t* page;
+    if (page_cache_get_page(mapping, index, true, &page) != ERR_SUCCESS) {
+        return 0;
+    }
+    
+    page->map_count++;
+    return (u64)page->data;
+}
+
+// Drop a pin taken by page_cache_map_page. A page that was mapped shared
+// and writable may have been written through, so it is marked dirty. In a
+// released mapping the last pin frees the page, and the last page frees
+// the mapping.
+void page_cache_unmap_page(page_cache_mapping_t* mapping, u64 index, bool dirty) {
+    page_cache_page_t* page = page_cache_lookup(mapping, index);
+    if (!page || page->map_count == 0) {
+        return;
+    }
+    
+    page->map_count--;
+    if (!mapping->released) {
+        if (dirty) {
+            page_cache_mark_dirty(page);
+        }
+        return;
+    }
+    
+    if (page->map_count == 0) {
+        radix_delete(mapping, index);
+        page_free(mapping->cache, page);
+        if (mapping->nr_pages == 0) {
+            free(mapping);
+        }
+    }
+}
+
+// Mark a page dirty; it stays in the cache until written back
+void page_cache_mark_dirty(page_cache_page_t* page) {
+    if (!page->dirty) {
+        page->dirty = true;
+        page->mapping->nr_dirty++;
+    }
+}
+
+// Write back one dirty page
+static i32 writeback_page(page_cache_mapping_t* mapping, page_cache_page_t* page) {
+    if (!page->dirty) {
+        return ERR_SUCCESS;
+    }
+    
+    page_cache_t* cache = mapping->cache;
+    if (!cache->ops || !cache->ops->writepage) {
+        return ERR_INVALID;
+    }
+    
+    i32 result = cache->ops->writepage(cache->host, mapping->ino, page->index, page->data);
+    if (result < 0) {
+        return result;
+    }
+    
+    // writepage may already have cleaned this page through
+    // page_cache_writeback_page
+    if (page->dirty) {
+        page->dirty = false;
+        mapping->nr_dirty--;
+    }
+    return ERR_SUCCESS;
+}
+
+// Write back a single dirty page
+i32 page_cache_writeback_page(page_cache_page_t* page) {
+    if (!page) {
+        return ERR_INVALID;
+    }
+    
+    return writeback_page(page->mapping, page);
+}
+
+// Write back the dirty pages of one inode in file order
+i32 page_cache_writeback(page_cache_mapping_t* mapping) {
+    if (!mapping) {
+        return ERR_INVALID;
+    }
+    
+    if (mapping->nr_dirty == 0 || !mapping->root) {
+        return ERR_SUCCESS;
+    }
+    
+    i32 errors = radix_walk(mapping, mapping->root, mapping->height - 1, writeback_page);
+    return errors > 0 ? ERR_INVALID : ERR_SUCCESS;
+}
+
+// Write back every dirty page in the cache
+i32 page_cache_writeback_all(page_cache_t* cache) {
+    if (!cache) {
+        return ERR_INVALID;
+    }
+    
+    i32 errors = 0;
+    for (u32 i = 0; i < PAGE_CACHE_HASH_SIZE; i++) {
+        for (page_cache_mapping_t* m = cache->mappings[i]; m; m = m->hash_next) {
+            if (page_cache_writeback(m) < 0) {
+                errors++;
+            }
+        }
+    }
+    
+    return errors > 0 ? ERR_INVALID : ERR_SUCCESS;
+}
+
+// Free every unmapped page of a subtree and the nodes left empty; pages
+// still mapped stay in place. Returns how many slots remain in use.
+static u32 radix_release(page_cache_t* cache, page_cache_radix_node_t* node, u32 level) {
+    for (u32 i = 0; i < PAGE_CACHE_RADIX_SLOTS; i++) {
+        if (!node->slots[i]) {
+            continue;
+        }
+        
+        if (level == 0) {
+            page_cache_page_t* page = (page_cache_page_t*)node->slots[i];
+            if (page->map_count > 0) {
+                continue;
+            }
+            page_free(cache, page);
+        } else {
+            page_cache_radix_node_t* child = (page_cache_radix_node_t*)node->slots[i];
+            if (radix_release(cache, child, level - 1) > 0) {
+                continue;
+            }
+            free(child);
+        }
+        node->slots[i] = NULL;
+        node->count--;
+    }
+    return node->count;
+}
+
+// Drop every page of an inode without writing it back and forget the
+// mapping. Pages mapped into a process stay until they are unmapped, so a
+// frame is never freed under a live mapping; the mapping is kept for them
+// but no longer found by inode.
+void page_cache_release_mapping(page_cache_t* cache, u32 ino) {
+    u32 bucket = ino % PAGE_CACHE_HASH_SIZE;
+    page_cache_mapping_t** link = &cache->mappings[bucket];
+    
+    while (*link && (*link)->ino != ino) {
+        link = &(*link)->hash_next;
+    }
+    
+    page_cache_mapping_t* mapping = *link;
+    if (!mapping) {
+        return;
+    }
+    
+    *link = mapping->hash_next;
+    mapping->hash_next = NULL;
+    
+    if (mapping->root && radix_release(cache, mapping->root, mapping->height - 1) == 0) {
+        free(mapping->root);
+        mapping->root = NULL;
+        mapping->height = 0;
+    }
+    
+    if (mapping->nr_pages > 0) {
+        mapping->released = true;
+        return;
+    }
+    free(mapping);
+}
+
+// Get cache statistics
+void page_cache_stats(page_cache_t* cache, u64* hits, u64* misses) {
+    if (!cache) return;
+    
+    if (hits) *hits = cache->hits;
+    if (misses) *misses = cache->misses;
+}
@@ -11,6 +11,7 @@ typedef struct block_cache_entry {
     u8* data;
     bool dirty;
     bool valid;
+    bool pinned;            // held in memory until a journal commit
     u64 last_access;
     struct block_cache_entry* next;
     struct block_cache_entry* prev;
@@ -45,6 +46,10 @@ block_cache_t* block_cache_create(void* block_device, u64 block_size);
 void block_cache_destroy(block_cache_t* cache);
 i32 block_cache_read(block_cache_t* cache, u64 block_num, void* buffer);
 i32 block_cache_write(block_cache_t* cache, u64 block_num, const void* buffer);
+i32 block_cache_read_direct(block_cache_t* cache, u64 block_num, void* buffer);
+i32 block_cache_write_direct(block_cache_t* cache, u64 block_num, const void* buffer);
 i32 block_cache_flush(block_cache_t* cache);
+i32 block_cache_pin(block_cache_t* cache, u64 block_num);
+void block_cache_unpin(block_cache_t* cache, u64 block_num);
 i32 block_cache_invalidate(block_cache_t* cache, u64 block_num);
 void block_cache_stats(block_cache_t* cache, u64* hits, u64* misses);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "types.h"
+#include "page_cache.h"
 
 // ext2 constants
 #define EXT2_MAGIC 0xEF53
@@ -8,6 +9,23 @@
 #define EXT2_NAME_LEN 255
 #define EXT2_ROOT_INO 2
 
+// Block preallocation (used when s_prealloc_blocks is 0)
+#define EXT2_PREALLOC_BLOCKS 8
+#define EXT2_PREALLOC_SLOTS  32
+
+// Delayed allocation: pending blocks per inode before a forced write-back
+#define EXT2_DELALLOC_SLOTS      16
+#define EXT2_DELALLOC_MAX_BLOCKS 64
+
+// Metadata journal (ext3/JBD2 log in the journal inode)
+#define EXT2_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+#define EXT2_FEATURE_INCOMPAT_RECOVER   0x0004
+#define EXT2_JOURNAL_TX_BLOCKS      64  // commit at the end of an operation
+#define EXT2_JOURNAL_TX_MAX         128 // commit even inside an operation
+#define EXT2_JOURNAL_REVOKE_MAX     256
+#define EXT2_JOURNAL_MAX_GDT_BLOCKS 32
+#define EXT2_JOURNAL_COMMIT_SECONDS 5
+
 // File type indicators
 #define EXT2_FT_UNKNOWN  0
 #define EXT2_FT_REG_FILE 1
@@ -18,10 +36,24 @@
 #define EXT2_FT_SOCK     6
 #define EXT2_FT_SYMLINK  7
 
+// getdents file types (d_type)
+#define EXT2_DT_UNKNOWN 0
+#define EXT2_DT_FIFO    1
+#define EXT2_DT_CHR     2
+#define EXT2_DT_DIR     4
+#define EXT2_DT_BLK     6
+#define EXT2_DT_REG     8
+#define EXT2_DT_LNK     10
+#define EXT2_DT_SOCK    12
+
 // Inode mode bits
 #define EXT2_S_IFREG  0x8000
 #define EXT2_S_IFDIR  0x4000
 #define EXT2_S_IFLNK  0xA000
+#define EXT2_S_IFSOCK 0xC000
+#define EXT2_S_IFBLK  0x6000
+#define EXT2_S_IFCHR  0x2000
+#define EXT2_S_IFIFO  0x1000
 
 // Superblock structure (1024 bytes)
 typedef struct ext2_superblock {
@@ -110,7 +142,9 @@ typedef struct ext2_inode {
     u8  i_osd2[12];
 } __attribute__((packed)) ext2_inode_t;
 
-// Directory entry
+// Directory entry. name is length-delimited by name_len; entries copied
+// out by ext2_readdir() are NUL-terminated only when the name is shorter
+// than EXT2_NAME_LEN.
 typedef struct ext2_dir_entry {
     u32 inode;
     u16 rec_len;
@@ -119,6 +153,72 @@ typedef struct ext2_dir_entry {
     char name[EXT2_NAME_LEN];
 } __attribute__((packed)) ext2_dir_entry_t;
 
+// getdents record; d_off is the cursor of the next entry
+#define EXT2_DIRENT_NAME_OFFSET 19
+
+typedef struct ext2_dirent {
+    u64 d_ino;
+    u64 d_off;
+    u16 d_reclen;
+    u8  d_type;
+    char d_name[];
+} __attribute__((packed)) ext2_dirent_t;
+
+// Per-inode preallocation window: blocks already marked in the bitmap and
+// reserved for the next sequential writes of the owning inode
+typedef struct ext2_prealloc {
+    u32 ino;
+    u32 start;
+    u32 count;
+} ext2_prealloc_t;
+
+// Delayed allocation list: written file blocks that have no disk block
+// yet, sorted by file block. Their data lives in dirty page cache pages;
+// placement happens at write-back, when the allocator can see the whole
+// extent.
+typedef struct ext2_delalloc {
+    u32 ino;
+    u32 count;
+    u32 file_block[EXT2_DELALLOC_MAX_BLOCKS];
+} ext2_delalloc_t;
+
+// Block number map with open addressing; block 0 marks a free slot
+typedef struct ext2_block_map {
+    u32* keys;
+    u32* values;
+    u32 mask;
+    u32 count;
+} ext2_block_map_t;
+
+// Metadata journal. Operations join the running transaction, whose blocks
+// stay pinned in the block cache until a commit writes them to the log.
+typedef struct ext2_journal {
+    u32* map;                   // log block -> disk block
+    u32 len;                    // log length in blocks
+    u32 first;                  // first log block after the journal superblock
+    u32 head;                   // next log block to write
+    u32 start;                  // first block of the live log, 0 when empty
+    u32 sequence;               // id of the running transaction
+    u32 start_sequence;         // id of the oldest transaction in the log
+    u32 reserve;                // log blocks one full commit can need
+    u8 uuid[16];
+    u8* buffer;
+    u8* descriptor;
+    u32 handles;                // operations in progress
+    bool committing;
+    u64 tx_start;
+    u32* tx_blocks;             // running transaction in log order, 0 = forgotten
+    u32 tx_used;
+    u32 tx_capacity;
+    ext2_block_map_t tx;        // block -> index in tx_blocks
+    ext2_block_map_t revoke;    // revoked in the running transaction
+    ext2_block_map_t logged;    // blocks in the live log
+    ext2_block_map_t freed;     // freed in the running transaction
+    u64 commits;
+    u64 checkpoints;
+    u64 blocks_logged;
+} ext2_journal_t;
+
 // ext2 filesystem instance
 typedef struct ext2_fs {
     void* block_device;
@@ -127,6 +227,16 @@ typedef struct ext2_fs {
     u32 block_size;
     u32 num_block_groups;
     bool dirty;
+    ext2_prealloc_t prealloc[EXT2_PREALLOC_SLOTS];
+    ext2_delalloc_t delalloc[EXT2_DELALLOC_SLOTS];
+    u32 delalloc_reserved;
+    page_cache_t* page_cache;
+    ext2_journal_t* journal;
+    // Inode held in memory by the file operation in progress. Write-back
+    // maps blocks into it instead of a copy read from disk, so the copy
+    // the caller writes back afterwards is never stale.
+    u32 live_ino;
+    ext2_inode_t* live_inode;
 } ext2_fs_t;
 
 // ext2 operations
@@ -134,17 +244,43 @@ ext2_fs_t* ext2_mount(void* block_device);
 i32 ext2_umount(ext2_fs_t* fs);
 i32 ext2_read_inode(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode);
 i32 ext2_write_inode(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode);
+i32 ext2_get_inode(ext2_fs_t* fs, u32 ino, ext2_inode_t* scratch, ext2_inode_t** inode);
 i32 ext2_read_block(ext2_fs_t* fs, u32 block, void* buffer);
 i32 ext2_write_block(ext2_fs_t* fs, u32 block, const void* buffer);
 i32 ext2_alloc_block(ext2_fs_t* fs, u32* block_num);
+i32 ext2_alloc_blocks(ext2_fs_t* fs, u32 goal, u32 count, u32* block_num, u32* allocated);
+i32 ext2_alloc_file_block(ext2_fs_t* fs, u32 ino, u32 goal, u32 want, u32* block_num);
+i32 ext2_alloc_file_blocks(ext2_fs_t* fs, u32 ino, u32 goal, u32 count, u32* block_num, u32* allocated);
 i32 ext2_free_block(ext2_fs_t* fs, u32 block_num);
+i32 ext2_free_blocks(ext2_fs_t* fs, u32 block_num, u32 count);
+u32 ext2_inode_goal(ext2_fs_t* fs, u32 ino);
+void ext2_discard_prealloc(ext2_fs_t* fs, u32 ino);
+void ext2_discard_all_prealloc(ext2_fs_t* fs);
 i32 ext2_alloc_inode(ext2_fs_t* fs, u32* ino);
 i32 ext2_free_inode(ext2_fs_t* fs, u32 ino);
+void ext2_free_inode_blocks(ext2_fs_t* fs, ext2_inode_t* inode);
 i32 ext2_lookup(ext2_fs_t* fs, u32 parent_ino, const char* name, u32* ino);
 i32 ext2_readdir(ext2_fs_t* fs, u32 ino, u64 index, ext2_dir_entry_t* entry);
+i32 ext2_readdir_next(ext2_fs_t* fs, u32 ino, u64* pos, ext2_dir_entry_t* entry);
+i32 ext2_getdents(ext2_fs_t* fs, u32 ino, u64* pos, void* buffer, u32 size);
 i32 ext2_create(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32* ino);
 i32 ext2_mkdir(ext2_fs_t* fs, u32 parent_ino, const char* name, u16 mode, u32* ino);
 i32 ext2_unlink(ext2_fs_t* fs, u32 parent_ino, const char* name);
-i32 ext2_read_file(ext2_fs_t* fs, ext2_inode_t* inode, u64 offset, u64 size, void* buffer);
-i32 ext2_write_file(ext2_fs_t* fs, ext2_inode_t* inode, u64 offset, u64 size, const void* buffer);
+i32 ext2_read_file(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, u64 offset, u64 size, void* buffer);
+i32 ext2_write_file(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, u64 offset, u64 size, const void* buffer);
 i32 ext2_sync(ext2_fs_t* fs);
+bool ext2_delalloc_pending(ext2_fs_t* fs, u32 ino, u32 file_block);
+i32 ext2_delalloc_reserve(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode, u32 file_block);
+i32 ext2_delalloc_flush(ext2_fs_t* fs, u32 ino, ext2_inode_t* inode);
+i32 ext2_delalloc_flush_all(ext2_fs_t* fs);
+void ext2_delalloc_discard(ext2_fs_t* fs, u32 ino);
+i32 ext2_journal_load(ext2_fs_t* fs, bool* replayed);
+void ext2_journal_destroy(ext2_fs_t* fs);
+void ext2_journal_start(ext2_fs_t* fs);
+i32 ext2_journal_stop(ext2_fs_t* fs);
+i32 ext2_journal_write(ext2_fs_t* fs, u32 block, const void* buffer);
+i32 ext2_journal_dirty(ext2_fs_t* fs, u32 block);
+void ext2_journal_forget(ext2_fs_t* fs, u32 block, u32 count);
+bool ext2_journal_freed(ext2_fs_t* fs, u32 block);
+i32 ext2_journal_commit(ext2_fs_t* fs);
+i32 ext2_journal_checkpoint(ext2_fs_t* fs);
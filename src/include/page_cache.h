@@ -0,0 +1,79 @@
+#pragma once
+
+#include "types.h"
+
+// Page cache geometry
+#define PAGE_CACHE_PAGE_SIZE   4096
+#define PAGE_CACHE_PAGE_SHIFT  12
+#define PAGE_CACHE_MAX_PAGES   1024
+#define PAGE_CACHE_RADIX_BITS  6
+#define PAGE_CACHE_RADIX_SLOTS (1 << PAGE_CACHE_RADIX_BITS)
+#define PAGE_CACHE_HASH_SIZE   64
+
+struct page_cache;
+struct page_cache_mapping;
+
+// Cached page of file data, backed by one physical frame
+typedef struct page_cache_page {
+    u64 index;
+    u8* data;
+    bool dirty;
+    bool uptodate;
+    u32 map_count;
+    struct page_cache_mapping* mapping;
+    struct page_cache_page* next;
+    struct page_cache_page* prev;
+} page_cache_page_t;
+
+// Radix tree node indexed by page offset within the file
+typedef struct page_cache_radix_node {
+    void* slots[PAGE_CACHE_RADIX_SLOTS];
+    u32 count;
+} page_cache_radix_node_t;
+
+// Filesystem callbacks used to fill and write back pages
+typedef struct page_cache_ops {
+    i32 (*readpage)(void* host, u32 ino, u64 index, u8* data);
+    i32 (*writepage)(void* host, u32 ino, u64 index, const u8* data);
+} page_cache_ops_t;
+
+// Pages of one inode
+typedef struct page_cache_mapping {
+    struct page_cache* cache;
+    u32 ino;
+    u32 height;
+    page_cache_radix_node_t* root;
+    u64 nr_pages;
+    u64 nr_dirty;
+    // Released while pages were still mapped; freed with the last of them
+    bool released;
+    struct page_cache_mapping* hash_next;
+} page_cache_mapping_t;
+
+// Page cache instance (one per mounted filesystem)
+typedef struct page_cache {
+    void* host;
+    const page_cache_ops_t* ops;
+    page_cache_mapping_t* mappings[PAGE_CACHE_HASH_SIZE];
+    page_cache_page_t* lru_head;
+    page_cache_page_t* lru_tail;
+    u64 nr_pages;
+    u64 max_pages;
+    u64 hits;
+    u64 misses;
+} page_cache_t;
+
+// Page cache operations
+page_cache_t* page_cache_create(void* host, const page_cache_ops_t* ops, u64 max_pages);
+void page_cache_destroy(page_cache_t* cache);
+page_cache_mapping_t* page_cache_get_mapping(page_cache_t* cache, u32 ino, bool create);
+page_cache_page_t* page_cache_lookup(page_cache_mapping_t* mapping, u64 index);
+i32 page_cache_get_page(page_cache_mapping_t* mapping, u64 index, bool fill, page_cache_page_t** page_out);
+void page_cache_mark_dirty(page_cache_page_t* page);
+u64 page_cache_map_page(page_cache_mapping_t* mapping, u64 index);
+void page_cache_unmap_page(page_cache_mapping_t* mapping, u64 index, bool dirty);
+i32 page_cache_writeback(page_cache_mapping_t* mapping);
+i32 page_cache_writeback_page(page_cache_page_t* page);
+i32 page_cache_writeback_all(page_cache_t* cache);
+void page_cache_release_mapping(page_cache_t* cache, u32 ino);
+void page_cache_stats(page_cache_t* cache, u64* hits, u64* misses);
@@ -67,6 +67,7 @@ typedef i64 isize;
 #define ERR_NO_MEMORY   -4
 #define ERR_BUSY        -5
 #define ERR_AGAIN       -6
+#define ERR_NOT_EMPTY   -7
 
 // File types for VFS
 #define S_IFREG    0x1000
@@ -20,6 +20,9 @@ fn hlt_loop() -> ! {
         unsafe {
             core::arch::asm!("wfi");
         }
+        // Woken by an interrupt; run any wakeup it deferred, then balance
+        kernel::process::wait_queue::run_deferred_wakeups();
+        kernel::process::scheduler::periodic_balance();
     }
 }
 
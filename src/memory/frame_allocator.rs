@@ -54,6 +54,8 @@ pub struct BitmapFrameAllocator {
     memory_regions: Vec<MemoryRegion>,
     bitmap: Vec<u64>,
     next_free: usize,
+    // Owners per frame; above 1 only for copy-on-write and shared pages
+    refcounts: Vec<u32>,
 }
 
 impl BitmapFrameAllocator {
@@ -62,6 +64,7 @@ impl BitmapFrameAllocator {
             memory_regions: Vec::new(),
             bitmap: Vec::new(),
             next_free: 0,
+            refcounts: Vec::new(),
         }
     }
 
@@ -77,6 +80,31 @@ impl BitmapFrameAllocator {
         self.bitmap.clear();
         self.bitmap.resize(bitmap_size, !0u64);
         self.next_free = 0;
+        self.refcounts.clear();
+        self.refcounts.resize(bitmap_size * 64, 0);
+    }
+
+    /// Add an owner to an allocated frame (a forked or shared mapping).
+    pub fn share(&mut self, frame: Frame) {
+        if let Some(idx) = self.frame_to_bit_index(frame) {
+            self.refcounts[idx] += 1;
+        }
+    }
+
+    /// Drop one owner, freeing the frame when it was the last.
+    pub fn release(&mut self, frame: Frame) {
+        if let Some(idx) = self.frame_to_bit_index(frame) {
+            if self.refcounts[idx] > 1 {
+                self.refcounts[idx] -= 1;
+            } else {
+                self.deallocate_frame(frame);
+            }
+        }
+    }
+
+    pub fn refcount(&self, frame: Frame) -> u32 {
+        self.frame_to_bit_index(frame)
+            .map_or(0, |idx| self.refcounts[idx])
     }
 
     fn frame_to_bit_index(&self, frame: Frame) -> Option<usize> {
@@ -119,6 +147,7 @@ impl FrameAllocator for BitmapFrameAllocator {
             
             if self.bitmap[word_idx] & (1u64 << bit_idx) != 0 {
                 self.bitmap[word_idx] &= !(1u64 << bit_idx);
+                self.refcounts[idx] = 1;
                 self.next_free = (idx + 1) % total_bits;
                 return self.bit_index_to_frame(idx);
             }
@@ -132,6 +161,7 @@ impl FrameAllocator for BitmapFrameAllocator {
             let word_idx = idx / 64;
             let bit_idx = idx % 64;
             self.bitmap[word_idx] |= 1u64 << bit_idx;
+            self.refcounts[idx] = 0;
         }
     }
 }
@@ -154,6 +184,39 @@ pub fn deallocate_frame(frame: Frame) {
     }
 }
 
+pub fn share_frame(frame: Frame) {
+    if let Some(ref mut allocator) = *FRAME_ALLOCATOR.lock() {
+        allocator.share(frame);
+    }
+}
+
+pub fn release_frame(frame: Frame) {
+    if let Some(ref mut allocator) = *FRAME_ALLOCATOR.lock() {
+        allocator.release(frame);
+    }
+}
+
+pub fn frame_refcount(frame: Frame) -> u32 {
+    FRAME_ALLOCATOR.lock().as_ref().map_or(0, |allocator| allocator.refcount(frame))
+}
+
+/// Allocates one frame for C subsystems (the file page cache). Returns its
+/// identity-mapped address, or 0 when no frame is available.
+#[no_mangle]
+pub extern "C" fn frame_alloc_page() -> u64 {
+    allocate_frame()
+        .map(|frame| frame.start_address.as_u64())
+        .unwrap_or(0)
+}
+
+/// Returns a frame obtained from `frame_alloc_page`.
+#[no_mangle]
+pub extern "C" fn frame_free_page(addr: u64) {
+    if addr != 0 {
+        deallocate_frame(Frame::containing_address(PhysAddr::new(addr)));
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -175,4 +238,27 @@ mod tests {
         let frame3 = allocator.allocate_frame();
         assert!(frame3.is_some());
     }
+
+    #[test]
+    fn test_frame_refcounts() {
+        let regions = [MemoryRegion::new(PhysAddr::new(0x100000), 64 * PAGE_SIZE)];
+        let mut allocator = BitmapFrameAllocator::new();
+        allocator.init(&regions);
+
+        let frame = allocator.allocate_frame().unwrap();
+        assert_eq!(allocator.refcount(frame), 1);
+        allocator.share(frame);
+        assert_eq!(allocator.refcount(frame), 2);
+
+        // The first release only drops an owner
+        allocator.release(frame);
+        assert_eq!(allocator.refcount(frame), 1);
+        let others: Vec<Frame> = (0..63).map(|_| allocator.allocate_frame().unwrap()).collect();
+        assert!(!others.contains(&frame));
+        assert!(allocator.allocate_frame().is_none());
+
+        allocator.release(frame);
+        assert_eq!(allocator.refcount(frame), 0);
+        assert_eq!(allocator.allocate_frame(), Some(frame));
+    }
 }
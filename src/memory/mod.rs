@@ -2,6 +2,7 @@ pub mod frame_allocator;
 pub mod paging;
 pub mod heap;
 pub mod numa;
+pub mod vma;
 
 use core::fmt;
 
@@ -25,6 +25,8 @@ pub struct NumaTopology {
     nodes: Vec<NumaNode>,
     regions: Vec<NumaMemoryRegion>,
     distance_matrix: Vec<Vec<u8>>,
+    /// Node of each CPU, by CPU id; CPUs past the end are on node 0.
+    cpu_nodes: Vec<NumaNode>,
 }
 
 impl NumaTopology {
@@ -33,6 +35,7 @@ impl NumaTopology {
             nodes: Vec::new(),
             regions: Vec::new(),
             distance_matrix: Vec::new(),
+            cpu_nodes: Vec::new(),
         }
     }
 
@@ -63,6 +66,21 @@ impl NumaTopology {
             .copied()
     }
 
+    pub fn set_cpu_node(&mut self, cpu_id: u32, node: NumaNode) {
+        let index = cpu_id as usize;
+        if self.cpu_nodes.len() <= index {
+            self.cpu_nodes.resize(index + 1, NumaNode { id: 0 });
+        }
+        self.cpu_nodes[index] = node;
+    }
+
+    pub fn get_cpu_node(&self, cpu_id: u32) -> NumaNode {
+        self.cpu_nodes
+            .get(cpu_id as usize)
+            .copied()
+            .unwrap_or(NumaNode { id: 0 })
+    }
+
     pub fn get_node_regions(&self, node: NumaNode) -> Vec<&NumaMemoryRegion> {
         self.regions.iter()
             .filter(|r| r.node == node)
@@ -119,8 +137,10 @@ pub fn init_numa_topology() {
     topology.set_distance(node0, node0, 10);
 }
 
+/// Node of the calling CPU, from the topology the scheduler uses.
 pub fn get_current_numa_node() -> NumaNode {
-    NumaNode { id: 0 }
+    let cpu_id = crate::cpu::percpu::get_current_cpu_id();
+    NumaNode { id: crate::cpu::topology::cpu_topology(cpu_id).node as usize }
 }
 
 pub fn allocate_numa_local(size: usize) -> Option<PhysAddr> {
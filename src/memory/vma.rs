@@ -0,0 +1,867 @@
+//! Virtual memory areas.
+//!
+//! An address space describes its user mappings with a `VmaTree`: areas
+//! ordered by start address in a B-tree, each with a protection and a
+//! backing. `mmap` and `brk` only record areas; a page gets its frame when
+//! it is first touched and the page-fault handler calls `VmaTree::fault`.
+//! Anonymous pages are fresh zeroed frames. File pages are pinned in the
+//! file's page cache, so mapping a large file reads nothing up front.
+//!
+//! `fork` copies no pages. Private pages are shared between parent and
+//! child with a second owner on the frame and write-protected; the first
+//! write on either side faults and takes a private copy, or just regains
+//! write access if the other side has already let go of the frame.
+//! Shared anonymous areas keep their pages in a `SharedAnonymous` object
+//! that every forked copy of the area looks up, so pages first touched
+//! after the fork are shared too.
+//!
+//! Page-table updates go through the active page table, so a tree is only
+//! changed from the context of the process that owns it.
+
+use core::fmt;
+
+use spin::Mutex;
+
+#[cfg(not(test))]
+use alloc::{collections::BTreeMap, sync::Arc, vec::Vec};
+#[cfg(test)]
+use std::{collections::BTreeMap, sync::Arc, vec::Vec};
+
+use super::frame_allocator::{allocate_frame, frame_refcount, release_frame, share_frame, Frame};
+use super::paging::PageFlags;
+use super::{VirtAddr, PAGE_SIZE};
+
+const PAGE: u64 = PAGE_SIZE as u64;
+
+bitflags::bitflags! {
+    /// Access an area allows, numbered like `PROT_*`.
+    #[derive(Debug, Clone, Copy, PartialEq, Eq)]
+    pub struct Protection: u32 {
+        const READ = 1 << 0;
+        const WRITE = 1 << 1;
+        const EXEC = 1 << 2;
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum VmaError {
+    /// The range collides with an existing area.
+    Overlap,
+    /// No free range of the requested size.
+    NoSpace,
+    OutOfMemory,
+    /// Not page aligned, empty, or outside user space.
+    Invalid,
+    /// No area covers the address.
+    NotMapped,
+    /// The area forbids the access, or the page is already present.
+    Violation,
+}
+
+/// A file that can back a mapping, page by page.
+pub trait FileBacking: fmt::Debug + Send + Sync {
+    /// Pin page `index` of the file in memory and return its frame.
+    fn map_page(&self, index: u64) -> Option<Frame>;
+    /// Drop a pin taken by `map_page`. `dirty` if the page was mapped
+    /// shared and writable, so it may have been written through.
+    fn unmap_page(&self, index: u64, dirty: bool);
+}
+
+#[derive(Debug, Clone)]
+pub enum VmaBacking {
+    Anonymous,
+    /// `offset` is the page-aligned file offset of the area's first byte.
+    File { file: Arc<dyn FileBacking>, offset: u64 },
+}
+
+#[derive(Debug, Clone, Copy)]
+struct Resident {
+    frame: Frame,
+    /// Pinned in the file's page cache rather than owned by the area.
+    cached: bool,
+    /// Shared with a forked process; mapped read-only until written.
+    cow: bool,
+    /// Present in the page table. A forked child's pages start out absent
+    /// and are installed on first touch.
+    installed: bool,
+}
+
+impl Resident {
+    fn new(frame: Frame, cached: bool) -> Self {
+        Self {
+            frame,
+            cached,
+            cow: false,
+            installed: false,
+        }
+    }
+}
+
+#[derive(Debug)]
+pub struct Vma {
+    pub start: VirtAddr,
+    pub end: VirtAddr,
+    pub prot: Protection,
+    pub shared: bool,
+    pub backing: VmaBacking,
+    resident: BTreeMap<u64, Resident>,
+}
+
+impl Vma {
+    pub fn new(start: VirtAddr, end: VirtAddr, prot: Protection, shared: bool, backing: VmaBacking) -> Self {
+        Self {
+            start,
+            end,
+            prot,
+            shared,
+            backing,
+            resident: BTreeMap::new(),
+        }
+    }
+
+    pub fn contains(&self, addr: VirtAddr) -> bool {
+        self.start <= addr && addr < self.end
+    }
+
+    /// Pages faulted in so far.
+    pub fn resident_pages(&self) -> usize {
+        self.resident.len()
+    }
+
+    pub fn is_resident(&self, addr: VirtAddr) -> bool {
+        self.resident.contains_key(&addr.align_down(PAGE).0)
+    }
+
+    /// The same area with nothing faulted in, for a forked child.
+    fn layout_copy(&self) -> Self {
+        Self::new(self.start, self.end, self.prot, self.shared, self.backing.clone())
+    }
+
+    fn page_flags(&self) -> PageFlags {
+        let mut flags = PageFlags::PRESENT | PageFlags::USER_ACCESSIBLE;
+        if self.prot.contains(Protection::WRITE) {
+            flags |= PageFlags::WRITABLE;
+        }
+        if !self.prot.contains(Protection::EXEC) {
+            flags |= PageFlags::NO_EXECUTE;
+        }
+        flags
+    }
+
+    fn resident_flags(&self, resident: &Resident) -> PageFlags {
+        let mut flags = self.page_flags();
+        if resident.cow {
+            flags.remove(PageFlags::WRITABLE);
+        }
+        flags
+    }
+
+    /// Frame behind `addr`, if it has been faulted in.
+    pub fn frame_at(&self, addr: VirtAddr) -> Option<Frame> {
+        self.resident.get(&addr.align_down(PAGE).0).map(|resident| resident.frame)
+    }
+
+    fn file_index(&self, page: u64, offset: u64) -> u64 {
+        (offset + (page - self.start.0)) / PAGE
+    }
+
+    /// Cut the area at `at`, keeping `[start, at)` and returning the rest.
+    fn split_off(&mut self, at: u64) -> Vma {
+        let backing = match &self.backing {
+            VmaBacking::Anonymous => VmaBacking::Anonymous,
+            VmaBacking::File { file, offset } => VmaBacking::File {
+                file: file.clone(),
+                offset: offset + (at - self.start.0),
+            },
+        };
+        let upper = Vma {
+            start: VirtAddr::new(at),
+            end: self.end,
+            prot: self.prot,
+            shared: self.shared,
+            backing,
+            resident: self.resident.split_off(&at),
+        };
+        self.end = VirtAddr::new(at);
+        upper
+    }
+
+    fn release_page(&self, page: u64, resident: Resident) {
+        if resident.installed {
+            uninstall(page);
+        }
+        match (&self.backing, resident.cached) {
+            (VmaBacking::File { file, offset }, true) => {
+                let dirty = self.shared && self.prot.contains(Protection::WRITE);
+                file.unmap_page(self.file_index(page, *offset), dirty);
+            }
+            _ => release_frame(resident.frame),
+        }
+    }
+
+    /// The child's copy of the area for `fork`. Owned frames gain the child
+    /// as a second owner; private ones become copy-on-write on both sides.
+    /// Page-cache pages get a pin of their own.
+    fn fork(&mut self) -> Vma {
+        let mut child = self.layout_copy();
+        let read_only = self.page_flags() - PageFlags::WRITABLE;
+
+        for (&page, resident) in self.resident.iter_mut() {
+            if resident.cached {
+                if let VmaBacking::File { file, offset } = &self.backing {
+                    // Left out on failure; the child faults it in again
+                    if let Some(frame) = file.map_page((offset + (page - self.start.0)) / PAGE) {
+                        child.resident.insert(page, Resident::new(frame, true));
+                    }
+                }
+                continue;
+            }
+
+            share_frame(resident.frame);
+            if !self.shared && !resident.cow {
+                resident.cow = true;
+                if resident.installed {
+                    uninstall(page);
+                    resident.installed = install(page, resident.frame, read_only).is_ok();
+                }
+            }
+            child.resident.insert(page, Resident { installed: false, ..*resident });
+        }
+        child
+    }
+
+    /// Fault on a page that already has a frame: install it if this page
+    /// table does not have it yet, or break copy-on-write on a write. A
+    /// read of an installed page was a protection fault, not a cow one.
+    fn refault(&mut self, page: u64, resident: Resident, write: bool) -> Result<(), VmaError> {
+        let breaks_cow = write && resident.cow;
+        if !resident.installed && !breaks_cow {
+            install(page, resident.frame, self.resident_flags(&resident))?;
+            self.resident.insert(page, Resident { installed: true, ..resident });
+            return Ok(());
+        }
+        if !breaks_cow {
+            return Err(VmaError::Violation);
+        }
+
+        // The last owner keeps the frame; otherwise copy it and let go
+        let frame = if frame_refcount(resident.frame) == 1 {
+            resident.frame
+        } else {
+            let copy = allocate_frame().ok_or(VmaError::OutOfMemory)?;
+            copy_frame(copy, resident.frame);
+            release_frame(resident.frame);
+            copy
+        };
+        if resident.installed {
+            uninstall(page);
+        }
+        let mut owned = Resident::new(frame, false);
+        let installed = install(page, frame, self.page_flags());
+        owned.installed = installed.is_ok();
+        self.resident.insert(page, owned);
+        installed
+    }
+
+    fn release(mut self) {
+        let resident = core::mem::take(&mut self.resident);
+        for (page, entry) in resident {
+            self.release_page(page, entry);
+        }
+    }
+}
+
+/// The areas of one address space, plus its program break.
+#[derive(Debug)]
+pub struct VmaTree {
+    areas: BTreeMap<u64, Vma>,
+    brk: u64,
+}
+
+impl VmaTree {
+    pub const fn new() -> Self {
+        Self {
+            areas: BTreeMap::new(),
+            brk: 0,
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.areas.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.areas.is_empty()
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = &Vma> {
+        self.areas.values()
+    }
+
+    /// The area covering `addr`.
+    pub fn find(&self, addr: VirtAddr) -> Option<&Vma> {
+        self.areas
+            .range(..=addr.0)
+            .next_back()
+            .map(|(_, vma)| vma)
+            .filter(|vma| vma.contains(addr))
+    }
+
+    fn overlaps(&self, start: u64, end: u64) -> bool {
+        self.areas
+            .range(..end)
+            .next_back()
+            .map_or(false, |(_, vma)| vma.end.0 > start)
+    }
+
+    /// Record a new area; it must be page aligned and free.
+    pub fn insert(&mut self, vma: Vma) -> Result<(), VmaError> {
+        let (start, end) = (vma.start.0, vma.end.0);
+        if start >= end || start % PAGE != 0 || end % PAGE != 0 {
+            return Err(VmaError::Invalid);
+        }
+        if self.overlaps(start, end) {
+            return Err(VmaError::Overlap);
+        }
+        self.areas.insert(start, vma);
+        Ok(())
+    }
+
+    /// Lowest free, page-aligned range of `len` bytes in `[lo, hi)` at or
+    /// above `hint`.
+    pub fn find_free(&self, len: u64, hint: u64, lo: u64, hi: u64) -> Option<u64> {
+        let mut candidate = hint.max(lo);
+        candidate = (candidate + PAGE - 1) & !(PAGE - 1);
+        if let Some((_, vma)) = self.areas.range(..=candidate).next_back() {
+            candidate = candidate.max(vma.end.0);
+        }
+        for vma in self.areas.range(candidate..).map(|(_, vma)| vma) {
+            if vma.start.0 >= candidate.checked_add(len)? {
+                break;
+            }
+            candidate = vma.end.0;
+        }
+        (candidate.checked_add(len)? <= hi).then_some(candidate)
+    }
+
+    /// Remove `[start, end)` from whatever areas cover it, splitting areas
+    /// that straddle an edge, and release the pages faulted in there.
+    pub fn unmap(&mut self, start: u64, end: u64) {
+        self.split_at(start);
+        self.split_at(end);
+        let doomed: Vec<u64> = self.areas.range(start..end).map(|(&key, _)| key).collect();
+        for key in doomed {
+            if let Some(vma) = self.areas.remove(&key) {
+                vma.release();
+            }
+        }
+    }
+
+    fn split_at(&mut self, at: u64) {
+        if let Some((_, vma)) = self.areas.range_mut(..at).next_back() {
+            if vma.end.0 > at {
+                let upper = vma.split_off(at);
+                self.areas.insert(at, upper);
+            }
+        }
+    }
+
+    /// Resolve a page fault: give a page its frame on first touch and map
+    /// it with the area's protection, install a page inherited from `fork`,
+    /// or give a copy-on-write page its own frame on write. `write` is the
+    /// write bit of the fault's error code.
+    pub fn fault(&mut self, addr: VirtAddr, write: bool) -> Result<(), VmaError> {
+        let page = addr.align_down(PAGE).0;
+        let vma = match self.areas.range_mut(..=addr.0).next_back() {
+            Some((_, vma)) if vma.contains(addr) => vma,
+            _ => return Err(VmaError::NotMapped),
+        };
+        if vma.prot.is_empty() || (write && !vma.prot.contains(Protection::WRITE)) {
+            return Err(VmaError::Violation);
+        }
+        if let Some(&resident) = vma.resident.get(&page) {
+            return vma.refault(page, resident, write);
+        }
+
+        let resident = match &vma.backing {
+            VmaBacking::Anonymous => {
+                let frame = allocate_frame().ok_or(VmaError::OutOfMemory)?;
+                zero_frame(frame);
+                Resident::new(frame, false)
+            }
+            VmaBacking::File { file, offset } => {
+                let index = vma.file_index(page, *offset);
+                let cached = file.map_page(index).ok_or(VmaError::OutOfMemory)?;
+                if vma.shared || !vma.prot.contains(Protection::WRITE) {
+                    Resident::new(cached, true)
+                } else {
+                    // Private and writable: the process gets its own copy
+                    let copy = allocate_frame();
+                    if let Some(frame) = copy {
+                        copy_frame(frame, cached);
+                    }
+                    file.unmap_page(index, false);
+                    Resident::new(copy.ok_or(VmaError::OutOfMemory)?, false)
+                }
+            }
+        };
+
+        if let Err(err) = install(page, resident.frame, vma.page_flags()) {
+            vma.release_page(page, resident);
+            return Err(err);
+        }
+        vma.resident.insert(page, Resident { installed: true, ..resident });
+        Ok(())
+    }
+
+    /// Current program break; `heap_start` until the heap first grows.
+    pub fn brk(&self, heap_start: VirtAddr) -> VirtAddr {
+        VirtAddr::new(if self.brk == 0 { heap_start.0 } else { self.brk })
+    }
+
+    /// Move the break within `[heap_start, heap_limit]`, growing or
+    /// shrinking the heap area. Returns the new break, or the old one if
+    /// the request is out of range or would run into another mapping.
+    pub fn set_brk(&mut self, heap_start: VirtAddr, heap_limit: VirtAddr, requested: VirtAddr) -> VirtAddr {
+        let current = self.brk(heap_start);
+        if requested < heap_start || requested > heap_limit {
+            return current;
+        }
+
+        let old_end = current.align_up(PAGE).0;
+        let new_end = requested.align_up(PAGE).0;
+        if new_end > old_end {
+            if self.overlaps(old_end, new_end) {
+                return current;
+            }
+            let heap = self
+                .areas
+                .range_mut(..old_end)
+                .next_back()
+                .map(|(_, vma)| vma)
+                .filter(|vma| {
+                    vma.end.0 == old_end
+                        && !vma.shared
+                        && vma.prot == Protection::READ | Protection::WRITE
+                        && matches!(vma.backing, VmaBacking::Anonymous)
+                });
+            match heap {
+                Some(vma) => vma.end = VirtAddr::new(new_end),
+                None => {
+                    let vma = Vma::new(
+                        VirtAddr::new(old_end),
+                        VirtAddr::new(new_end),
+                        Protection::READ | Protection::WRITE,
+                        false,
+                        VmaBacking::Anonymous,
+                    );
+                    if self.insert(vma).is_err() {
+                        return current;
+                    }
+                }
+            }
+        } else if new_end < old_end {
+            self.unmap(new_end, old_end);
+        }
+
+        self.brk = requested.0;
+        requested
+    }
+
+    /// The tree for a forked child: the same areas and break, sharing
+    /// every page faulted in so far (see `Vma::fork`). Write-protects the
+    /// parent's private pages, so it runs in the parent's context.
+    pub fn fork(&mut self) -> Self {
+        Self {
+            areas: self
+                .areas
+                .iter_mut()
+                .map(|(&start, vma)| (start, vma.fork()))
+                .collect(),
+            brk: self.brk,
+        }
+    }
+
+    /// Unmap everything, returning every frame and page-cache pin.
+    pub fn clear(&mut self) {
+        for (_, vma) in core::mem::take(&mut self.areas) {
+            vma.release();
+        }
+        self.brk = 0;
+    }
+}
+
+impl Default for VmaTree {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// File pages served from the C page cache (`page_cache_map_page`), which
+/// keeps a pinned page out of its LRU eviction.
+#[cfg(not(test))]
+#[derive(Debug)]
+pub struct PageCacheFile {
+    mapping: *mut core::ffi::c_void,
+}
+
+#[cfg(not(test))]
+extern "C" {
+    fn page_cache_map_page(mapping: *mut core::ffi::c_void, index: u64) -> u64;
+    fn page_cache_unmap_page(mapping: *mut core::ffi::c_void, index: u64, dirty: bool);
+}
+
+// The page cache is used under the file system's own locking
+#[cfg(not(test))]
+unsafe impl Send for PageCacheFile {}
+#[cfg(not(test))]
+unsafe impl Sync for PageCacheFile {}
+
+#[cfg(not(test))]
+impl PageCacheFile {
+    /// # Safety
+    /// `mapping` must be a live `page_cache_mapping_t`. It stays valid
+    /// while any of its pages are mapped, even after the file is deleted.
+    pub unsafe fn new(mapping: *mut core::ffi::c_void) -> Self {
+        Self { mapping }
+    }
+}
+
+#[cfg(not(test))]
+impl FileBacking for PageCacheFile {
+    fn map_page(&self, index: u64) -> Option<Frame> {
+        match unsafe { page_cache_map_page(self.mapping, index) } {
+            0 => None,
+            addr => Some(Frame::containing_address(super::PhysAddr::new(addr))),
+        }
+    }
+
+    fn unmap_page(&self, index: u64, dirty: bool) {
+        unsafe { page_cache_unmap_page(self.mapping, index, dirty) }
+    }
+}
+
+/// Pages of a `MAP_SHARED | MAP_ANONYMOUS` area, created zeroed on first
+/// touch. The object is shared by every copy of the area, including ones
+/// split off by `munmap` and forked into children. Its frames are freed
+/// when the last copy goes.
+#[derive(Debug)]
+pub struct SharedAnonymous {
+    pages: Mutex<BTreeMap<u64, Frame>>,
+}
+
+impl SharedAnonymous {
+    pub const fn new() -> Self {
+        Self {
+            pages: Mutex::new(BTreeMap::new()),
+        }
+    }
+}
+
+impl FileBacking for SharedAnonymous {
+    fn map_page(&self, index: u64) -> Option<Frame> {
+        let mut pages = self.pages.lock();
+        if let Some(&frame) = pages.get(&index) {
+            return Some(frame);
+        }
+        let frame = allocate_frame()?;
+        zero_frame(frame);
+        pages.insert(index, frame);
+        Some(frame)
+    }
+
+    // Pages stay until the object is dropped
+    fn unmap_page(&self, _index: u64, _dirty: bool) {}
+}
+
+impl Drop for SharedAnonymous {
+    fn drop(&mut self) {
+        for (_, frame) in core::mem::take(self.pages.get_mut()) {
+            release_frame(frame);
+        }
+    }
+}
+
+// Frames are identity mapped in the kernel. Host tests only track
+// residency; their frames are not real memory.
+
+#[cfg(not(test))]
+fn install(page: u64, frame: Frame, flags: PageFlags) -> Result<(), VmaError> {
+    use super::paging::{Page, PageTableMapper, X86_64PageTable};
+    X86_64PageTable::active()
+        .map_to(Page::containing_address(VirtAddr::new(page)), frame, flags)
+        .map_err(|_| VmaError::OutOfMemory)
+}
+
+#[cfg(not(test))]
+fn uninstall(page: u64) {
+    use super::paging::{Page, PageTableMapper, X86_64PageTable};
+    let _ = X86_64PageTable::active().unmap(Page::containing_address(VirtAddr::new(page)));
+}
+
+#[cfg(not(test))]
+fn zero_frame(frame: Frame) {
+    unsafe { core::ptr::write_bytes(frame.start_address.0 as *mut u8, 0, PAGE_SIZE) };
+}
+
+#[cfg(not(test))]
+fn copy_frame(dst: Frame, src: Frame) {
+    unsafe {
+        core::ptr::copy_nonoverlapping(
+            src.start_address.0 as *const u8,
+            dst.start_address.0 as *mut u8,
+            PAGE_SIZE,
+        )
+    };
+}
+
+#[cfg(test)]
+fn install(_: u64, _: Frame, _: PageFlags) -> Result<(), VmaError> {
+    Ok(())
+}
+
+#[cfg(test)]
+fn uninstall(_: u64) {}
+
+#[cfg(test)]
+fn zero_frame(_: Frame) {}
+
+#[cfg(test)]
+fn copy_frame(_: Frame, _: Frame) {}
+
+#[cfg(test)]
+pub(crate) fn init_test_frames() {
+    use super::frame_allocator::{init_frame_allocator, FRAME_ALLOCATOR};
+    use super::{MemoryRegion, PhysAddr};
+
+    if FRAME_ALLOCATOR.lock().is_none() {
+        init_frame_allocator(&[MemoryRegion::new(PhysAddr::new(0x100_0000), 64 << 20)]);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::Mutex as StdMutex;
+    use std::vec;
+
+    /// Records pins so tests can check they are balanced.
+    #[derive(Debug, Default)]
+    struct FakeFile {
+        pinned: StdMutex<Vec<u64>>,
+        dirtied: StdMutex<Vec<u64>>,
+    }
+
+    impl FileBacking for FakeFile {
+        fn map_page(&self, index: u64) -> Option<Frame> {
+            self.pinned.lock().unwrap().push(index);
+            Some(Frame::containing_address(super::super::PhysAddr::new(0x8000_0000 + index * PAGE)))
+        }
+
+        fn unmap_page(&self, index: u64, dirty: bool) {
+            let mut pinned = self.pinned.lock().unwrap();
+            let slot = pinned.iter().position(|&pin| pin == index).expect("unbalanced unpin");
+            pinned.remove(slot);
+            if dirty {
+                self.dirtied.lock().unwrap().push(index);
+            }
+        }
+    }
+
+    fn anon(start: u64, end: u64) -> Vma {
+        Vma::new(
+            VirtAddr::new(start),
+            VirtAddr::new(end),
+            Protection::READ | Protection::WRITE,
+            false,
+            VmaBacking::Anonymous,
+        )
+    }
+
+    #[test]
+    fn test_insert_find_and_free_ranges() {
+        let mut tree = VmaTree::new();
+        tree.insert(anon(0x10000, 0x12000)).unwrap();
+        tree.insert(anon(0x14000, 0x15000)).unwrap();
+        assert_eq!(tree.insert(anon(0x11000, 0x13000)).unwrap_err(), VmaError::Overlap);
+        assert_eq!(tree.insert(anon(0x16000, 0x16800)).unwrap_err(), VmaError::Invalid);
+
+        assert_eq!(tree.find(VirtAddr::new(0x11fff)).unwrap().start.0, 0x10000);
+        assert!(tree.find(VirtAddr::new(0x12000)).is_none());
+
+        assert_eq!(tree.find_free(0x2000, 0, 0x10000, 0x20000), Some(0x12000));
+        assert_eq!(tree.find_free(0x3000, 0, 0x10000, 0x20000), Some(0x15000));
+        assert_eq!(tree.find_free(0x1000, 0x14800, 0x10000, 0x20000), Some(0x15000));
+        assert_eq!(tree.find_free(0x10000, 0, 0x10000, 0x20000), None);
+    }
+
+    #[test]
+    fn test_lazy_anonymous_faults_and_partial_unmap() {
+        init_test_frames();
+        let mut tree = VmaTree::new();
+        tree.insert(anon(0x40000, 0x48000)).unwrap();
+        assert_eq!(tree.find(VirtAddr::new(0x40000)).unwrap().resident_pages(), 0);
+
+        tree.fault(VirtAddr::new(0x40010), false).unwrap();
+        tree.fault(VirtAddr::new(0x45000), true).unwrap();
+        assert_eq!(tree.fault(VirtAddr::new(0x40020), false), Err(VmaError::Violation));
+        assert_eq!(tree.fault(VirtAddr::new(0x40020), true), Err(VmaError::Violation));
+        assert_eq!(tree.fault(VirtAddr::new(0x48000), false), Err(VmaError::NotMapped));
+        assert_eq!(tree.find(VirtAddr::new(0x40000)).unwrap().resident_pages(), 2);
+
+        // Punch a hole: the area splits and the page inside is released
+        tree.unmap(0x44000, 0x46000);
+        assert_eq!(tree.len(), 2);
+        assert_eq!(tree.find(VirtAddr::new(0x40000)).unwrap().end.0, 0x44000);
+        assert_eq!(tree.find(VirtAddr::new(0x46000)).unwrap().start.0, 0x46000);
+        assert!(tree.find(VirtAddr::new(0x45000)).is_none());
+        assert_eq!(tree.iter().map(Vma::resident_pages).sum::<usize>(), 1);
+
+        tree.clear();
+        assert!(tree.is_empty());
+    }
+
+    #[test]
+    fn test_file_mapping_pins_cache_pages() {
+        init_test_frames();
+        let file = Arc::new(FakeFile::default());
+        let mut tree = VmaTree::new();
+
+        let shared = Vma::new(
+            VirtAddr::new(0x100000),
+            VirtAddr::new(0x104000),
+            Protection::READ | Protection::WRITE,
+            true,
+            VmaBacking::File { file: file.clone(), offset: 8 * PAGE },
+        );
+        tree.insert(shared).unwrap();
+        let private = Vma::new(
+            VirtAddr::new(0x200000),
+            VirtAddr::new(0x202000),
+            Protection::READ | Protection::WRITE,
+            false,
+            VmaBacking::File { file: file.clone(), offset: 0 },
+        );
+        tree.insert(private).unwrap();
+
+        tree.fault(VirtAddr::new(0x102000), false).unwrap();
+        tree.fault(VirtAddr::new(0x103000), true).unwrap();
+        assert_eq!(*file.pinned.lock().unwrap(), vec![10, 11]);
+
+        // A private writable page is copied, so its pin is dropped at once
+        tree.fault(VirtAddr::new(0x201000), false).unwrap();
+        assert_eq!(*file.pinned.lock().unwrap(), vec![10, 11]);
+
+        // Splitting keeps file offsets: the upper half still maps index 11
+        tree.unmap(0x103000, 0x104000);
+        assert_eq!(*file.pinned.lock().unwrap(), vec![10]);
+        assert_eq!(*file.dirtied.lock().unwrap(), vec![11]);
+
+        tree.clear();
+        assert!(file.pinned.lock().unwrap().is_empty());
+    }
+
+    #[test]
+    fn test_fork_shares_pages_copy_on_write() {
+        use super::super::frame_allocator::frame_refcount;
+
+        init_test_frames();
+        let mut parent = VmaTree::new();
+        parent.insert(anon(0x60000, 0x63000)).unwrap();
+        for addr in [0x60000, 0x61000, 0x62000] {
+            parent.fault(VirtAddr::new(addr), true).unwrap();
+        }
+        let frame_at = |tree: &VmaTree, addr: u64| {
+            tree.find(VirtAddr::new(addr)).unwrap().frame_at(VirtAddr::new(addr)).unwrap()
+        };
+        let original = frame_at(&parent, 0x60000);
+
+        let mut child = parent.fork();
+        assert_eq!(frame_at(&child, 0x60000), original);
+        assert_eq!(frame_refcount(original), 2);
+
+        // The child's first read only installs the shared frame, and a
+        // read fault on it after that is no reason to copy
+        child.fault(VirtAddr::new(0x60000), false).unwrap();
+        assert_eq!(child.fault(VirtAddr::new(0x60000), false), Err(VmaError::Violation));
+        assert_eq!(frame_at(&child, 0x60000), original);
+        assert_eq!(frame_refcount(original), 2);
+
+        // Its write then takes a copy, leaving the parent sole owner
+        child.fault(VirtAddr::new(0x60000), true).unwrap();
+        let copy = frame_at(&child, 0x60000);
+        assert_ne!(copy, original);
+        assert_eq!(frame_refcount(original), 1);
+        assert_eq!(frame_refcount(copy), 1);
+
+        // ...so the parent's write reuses its frame instead of copying
+        parent.fault(VirtAddr::new(0x60000), true).unwrap();
+        assert_eq!(frame_at(&parent, 0x60000), original);
+        assert_eq!(parent.fault(VirtAddr::new(0x60000), true), Err(VmaError::Violation));
+
+        // A first write to an uninstalled cow page copies straight away
+        let before = frame_at(&child, 0x62000);
+        child.fault(VirtAddr::new(0x62000), true).unwrap();
+        assert_ne!(frame_at(&child, 0x62000), before);
+        assert_eq!(frame_refcount(before), 1);
+
+        // Whichever side exits first leaves the other's frames intact
+        let kept = frame_at(&child, 0x61000);
+        assert_eq!(frame_refcount(kept), 2);
+        parent.clear();
+        assert_eq!(frame_refcount(kept), 1);
+        child.clear();
+    }
+
+    #[test]
+    fn test_shared_anonymous_pages_after_fork() {
+        init_test_frames();
+        let mut parent = VmaTree::new();
+        let shared = Vma::new(
+            VirtAddr::new(0x300000),
+            VirtAddr::new(0x302000),
+            Protection::READ | Protection::WRITE,
+            true,
+            VmaBacking::File { file: Arc::new(SharedAnonymous::new()), offset: 0 },
+        );
+        parent.insert(shared).unwrap();
+        let mut child = parent.fork();
+
+        // The parent writes a page first touched after the fork; the
+        // child's read of it finds the same frame, not a private one
+        parent.fault(VirtAddr::new(0x301000), true).unwrap();
+        child.fault(VirtAddr::new(0x301000), false).unwrap();
+        let frame_at = |tree: &VmaTree| tree.find(VirtAddr::new(0x301000)).unwrap().frame_at(VirtAddr::new(0x301000));
+        assert!(frame_at(&parent).is_some());
+        assert_eq!(frame_at(&parent), frame_at(&child));
+
+        // The frame outlives the parent's area for the child
+        let frame = frame_at(&child).unwrap();
+        parent.clear();
+        assert_eq!(frame_at(&child), Some(frame));
+        assert_eq!(super::super::frame_allocator::frame_refcount(frame), 1);
+        child.clear();
+    }
+
+    #[test]
+    fn test_brk_grows_and_shrinks_heap() {
+        init_test_frames();
+        let (start, limit) = (VirtAddr::new(0x1000_0000), VirtAddr::new(0x1010_0000));
+        let mut tree = VmaTree::new();
+
+        assert_eq!(tree.brk(start), start);
+        assert_eq!(tree.set_brk(start, limit, VirtAddr::new(0x1000_0800)).0, 0x1000_0800);
+        assert_eq!(tree.set_brk(start, limit, VirtAddr::new(0x1000_3000)).0, 0x1000_3000);
+        assert_eq!(tree.len(), 1);
+        assert_eq!(tree.find(start).unwrap().end.0, 0x1000_3000);
+
+        tree.fault(VirtAddr::new(0x1000_2000), true).unwrap();
+        assert_eq!(tree.set_brk(start, limit, VirtAddr::new(0x1000_1000)).0, 0x1000_1000);
+        assert!(tree.find(VirtAddr::new(0x1000_2000)).is_none());
+
+        // Out of range, or into another mapping: the break stays put
+        assert_eq!(tree.set_brk(start, limit, VirtAddr::new(0x2000_0000)).0, 0x1000_1000);
+        tree.insert(anon(0x1000_4000, 0x1000_5000)).unwrap();
+        assert_eq!(tree.set_brk(start, limit, VirtAddr::new(0x1000_8000)).0, 0x1000_1000);
+    }
+}
@@ -0,0 +1,158 @@
+//! Per-CPU cache of the running thread's identity and credentials.
+//!
+//! The scheduler records which thread it switched to; the first syscall
+//! after that looks the thread's process up once and caches its
+//! `Credentials`. Later syscalls read the cache without taking the thread
+//! or process table locks or copying either entry. Any change to a
+//! process's security state bumps a global generation, which makes every
+//! CPU refresh on its next syscall.
+
+use core::sync::atomic::{fence, AtomicU64, AtomicU8, AtomicUsize, Ordering};
+
+use super::{ProcessId, ThreadId, PROCESS_TABLE, THREAD_TABLE};
+use crate::cpu::percpu::{get_current_cpu_id, MAX_CPUS};
+use crate::security::{Credentials, PrivilegeLevel};
+
+/// Who is running on this CPU, as seen by syscall dispatch.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct CurrentTask {
+    pub tid: ThreadId,
+    pub pid: ProcessId,
+    pub credentials: Credentials,
+}
+
+/// Bumped whenever process security state changes; 0 is never current.
+static SECURITY_GENERATION: AtomicU64 = AtomicU64::new(1);
+
+/// One CPU's cache slot. Writers are the CPU itself (context switch and
+/// refresh), so `seq` only has to keep an interrupted reader from using a
+/// half-written slot: it is odd while a write is in progress.
+struct CpuCurrent {
+    seq: AtomicU64,
+    tid: AtomicUsize,
+    pid: AtomicUsize,
+    generation: AtomicU64,
+    ids: AtomicU64,
+    privilege: AtomicU8,
+    capabilities: AtomicU64,
+}
+
+impl CpuCurrent {
+    const fn new() -> Self {
+        Self {
+            seq: AtomicU64::new(0),
+            tid: AtomicUsize::new(0),
+            pid: AtomicUsize::new(0),
+            generation: AtomicU64::new(0),
+            ids: AtomicU64::new(0),
+            privilege: AtomicU8::new(PrivilegeLevel::Ring3 as u8),
+            capabilities: AtomicU64::new(0),
+        }
+    }
+
+    fn write(&self, f: impl FnOnce(&Self)) {
+        self.seq.fetch_add(1, Ordering::AcqRel);
+        fence(Ordering::Release);
+        f(self);
+        self.seq.fetch_add(1, Ordering::Release);
+    }
+
+    /// Consistent copy of the slot: (tid, pid, generation, credentials).
+    fn read(&self) -> (usize, usize, u64, Credentials) {
+        loop {
+            let seq = self.seq.load(Ordering::Acquire);
+            if seq & 1 != 0 {
+                core::hint::spin_loop();
+                continue;
+            }
+
+            let tid = self.tid.load(Ordering::Relaxed);
+            let pid = self.pid.load(Ordering::Relaxed);
+            let generation = self.generation.load(Ordering::Relaxed);
+            let ids = self.ids.load(Ordering::Relaxed);
+            let credentials = Credentials {
+                uid: ids as u32,
+                euid: (ids >> 32) as u32,
+                privilege: PrivilegeLevel::from_ring(self.privilege.load(Ordering::Relaxed)),
+                capabilities: self.capabilities.load(Ordering::Relaxed),
+            };
+
+            fence(Ordering::Acquire);
+            if self.seq.load(Ordering::Relaxed) == seq {
+                return (tid, pid, generation, credentials);
+            }
+        }
+    }
+}
+
+const EMPTY_SLOT: CpuCurrent = CpuCurrent::new();
+static CURRENT: [CpuCurrent; MAX_CPUS] = [EMPTY_SLOT; MAX_CPUS];
+
+fn slot() -> &'static CpuCurrent {
+    &CURRENT[get_current_cpu_id() as usize % MAX_CPUS]
+}
+
+/// Record the thread this CPU now runs. Its credentials are looked up on
+/// its next syscall.
+pub fn set_current_thread(tid: Option<ThreadId>) {
+    let tid = tid.map_or(0, |tid| tid.0);
+    let slot = slot();
+    if slot.tid.load(Ordering::Relaxed) == tid {
+        return;
+    }
+
+    slot.write(|s| {
+        s.tid.store(tid, Ordering::Relaxed);
+        s.generation.store(0, Ordering::Relaxed);
+    });
+}
+
+/// Make every CPU reload credentials on its next syscall. Called when a
+/// process is created or removed or its security context changes.
+pub fn invalidate_credentials() {
+    SECURITY_GENERATION.fetch_add(1, Ordering::AcqRel);
+}
+
+/// The running thread, its process and credentials. Only the first call
+/// after a switch or an invalidation touches the thread and process
+/// tables; neither entry is cloned.
+pub fn current_task() -> Option<CurrentTask> {
+    let slot = slot();
+    let generation = SECURITY_GENERATION.load(Ordering::Acquire);
+    let (tid, pid, cached, credentials) = slot.read();
+    if tid == 0 {
+        return None;
+    }
+
+    if cached == generation {
+        return Some(CurrentTask {
+            tid: ThreadId(tid),
+            pid: ProcessId(pid),
+            credentials,
+        });
+    }
+
+    let pid = THREAD_TABLE.with_thread(ThreadId(tid), |thread| thread.process_id)?;
+    let credentials = PROCESS_TABLE.with_process(pid, |process| process.security.credentials())?;
+
+    slot.write(|s| {
+        // A switch since the read above owns the slot now
+        if s.tid.load(Ordering::Relaxed) != tid {
+            return;
+        }
+        s.pid.store(pid.0, Ordering::Relaxed);
+        s.ids.store(
+            credentials.uid as u64 | ((credentials.euid as u64) << 32),
+            Ordering::Relaxed,
+        );
+        s.privilege.store(credentials.privilege as u8, Ordering::Relaxed);
+        s.capabilities.store(credentials.capabilities, Ordering::Relaxed);
+        s.generation.store(generation, Ordering::Relaxed);
+    });
+
+    Some(CurrentTask {
+        tid: ThreadId(tid),
+        pid,
+        credentials,
+    })
+}
@@ -759,13 +759,13 @@ mod tests {
 
     fn dummy_space() -> AddressSpace {
         AddressSpace {
-            page_table_frame: crate::memory::frame_allocator::Frame {
-                start_address: crate::memory::PhysAddr::new(0),
-            },
             heap_start: VirtAddr::new(0x1000_0000),
             heap_end: VirtAddr::new(0x2000_0000),
             stack_start: VirtAddr::new(0x0000_7FFF_FFFF_0000),
             stack_end: VirtAddr::new(0x0000_8000_0000_0000),
+            ..AddressSpace::new(crate::memory::frame_allocator::Frame {
+                start_address: crate::memory::PhysAddr::new(0),
+            })
         }
     }
 
@@ -18,6 +18,9 @@ pub fn exec_into_process(
     envp: &[&str],
 ) -> Result<LoadedImage, ElfLoaderError> {
     let loaded = load_executable(image, arch, &process.address_space, argv, envp)?;
+    // The new image is committed: the old program's mappings, their
+    // frames and its break go with it
+    process.address_space.vmas.lock().clear();
     process.image = Some(loaded.clone());
     Ok(loaded)
 }
@@ -3,9 +3,14 @@ pub mod context;
 pub mod thread;
 pub mod elf_loader;
 pub mod loader;
+pub mod current;
+pub mod pipe;
+pub mod wait_queue;
 
+use core::sync::atomic::{AtomicUsize, Ordering};
 use spin::Mutex;
-use crate::memory::{VirtAddr, frame_allocator::Frame};
+use crate::memory::{VirtAddr, PAGE_SIZE, frame_allocator::Frame};
+use crate::memory::vma::{Protection, Vma, VmaBacking, VmaError, VmaTree};
 use crate::security::{self, SecurityContext};
 
 #[cfg(not(test))]
@@ -22,6 +27,7 @@ use std::string::String;
 
 pub use thread::{Thread, ThreadState, THREAD_TABLE, create_thread};
 pub use context::Context;
+pub use pipe::{PipeEnd, PipeEndKind};
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub struct ProcessId(pub usize);
@@ -45,115 +51,9 @@ impl Priority {
 }
 
 #[cfg(not(test))]
-use alloc::{collections::VecDeque, sync::Arc};
+use alloc::sync::Arc;
 #[cfg(test)]
-use std::{collections::VecDeque, sync::Arc};
-
-#[derive(Debug, Clone, Copy, PartialEq, Eq)]
-pub enum PipeEndKind {
-    Read,
-    Write,
-}
-
-#[derive(Debug)]
-pub struct PipeInner {
-    buffer: VecDeque<u8>,
-    readers: usize,
-    writers: usize,
-}
-
-#[derive(Debug)]
-pub struct PipeEnd {
-    inner: Arc<Mutex<PipeInner>>,
-    kind: PipeEndKind,
-}
-
-impl PipeEnd {
-    pub fn new_pair() -> (Self, Self) {
-        let inner = Arc::new(Mutex::new(PipeInner {
-            buffer: VecDeque::new(),
-            readers: 1,
-            writers: 1,
-        }));
-
-        let read_end = PipeEnd {
-            inner: Arc::clone(&inner),
-            kind: PipeEndKind::Read,
-        };
-
-        let write_end = PipeEnd {
-            inner,
-            kind: PipeEndKind::Write,
-        };
-
-        (read_end, write_end)
-    }
-
-    pub fn kind(&self) -> PipeEndKind {
-        self.kind
-    }
-
-    pub fn read(&self, dst: &mut [u8]) -> usize {
-        if self.kind != PipeEndKind::Read {
-            return 0;
-        }
-
-        let mut inner = self.inner.lock();
-        let mut read = 0usize;
-        while read < dst.len() {
-            match inner.buffer.pop_front() {
-                Some(byte) => {
-                    dst[read] = byte;
-                    read += 1;
-                }
-                None => break,
-            }
-        }
-        read
-    }
-
-    pub fn write(&self, src: &[u8]) -> usize {
-        if self.kind != PipeEndKind::Write {
-            return 0;
-        }
-
-        let mut inner = self.inner.lock();
-        const PIPE_CAPACITY: usize = 4096;
-        let mut written = 0usize;
-        while written < src.len() && inner.buffer.len() < PIPE_CAPACITY {
-            inner.buffer.push_back(src[written]);
-            written += 1;
-        }
-        written
-    }
-}
-
-impl Clone for PipeEnd {
-    fn clone(&self) -> Self {
-        {
-            let mut inner = self.inner.lock();
-            match self.kind {
-                PipeEndKind::Read => inner.readers += 1,
-                PipeEndKind::Write => inner.writers += 1,
-            }
-        }
-
-        PipeEnd {
-            inner: Arc::clone(&self.inner),
-            kind: self.kind,
-        }
-    }
-}
-
-impl Drop for PipeEnd {
-    fn drop(&mut self) {
-        let mut inner = self.inner.lock();
-        match self.kind {
-            PipeEndKind::Read => inner.readers = inner.readers.saturating_sub(1),
-            PipeEndKind::Write => inner.writers = inner.writers.saturating_sub(1),
-        }
-    }
-}
+use std::sync::Arc;
 
 #[derive(Debug, Clone)]
 pub enum FdObject {
@@ -167,14 +67,24 @@ pub enum FdObject {
 pub struct FileDescriptorEntry {
     pub fd: u32,
     pub flags: u32,
+    /// Kept across exec; `false` is `FD_CLOEXEC`.
     pub inheritable: bool,
     pub object: FdObject,
 }
 
+/// One past the highest fd a table can hold, as `VFS_FD_MAX` on the C side.
+pub const FD_MAX: u32 = 1 << 20;
+
+/// A process's descriptors, indexed by fd. The table grows with the
+/// highest fd in use, up to `FD_MAX`. A two-level bitmap finds the lowest
+/// free fd in a few word scans however many are open: one bit per fd
+/// marks it in use, and one bit per 64-fd word marks that word full.
 #[derive(Debug, Clone)]
 pub struct FileDescriptorTable {
-    entries: Vec<FileDescriptorEntry>,
-    next_fd: u32,
+    slots: Vec<Option<FileDescriptorEntry>>,
+    used: Vec<u64>,
+    full: Vec<u64>,
+    open: usize,
 }
 
 impl FileDescriptorTable {
@@ -182,73 +92,125 @@ impl FileDescriptorTable {
         Self::default()
     }
 
-    pub fn inherit(&self) -> Self {
-        let entries = self
-            .entries
-            .iter()
-            .filter(|entry| entry.inheritable)
-            .cloned()
-            .collect();
+    fn empty() -> Self {
+        Self {
+            slots: Vec::new(),
+            used: Vec::new(),
+            full: Vec::new(),
+            open: 0,
+        }
+    }
 
-        let next_fd = entries
-            .iter()
-            .fold(0u32, |max_fd, entry| max_fd.max(entry.fd + 1));
+    /// Close every descriptor not marked inheritable, as `exec` does.
+    /// Walks the in-use bits rather than every slot.
+    pub fn close_on_exec(&mut self) {
+        for word in 0..self.used.len() {
+            let mut bits = self.used[word];
+            while bits != 0 {
+                let fd = (word * 64) as u32 + bits.trailing_zeros();
+                bits &= bits - 1;
+                if self.get(fd).map_or(false, |entry| !entry.inheritable) {
+                    self.remove(fd);
+                }
+            }
+        }
+    }
 
-        Self { entries, next_fd }
+    /// Number of open descriptors.
+    pub fn len(&self) -> usize {
+        self.open
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.open == 0
     }
 
     pub fn iter(&self) -> impl Iterator<Item = &FileDescriptorEntry> {
-        self.entries.iter()
+        self.slots.iter().flatten()
     }
 
     pub fn get(&self, fd: u32) -> Option<&FileDescriptorEntry> {
-        self.entries.iter().find(|entry| entry.fd == fd)
+        self.slots.get(fd as usize)?.as_ref()
+    }
+
+    pub fn get_mut(&mut self, fd: u32) -> Option<&mut FileDescriptorEntry> {
+        self.slots.get_mut(fd as usize)?.as_mut()
     }
 
     pub fn remove(&mut self, fd: u32) -> bool {
-        if let Some(index) = self.entries.iter().position(|entry| entry.fd == fd) {
-            self.entries.remove(index);
-            true
-        } else {
-            false
+        match self.slots.get_mut(fd as usize).and_then(Option::take) {
+            Some(_) => {
+                let word = fd as usize / 64;
+                self.used[word] &= !(1u64 << (fd % 64));
+                self.full[word / 64] &= !(1u64 << (word % 64));
+                self.open -= 1;
+                true
+            }
+            None => false,
         }
     }
 
-    pub fn insert(&mut self, fd: u32, flags: u32, inheritable: bool, object: FdObject) {
-        self.next_fd = self.next_fd.max(fd + 1);
-        if let Some(existing) = self.entries.iter_mut().find(|entry| entry.fd == fd) {
+    /// Install `object` at `fd`, replacing what was there. False if `fd`
+    /// is not below `FD_MAX`.
+    pub fn insert(&mut self, fd: u32, flags: u32, inheritable: bool, object: FdObject) -> bool {
+        if fd >= FD_MAX {
+            return false;
+        }
+        if let Some(existing) = self.get_mut(fd) {
             existing.flags = flags;
             existing.inheritable = inheritable;
             existing.object = object;
-        } else {
-            self.entries.push(FileDescriptorEntry {
-                fd,
-                flags,
-                inheritable,
-                object,
-            });
+            return true;
         }
-    }
 
-    pub fn allocate(&mut self, flags: u32, inheritable: bool, object: FdObject) -> u32 {
-        let fd = self.next_fd;
-        self.next_fd = self.next_fd.saturating_add(1);
-        self.entries.push(FileDescriptorEntry {
+        let (slot, word) = (fd as usize, fd as usize / 64);
+        if self.slots.len() <= slot {
+            self.slots.resize_with(slot + 1, || None);
+        }
+        if self.used.len() <= word {
+            self.used.resize(word + 1, 0);
+        }
+        if self.full.len() <= word / 64 {
+            self.full.resize(word / 64 + 1, 0);
+        }
+
+        self.slots[slot] = Some(FileDescriptorEntry {
             fd,
             flags,
             inheritable,
             object,
         });
-        fd
+        self.used[word] |= 1u64 << (fd % 64);
+        if self.used[word] == !0 {
+            self.full[word / 64] |= 1u64 << (word % 64);
+        }
+        self.open += 1;
+        true
+    }
+
+    /// Install `object` at the lowest free fd, as POSIX requires. None
+    /// when every fd below `FD_MAX` is open.
+    pub fn allocate(&mut self, flags: u32, inheritable: bool, object: FdObject) -> Option<u32> {
+        let fd = self.lowest_free();
+        self.insert(fd, flags, inheritable, object).then_some(fd)
+    }
+
+    fn lowest_free(&self) -> u32 {
+        // A word past the end of `used` has no fds in use yet
+        for (index, &full) in self.full.iter().enumerate() {
+            if full != !0 {
+                let word = index * 64 + (!full).trailing_zeros() as usize;
+                let bits = self.used.get(word).copied().unwrap_or(0);
+                return (word * 64) as u32 + (!bits).trailing_zeros();
+            }
+        }
+        (self.full.len() * 64 * 64) as u32
     }
 }
 
 impl Default for FileDescriptorTable {
     fn default() -> Self {
-        let mut table = FileDescriptorTable {
-            entries: Vec::new(),
-            next_fd: 0,
-        };
+        let mut table = FileDescriptorTable::empty();
         table.insert(0, 0, true, FdObject::Stdin);
         table.insert(1, 0, true, FdObject::Stdout);
         table.insert(2, 0, true, FdObject::Stderr);
@@ -256,6 +218,13 @@ impl Default for FileDescriptorTable {
     }
 }
 
+/// A process's mappings, locked on their own like its fd table so the
+/// page-fault handler never holds a process-table shard.
+pub type SharedVmaTree = Arc<Mutex<VmaTree>>;
+
+/// Where `mmap` places mappings that have no fixed address.
+pub const MMAP_BASE: VirtAddr = VirtAddr::new(0x0000_2000_0000_0000);
+
 #[derive(Debug, Clone)]
 pub struct AddressSpace {
     pub page_table_frame: Frame,
@@ -263,6 +232,7 @@ pub struct AddressSpace {
     pub heap_end: VirtAddr,
     pub stack_start: VirtAddr,
     pub stack_end: VirtAddr,
+    pub vmas: SharedVmaTree,
 }
 
 impl AddressSpace {
@@ -273,9 +243,12 @@ impl AddressSpace {
             heap_end: VirtAddr::new(0x0000_1000_1000_0000),
             stack_start: VirtAddr::new(0x0000_7FFF_FFFF_0000),
             stack_end: VirtAddr::new(0x0000_8000_0000_0000),
+            vmas: Arc::new(Mutex::new(VmaTree::new())),
         }
     }
 
+    /// The child's address space for `fork`: a new page table and the
+    /// parent's mappings, shared copy-on-write.
     pub fn clone_for_fork(&self) -> Option<Self> {
         let frame = crate::memory::frame_allocator::allocate_frame()?;
         Some(Self {
@@ -284,10 +257,76 @@ impl AddressSpace {
             heap_end: self.heap_end,
             stack_start: self.stack_start,
             stack_end: self.stack_end,
+            vmas: Arc::new(Mutex::new(self.vmas.lock().fork())),
         })
     }
+
+    /// Record a mapping of `len` bytes; pages are faulted in on first
+    /// touch. `fixed` places it exactly at `addr`, replacing whatever was
+    /// there; otherwise `addr` is a hint and the lowest free range at or
+    /// above it between `MMAP_BASE` and the stack is used.
+    pub fn map(
+        &self,
+        addr: VirtAddr,
+        len: usize,
+        prot: Protection,
+        shared: bool,
+        fixed: bool,
+        backing: VmaBacking,
+    ) -> Result<VirtAddr, VmaError> {
+        let len = (len as u64)
+            .checked_add(PAGE_SIZE as u64 - 1)
+            .ok_or(VmaError::Invalid)?
+            & !(PAGE_SIZE as u64 - 1);
+        if len == 0 {
+            return Err(VmaError::Invalid);
+        }
+
+        let mut vmas = self.vmas.lock();
+        let start = if fixed {
+            let end = addr.0.checked_add(len).ok_or(VmaError::Invalid)?;
+            if !addr.is_aligned(PAGE_SIZE as u64) || addr.0 == 0 || end > self.stack_end.0 {
+                return Err(VmaError::Invalid);
+            }
+            vmas.unmap(addr.0, end);
+            addr.0
+        } else {
+            vmas.find_free(len, addr.0, MMAP_BASE.0, self.stack_start.0)
+                .ok_or(VmaError::NoSpace)?
+        };
+
+        let start = VirtAddr::new(start);
+        vmas.insert(Vma::new(start, VirtAddr::new(start.0 + len), prot, shared, backing))?;
+        Ok(start)
+    }
+
+    pub fn unmap(&self, addr: VirtAddr, len: usize) -> Result<(), VmaError> {
+        let end = addr
+            .0
+            .checked_add(len as u64)
+            .ok_or(VmaError::Invalid)?;
+        if len == 0 || !addr.is_aligned(PAGE_SIZE as u64) {
+            return Err(VmaError::Invalid);
+        }
+        self.vmas.lock().unmap(addr.0, VirtAddr::new(end).align_up(PAGE_SIZE as u64).0);
+        Ok(())
+    }
+
+    /// `brk`: 0 queries the break, anything else tries to move it within
+    /// `[heap_start, heap_end]`. Returns the resulting break.
+    pub fn brk(&self, requested: VirtAddr) -> VirtAddr {
+        let mut vmas = self.vmas.lock();
+        if requested.0 == 0 {
+            return vmas.brk(self.heap_start);
+        }
+        vmas.set_brk(self.heap_start, self.heap_end, requested)
+    }
 }
 
+/// A process's descriptor table, locked on its own so fd syscalls never
+/// hold a process-table shard while they run.
+pub type SharedFdTable = Arc<Mutex<FileDescriptorTable>>;
+
 #[derive(Debug, Clone)]
 pub struct Process {
     pub id: ProcessId,
@@ -296,7 +335,7 @@ pub struct Process {
     pub threads: Vec<ThreadId>,
     pub parent: Option<ProcessId>,
     pub children: Vec<ProcessId>,
-    pub file_descriptors: FileDescriptorTable,
+    pub file_descriptors: SharedFdTable,
     pub security: SecurityContext,
     pub image: Option<loader::LoadedImage>,
 }
@@ -316,7 +355,7 @@ impl Process {
             threads: Vec::new(),
             parent: None,
             children: Vec::new(),
-            file_descriptors,
+            file_descriptors: Arc::new(Mutex::new(file_descriptors)),
             security,
             image: None,
         }
@@ -331,56 +370,117 @@ impl Process {
     }
 }
 
+/// Number of independently locked process-table shards. PIDs are handed
+/// out sequentially, so neighbouring processes land in different shards.
+const PROCESS_SHARDS: usize = 64;
+
+type ProcessShard = Mutex<Vec<Option<Process>>>;
+
+/// Process table split into per-PID-bucket locks. Lookups on different
+/// processes only contend when their PIDs share a shard; PID allocation is
+/// a single atomic.
 pub struct ProcessTable {
-    processes: Vec<Option<Process>>,
-    next_pid: usize,
+    shards: [ProcessShard; PROCESS_SHARDS],
+    next_pid: AtomicUsize,
 }
 
 impl ProcessTable {
     pub const fn new() -> Self {
+        const EMPTY_SHARD: ProcessShard = Mutex::new(Vec::new());
         Self {
-            processes: Vec::new(),
-            next_pid: 1,
+            shards: [EMPTY_SHARD; PROCESS_SHARDS],
+            next_pid: AtomicUsize::new(1),
         }
     }
 
-    pub fn allocate_pid(&mut self) -> ProcessId {
-        let pid = ProcessId(self.next_pid);
-        self.next_pid += 1;
-        pid
+    fn shard(&self, pid: ProcessId) -> (&ProcessShard, usize) {
+        (&self.shards[pid.0 % PROCESS_SHARDS], pid.0 / PROCESS_SHARDS)
+    }
+
+    pub fn allocate_pid(&self) -> ProcessId {
+        ProcessId(self.next_pid.fetch_add(1, Ordering::Relaxed))
     }
 
-    pub fn add_process(&mut self, process: Process) {
-        let id = process.id.0;
-        while self.processes.len() <= id {
-            self.processes.push(None);
+    pub fn add_process(&self, process: Process) {
+        let (shard, index) = self.shard(process.id);
+        let mut slots = shard.lock();
+        while slots.len() <= index {
+            slots.push(None);
         }
-        self.processes[id] = Some(process);
+        slots[index] = Some(process);
+    }
+
+    /// Run `f` on the process with only its shard locked. `f` must not
+    /// take another process- or thread-table lock.
+    pub fn with_process<R>(&self, pid: ProcessId, f: impl FnOnce(&Process) -> R) -> Option<R> {
+        let (shard, index) = self.shard(pid);
+        let slots = shard.lock();
+        slots.get(index)?.as_ref().map(f)
     }
 
-    pub fn get_process(&self, pid: ProcessId) -> Option<&Process> {
-        self.processes.get(pid.0)?.as_ref()
+    pub fn with_process_mut<R>(
+        &self,
+        pid: ProcessId,
+        f: impl FnOnce(&mut Process) -> R,
+    ) -> Option<R> {
+        let (shard, index) = self.shard(pid);
+        let mut slots = shard.lock();
+        slots.get_mut(index)?.as_mut().map(f)
     }
 
-    pub fn get_process_mut(&mut self, pid: ProcessId) -> Option<&mut Process> {
-        self.processes.get_mut(pid.0)?.as_mut()
+    pub fn remove_process(&self, pid: ProcessId) -> Option<Process> {
+        self.remove_process_if(pid, |_| true)
     }
 
-    pub fn remove_process(&mut self, pid: ProcessId) -> Option<Process> {
-        if pid.0 < self.processes.len() {
-            if let Some(process) = self.processes[pid.0].take() {
-                security::remove_context(pid.0);
-                Some(process)
-            } else {
-                None
+    /// Remove the process if `f` returns true, deciding and removing under
+    /// one shard lock.
+    pub fn remove_process_if(
+        &self,
+        pid: ProcessId,
+        f: impl FnOnce(&mut Process) -> bool,
+    ) -> Option<Process> {
+        let (shard, index) = self.shard(pid);
+        let process = {
+            let mut slots = shard.lock();
+            let slot = slots.get_mut(index)?;
+            if !f(slot.as_mut()?) {
+                return None;
             }
-        } else {
-            None
+            slot.take()?
+        };
+
+        security::remove_context(pid.0);
+        current::invalidate_credentials();
+        Some(process)
+    }
+
+    /// Drop every process and restart PID allocation at 1.
+    pub fn clear(&self) {
+        for shard in &self.shards {
+            shard.lock().clear();
         }
+        self.next_pid.store(1, Ordering::Relaxed);
+        current::invalidate_credentials();
     }
 }
 
-pub static PROCESS_TABLE: Mutex<ProcessTable> = Mutex::new(ProcessTable::new());
+pub static PROCESS_TABLE: ProcessTable = ProcessTable::new();
+
+/// Page-fault entry for user addresses: give the page a frame if an area
+/// of the running process covers it, or a private copy when a shared
+/// copy-on-write page is written. `write` is set for a write access.
+/// `false` means the fault is fatal.
+pub fn handle_page_fault(addr: VirtAddr, write: bool) -> bool {
+    let Some(task) = current::current_task() else {
+        return false;
+    };
+    let Some(vmas) = mappings(task.pid) else {
+        return false;
+    };
+    // The shard is released by now: the fault may allocate and copy frames
+    let resolved = vmas.lock().fault(addr, write).is_ok();
+    resolved
+}
 
 pub fn create_process(
     name: String,
@@ -388,41 +488,52 @@ pub fn create_process(
     security: SecurityContext,
     file_descriptors: FileDescriptorTable,
 ) -> Option<ProcessId> {
-    let mut table = PROCESS_TABLE.lock();
-    let pid = table.allocate_pid();
+    let pid = PROCESS_TABLE.allocate_pid();
     let address_space = AddressSpace::new(page_table_frame);
     let process = Process::new(pid, name, address_space, security.clone(), file_descriptors);
     security::register_process(pid.0, security);
-    table.add_process(process);
+    PROCESS_TABLE.add_process(process);
+    current::invalidate_credentials();
     Some(pid)
 }
 
 pub fn get_process(pid: ProcessId) -> Option<Process> {
-    let table = PROCESS_TABLE.lock();
-    table.get_process(pid).cloned()
+    PROCESS_TABLE.with_process(pid, |process| process.clone())
+}
+
+/// The process's descriptor table, for locking without its shard held.
+pub fn file_descriptors(pid: ProcessId) -> Option<SharedFdTable> {
+    PROCESS_TABLE.with_process(pid, |process| Arc::clone(&process.file_descriptors))
+}
+
+/// The process's mappings, for faulting without its shard held.
+pub fn mappings(pid: ProcessId) -> Option<SharedVmaTree> {
+    PROCESS_TABLE.with_process(pid, |process| Arc::clone(&process.address_space.vmas))
 }
 
 pub fn set_process_capabilities(pid: ProcessId, capabilities: security::CapMask) -> bool {
-    let mut table = PROCESS_TABLE.lock();
-    let process = match table.get_process_mut(pid) {
-        Some(process) => process,
-        None => return false,
-    };
+    let updated = PROCESS_TABLE.with_process_mut(pid, |process| {
+        process.security.capabilities = capabilities;
+    });
+    if updated.is_none() {
+        return false;
+    }
 
-    process.security.capabilities = capabilities;
     security::set_capabilities(pid.0, capabilities);
+    current::invalidate_credentials();
     true
 }
 
 pub fn grant_process_capabilities(pid: ProcessId, mask: security::CapMask) -> bool {
-    let mut table = PROCESS_TABLE.lock();
-    let process = match table.get_process_mut(pid) {
-        Some(process) => process,
-        None => return false,
-    };
+    let updated = PROCESS_TABLE.with_process_mut(pid, |process| {
+        process.security.capabilities |= mask;
+    });
+    if updated.is_none() {
+        return false;
+    }
 
-    process.security.capabilities |= mask;
     security::grant_capabilities(pid.0, mask);
+    current::invalidate_credentials();
     true
 }
 
@@ -432,7 +543,7 @@ mod tests {
 
     #[test]
     fn test_process_creation() {
-        let mut table = ProcessTable::new();
+        let table = ProcessTable::new();
         let pid = table.allocate_pid();
         assert_eq!(pid.0, 1);
 
@@ -440,6 +551,122 @@ mod tests {
         assert_eq!(pid2.0, 2);
     }
 
+    #[test]
+    fn test_fd_table_lowest_free_and_close_on_exec() {
+        let mut fds = FileDescriptorTable::new();
+        assert_eq!(fds.allocate(0, true, FdObject::Stdout), Some(3));
+
+        // Well past one bitmap word of words: no cap, and holes refill first
+        for expected in 4..70_000 {
+            assert_eq!(fds.allocate(0, expected % 2 == 0, FdObject::Stdout), Some(expected));
+        }
+        assert_eq!(fds.len(), 70_000);
+        assert!(fds.remove(1));
+        assert!(fds.remove(4_100));
+        assert_eq!(fds.allocate(0, true, FdObject::Stdout), Some(1));
+        assert_eq!(fds.allocate(0, true, FdObject::Stdout), Some(4_100));
+        assert_eq!(fds.allocate(0, true, FdObject::Stdout), Some(70_000));
+
+        assert!(fds.insert(100_000, 0, true, FdObject::Stdout));
+        assert!(fds.get(99_999).is_none());
+        assert!(!fds.insert(FD_MAX, 0, true, FdObject::Stdout));
+        assert_eq!(fds.allocate(0, true, FdObject::Stdout), Some(70_001));
+
+        // Odd fds from the loop above are close-on-exec
+        let mut child = fds.clone();
+        child.close_on_exec();
+        assert!(child.get(5).is_none());
+        assert!(child.get(6).is_some());
+        assert_eq!(child.len(), fds.len() - (70_000 - 4) / 2);
+        fds.close_on_exec();
+        assert_eq!(fds.len(), child.len());
+        assert_eq!(fds.allocate(0, true, FdObject::Stdout), Some(5));
+    }
+
+    #[test]
+    fn test_sharded_table_concurrent_access() {
+        use crate::memory::PhysAddr;
+
+        let table = Arc::new(ProcessTable::new());
+        let workers: Vec<_> = (0..8)
+            .map(|_| {
+                let table = Arc::clone(&table);
+                std::thread::spawn(move || {
+                    for _ in 0..200 {
+                        let pid = table.allocate_pid();
+                        let frame = Frame { start_address: PhysAddr::new(0x1000) };
+                        table.add_process(Process::new(
+                            pid,
+                            String::from("worker"),
+                            AddressSpace::new(frame),
+                            SecurityContext::kernel(),
+                            FileDescriptorTable::new(),
+                        ));
+                        assert_eq!(table.with_process(pid, |p| p.id), Some(pid));
+                        table.with_process_mut(pid, |p| p.children.push(ProcessId(0)));
+                        let fds = table.with_process(pid, |p| Arc::clone(&p.file_descriptors)).unwrap();
+                        assert!(fds.lock().get(1).is_some());
+                        assert!(table.remove_process(pid).is_some());
+                        assert!(table.with_process(pid, |_| ()).is_none());
+                    }
+                })
+            })
+            .collect();
+
+        for worker in workers {
+            worker.join().unwrap();
+        }
+        assert_eq!(table.allocate_pid(), ProcessId(1601));
+    }
+
+    /// Aggregate fd-lookup throughput as threads are added, each working
+    /// on its own process the way `sys_write` does. Run with
+    /// `cargo test --release --lib process_table_scaling_bench -- --ignored --nocapture`.
+    #[test]
+    #[ignore]
+    fn process_table_scaling_bench() {
+        use crate::memory::PhysAddr;
+        use std::time::Instant;
+
+        const LOOKUPS: usize = 500_000;
+
+        for workers in [1usize, 2, 4, 8] {
+            let table = Arc::new(ProcessTable::new());
+            let start = Instant::now();
+            let handles: Vec<_> = (0..workers)
+                .map(|_| {
+                    let table = Arc::clone(&table);
+                    std::thread::spawn(move || {
+                        let pid = table.allocate_pid();
+                        let frame = Frame { start_address: PhysAddr::new(0x1000) };
+                        table.add_process(Process::new(
+                            pid,
+                            String::from("bench"),
+                            AddressSpace::new(frame),
+                            SecurityContext::kernel(),
+                            FileDescriptorTable::new(),
+                        ));
+                        for _ in 0..LOOKUPS {
+                            let fds = table.with_process(pid, |p| Arc::clone(&p.file_descriptors)).unwrap();
+                            let fds = fds.lock();
+                            std::hint::black_box(fds.get(1).map(|entry| entry.flags));
+                        }
+                    })
+                })
+                .collect();
+            for handle in handles {
+                handle.join().unwrap();
+            }
+
+            let elapsed = start.elapsed().as_secs_f64();
+            std::println!(
+                "{} thread(s): {:.1} M fd lookups/s",
+                workers,
+                (workers * LOOKUPS) as f64 / elapsed / 1e6
+            );
+        }
+    }
+
     #[test]
     fn test_priority() {
         assert!(Priority::High.as_usize() > Priority::Normal.as_usize());
@@ -0,0 +1,859 @@
+//! Pipes backed by a power-of-two byte ring.
+//!
+//! `head` and `tail` count bytes ever read and written, so the fill level
+//! is `tail - head` and a position maps into the ring with `& (cap - 1)`.
+//! A writer only publishes `tail` after copying, and a reader only
+//! publishes `head` after copying, so one reader and one writer never
+//! share a lock. The side locks only serialize several readers (or
+//! writers) holding dup'ed or inherited ends, and resizing, which takes
+//! both.
+//!
+//! Blocking readers sleep on `readable` and blocking writers on
+//! `writable`; each side wakes the other after moving data, and closing
+//! the last end of one side wakes the other for EOF / broken pipe.
+//!
+//! Lock order: a read lock before any write lock, and at most one write
+//! lock at a time. `splice`/`tee` hold the source's read lock and the
+//! sink's write lock; `resize` takes its own read lock, then write lock.
+
+use core::cell::UnsafeCell;
+use core::ptr;
+use core::sync::atomic::{AtomicUsize, Ordering};
+use spin::Mutex;
+
+use super::wait_queue::WaitQueue;
+
+#[cfg(not(test))]
+use alloc::{boxed::Box, sync::Arc, vec};
+
+#[cfg(test)]
+use std::{boxed::Box, sync::Arc, vec};
+
+pub const PIPE_PAGE_SIZE: usize = 4096;
+/// Default capacity, 16 pages as on Linux.
+pub const PIPE_DEFAULT_SIZE: usize = 16 * PIPE_PAGE_SIZE;
+/// Largest capacity `F_SETPIPE_SZ` may request.
+pub const PIPE_MAX_SIZE: usize = 1 << 20;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PipeEndKind {
+    Read,
+    Write,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PipeError {
+    /// Nothing to read yet, or no room to write (non-blocking calls only).
+    WouldBlock,
+    /// Writing with no read end left open.
+    BrokenPipe,
+    /// Reading from a write end or writing to a read end.
+    WrongEnd,
+    /// `splice`/`tee` with both ends on the same pipe.
+    SamePipe,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PipeResizeError {
+    /// Larger than `PIPE_MAX_SIZE`.
+    TooLarge,
+    /// The pipe holds more data than the new capacity.
+    Busy,
+}
+
+/// Ring storage. Replaced only by `resize`, with both side locks held.
+#[derive(Clone, Copy)]
+struct Ring {
+    data: *mut u8,
+    capacity: usize,
+}
+
+impl Ring {
+    fn allocate(capacity: usize) -> Self {
+        let data = Box::into_raw(vec![0u8; capacity].into_boxed_slice()) as *mut u8;
+        Self { data, capacity }
+    }
+
+    /// # Safety
+    /// The ring must not be used afterwards.
+    unsafe fn free(self) {
+        drop(Box::from_raw(ptr::slice_from_raw_parts_mut(self.data, self.capacity)));
+    }
+
+    /// Copy `src` in at byte position `pos`, wrapping at most once.
+    ///
+    /// # Safety
+    /// `[pos, pos + src.len())` must be free and at most `capacity` long.
+    unsafe fn copy_in(&self, pos: usize, src: &[u8]) {
+        let offset = pos & (self.capacity - 1);
+        let first = src.len().min(self.capacity - offset);
+        ptr::copy_nonoverlapping(src.as_ptr(), self.data.add(offset), first);
+        ptr::copy_nonoverlapping(src.as_ptr().add(first), self.data, src.len() - first);
+    }
+
+    /// The filled bytes `[pos, pos + len)` as at most two slices.
+    ///
+    /// # Safety
+    /// The range must be filled and stay untouched while the slices live.
+    unsafe fn slices<'a>(&self, pos: usize, len: usize) -> (&'a [u8], &'a [u8]) {
+        let offset = pos & (self.capacity - 1);
+        let first = len.min(self.capacity - offset);
+        (
+            core::slice::from_raw_parts(self.data.add(offset), first),
+            core::slice::from_raw_parts(self.data, len - first),
+        )
+    }
+
+    /// Copy out to `dst` from byte position `pos`, wrapping at most once.
+    ///
+    /// # Safety
+    /// `[pos, pos + dst.len())` must be filled and at most `capacity` long.
+    unsafe fn copy_out(&self, pos: usize, dst: &mut [u8]) {
+        let offset = pos & (self.capacity - 1);
+        let first = dst.len().min(self.capacity - offset);
+        ptr::copy_nonoverlapping(self.data.add(offset), dst.as_mut_ptr(), first);
+        ptr::copy_nonoverlapping(self.data, dst.as_mut_ptr().add(first), dst.len() - first);
+    }
+}
+
+pub struct PipeInner {
+    ring: UnsafeCell<Ring>,
+    head: AtomicUsize,
+    tail: AtomicUsize,
+    read_lock: Mutex<()>,
+    write_lock: Mutex<()>,
+    readers: AtomicUsize,
+    writers: AtomicUsize,
+    readable: WaitQueue,
+    writable: WaitQueue,
+}
+
+// The ring is only written through disjoint head/tail windows, and only
+// replaced with both side locks held.
+unsafe impl Send for PipeInner {}
+unsafe impl Sync for PipeInner {}
+
+impl core::fmt::Debug for PipeInner {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("PipeInner")
+            .field("len", &self.len())
+            .field("capacity", &self.capacity())
+            .field("readers", &self.readers.load(Ordering::Relaxed))
+            .field("writers", &self.writers.load(Ordering::Relaxed))
+            .finish()
+    }
+}
+
+impl PipeInner {
+    fn new(capacity: usize) -> Self {
+        Self {
+            ring: UnsafeCell::new(Ring::allocate(capacity)),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            read_lock: Mutex::new(()),
+            write_lock: Mutex::new(()),
+            readers: AtomicUsize::new(1),
+            writers: AtomicUsize::new(1),
+            readable: WaitQueue::new(),
+            writable: WaitQueue::new(),
+        }
+    }
+
+    fn ring(&self) -> Ring {
+        unsafe { *self.ring.get() }
+    }
+
+    fn capacity(&self) -> usize {
+        self.ring().capacity
+    }
+
+    fn len(&self) -> usize {
+        self.tail
+            .load(Ordering::Acquire)
+            .wrapping_sub(self.head.load(Ordering::Acquire))
+    }
+
+    /// Fill the buffers in `dst` in order from what is buffered, publishing
+    /// `head` and waking writers once for the whole vector.
+    fn read(&self, dst: &mut [&mut [u8]]) -> usize {
+        let _guard = self.read_lock.lock();
+        let ring = self.ring();
+        let head = self.head.load(Ordering::Relaxed);
+        let available = self.tail.load(Ordering::Acquire).wrapping_sub(head);
+
+        let mut count = 0;
+        for buf in dst.iter_mut() {
+            if count == available {
+                break;
+            }
+            let take = buf.len().min(available - count);
+            unsafe { ring.copy_out(head.wrapping_add(count), &mut buf[..take]) };
+            count += take;
+        }
+        if count == 0 {
+            return 0;
+        }
+
+        self.head.store(head.wrapping_add(count), Ordering::Release);
+        drop(_guard);
+        self.writable.wake_all();
+        count
+    }
+
+    /// Append as much of the concatenation of `src`, minus its first `skip`
+    /// bytes, as fits; `tail` is published once for the whole vector.
+    fn write(&self, src: &[&[u8]], mut skip: usize) -> usize {
+        let _guard = self.write_lock.lock();
+        let ring = self.ring();
+        let tail = self.tail.load(Ordering::Relaxed);
+        let room = ring.capacity - tail.wrapping_sub(self.head.load(Ordering::Acquire));
+
+        let mut count = 0;
+        for buf in src {
+            if skip >= buf.len() {
+                skip -= buf.len();
+                continue;
+            }
+            let put = (buf.len() - skip).min(room - count);
+            if put == 0 {
+                break;
+            }
+            unsafe { ring.copy_in(tail.wrapping_add(count), &buf[skip..skip + put]) };
+            skip = 0;
+            count += put;
+        }
+        if count == 0 {
+            return 0;
+        }
+
+        self.tail.store(tail.wrapping_add(count), Ordering::Release);
+        drop(_guard);
+        self.readable.wake_all();
+        count
+    }
+
+    fn has_room(&self) -> bool {
+        self.len() < self.capacity()
+    }
+
+    /// Hand up to `max` buffered bytes to `sink` as ring slices, without
+    /// an intermediate buffer. Returns how many were consumed.
+    fn consume_with(&self, max: usize, mut sink: impl FnMut(&[u8])) -> usize {
+        let guard = self.read_lock.lock();
+        let ring = self.ring();
+        let head = self.head.load(Ordering::Relaxed);
+        let count = max.min(self.tail.load(Ordering::Acquire).wrapping_sub(head));
+        if count == 0 {
+            return 0;
+        }
+
+        let (first, second) = unsafe { ring.slices(head, count) };
+        sink(first);
+        if !second.is_empty() {
+            sink(second);
+        }
+        self.head.store(head.wrapping_add(count), Ordering::Release);
+        drop(guard);
+        self.writable.wake_all();
+        count
+    }
+
+    /// Copy up to `max` bytes straight from this ring into `sink`'s ring,
+    /// consuming them here unless this is a `tee`.
+    fn transfer(&self, sink: &PipeInner, max: usize, consume: bool) -> usize {
+        let read_guard = self.read_lock.lock();
+        let write_guard = sink.write_lock.lock();
+        let (from, to) = (self.ring(), sink.ring());
+
+        let head = self.head.load(Ordering::Relaxed);
+        let available = self.tail.load(Ordering::Acquire).wrapping_sub(head);
+        let tail = sink.tail.load(Ordering::Relaxed);
+        let room = to.capacity - tail.wrapping_sub(sink.head.load(Ordering::Acquire));
+        let count = max.min(available).min(room);
+        if count == 0 {
+            return 0;
+        }
+
+        unsafe {
+            let (first, second) = from.slices(head, count);
+            to.copy_in(tail, first);
+            to.copy_in(tail.wrapping_add(first.len()), second);
+        }
+        sink.tail.store(tail.wrapping_add(count), Ordering::Release);
+        if consume {
+            self.head.store(head.wrapping_add(count), Ordering::Release);
+        }
+        drop(write_guard);
+        drop(read_guard);
+
+        sink.readable.wake_all();
+        if consume {
+            self.writable.wake_all();
+        }
+        count
+    }
+
+    fn resize(&self, requested: usize) -> Result<usize, PipeResizeError> {
+        if requested > PIPE_MAX_SIZE {
+            return Err(PipeResizeError::TooLarge);
+        }
+        let capacity = requested.max(PIPE_PAGE_SIZE).next_power_of_two();
+
+        let _read = self.read_lock.lock();
+        let _write = self.write_lock.lock();
+        let old = self.ring();
+        if capacity == old.capacity {
+            return Ok(capacity);
+        }
+
+        let head = self.head.load(Ordering::Relaxed);
+        let len = self.tail.load(Ordering::Relaxed).wrapping_sub(head);
+        if len > capacity {
+            return Err(PipeResizeError::Busy);
+        }
+
+        // Repack the contents at position 0 of the new ring
+        let new = Ring::allocate(capacity);
+        unsafe {
+            old.copy_out(head, core::slice::from_raw_parts_mut(new.data, len));
+            *self.ring.get() = new;
+            old.free();
+        }
+        self.head.store(0, Ordering::Release);
+        self.tail.store(len, Ordering::Release);
+        Ok(capacity)
+    }
+}
+
+impl Drop for PipeInner {
+    fn drop(&mut self) {
+        unsafe { self.ring().free() };
+    }
+}
+
+#[derive(Debug)]
+pub struct PipeEnd {
+    inner: Arc<PipeInner>,
+    kind: PipeEndKind,
+}
+
+impl PipeEnd {
+    pub fn new_pair() -> (Self, Self) {
+        let inner = Arc::new(PipeInner::new(PIPE_DEFAULT_SIZE));
+
+        let read_end = PipeEnd {
+            inner: Arc::clone(&inner),
+            kind: PipeEndKind::Read,
+        };
+
+        let write_end = PipeEnd {
+            inner,
+            kind: PipeEndKind::Write,
+        };
+
+        (read_end, write_end)
+    }
+
+    pub fn kind(&self) -> PipeEndKind {
+        self.kind
+    }
+
+    /// Bytes currently buffered.
+    pub fn len(&self) -> usize {
+        self.inner.len()
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.inner.capacity()
+    }
+
+    /// Resize the ring (`F_SETPIPE_SZ`). The request is rounded up to a
+    /// power of two of at least one page; the new capacity is returned.
+    pub fn set_capacity(&self, bytes: usize) -> Result<usize, PipeResizeError> {
+        self.inner.resize(bytes)
+    }
+
+    /// Read what is buffered without sleeping. `Ok(0)` is end of file:
+    /// empty with every write end closed.
+    pub fn try_read(&self, dst: &mut [u8]) -> Result<usize, PipeError> {
+        self.try_read_vectored(&mut [dst])
+    }
+
+    /// Read at least one byte, sleeping while the pipe is empty and a
+    /// writer remains.
+    pub fn read(&self, dst: &mut [u8]) -> Result<usize, PipeError> {
+        self.read_vectored(&mut [dst])
+    }
+
+    /// Write as much as fits without sleeping.
+    pub fn try_write(&self, src: &[u8]) -> Result<usize, PipeError> {
+        self.try_write_vectored(&[src])
+    }
+
+    /// Write all of `src`, sleeping while the pipe is full. Stops early
+    /// only if the last reader goes away, returning what was written.
+    pub fn write(&self, src: &[u8]) -> Result<usize, PipeError> {
+        self.write_vectored(&[src])
+    }
+
+    /// `try_read` scattering into several buffers, filled in order.
+    pub fn try_read_vectored(&self, dst: &mut [&mut [u8]]) -> Result<usize, PipeError> {
+        if self.kind != PipeEndKind::Read {
+            return Err(PipeError::WrongEnd);
+        }
+        if dst.iter().all(|buf| buf.is_empty()) {
+            return Ok(0);
+        }
+
+        match self.inner.read(dst) {
+            0 if self.inner.writers.load(Ordering::Acquire) != 0 => Err(PipeError::WouldBlock),
+            count => Ok(count),
+        }
+    }
+
+    pub fn read_vectored(&self, dst: &mut [&mut [u8]]) -> Result<usize, PipeError> {
+        self.inner.readable.wait_until(|| match self.try_read_vectored(dst) {
+            Err(PipeError::WouldBlock) => None,
+            result => Some(result),
+        })
+    }
+
+    /// `try_write` gathering from several buffers. What fits is appended
+    /// as one unit, so a reader never sees part of a header without the
+    /// payload that was queued with it.
+    pub fn try_write_vectored(&self, src: &[&[u8]]) -> Result<usize, PipeError> {
+        self.try_write_from(src, 0)
+    }
+
+    pub fn write_vectored(&self, src: &[&[u8]]) -> Result<usize, PipeError> {
+        let total: usize = src.iter().map(|buf| buf.len()).sum();
+        let mut written = 0;
+        while written < total {
+            let result = self.inner.writable.wait_until(|| match self.try_write_from(src, written) {
+                Err(PipeError::WouldBlock) => None,
+                result => Some(result),
+            });
+            match result {
+                Ok(count) => written += count,
+                Err(_) if written > 0 => break,
+                Err(err) => return Err(err),
+            }
+        }
+        Ok(written)
+    }
+
+    fn try_write_from(&self, src: &[&[u8]], skip: usize) -> Result<usize, PipeError> {
+        if self.kind != PipeEndKind::Write {
+            return Err(PipeError::WrongEnd);
+        }
+        if self.inner.readers.load(Ordering::Acquire) == 0 {
+            return Err(PipeError::BrokenPipe);
+        }
+        if src.iter().map(|buf| buf.len()).sum::<usize>() <= skip {
+            return Ok(0);
+        }
+
+        match self.inner.write(src, skip) {
+            0 => Err(PipeError::WouldBlock),
+            count => Ok(count),
+        }
+    }
+}
+
+impl PipeEnd {
+    fn writers_gone(&self) -> bool {
+        self.inner.writers.load(Ordering::Acquire) == 0
+    }
+
+    /// Consume up to `max` bytes into `sink` without sleeping. `Ok(0)` is
+    /// end of file. Used to splice into the console.
+    pub fn try_consume_with(&self, max: usize, sink: impl FnMut(&[u8])) -> Result<usize, PipeError> {
+        if self.kind != PipeEndKind::Read {
+            return Err(PipeError::WrongEnd);
+        }
+        if max == 0 {
+            return Ok(0);
+        }
+
+        match self.inner.consume_with(max, sink) {
+            0 if !self.writers_gone() => Err(PipeError::WouldBlock),
+            count => Ok(count),
+        }
+    }
+
+    /// `try_consume_with`, sleeping while the pipe is empty and a writer
+    /// remains.
+    pub fn consume_with(&self, max: usize, mut sink: impl FnMut(&[u8])) -> Result<usize, PipeError> {
+        self.inner.readable.wait_until(|| match self.try_consume_with(max, &mut sink) {
+            Err(PipeError::WouldBlock) => None,
+            result => Some(result),
+        })
+    }
+
+    /// Move up to `len` bytes from this read end into the write end `out`
+    /// with a single ring-to-ring copy (`splice`). Does not sleep.
+    pub fn try_splice_to(&self, out: &PipeEnd, len: usize) -> Result<usize, PipeError> {
+        self.try_transfer(out, len, true)
+    }
+
+    /// Copy up to `len` bytes into `out` without consuming them here
+    /// (`tee`). Does not sleep.
+    pub fn try_tee_to(&self, out: &PipeEnd, len: usize) -> Result<usize, PipeError> {
+        self.try_transfer(out, len, false)
+    }
+
+    /// `try_splice_to`, sleeping until data and room are both available.
+    pub fn splice_to(&self, out: &PipeEnd, len: usize) -> Result<usize, PipeError> {
+        self.transfer(out, len, true)
+    }
+
+    /// `try_tee_to`, sleeping until data and room are both available.
+    pub fn tee_to(&self, out: &PipeEnd, len: usize) -> Result<usize, PipeError> {
+        self.transfer(out, len, false)
+    }
+
+    fn try_transfer(&self, out: &PipeEnd, len: usize, consume: bool) -> Result<usize, PipeError> {
+        if self.kind != PipeEndKind::Read || out.kind != PipeEndKind::Write {
+            return Err(PipeError::WrongEnd);
+        }
+        if Arc::ptr_eq(&self.inner, &out.inner) {
+            return Err(PipeError::SamePipe);
+        }
+        if out.inner.readers.load(Ordering::Acquire) == 0 {
+            return Err(PipeError::BrokenPipe);
+        }
+        if len == 0 {
+            return Ok(0);
+        }
+
+        match self.inner.transfer(&out.inner, len, consume) {
+            0 if self.len() == 0 && self.writers_gone() => Ok(0),
+            0 => Err(PipeError::WouldBlock),
+            count => Ok(count),
+        }
+    }
+
+    fn transfer(&self, out: &PipeEnd, len: usize, consume: bool) -> Result<usize, PipeError> {
+        loop {
+            match self.try_transfer(out, len, consume) {
+                Err(PipeError::WouldBlock) => {}
+                result => return result,
+            }
+
+            // Sleep on whichever side is holding us up, then retry
+            if self.len() == 0 {
+                self.inner
+                    .readable
+                    .wait_until(|| (self.len() != 0 || self.writers_gone()).then_some(()));
+            } else {
+                out.inner.writable.wait_until(|| {
+                    let closed = out.inner.readers.load(Ordering::Acquire) == 0;
+                    (out.inner.has_room() || closed).then_some(())
+                });
+            }
+        }
+    }
+}
+
+impl Clone for PipeEnd {
+    fn clone(&self) -> Self {
+        match self.kind {
+            PipeEndKind::Read => self.inner.readers.fetch_add(1, Ordering::Relaxed),
+            PipeEndKind::Write => self.inner.writers.fetch_add(1, Ordering::Relaxed),
+        };
+
+        PipeEnd {
+            inner: Arc::clone(&self.inner),
+            kind: self.kind,
+        }
+    }
+}
+
+impl Drop for PipeEnd {
+    fn drop(&mut self) {
+        // The last end of one side wakes the other for EOF / EPIPE
+        match self.kind {
+            PipeEndKind::Read => {
+                if self.inner.readers.fetch_sub(1, Ordering::AcqRel) == 1 {
+                    self.inner.writable.wake_all();
+                }
+            }
+            PipeEndKind::Write => {
+                if self.inner.writers.fetch_sub(1, Ordering::AcqRel) == 1 {
+                    self.inner.readable.wake_all();
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::vec::Vec;
+
+    #[test]
+    fn test_bulk_copy_wraps_around() {
+        let (read_end, write_end) = PipeEnd::new_pair();
+        write_end.set_capacity(PIPE_PAGE_SIZE).unwrap();
+
+        let chunk: Vec<u8> = (0..3000u32).map(|i| i as u8).collect();
+        let mut out = vec![0u8; 3000];
+        for _ in 0..5 {
+            assert_eq!(write_end.try_write(&chunk), Ok(3000));
+            assert_eq!(read_end.try_read(&mut out), Ok(3000));
+            assert_eq!(out, chunk);
+        }
+
+        // Full pipe takes a short write, then nothing
+        assert_eq!(write_end.try_write(&[1u8; 5000]), Ok(PIPE_PAGE_SIZE));
+        assert_eq!(write_end.try_write(&[1u8]), Err(PipeError::WouldBlock));
+        assert_eq!(read_end.try_read(&mut out), Ok(3000));
+        assert_eq!(read_end.try_read(&mut out), Ok(PIPE_PAGE_SIZE - 3000));
+        assert_eq!(read_end.try_read(&mut out), Err(PipeError::WouldBlock));
+    }
+
+    #[test]
+    fn test_vectored_io() {
+        let (read_end, write_end) = PipeEnd::new_pair();
+        write_end.set_capacity(PIPE_PAGE_SIZE).unwrap();
+
+        // Start near the end of the ring so the gathered write wraps
+        let filler = [0u8; PIPE_PAGE_SIZE - 10];
+        write_end.try_write(&filler).unwrap();
+        read_end.try_read(&mut [0u8; PIPE_PAGE_SIZE]).unwrap();
+
+        let header = *b"HDR:";
+        let payload = [7u8; 20];
+        let iov: [&[u8]; 3] = [&header, &[], &payload];
+        assert_eq!(write_end.try_write_vectored(&iov), Ok(24));
+
+        let mut head = [0u8; 4];
+        let mut body = [0u8; 16];
+        let mut rest = [0u8; 16];
+        assert_eq!(read_end.try_read_vectored(&mut [&mut head, &mut body, &mut rest]), Ok(24));
+        assert_eq!(&head, b"HDR:");
+        assert_eq!(body, [7u8; 16]);
+        assert_eq!(rest[..4], [7u8; 4]);
+
+        // A short gathered write resumes mid-buffer
+        write_end.try_write(&filler).unwrap();
+        let room = PIPE_PAGE_SIZE - filler.len();
+        assert_eq!(write_end.try_write_vectored(&iov), Ok(room));
+        assert_eq!(write_end.try_write_from(&iov, room), Err(PipeError::WouldBlock));
+        read_end.try_read(&mut [0u8; PIPE_PAGE_SIZE]).unwrap();
+        assert_eq!(write_end.try_write_from(&iov, room), Ok(24 - room));
+        assert_eq!(read_end.try_read(&mut rest), Ok(24 - room));
+        assert_eq!(rest[..24 - room], payload[room - 4..]);
+    }
+
+    #[test]
+    fn test_eof_and_broken_pipe() {
+        let (read_end, write_end) = PipeEnd::new_pair();
+        let mut out = [0u8; 16];
+        assert_eq!(read_end.try_write(b"x"), Err(PipeError::WrongEnd));
+
+        // Buffered data is still delivered after the writer closes
+        assert_eq!(write_end.write(b"bye"), Ok(3));
+        let second_writer = write_end.clone();
+        drop(write_end);
+        assert_eq!(read_end.read(&mut out), Ok(3));
+        assert_eq!(read_end.try_read(&mut out), Err(PipeError::WouldBlock));
+        drop(second_writer);
+        assert_eq!(read_end.read(&mut out), Ok(0));
+
+        let (read_end, write_end) = PipeEnd::new_pair();
+        drop(read_end);
+        assert_eq!(write_end.write(b"lost"), Err(PipeError::BrokenPipe));
+    }
+
+    #[test]
+    fn test_splice_and_tee() {
+        let (in_read, in_write) = PipeEnd::new_pair();
+        let (out_read, out_write) = PipeEnd::new_pair();
+        let (copy_read, copy_write) = PipeEnd::new_pair();
+        out_write.set_capacity(PIPE_PAGE_SIZE).unwrap();
+
+        // Wrap the source ring so the copy spans both of its slices
+        let data: Vec<u8> = (0..6000u32).map(|i| (i % 253) as u8).collect();
+        in_write.set_capacity(8192).unwrap();
+        in_write.try_write(&[0u8; 5000]).unwrap();
+        in_read.try_read(&mut [0u8; 5000]).unwrap();
+        assert_eq!(in_write.try_write(&data), Ok(6000));
+
+        assert_eq!(in_read.try_tee_to(&copy_write, 10000), Ok(6000));
+        assert_eq!(in_read.len(), 6000);
+
+        // The sink only has room for one page
+        assert_eq!(in_read.try_splice_to(&out_write, 10000), Ok(PIPE_PAGE_SIZE));
+        assert_eq!(in_read.try_splice_to(&out_write, 10000), Err(PipeError::WouldBlock));
+        let mut out = vec![0u8; 6000];
+        assert_eq!(out_read.try_read(&mut out), Ok(PIPE_PAGE_SIZE));
+        assert_eq!(in_read.splice_to(&out_write, 10000), Ok(6000 - PIPE_PAGE_SIZE));
+        out_read.try_read(&mut out[PIPE_PAGE_SIZE..]).unwrap();
+        assert_eq!(out, data);
+
+        let mut copy = vec![0u8; 6000];
+        assert_eq!(copy_read.try_read(&mut copy), Ok(6000));
+        assert_eq!(copy, data);
+
+        assert_eq!(in_read.try_splice_to(&in_write, 1), Err(PipeError::SamePipe));
+        assert_eq!(out_write.try_splice_to(&in_write, 1), Err(PipeError::WrongEnd));
+        drop(in_write);
+        assert_eq!(in_read.splice_to(&out_write, 1), Ok(0));
+        drop(out_read);
+        assert_eq!(copy_read.try_splice_to(&out_write, 1), Err(PipeError::BrokenPipe));
+    }
+
+    #[test]
+    fn test_consume_with() {
+        let (read_end, write_end) = PipeEnd::new_pair();
+        write_end.set_capacity(PIPE_PAGE_SIZE).unwrap();
+        write_end.try_write(&[1u8; 3000]).unwrap();
+        read_end.try_read(&mut [0u8; 3000]).unwrap();
+        write_end.try_write(&[2u8; 2000]).unwrap();
+
+        let mut seen = Vec::new();
+        let mut calls = 0;
+        assert_eq!(read_end.try_consume_with(usize::MAX, |chunk| {
+            seen.extend_from_slice(chunk);
+            calls += 1;
+        }), Ok(2000));
+        assert_eq!(calls, 2);
+        assert_eq!(seen, vec![2u8; 2000]);
+        assert_eq!(read_end.try_consume_with(10, |_| ()), Err(PipeError::WouldBlock));
+    }
+
+    #[test]
+    fn test_set_capacity() {
+        let (read_end, write_end) = PipeEnd::new_pair();
+        assert_eq!(write_end.capacity(), PIPE_DEFAULT_SIZE);
+        assert_eq!(write_end.set_capacity(5000), Ok(8192));
+        assert_eq!(write_end.set_capacity(1), Ok(PIPE_PAGE_SIZE));
+        assert_eq!(write_end.set_capacity(PIPE_MAX_SIZE + 1), Err(PipeResizeError::TooLarge));
+
+        // Shrinking below the buffered data fails; growing keeps it in order
+        write_end.set_capacity(8192).unwrap();
+        let data: Vec<u8> = (0..6000u32).map(|i| (i * 7) as u8).collect();
+        let mut out = vec![0u8; 6000];
+        write_end.try_write(&data[..5000]).unwrap();
+        read_end.try_read(&mut out[..5000]).unwrap();
+        assert_eq!(write_end.try_write(&data), Ok(6000));
+        assert_eq!(read_end.set_capacity(4096), Err(PipeResizeError::Busy));
+        assert_eq!(read_end.set_capacity(65536), Ok(65536));
+        assert_eq!(read_end.len(), 6000);
+        assert_eq!(read_end.try_read(&mut out), Ok(6000));
+        assert_eq!(out, data);
+    }
+
+    #[test]
+    fn test_concurrent_producer_consumer() {
+        let (read_end, write_end) = PipeEnd::new_pair();
+        const TOTAL: usize = 1 << 20;
+
+        let producer = std::thread::spawn(move || {
+            let data: Vec<u8> = (0..TOTAL).map(|i| (i % 251) as u8).collect();
+            let mut sent = 0;
+            while sent < TOTAL {
+                sent += write_end.try_write(&data[sent..(sent + 1500).min(TOTAL)]).unwrap_or(0);
+                std::thread::yield_now();
+            }
+        });
+
+        let mut buf = [0u8; 4096];
+        let mut received = 0;
+        while received < TOTAL {
+            let n = read_end.try_read(&mut buf).unwrap_or(0);
+            for (i, byte) in buf[..n].iter().enumerate() {
+                assert_eq!(*byte, ((received + i) % 251) as u8);
+            }
+            received += n;
+            if n == 0 {
+                std::thread::yield_now();
+            }
+        }
+        producer.join().unwrap();
+    }
+
+    /// Moving data between two pipes with splice (one copy) against a
+    /// read into a user buffer and a write back out (two copies). Run with
+    /// `cargo test --release --lib pipe_splice_bench -- --ignored --nocapture`.
+    #[test]
+    #[ignore]
+    fn pipe_splice_bench() {
+        use std::time::Instant;
+
+        const CHUNK: usize = 64 * 1024;
+        const ROUNDS: usize = 16 * 1024;
+
+        let (in_read, in_write) = PipeEnd::new_pair();
+        let (out_read, out_write) = PipeEnd::new_pair();
+        let src = vec![0x5au8; CHUNK];
+        let mut user = vec![0u8; CHUNK];
+
+        let start = Instant::now();
+        for _ in 0..ROUNDS {
+            in_write.write(&src).unwrap();
+            let n = in_read.read(&mut user).unwrap();
+            out_write.write(&user[..n]).unwrap();
+            out_read.consume_with(CHUNK, |chunk| {
+                std::hint::black_box(chunk);
+            }).unwrap();
+        }
+        let copied = start.elapsed().as_secs_f64();
+
+        let start = Instant::now();
+        for _ in 0..ROUNDS {
+            in_write.write(&src).unwrap();
+            in_read.splice_to(&out_write, CHUNK).unwrap();
+            out_read.consume_with(CHUNK, |chunk| {
+                std::hint::black_box(chunk);
+            }).unwrap();
+        }
+        let spliced = start.elapsed().as_secs_f64();
+
+        let gib = (CHUNK * ROUNDS) as f64 / (1u64 << 30) as f64;
+        std::println!(
+            "pipe to pipe: read+write {:.2} GiB/s, splice {:.2} GiB/s",
+            gib / copied,
+            gib / spliced
+        );
+    }
+
+    /// Pipe throughput in 64 KiB chunks, for comparison against a plain
+    /// memcpy. Run with
+    /// `cargo test --release --lib pipe_throughput_bench -- --ignored --nocapture`.
+    #[test]
+    #[ignore]
+    fn pipe_throughput_bench() {
+        use std::time::Instant;
+
+        const CHUNK: usize = 64 * 1024;
+        const ROUNDS: usize = 16 * 1024;
+
+        let (read_end, write_end) = PipeEnd::new_pair();
+        let src = vec![0x5au8; CHUNK];
+        let mut dst = vec![0u8; CHUNK];
+
+        let start = Instant::now();
+        for _ in 0..ROUNDS {
+            assert_eq!(write_end.write(&src), Ok(CHUNK));
+            assert_eq!(read_end.read(&mut dst), Ok(CHUNK));
+        }
+        let pipe = start.elapsed().as_secs_f64();
+
+        let start = Instant::now();
+        for _ in 0..ROUNDS {
+            dst.copy_from_slice(std::hint::black_box(&src));
+            std::hint::black_box(&mut dst);
+        }
+        let memcpy = start.elapsed().as_secs_f64();
+
+        let gib = (CHUNK * ROUNDS) as f64 / (1u64 << 30) as f64;
+        std::println!(
+            "pipe {:.2} GiB/s, memcpy {:.2} GiB/s",
+            gib / pipe,
+            gib / memcpy
+        );
+    }
+}
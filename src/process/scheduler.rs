@@ -1,228 +1,805 @@
-use super::{ThreadId, Priority, ThreadState, THREAD_TABLE};
+//! Per-CPU thread scheduler.
+//!
+//! Every CPU owns a `Scheduler`: its own run queue, running thread, time
+//! slice and tick count. `schedule`, `tick`, `yield_cpu` and
+//! `current_thread` only touch the calling CPU's instance, so scheduling on
+//! one core never waits on another. A queue's lock is taken by other CPUs
+//! only to place a wakeup on it or to steal from it.
+//!
+//! There are two classes. `Priority::Realtime` threads are first in, first
+//! out: one runs until it blocks or yields, and it preempts fair threads at
+//! the next tick. Every other priority is fair-share: threads run in order
+//! of virtual runtime, which grows more slowly for heavier (higher
+//! priority) threads. A lower priority gets a smaller share of the CPU,
+//! but it is never starved. Fair slices divide `SCHED_LATENCY` between the
+//! queued threads by weight, so each one runs at least once per period.
+//!
+//! A CPU whose queue runs dry steals half of another CPU's queued threads
+//! in one batch. It tries the victim's lock once instead of spinning on
+//! it, and simply retries on a later `schedule`.
+//!
+//! Placement follows the topology in `cpu::topology`. A woken thread goes
+//! back to its previous CPU if that CPU is idle. Otherwise it goes to the
+//! nearest idle CPU: an SMT sibling, then the same package, then the same
+//! NUMA node. Stealing takes from the nearest CPU that has work, and it
+//! crosses nodes only for a queue worth the remote memory traffic.
+//!
+//! Every `BALANCE_INTERVAL` ticks, `periodic_balance` compares decayed
+//! queue lengths and moves half the gap from the busiest CPU to the least
+//! loaded one, so CPUs that never run dry still share the work. Moving
+//! threads can allocate, so this runs in thread context only, never from
+//! the timer interrupt.
+
+use super::{current, ThreadId, Priority, ThreadState, THREAD_TABLE};
+use crate::cpu::percpu::{get_cpu_manager, get_current_cpu_id, MAX_CPUS};
+use crate::cpu::topology::{self, Level};
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
 use spin::Mutex;
 
 #[cfg(not(test))]
-use alloc::collections::VecDeque;
+use alloc::collections::BTreeSet;
 
 #[cfg(test)]
 extern crate std;
 #[cfg(test)]
-use std::collections::VecDeque;
+use std::collections::BTreeSet;
+
+/// Most threads moved by one steal.
+pub const STEAL_BATCH: usize = 16;
+
+/// Ticks between periodic balancing passes.
+pub const BALANCE_INTERVAL: u64 = 4;
+
+/// Load averages are fixed point with this many fraction bits.
+const LOAD_SHIFT: u32 = 10;
+
+/// Ticks in which every queued fair thread should get to run once.
+pub const SCHED_LATENCY: u64 = 20;
+
+/// Shortest fair slice in ticks, so a crowded queue does not thrash.
+pub const MIN_GRANULARITY: u64 = 2;
+
+/// Virtual runtime a `Priority::Normal` thread accrues per tick.
+const TICK_VRUNTIME: u64 = 1 << 20;
+
+/// Most virtual runtime a waking thread keeps as credit for its sleep.
+const SLEEPER_CREDIT: u64 = SCHED_LATENCY * TICK_VRUNTIME / 2;
+
+const NORMAL_WEIGHT: u64 = 1024;
+
+/// Fair-class weight of a priority, five CFS nice steps apart (each step
+/// is about 1.25x), with `Idle` at nice 19.
+pub const fn weight(priority: Priority) -> u64 {
+    match priority {
+        Priority::Idle => 15,
+        Priority::Low => 335,
+        Priority::Normal => NORMAL_WEIGHT,
+        Priority::High | Priority::Realtime => 3121,
+    }
+}
+
+fn is_realtime(priority: Priority) -> bool {
+    priority == Priority::Realtime
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+enum Queued {
+    #[default]
+    No,
+    Realtime,
+    /// In the fair tree under this vruntime.
+    Fair(u64),
+}
 
+/// A thread's place in a run queue, kept in the thread itself so that no
+/// queue operation searches. Only the queue on `Thread::cpu` changes it,
+/// and only while holding that queue's lock.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct RunLink {
+    prev: Option<ThreadId>,
+    next: Option<ThreadId>,
+    queued: Queued,
+}
+
+impl RunLink {
+    pub fn is_queued(&self) -> bool {
+        self.queued != Queued::No
+    }
+}
+
+fn with_link<R>(tid: ThreadId, f: impl FnOnce(&mut RunLink) -> R) -> Option<R> {
+    THREAD_TABLE.with_thread_mut(tid, |thread| f(&mut thread.run_link))
+}
+
+/// Realtime FIFO linked through `Thread::run_link`.
+#[derive(Clone, Copy)]
+struct Fifo {
+    head: Option<ThreadId>,
+    tail: Option<ThreadId>,
+    len: usize,
+}
+
+/// Both classes for one CPU: the realtime FIFO, and the fair threads
+/// ordered by (vruntime, tid). Lock order is run queue, then thread
+/// table, never the reverse.
 pub struct RunQueue {
-    queues: [VecDeque<ThreadId>; 5],
-    current_thread: Option<ThreadId>,
+    cpu: u32,
+    realtime: Fifo,
+    fair: BTreeSet<(u64, usize)>,
+    /// Sum of the queued fair threads' weights.
+    fair_weight: u64,
+    /// Lower bound of every queued vruntime. It only moves forward, and new
+    /// and waking threads are placed relative to it.
+    min_vruntime: u64,
     idle_thread: Option<ThreadId>,
 }
 
 impl RunQueue {
     pub const fn new() -> Self {
+        Self::for_cpu(0)
+    }
+
+    pub const fn for_cpu(cpu: u32) -> Self {
         Self {
-            queues: [
-                VecDeque::new(),
-                VecDeque::new(),
-                VecDeque::new(),
-                VecDeque::new(),
-                VecDeque::new(),
-            ],
-            current_thread: None,
+            cpu,
+            realtime: Fifo { head: None, tail: None, len: 0 },
+            fair: BTreeSet::new(),
+            fair_weight: 0,
+            min_vruntime: 0,
             idle_thread: None,
         }
     }
 
-    pub fn enqueue(&mut self, tid: ThreadId, priority: Priority) {
-        let queue_idx = priority.as_usize();
-        if !self.queues[queue_idx].contains(&tid) {
-            self.queues[queue_idx].push_back(tid);
+    /// Queue `tid` in its class and make this CPU its home. Does nothing
+    /// and returns false if it is already queued anywhere.
+    pub fn enqueue(&mut self, tid: ThreadId, priority: Priority) -> bool {
+        let cpu = self.cpu;
+        let tail = self.realtime.tail;
+        let floor = self.min_vruntime.saturating_sub(SLEEPER_CREDIT);
+        let queued = THREAD_TABLE
+            .with_thread_mut(tid, |thread| {
+                if thread.run_link.is_queued() {
+                    return None;
+                }
+                thread.cpu = cpu;
+                thread.run_link = if is_realtime(priority) {
+                    RunLink { prev: tail, next: None, queued: Queued::Realtime }
+                } else {
+                    thread.vruntime = thread.vruntime.max(floor);
+                    RunLink { queued: Queued::Fair(thread.vruntime), ..RunLink::default() }
+                };
+                Some(thread.run_link.queued)
+            })
+            .flatten();
+
+        match queued {
+            Some(Queued::Realtime) => {
+                match tail {
+                    Some(tail) => {
+                        with_link(tail, |link| link.next = Some(tid));
+                    }
+                    None => self.realtime.head = Some(tid),
+                }
+                self.realtime.tail = Some(tid);
+                self.realtime.len += 1;
+            }
+            Some(Queued::Fair(vruntime)) => {
+                self.fair.insert((vruntime, tid.0));
+                self.fair_weight += weight(priority);
+            }
+            _ => return false,
         }
+        true
     }
 
-    pub fn dequeue(&mut self, priority: Priority) -> Option<ThreadId> {
-        let queue_idx = priority.as_usize();
-        self.queues[queue_idx].pop_front()
+    /// Next thread to run: the realtime head, else the fair thread with the
+    /// least vruntime. Does not fall back to idle.
+    pub fn pop_next(&mut self) -> Option<ThreadId> {
+        let tid = match self.realtime.head {
+            Some(tid) => tid,
+            None => ThreadId(self.fair.first()?.1),
+        };
+        self.remove(tid).then_some(tid)
     }
 
     pub fn pick_next(&mut self) -> Option<ThreadId> {
-        for i in (0..5).rev() {
-            if let Some(tid) = self.queues[i].pop_front() {
-                return Some(tid);
+        self.pop_next().or(self.idle_thread)
+    }
+
+    pub fn set_idle_thread(&mut self, tid: ThreadId) {
+        self.idle_thread = Some(tid);
+    }
+
+    pub fn idle_thread(&self) -> Option<ThreadId> {
+        self.idle_thread
+    }
+
+    /// Unlink `tid` if this queue holds it.
+    pub fn remove(&mut self, tid: ThreadId) -> bool {
+        let cpu = self.cpu;
+        let taken = THREAD_TABLE
+            .with_thread_mut(tid, |thread| {
+                (thread.run_link.is_queued() && thread.cpu == cpu)
+                    .then(|| (core::mem::take(&mut thread.run_link), thread.priority))
+            })
+            .flatten();
+        let Some((link, priority)) = taken else {
+            return false;
+        };
+
+        match link.queued {
+            Queued::Realtime => {
+                match link.prev {
+                    Some(prev) => {
+                        with_link(prev, |prev| prev.next = link.next);
+                    }
+                    None => self.realtime.head = link.next,
+                }
+                match link.next {
+                    Some(next) => {
+                        with_link(next, |next| next.prev = link.prev);
+                    }
+                    None => self.realtime.tail = link.prev,
+                }
+                self.realtime.len -= 1;
+            }
+            Queued::Fair(vruntime) => {
+                self.fair.remove(&(vruntime, tid.0));
+                self.fair_weight -= weight(priority);
+                if let Some(&(leftmost, _)) = self.fair.first() {
+                    self.min_vruntime = self.min_vruntime.max(leftmost.min(vruntime));
+                } else {
+                    self.min_vruntime = self.min_vruntime.max(vruntime);
+                }
             }
+            Queued::No => {}
         }
-        
-        self.idle_thread
+        true
     }
 
-    pub fn set_current(&mut self, tid: Option<ThreadId>) {
-        self.current_thread = tid;
+    /// Ticks a thread of `priority` may run before the queue is looked at
+    /// again. Realtime threads run until they block or yield. Fair threads
+    /// get their weight's share of `SCHED_LATENCY` against what is queued.
+    pub fn time_slice(&self, priority: Priority) -> usize {
+        if is_realtime(priority) {
+            return usize::MAX;
+        }
+        let weight = weight(priority);
+        let share = SCHED_LATENCY * weight / (self.fair_weight + weight);
+        share.max(MIN_GRANULARITY) as usize
     }
 
-    pub fn current(&self) -> Option<ThreadId> {
-        self.current_thread
+    pub fn len(&self) -> usize {
+        self.realtime.len + self.fair.len()
     }
 
-    pub fn set_idle_thread(&mut self, tid: ThreadId) {
-        self.idle_thread = Some(tid);
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    pub fn realtime_len(&self) -> usize {
+        self.realtime.len
     }
 
-    pub fn remove(&mut self, tid: ThreadId) {
-        for queue in &mut self.queues {
-            queue.retain(|&t| t != tid);
+    /// Move up to half of `victim`'s queued threads here, at most `max`.
+    /// Realtime threads go first, then the fair threads that would wait
+    /// longest there. A moved thread keeps its vruntime lead or lag
+    /// relative to the queue it left. Returns how many moved.
+    pub fn steal_from(&mut self, victim: &mut RunQueue, max: usize) -> usize {
+        let want = ((victim.len() + 1) / 2).min(max);
+        let mut moved = 0;
+        while moved < want {
+            let tid = match victim.realtime.tail {
+                Some(tid) => tid,
+                None => match victim.fair.last() {
+                    Some(&(_, tid)) => ThreadId(tid),
+                    None => break,
+                },
+            };
+            if !victim.remove(tid) {
+                break;
+            }
+            let (from, to) = (victim.min_vruntime, self.min_vruntime);
+            let priority = THREAD_TABLE.with_thread_mut(tid, |thread| {
+                thread.vruntime = thread.vruntime.saturating_sub(from) + to;
+                thread.priority
+            });
+            if let Some(priority) = priority {
+                self.enqueue(tid, priority);
+            }
+            moved += 1;
         }
+        moved
     }
 }
 
+/// Virtual runtime one tick adds for a fair thread of `priority`.
+fn vruntime_delta(priority: Priority) -> u64 {
+    TICK_VRUNTIME * NORMAL_WEIGHT / weight(priority)
+}
+
+/// One CPU's scheduling state. Only `run_queue` is locked; the rest is
+/// written by the owning CPU alone and read lock-free.
 pub struct Scheduler {
-    run_queue: RunQueue,
-    time_slice_remaining: usize,
-    total_ticks: u64,
+    cpu: u32,
+    run_queue: Mutex<RunQueue>,
+    /// Length of `run_queue`, readable without its lock to pick victims.
+    queued: AtomicUsize,
+    /// Realtime threads in `run_queue`; a fair thread yields to them.
+    realtime_queued: AtomicUsize,
+    /// Running thread id, 0 when none.
+    current: AtomicUsize,
+    /// This CPU's idle thread, 0 when none.
+    idle: AtomicUsize,
+    time_slice_remaining: AtomicUsize,
+    total_ticks: AtomicU64,
+    /// Decayed queue length, `LOAD_SHIFT` fixed point; `rebalance` keeps it.
+    load: AtomicU64,
 }
 
 impl Scheduler {
     pub const fn new() -> Self {
+        Self::for_cpu(0)
+    }
+
+    pub const fn for_cpu(cpu: u32) -> Self {
         Self {
-            run_queue: RunQueue::new(),
-            time_slice_remaining: 0,
-            total_ticks: 0,
+            cpu,
+            run_queue: Mutex::new(RunQueue::for_cpu(cpu)),
+            queued: AtomicUsize::new(0),
+            realtime_queued: AtomicUsize::new(0),
+            current: AtomicUsize::new(0),
+            idle: AtomicUsize::new(0),
+            time_slice_remaining: AtomicUsize::new(0),
+            total_ticks: AtomicU64::new(0),
+            load: AtomicU64::new(0),
         }
     }
 
-    pub fn add_thread(&mut self, tid: ThreadId) {
-        let thread_table = THREAD_TABLE.lock();
-        if let Some(thread) = thread_table.get_thread(tid) {
-            if thread.is_runnable() {
-                self.run_queue.enqueue(tid, thread.priority);
-            }
+    pub fn cpu(&self) -> u32 {
+        self.cpu
+    }
+
+    /// Threads waiting in this CPU's queue.
+    pub fn queued(&self) -> usize {
+        self.queued.load(Ordering::Relaxed)
+    }
+
+    fn load(&self) -> u64 {
+        self.load.load(Ordering::Relaxed)
+    }
+
+    fn with_queue<R>(&self, f: impl FnOnce(&mut RunQueue) -> R) -> R {
+        let mut run_queue = self.run_queue.lock();
+        let result = f(&mut run_queue);
+        self.publish_len(&run_queue);
+        result
+    }
+
+    fn publish_len(&self, run_queue: &RunQueue) {
+        self.queued.store(run_queue.len(), Ordering::Relaxed);
+        self.realtime_queued.store(run_queue.realtime_len(), Ordering::Relaxed);
+    }
+
+    fn enqueue(&self, tid: ThreadId, priority: Priority) {
+        self.with_queue(|run_queue| run_queue.enqueue(tid, priority));
+    }
+
+    pub fn add_thread(&self, tid: ThreadId) {
+        let runnable = THREAD_TABLE
+            .with_thread(tid, |thread| thread.is_runnable().then_some(thread.priority))
+            .flatten();
+        if let Some(priority) = runnable {
+            self.enqueue(tid, priority);
         }
     }
 
-    pub fn remove_thread(&mut self, tid: ThreadId) {
-        self.run_queue.remove(tid);
+    /// Take `tid` off this CPU's queue; false if it is not queued here.
+    pub fn remove_thread(&self, tid: ThreadId) -> bool {
+        self.with_queue(|run_queue| run_queue.remove(tid))
     }
 
-    pub fn set_idle_thread(&mut self, tid: ThreadId) {
-        self.run_queue.set_idle_thread(tid);
+    pub fn set_idle_thread(&self, tid: ThreadId) {
+        self.run_queue.lock().set_idle_thread(tid);
+        self.idle.store(tid.0, Ordering::Relaxed);
+    }
+
+    /// Nothing queued and nothing but the idle thread running, read without
+    /// the queue lock.
+    pub fn is_idle(&self) -> bool {
+        let current = self.current.load(Ordering::Relaxed);
+        self.queued() == 0 && (current == 0 || current == self.idle.load(Ordering::Relaxed))
+    }
+
+    /// Mark `tid` running here and return its priority, or `None` if it is
+    /// no longer ready (it exited while it sat in the queue).
+    fn claim(&self, tid: ThreadId) -> Option<Priority> {
+        THREAD_TABLE
+            .with_thread_mut(tid, |thread| {
+                if thread.state != ThreadState::Ready {
+                    return None;
+                }
+                thread.set_state(ThreadState::Running);
+                thread.cpu = self.cpu;
+                Some(thread.priority)
+            })
+            .flatten()
     }
 
-    pub fn schedule(&mut self) -> Option<ThreadId> {
-        let current = self.run_queue.current();
-        
-        if self.time_slice_remaining > 0 {
+    pub fn schedule(&self) -> Option<ThreadId> {
+        let current = self.current_thread();
+
+        if self.time_slice_remaining.load(Ordering::Relaxed) > 0 {
             if let Some(current_tid) = current {
-                let thread_table = THREAD_TABLE.lock();
-                if let Some(thread) = thread_table.get_thread(current_tid) {
-                    if thread.state == ThreadState::Running && thread.is_runnable() {
-                        return Some(current_tid);
-                    }
+                let realtime_waiting = self.realtime_queued.load(Ordering::Relaxed) > 0;
+                let still_running = THREAD_TABLE.with_thread(current_tid, |thread| {
+                    thread.state == ThreadState::Running
+                        && thread.is_runnable()
+                        && (is_realtime(thread.priority) || !realtime_waiting)
+                });
+                if still_running == Some(true) {
+                    return Some(current_tid);
                 }
             }
         }
 
         if let Some(current_tid) = current {
-            let mut thread_table = THREAD_TABLE.lock();
-            if let Some(thread) = thread_table.get_thread_mut(current_tid) {
-                if thread.state == ThreadState::Running {
-                    thread.set_state(ThreadState::Ready);
-                    self.run_queue.enqueue(current_tid, thread.priority);
-                }
+            let preempted = THREAD_TABLE
+                .with_thread_mut(current_tid, |thread| {
+                    if thread.state == ThreadState::Running {
+                        thread.set_state(ThreadState::Ready);
+                        Some(thread.priority)
+                    } else {
+                        None
+                    }
+                })
+                .flatten();
+            if let Some(priority) = preempted {
+                // The idle thread is the fallback, not a queue entry
+                self.with_queue(|run_queue| {
+                    if run_queue.idle_thread() != Some(current_tid) {
+                        run_queue.enqueue(current_tid, priority);
+                    }
+                });
             }
         }
 
-        let next_tid = self.run_queue.pick_next()?;
-        
-        let mut thread_table = THREAD_TABLE.lock();
-        if let Some(thread) = thread_table.get_thread_mut(next_tid) {
-            thread.set_state(ThreadState::Running);
-            self.time_slice_remaining = thread.time_slice;
-        }
+        let (next_tid, time_slice) = self.with_queue(|run_queue| loop {
+            let tid = match run_queue.pop_next() {
+                Some(tid) => tid,
+                None => {
+                    let idle = run_queue.idle_thread()?;
+                    let priority = self.claim(idle)?;
+                    break Some((idle, run_queue.time_slice(priority)));
+                }
+            };
+            if let Some(priority) = self.claim(tid) {
+                break Some((tid, run_queue.time_slice(priority)));
+            }
+        })?;
 
-        self.run_queue.set_current(Some(next_tid));
+        self.time_slice_remaining.store(time_slice, Ordering::Relaxed);
+        self.current.store(next_tid.0, Ordering::Relaxed);
+        current::set_current_thread(Some(next_tid));
         Some(next_tid)
     }
 
-    pub fn tick(&mut self) {
-        self.total_ticks += 1;
-        
-        if self.time_slice_remaining > 0 {
-            self.time_slice_remaining -= 1;
+    /// Nothing queued here and the running thread, if any, has used its
+    /// slice: the next `schedule` would idle.
+    pub fn needs_work(&self) -> bool {
+        self.queued() == 0
+            && (self.current_thread().is_none()
+                || self.time_slice_remaining.load(Ordering::Relaxed) == 0)
+    }
+
+    pub fn tick(&self) {
+        self.total_ticks.fetch_add(1, Ordering::Relaxed);
+
+        let remaining = self.time_slice_remaining.load(Ordering::Relaxed);
+        if remaining > 0 {
+            self.time_slice_remaining.store(remaining - 1, Ordering::Relaxed);
         }
 
-        if let Some(current_tid) = self.run_queue.current() {
-            let mut thread_table = THREAD_TABLE.lock();
-            if let Some(thread) = thread_table.get_thread_mut(current_tid) {
+        if let Some(current_tid) = self.current_thread() {
+            THREAD_TABLE.with_thread_mut(current_tid, |thread| {
                 thread.increment_cpu_time(1);
-            }
+                if !is_realtime(thread.priority) {
+                    thread.vruntime += vruntime_delta(thread.priority);
+                }
+            });
         }
     }
 
-    pub fn yield_current(&mut self) {
-        self.time_slice_remaining = 0;
+    pub fn yield_current(&self) {
+        self.time_slice_remaining.store(0, Ordering::Relaxed);
     }
 
-    pub fn block_current(&mut self) {
-        if let Some(current_tid) = self.run_queue.current() {
-            let mut thread_table = THREAD_TABLE.lock();
-            if let Some(thread) = thread_table.get_thread_mut(current_tid) {
-                thread.set_state(ThreadState::Blocked);
+    pub fn block_current(&self) {
+        if let Some(current_tid) = self.current_thread() {
+            let blocked = THREAD_TABLE
+                .with_thread_mut(current_tid, |thread| {
+                    if core::mem::take(&mut thread.wake_pending) {
+                        false
+                    } else {
+                        thread.set_state(ThreadState::Blocked);
+                        true
+                    }
+                })
+                .unwrap_or(true);
+            if !blocked {
+                return;
             }
-            self.run_queue.set_current(None);
+            self.current.store(0, Ordering::Relaxed);
+            current::set_current_thread(None);
         }
     }
 
-    pub fn unblock_thread(&mut self, tid: ThreadId) {
-        let mut thread_table = THREAD_TABLE.lock();
-        if let Some(thread) = thread_table.get_thread_mut(tid) {
-            if thread.state == ThreadState::Blocked {
-                thread.set_state(ThreadState::Ready);
-                self.run_queue.enqueue(tid, thread.priority);
-            }
+    /// Wake `tid` onto this CPU's queue.
+    pub fn unblock_thread(&self, tid: ThreadId) {
+        if let Some((priority, _)) = wake(tid) {
+            self.enqueue(tid, priority);
         }
     }
 
     pub fn current_thread(&self) -> Option<ThreadId> {
-        self.run_queue.current()
+        match self.current.load(Ordering::Relaxed) {
+            0 => None,
+            tid => Some(ThreadId(tid)),
+        }
     }
 
     pub fn total_ticks(&self) -> u64 {
-        self.total_ticks
+        self.total_ticks.load(Ordering::Relaxed)
+    }
+
+    #[cfg(test)]
+    fn reset(&self) {
+        *self.run_queue.lock() = RunQueue::for_cpu(self.cpu);
+        self.queued.store(0, Ordering::Relaxed);
+        self.realtime_queued.store(0, Ordering::Relaxed);
+        self.current.store(0, Ordering::Relaxed);
+        self.idle.store(0, Ordering::Relaxed);
+        self.time_slice_remaining.store(0, Ordering::Relaxed);
+        self.total_ticks.store(0, Ordering::Relaxed);
+        self.load.store(0, Ordering::Relaxed);
+    }
+}
+
+/// Move a blocked thread to `Ready` and return its priority and the CPU it
+/// last ran on. A thread that has not gone to sleep yet gets `wake_pending`
+/// instead, which makes its next block a no-op.
+fn wake(tid: ThreadId) -> Option<(Priority, u32)> {
+    THREAD_TABLE
+        .with_thread_mut(tid, |thread| match thread.state {
+            ThreadState::Blocked => {
+                thread.set_state(ThreadState::Ready);
+                Some((thread.priority, thread.cpu))
+            }
+            ThreadState::Running | ThreadState::Ready => {
+                thread.wake_pending = true;
+                None
+            }
+            _ => None,
+        })
+        .flatten()
+}
+
+/// Refill `thief` from the nearest CPU with queued threads, taking the
+/// busiest one when several are equally near. A CPU on another NUMA node
+/// counts only if it has at least two threads queued. Returns how many
+/// threads moved; 0 if there was nothing to take or the victim was locked
+/// at that moment.
+pub fn steal_work(thief: &Scheduler, cpus: &[Scheduler]) -> usize {
+    let victim = cpus
+        .iter()
+        .filter(|victim| victim.cpu != thief.cpu && victim.queued() > 0)
+        .map(|victim| (topology::shared_level(thief.cpu, victim.cpu), victim))
+        .filter(|&(level, victim)| level < Level::System || victim.queued() >= 2)
+        .min_by_key(|&(level, victim)| (level, usize::MAX - victim.queued()));
+    let Some((_, victim)) = victim else {
+        return 0;
+    };
+
+    // Own queue first, victim only if free: two CPUs stealing from each
+    // other fail their try_lock instead of deadlocking.
+    let mut run_queue = thief.run_queue.lock();
+    let Some(mut victim_queue) = victim.run_queue.try_lock() else {
+        return 0;
+    };
+    let moved = run_queue.steal_from(&mut victim_queue, STEAL_BATCH);
+    victim.publish_len(&victim_queue);
+    thief.publish_len(&run_queue);
+    moved
+}
+
+/// Periodic pass over `cpus`. Decays each CPU's load average, then moves
+/// half the gap between the busiest CPU and the least loaded one, at most
+/// `STEAL_BATCH` threads, taking the ones that would wait longest. A target
+/// on another NUMA node needs a gap of two threads, like a remote steal,
+/// and loses to any target nearer the busiest CPU. Returns how many
+/// threads moved; 0 if nothing was worth moving or the busiest queue was
+/// locked at that moment.
+pub fn rebalance(cpus: &[Scheduler]) -> usize {
+    for cpu in cpus {
+        // Keep 3/4 of the history, so a short burst does not move work
+        let sample = (cpu.queued() as u64) << LOAD_SHIFT;
+        cpu.load.store((cpu.load() * 3 + sample) / 4, Ordering::Relaxed);
+    }
+    let Some(busiest) = cpus.iter().max_by_key(|cpu| cpu.load()) else {
+        return 0;
+    };
+    // Half the gap, in whole threads
+    let gap = |target: &Scheduler| (busiest.load().saturating_sub(target.load()) >> LOAD_SHIFT) / 2;
+    let target = cpus
+        .iter()
+        .filter(|target| target.cpu != busiest.cpu)
+        .map(|target| (topology::shared_level(busiest.cpu, target.cpu) == Level::System, target))
+        .filter(|&(remote, target)| gap(target) >= if remote { 2 } else { 1 })
+        .min_by_key(|&(remote, target)| (remote, target.load()));
+    let Some((_, target)) = target else {
+        return 0;
+    };
+
+    // Same order as steal_work: the receiving queue, then the source only
+    // if it is free.
+    let batch = (gap(target) as usize).min(STEAL_BATCH);
+    let mut run_queue = target.run_queue.lock();
+    let Some(mut busiest_queue) = busiest.run_queue.try_lock() else {
+        return 0;
+    };
+    let moved = run_queue.steal_from(&mut busiest_queue, batch);
+    busiest.publish_len(&busiest_queue);
+    target.publish_len(&run_queue);
+
+    // The averages follow the move, so the next pass does not repeat it
+    let shift = (moved as u64) << LOAD_SHIFT;
+    busiest.load.fetch_sub(shift.min(busiest.load()), Ordering::Relaxed);
+    target.load.fetch_add(shift, Ordering::Relaxed);
+    moved
+}
+
+/// CPU for a thread waking up after running on `prev`. `prev` wins if it
+/// is idle. Otherwise the nearest idle CPU on the same node wins. With none
+/// idle the thread stays on `prev`, where its cache is warm. `None` if
+/// `prev` is not among `cpus`.
+pub fn select_wake_cpu(prev: u32, cpus: &[Scheduler]) -> Option<&Scheduler> {
+    let previous = cpus.iter().find(|scheduler| scheduler.cpu == prev)?;
+    if previous.is_idle() {
+        return Some(previous);
+    }
+
+    let mut nearest: Option<(Level, &Scheduler)> = None;
+    for candidate in cpus.iter().filter(|candidate| candidate.cpu != prev) {
+        let level = topology::shared_level(prev, candidate.cpu);
+        if level == Level::System || nearest.map_or(false, |(best, _)| level >= best) {
+            continue;
+        }
+        if candidate.is_idle() {
+            nearest = Some((level, candidate));
+            if level == Level::Smt {
+                break;
+            }
+        }
     }
+    Some(nearest.map_or(previous, |(_, scheduler)| scheduler))
 }
 
-pub static SCHEDULER: Mutex<Scheduler> = Mutex::new(Scheduler::new());
+const fn build_schedulers() -> [Scheduler; MAX_CPUS] {
+    const IDLE: Scheduler = Scheduler::new();
+    let mut schedulers = [IDLE; MAX_CPUS];
+    let mut cpu = 0;
+    while cpu < MAX_CPUS {
+        core::mem::forget(core::mem::replace(
+            &mut schedulers[cpu],
+            Scheduler::for_cpu(cpu as u32),
+        ));
+        cpu += 1;
+    }
+    schedulers
+}
+
+static SCHEDULERS: [Scheduler; MAX_CPUS] = build_schedulers();
+
+/// Tick of the last `periodic_balance` pass.
+static LAST_BALANCE: AtomicU64 = AtomicU64::new(0);
+
+fn online_cpus() -> &'static [Scheduler] {
+    let count = get_cpu_manager().map_or(1, |mgr| mgr.cpu_count());
+    &SCHEDULERS[..count.clamp(1, MAX_CPUS)]
+}
+
+/// The calling CPU's scheduler.
+pub fn local() -> &'static Scheduler {
+    &SCHEDULERS[get_current_cpu_id() as usize % MAX_CPUS]
+}
+
+/// The scheduler of `cpu`.
+pub fn on_cpu(cpu: u32) -> &'static Scheduler {
+    &SCHEDULERS[cpu as usize % MAX_CPUS]
+}
 
 pub fn init_scheduler() {
-    
+
 }
 
 pub fn add_thread(tid: ThreadId) {
-    SCHEDULER.lock().add_thread(tid);
+    local().add_thread(tid);
 }
 
+/// Take `tid` off whichever queue holds it. A steal can move it between
+/// reading its CPU and locking that queue, so follow it once more then.
 pub fn remove_thread(tid: ThreadId) {
-    SCHEDULER.lock().remove_thread(tid);
+    let mut tried = None;
+    while let Some(cpu) = queued_on(tid) {
+        if tried == Some(cpu) || on_cpu(cpu).remove_thread(tid) {
+            return;
+        }
+        tried = Some(cpu);
+    }
+}
+
+fn queued_on(tid: ThreadId) -> Option<u32> {
+    THREAD_TABLE
+        .with_thread(tid, |thread| thread.run_link.is_queued().then_some(thread.cpu))
+        .flatten()
 }
 
 pub fn schedule() -> Option<ThreadId> {
-    SCHEDULER.lock().schedule()
+    let local = local();
+    if local.needs_work() {
+        steal_work(local, online_cpus());
+    }
+    local.schedule()
 }
 
 pub fn tick() {
-    SCHEDULER.lock().tick();
+    local().tick();
+}
+
+/// Run `rebalance` over the online CPUs once `BALANCE_INTERVAL` ticks have
+/// passed since the last pass; one caller wins each slot. Called on the way
+/// out of a syscall and from the idle loop, not from the timer interrupt,
+/// because moving threads may allocate.
+pub fn periodic_balance() -> usize {
+    let now = local().total_ticks();
+    let last = LAST_BALANCE.load(Ordering::Relaxed);
+    if now < last + BALANCE_INTERVAL
+        || LAST_BALANCE
+            .compare_exchange(last, now, Ordering::AcqRel, Ordering::Relaxed)
+            .is_err()
+    {
+        return 0;
+    }
+    rebalance(online_cpus())
 }
 
 pub fn yield_cpu() {
-    SCHEDULER.lock().yield_current();
+    local().yield_current();
 }
 
 pub fn block_current_thread() {
-    SCHEDULER.lock().block_current();
+    local().block_current();
 }
 
+/// Wake `tid` onto the CPU `select_wake_cpu` picks.
 pub fn unblock_thread(tid: ThreadId) {
-    SCHEDULER.lock().unblock_thread(tid);
+    if let Some((priority, prev)) = wake(tid) {
+        select_wake_cpu(prev, online_cpus())
+            .unwrap_or_else(|| on_cpu(prev))
+            .enqueue(tid, priority);
+    }
 }
 
 pub fn current_thread() -> Option<ThreadId> {
-    SCHEDULER.lock().current_thread()
+    local().current_thread()
+}
+
+/// Drop every CPU's queue and running thread.
+#[cfg(test)]
+pub fn reset() {
+    for scheduler in SCHEDULERS.iter() {
+        scheduler.reset();
+    }
 }
 
 #[cfg(test)]
@@ -230,24 +807,232 @@ mod tests {
     use super::*;
     use crate::process::{Priority, ProcessId};
     use crate::memory::VirtAddr;
+    use std::vec::Vec;
+
+    fn ready_thread(priority: Priority) -> ThreadId {
+        crate::process::create_thread(
+            ProcessId(0),
+            priority,
+            VirtAddr::new(0x1000),
+            VirtAddr::new(0x2000),
+            None,
+        )
+        .unwrap()
+    }
 
     #[test]
     fn test_run_queue() {
+        let [normal, realtime, low] =
+            [Priority::Normal, Priority::Realtime, Priority::Low].map(ready_thread);
+        THREAD_TABLE.with_thread_mut(normal, |t| t.vruntime = 2 * TICK_VRUNTIME);
+        THREAD_TABLE.with_thread_mut(low, |t| t.vruntime = TICK_VRUNTIME);
         let mut queue = RunQueue::new();
-        queue.enqueue(ThreadId(1), Priority::Normal);
-        queue.enqueue(ThreadId(2), Priority::High);
-        queue.enqueue(ThreadId(3), Priority::Low);
+        queue.enqueue(normal, Priority::Normal);
+        queue.enqueue(realtime, Priority::Realtime);
+        queue.enqueue(low, Priority::Low);
 
         let next = queue.pick_next();
-        assert_eq!(next, Some(ThreadId(2)));
+        assert_eq!(next, Some(realtime));
 
+        // Fair threads run in vruntime order, whatever their priority
         let next = queue.pick_next();
-        assert_eq!(next, Some(ThreadId(1)));
+        assert_eq!(next, Some(low));
+
+        assert_eq!(queue.pick_next(), Some(normal));
+        for tid in [normal, realtime, low] {
+            THREAD_TABLE.remove_thread(tid);
+        }
+    }
+
+    #[test]
+    fn test_run_queue_links() {
+        let tids: Vec<ThreadId> = (0..2000).map(|_| ready_thread(Priority::Normal)).collect();
+        let mut queue = RunQueue::new();
+        for &tid in &tids {
+            assert!(queue.enqueue(tid, Priority::Normal));
+        }
+        // Already queued: the flag turns a second enqueue into a no-op
+        assert!(!queue.enqueue(tids[7], Priority::High));
+        assert_eq!(queue.len(), tids.len());
+
+        for tid in tids.iter().skip(1).step_by(2) {
+            assert!(queue.remove(*tid));
+        }
+        assert!(!queue.remove(tids[1]));
+        assert_eq!(queue.len(), tids.len() / 2);
+
+        for tid in tids.iter().step_by(2) {
+            assert_eq!(queue.pop_next(), Some(*tid));
+        }
+        assert_eq!(queue.pop_next(), None);
+        assert!(queue.is_empty());
+
+        for tid in tids {
+            assert_eq!(THREAD_TABLE.remove_thread(tid).map(|t| t.run_link.is_queued()), Some(false));
+        }
+    }
+
+    #[test]
+    fn test_wakeup_before_block_is_not_lost() {
+        let tid = ready_thread(Priority::Normal);
+
+        let scheduler = Scheduler::new();
+        scheduler.add_thread(tid);
+        assert_eq!(scheduler.schedule(), Some(tid));
+
+        // Woken while still running: the block that follows is skipped
+        scheduler.unblock_thread(tid);
+        scheduler.block_current();
+        assert_eq!(scheduler.current_thread(), Some(tid));
+        assert_eq!(THREAD_TABLE.with_thread(tid, |t| t.state), Some(ThreadState::Running));
+
+        scheduler.block_current();
+        assert_eq!(scheduler.current_thread(), None);
+        assert_eq!(THREAD_TABLE.with_thread(tid, |t| t.state), Some(ThreadState::Blocked));
+
+        scheduler.unblock_thread(tid);
+        assert_eq!(scheduler.schedule(), Some(tid));
+        THREAD_TABLE.remove_thread(tid);
+    }
+
+    #[test]
+    fn test_idle_cpu_steals_half_of_busiest_queue() {
+        let cpus = [Scheduler::for_cpu(0), Scheduler::for_cpu(1), Scheduler::for_cpu(2)];
+        let tids: [ThreadId; 4] = core::array::from_fn(|_| ready_thread(Priority::Normal));
+        let high = ready_thread(Priority::Realtime);
+        for &tid in &tids {
+            cpus[1].add_thread(tid);
+        }
+        cpus[1].add_thread(high);
+        cpus[2].add_thread(ready_thread(Priority::Normal));
+
+        assert!(cpus[0].needs_work());
+        assert_eq!(steal_work(&cpus[0], &cpus), 3);
+        assert_eq!((cpus[0].queued(), cpus[1].queued()), (3, 2));
+
+        // The realtime thread moves first and runs on the thief
+        assert_eq!(cpus[0].schedule(), Some(high));
+        assert_eq!(THREAD_TABLE.with_thread(high, |t| t.cpu), Some(0));
+        assert_eq!(cpus[1].schedule(), Some(tids[0]));
+
+        // A thread that exited while queued is skipped
+        THREAD_TABLE.with_thread_mut(tids[1], |t| t.set_state(ThreadState::Terminated));
+        cpus[1].tick();
+        cpus[1].yield_current();
+        assert_eq!(cpus[1].schedule(), Some(tids[0]));
+        assert_eq!(cpus[1].queued(), 0);
+
+        for tid in tids.into_iter().chain([high]) {
+            THREAD_TABLE.remove_thread(tid);
+        }
+    }
+
+    #[test]
+    fn test_rebalance_spreads_busy_queue() {
+        let cpus = [Scheduler::for_cpu(0), Scheduler::for_cpu(1), Scheduler::for_cpu(2)];
+        let tids: [ThreadId; 8] = core::array::from_fn(|_| ready_thread(Priority::Normal));
+        for &tid in &tids {
+            cpus[0].add_thread(tid);
+        }
+
+        // Averages need a few passes to believe the imbalance
+        let moved: usize = (0..12).map(|_| rebalance(&cpus)).sum();
+        assert!(moved > 0);
+        let queued: [usize; 3] = core::array::from_fn(|cpu| cpus[cpu].queued());
+        assert_eq!(queued.iter().sum::<usize>(), 8);
+        assert!(queued[1] > 0 && queued[2] > 0);
+        assert!(queued.iter().max().unwrap() - queued.iter().min().unwrap() <= 3);
+        for (cpu, scheduler) in cpus.iter().enumerate() {
+            if let Some(tid) = scheduler.schedule() {
+                assert_eq!(THREAD_TABLE.with_thread(tid, |t| t.cpu), Some(cpu as u32));
+            }
+        }
+
+        for tid in tids {
+            THREAD_TABLE.remove_thread(tid);
+        }
+    }
+
+    #[test]
+    fn test_wakeup_placement_follows_topology() {
+        use crate::cpu::topology::{set_cpu_topology, CpuTopology};
+
+        // CPUs 200-203: two SMT pairs in package 0 on node 0. CPU 204: node 1.
+        let layout = [(0, 0, 0), (0, 0, 0), (1, 0, 0), (1, 0, 0), (2, 1, 1)];
+        for (index, &(core, package, node)) in layout.iter().enumerate() {
+            set_cpu_topology(200 + index as u32, CpuTopology { core, package, node });
+        }
+        let cpus: [Scheduler; 5] = core::array::from_fn(|i| Scheduler::for_cpu(200 + i as u32));
+        let cpu_of = |scheduler: Option<&Scheduler>| scheduler.map(Scheduler::cpu);
+
+        // An idle previous CPU wins
+        assert_eq!(cpu_of(select_wake_cpu(200, &cpus)), Some(200));
+
+        let busy: [ThreadId; 4] = core::array::from_fn(|_| ready_thread(Priority::Normal));
+        cpus[0].add_thread(busy[0]);
+        assert_eq!(cpu_of(select_wake_cpu(200, &cpus)), Some(201));
+
+        cpus[1].add_thread(busy[1]);
+        assert_eq!(cpu_of(select_wake_cpu(200, &cpus)), Some(202));
+
+        // Only the other node is idle: stay put rather than cross it
+        cpus[2].add_thread(busy[2]);
+        cpus[3].add_thread(busy[3]);
+        assert_eq!(cpu_of(select_wake_cpu(200, &cpus)), Some(200));
+        assert_eq!(cpu_of(select_wake_cpu(255, &cpus)), None);
+
+        // Stealing stays near: single threads across nodes are left alone,
+        // and the SMT sibling is raided before the rest of the package
+        assert_eq!(steal_work(&cpus[4], &cpus), 0);
+        assert_eq!(steal_work(&cpus[0], &cpus), 1);
+        assert_eq!(cpus.each_ref().map(Scheduler::queued), [2, 0, 1, 1, 0]);
+
+        for tid in busy {
+            THREAD_TABLE.remove_thread(tid);
+        }
+    }
+
+    #[test]
+    fn test_fair_class_shares_cpu_by_weight() {
+        let scheduler = Scheduler::new();
+        let priorities = [Priority::Low, Priority::Normal, Priority::High];
+        let tids = priorities.map(ready_thread);
+        for tid in tids {
+            scheduler.add_thread(tid);
+        }
+
+        const TICKS: u64 = 3000;
+        for _ in 0..TICKS {
+            scheduler.schedule();
+            scheduler.tick();
+        }
+
+        // Shares follow the weights, give or take a few slices
+        let total_weight: u64 = priorities.map(weight).iter().sum();
+        for (tid, priority) in tids.into_iter().zip(priorities) {
+            let used = THREAD_TABLE.with_thread(tid, |t| t.total_cpu_time).unwrap();
+            let expected = TICKS * weight(priority) / total_weight;
+            assert!(used.abs_diff(expected) < TICKS / 20, "{:?}: {} vs {}", priority, used, expected);
+        }
+
+        // Realtime preempts at once and keeps the CPU until it blocks
+        let realtime = ready_thread(Priority::Realtime);
+        scheduler.add_thread(realtime);
+        for _ in 0..100 {
+            assert_eq!(scheduler.schedule(), Some(realtime));
+            scheduler.tick();
+        }
+        scheduler.block_current();
+        assert!(tids.contains(&scheduler.schedule().unwrap()));
+
+        for tid in tids.into_iter().chain([realtime]) {
+            THREAD_TABLE.remove_thread(tid);
+        }
     }
 
     #[test]
     fn test_scheduler_tick() {
-        let mut scheduler = Scheduler::new();
+        let scheduler = Scheduler::new();
         let initial_ticks = scheduler.total_ticks();
         scheduler.tick();
         assert_eq!(scheduler.total_ticks(), initial_ticks + 1);
@@ -1,5 +1,7 @@
 use super::{ProcessId, ThreadId, Priority, Context};
+use super::scheduler::RunLink;
 use crate::memory::VirtAddr;
+use core::sync::atomic::{AtomicUsize, Ordering};
 use spin::Mutex;
 
 #[cfg(not(test))]
@@ -30,6 +32,14 @@ pub struct Thread {
     pub user_stack: Option<VirtAddr>,
     pub time_slice: usize,
     pub total_cpu_time: u64,
+    /// Set when a wakeup arrives before the thread blocks; the next
+    /// block then returns at once instead of sleeping.
+    pub wake_pending: bool,
+    /// CPU whose run queue holds the thread, or that last ran it.
+    pub cpu: u32,
+    pub run_link: RunLink,
+    /// Weighted CPU time used by the fair scheduling class.
+    pub vruntime: u64,
 }
 
 impl Thread {
@@ -57,6 +67,10 @@ impl Thread {
             user_stack,
             time_slice: Self::calculate_time_slice(priority),
             total_cpu_time: 0,
+            wake_pending: false,
+            cpu: 0,
+            run_link: RunLink::default(),
+            vruntime: 0,
         }
     }
 
@@ -83,59 +97,82 @@ impl Thread {
     }
 }
 
+/// Number of independently locked thread-table shards, keyed by TID.
+const THREAD_SHARDS: usize = 64;
+
+type ThreadShard = Mutex<Vec<Option<Thread>>>;
+
+/// Thread table split into per-TID-bucket locks, like `ProcessTable`.
 pub struct ThreadTable {
-    threads: Vec<Option<Thread>>,
-    next_tid: usize,
+    shards: [ThreadShard; THREAD_SHARDS],
+    next_tid: AtomicUsize,
 }
 
 impl ThreadTable {
     pub const fn new() -> Self {
+        const EMPTY_SHARD: ThreadShard = Mutex::new(Vec::new());
         Self {
-            threads: Vec::new(),
-            next_tid: 1,
+            shards: [EMPTY_SHARD; THREAD_SHARDS],
+            next_tid: AtomicUsize::new(1),
         }
     }
 
-    pub fn allocate_tid(&mut self) -> ThreadId {
-        let tid = ThreadId(self.next_tid);
-        self.next_tid += 1;
-        tid
+    fn shard(&self, tid: ThreadId) -> (&ThreadShard, usize) {
+        (&self.shards[tid.0 % THREAD_SHARDS], tid.0 / THREAD_SHARDS)
     }
 
-    pub fn add_thread(&mut self, thread: Thread) {
-        let id = thread.id.0;
-        while self.threads.len() <= id {
-            self.threads.push(None);
+    pub fn allocate_tid(&self) -> ThreadId {
+        ThreadId(self.next_tid.fetch_add(1, Ordering::Relaxed))
+    }
+
+    pub fn add_thread(&self, thread: Thread) {
+        let (shard, index) = self.shard(thread.id);
+        let mut slots = shard.lock();
+        while slots.len() <= index {
+            slots.push(None);
         }
-        self.threads[id] = Some(thread);
+        slots[index] = Some(thread);
     }
 
-    pub fn get_thread(&self, tid: ThreadId) -> Option<&Thread> {
-        self.threads.get(tid.0)?.as_ref()
+    /// Run `f` on the thread with only its shard locked. `f` must not take
+    /// another process- or thread-table lock.
+    pub fn with_thread<R>(&self, tid: ThreadId, f: impl FnOnce(&Thread) -> R) -> Option<R> {
+        let (shard, index) = self.shard(tid);
+        let slots = shard.lock();
+        slots.get(index)?.as_ref().map(f)
     }
 
-    pub fn get_thread_mut(&mut self, tid: ThreadId) -> Option<&mut Thread> {
-        self.threads.get_mut(tid.0)?.as_mut()
+    pub fn with_thread_mut<R>(&self, tid: ThreadId, f: impl FnOnce(&mut Thread) -> R) -> Option<R> {
+        let (shard, index) = self.shard(tid);
+        let mut slots = shard.lock();
+        slots.get_mut(index)?.as_mut().map(f)
     }
 
-    pub fn remove_thread(&mut self, tid: ThreadId) -> Option<Thread> {
-        if tid.0 < self.threads.len() {
-            self.threads[tid.0].take()
-        } else {
-            None
-        }
+    pub fn remove_thread(&self, tid: ThreadId) -> Option<Thread> {
+        let (shard, index) = self.shard(tid);
+        let thread = shard.lock().get_mut(index)?.take();
+        super::current::invalidate_credentials();
+        thread
     }
 
-    pub fn all_threads(&self) -> impl Iterator<Item = &Thread> {
-        self.threads.iter().filter_map(|t| t.as_ref())
+    /// Visit every thread, one shard locked at a time.
+    pub fn for_each_thread(&self, mut f: impl FnMut(&Thread)) {
+        for shard in &self.shards {
+            shard.lock().iter().filter_map(|t| t.as_ref()).for_each(&mut f);
+        }
     }
 
-    pub fn all_threads_mut(&mut self) -> impl Iterator<Item = &mut Thread> {
-        self.threads.iter_mut().filter_map(|t| t.as_mut())
+    /// Drop every thread and restart TID allocation at 1.
+    pub fn clear(&self) {
+        for shard in &self.shards {
+            shard.lock().clear();
+        }
+        self.next_tid.store(1, Ordering::Relaxed);
+        super::current::invalidate_credentials();
     }
 }
 
-pub static THREAD_TABLE: Mutex<ThreadTable> = Mutex::new(ThreadTable::new());
+pub static THREAD_TABLE: ThreadTable = ThreadTable::new();
 
 pub fn create_thread(
     process_id: ProcessId,
@@ -144,27 +181,21 @@ pub fn create_thread(
     kernel_stack: VirtAddr,
     user_stack: Option<VirtAddr>,
 ) -> Option<ThreadId> {
-    let mut table = THREAD_TABLE.lock();
-    let tid = table.allocate_tid();
+    let tid = THREAD_TABLE.allocate_tid();
     let thread = Thread::new(tid, process_id, priority, entry_point, kernel_stack, user_stack);
-    table.add_thread(thread);
+    THREAD_TABLE.add_thread(thread);
     
-    if let Some(process) = super::PROCESS_TABLE.lock().get_process_mut(process_id) {
-        process.add_thread(tid);
-    }
+    super::PROCESS_TABLE.with_process_mut(process_id, |process| process.add_thread(tid));
     
     Some(tid)
 }
 
 pub fn get_thread(tid: ThreadId) -> Option<Thread> {
-    let table = THREAD_TABLE.lock();
-    table.get_thread(tid).cloned()
+    THREAD_TABLE.with_thread(tid, |thread| thread.clone())
 }
 
 pub fn set_thread_state(tid: ThreadId, state: ThreadState) {
-    if let Some(thread) = THREAD_TABLE.lock().get_thread_mut(tid) {
-        thread.set_state(state);
-    }
+    THREAD_TABLE.with_thread_mut(tid, |thread| thread.set_state(state));
 }
 
 #[cfg(test)]
@@ -173,7 +204,7 @@ mod tests {
 
     #[test]
     fn test_thread_creation() {
-        let mut table = ThreadTable::new();
+        let table = ThreadTable::new();
         let tid = table.allocate_tid();
         assert_eq!(tid.0, 1);
 
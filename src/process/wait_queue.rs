@@ -0,0 +1,224 @@
+//! Wait queues.
+//!
+//! A thread that cannot make progress (empty pipe, no console input, ...)
+//! sleeps on a `WaitQueue` instead of spinning; whoever makes progress
+//! possible (a pipe writer, an IRQ handler) wakes it. Waiters register
+//! before their final condition check, and the scheduler remembers a
+//! wakeup that lands before the thread actually blocks, so no wakeup is
+//! lost.
+//!
+//! Interrupt handlers must not wake threads directly: that takes the
+//! waiter, thread table and run-queue locks, which the interrupted code
+//! may hold. They call `defer_wake_all` instead. The wakeup runs later in
+//! thread context, when a syscall returns or the idle loop wakes, and
+//! never from an interrupt handler.
+
+use core::ptr;
+use core::sync::atomic::{fence, AtomicBool, AtomicPtr, AtomicUsize, Ordering};
+use spin::Mutex;
+
+use super::{scheduler, ThreadId};
+
+#[cfg(not(test))]
+use alloc::collections::VecDeque;
+#[cfg(test)]
+use std::collections::VecDeque;
+
+pub struct WaitQueue {
+    waiters: Mutex<VecDeque<ThreadId>>,
+    // Mirrors `waiters.len()` so wakers can skip the lock when idle
+    count: AtomicUsize,
+    // Set by `defer_wake_all`, cleared when the wakeup runs
+    wake_deferred: AtomicBool,
+}
+
+/// Queues with a deferred `wake_all`; a queue keeps its slot once it has
+/// one, so interrupt handlers only ever store into atomics.
+const DEFERRED_SLOTS: usize = 8;
+const NO_QUEUE: AtomicPtr<WaitQueue> = AtomicPtr::new(ptr::null_mut());
+static DEFERRED: [AtomicPtr<WaitQueue>; DEFERRED_SLOTS] = [NO_QUEUE; DEFERRED_SLOTS];
+
+impl WaitQueue {
+    pub const fn new() -> Self {
+        Self {
+            waiters: Mutex::new(VecDeque::new()),
+            count: AtomicUsize::new(0),
+            wake_deferred: AtomicBool::new(false),
+        }
+    }
+
+    /// Sleep until `ready` returns a value. `ready` is re-run after every
+    /// wakeup, so spurious wakeups are harmless. Without a current thread
+    /// (early boot, host tests) this polls instead.
+    pub fn wait_until<R>(&self, mut ready: impl FnMut() -> Option<R>) -> R {
+        loop {
+            if let Some(value) = ready() {
+                return value;
+            }
+
+            let tid = match scheduler::current_thread() {
+                Some(tid) => tid,
+                None => {
+                    core::hint::spin_loop();
+                    continue;
+                }
+            };
+
+            self.enqueue(tid);
+            // Pairs with the fence in `has_waiters`
+            fence(Ordering::SeqCst);
+            if let Some(value) = ready() {
+                self.remove(tid);
+                return value;
+            }
+
+            scheduler::block_current_thread();
+            self.remove(tid);
+        }
+    }
+
+    /// Wake the longest waiting thread. Returns whether there was one.
+    pub fn wake_one(&self) -> bool {
+        if !self.has_waiters() {
+            return false;
+        }
+
+        let tid = {
+            let mut waiters = self.waiters.lock();
+            let tid = waiters.pop_front();
+            self.count.store(waiters.len(), Ordering::Relaxed);
+            tid
+        };
+
+        match tid {
+            Some(tid) => {
+                scheduler::unblock_thread(tid);
+                true
+            }
+            None => false,
+        }
+    }
+
+    /// Wake every waiter. Returns how many were woken.
+    pub fn wake_all(&self) -> usize {
+        if !self.has_waiters() {
+            return 0;
+        }
+        let waiters = self.take_all(self.waiters.lock());
+        Self::unblock(waiters)
+    }
+
+    /// `wake_all` for interrupt context. Takes no lock: the wakeup runs in
+    /// the next `run_deferred_wakeups`. Returns false if every deferral
+    /// slot belongs to another queue; the caller should retry later.
+    pub fn defer_wake_all(&'static self) -> bool {
+        if !self.has_waiters() {
+            return true;
+        }
+        let this = self as *const Self as *mut Self;
+        let registered = DEFERRED.iter().any(|slot| {
+            slot.load(Ordering::Acquire) == this
+                || slot
+                    .compare_exchange(ptr::null_mut(), this, Ordering::AcqRel, Ordering::Acquire)
+                    .is_ok()
+        });
+        if registered {
+            self.wake_deferred.store(true, Ordering::Release);
+        }
+        registered
+    }
+
+    pub fn has_waiters(&self) -> bool {
+        fence(Ordering::SeqCst);
+        self.count.load(Ordering::Relaxed) != 0
+    }
+
+    fn enqueue(&self, tid: ThreadId) {
+        let mut waiters = self.waiters.lock();
+        if !waiters.contains(&tid) {
+            waiters.push_back(tid);
+        }
+        self.count.store(waiters.len(), Ordering::SeqCst);
+    }
+
+    fn remove(&self, tid: ThreadId) {
+        let mut waiters = self.waiters.lock();
+        waiters.retain(|&waiter| waiter != tid);
+        self.count.store(waiters.len(), Ordering::Relaxed);
+    }
+
+    fn take_all(&self, mut waiters: spin::MutexGuard<'_, VecDeque<ThreadId>>) -> VecDeque<ThreadId> {
+        self.count.store(0, Ordering::Relaxed);
+        core::mem::take(&mut *waiters)
+    }
+
+    fn unblock(waiters: VecDeque<ThreadId>) -> usize {
+        let woken = waiters.len();
+        for tid in waiters {
+            scheduler::unblock_thread(tid);
+        }
+        woken
+    }
+}
+
+/// Run the wakeups interrupt handlers deferred. Takes the waiter and
+/// scheduler locks, so it is called only outside interrupt context: on
+/// syscall return and from the idle loop.
+pub fn run_deferred_wakeups() {
+    for slot in DEFERRED.iter() {
+        let queue = slot.load(Ordering::Acquire);
+        if queue.is_null() {
+            break;
+        }
+        // Only `&'static WaitQueue`s are ever stored
+        let queue = unsafe { &*queue };
+        if queue.wake_deferred.swap(false, Ordering::AcqRel) {
+            queue.wake_all();
+        }
+    }
+}
+
+impl Default for WaitQueue {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::memory::VirtAddr;
+    use crate::process::{Priority, ProcessId, ThreadState, THREAD_TABLE};
+
+    #[test]
+    fn test_deferred_wake_runs_outside_interrupts() {
+        static QUEUE: WaitQueue = WaitQueue::new();
+        let tid = crate::process::create_thread(
+            ProcessId(0),
+            Priority::Normal,
+            VirtAddr::new(0x1000),
+            VirtAddr::new(0x2000),
+            None,
+        )
+        .unwrap();
+        THREAD_TABLE.with_thread_mut(tid, |t| t.set_state(ThreadState::Blocked));
+        QUEUE.enqueue(tid);
+
+        // The interrupt side only records the wakeup while the interrupted
+        // code holds the waiter lock; rescheduling from the same interrupt
+        // must not try to take it, or this would spin forever
+        {
+            let _held = QUEUE.waiters.lock();
+            assert!(QUEUE.defer_wake_all());
+            scheduler::schedule();
+        }
+
+        // Back in thread context with the lock released
+        run_deferred_wakeups();
+        assert!(!QUEUE.has_waiters());
+        assert_ne!(THREAD_TABLE.with_thread(tid, |t| t.state), Some(ThreadState::Blocked));
+
+        scheduler::remove_thread(tid);
+        THREAD_TABLE.remove_thread(tid);
+    }
+}
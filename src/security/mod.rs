@@ -15,6 +15,18 @@ pub enum PrivilegeLevel {
     Ring3 = 3,
 }
 
+impl PrivilegeLevel {
+    /// Ring number back to a level; anything outside 0..=2 is Ring3.
+    pub const fn from_ring(ring: u8) -> Self {
+        match ring {
+            0 => PrivilegeLevel::Ring0,
+            1 => PrivilegeLevel::Ring1,
+            2 => PrivilegeLevel::Ring2,
+            _ => PrivilegeLevel::Ring3,
+        }
+    }
+}
+
 impl fmt::Display for PrivilegeLevel {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         write!(f, "Ring{}", *self as u8)
@@ -32,6 +44,26 @@ pub const CAP_FS_RW: CapMask = 1 << 19;
 pub const CAP_IPC: CapMask = 1 << 20;
 pub const CAP_SYS_ADMIN: CapMask = 1 << 63;
 
+/// The part of a `SecurityContext` that syscall dispatch checks, small
+/// enough to copy on every call.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Credentials {
+    pub uid: u32,
+    pub euid: u32,
+    pub privilege: PrivilegeLevel,
+    pub capabilities: CapMask,
+}
+
+impl Credentials {
+    pub fn is_privileged_enough(&self, max_allowed_ring: PrivilegeLevel) -> bool {
+        (self.privilege as u8) <= (max_allowed_ring as u8)
+    }
+
+    pub fn has_capabilities(&self, required: CapMask) -> bool {
+        (self.capabilities & required) == required
+    }
+}
+
 #[derive(Debug, Clone)]
 pub struct SecurityContext {
     pub uid: u32,
@@ -86,11 +118,20 @@ impl SecurityContext {
     }
 
     pub fn is_privileged_enough(&self, max_allowed_ring: PrivilegeLevel) -> bool {
-        (self.privilege as u8) <= (max_allowed_ring as u8)
+        self.credentials().is_privileged_enough(max_allowed_ring)
     }
 
     pub fn has_capabilities(&self, required: CapMask) -> bool {
-        (self.capabilities & required) == required
+        self.credentials().has_capabilities(required)
+    }
+
+    pub fn credentials(&self) -> Credentials {
+        Credentials {
+            uid: self.uid,
+            euid: self.euid,
+            privilege: self.privilege,
+            capabilities: self.capabilities,
+        }
     }
 
     pub fn grant_capabilities(&mut self, mask: CapMask) {
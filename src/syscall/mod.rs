@@ -1,22 +1,30 @@
 use core::{slice, str};
 
 #[cfg(not(test))]
-use alloc::{collections::VecDeque, string::String, vec::Vec};
+use alloc::{collections::VecDeque, string::String, sync::Arc, vec::Vec};
 #[cfg(test)]
-use std::{collections::VecDeque, string::String, vec::Vec};
+use std::{collections::VecDeque, string::String, sync::Arc, vec::Vec};
 
 use spin::Mutex;
 
-use crate::memory::{frame_allocator::allocate_frame, paging::Page, VirtAddr};
+use crate::memory::{
+    frame_allocator::{allocate_frame, deallocate_frame},
+    VirtAddr,
+};
+use crate::memory::vma::{Protection, SharedAnonymous, VmaBacking, VmaError};
 use crate::process::{
     self,
     create_process,
+    current,
     create_thread,
     scheduler,
     thread::{self, ThreadState, THREAD_TABLE},
     Context,
     FdObject,
+    FileDescriptorTable,
     PipeEnd,
+    pipe::{PipeError, PipeResizeError},
+    wait_queue::{self, WaitQueue},
     ProcessId,
     ThreadId,
 };
@@ -29,6 +37,7 @@ use crate::userspace;
 use crate::drivers::serial::SERIAL1;
 
 pub mod entry;
+pub mod uring;
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 #[repr(i32)]
@@ -36,8 +45,14 @@ pub enum Errno {
     EPERM = 1,
     ESRCH = 3,
     ENOMEM = 12,
+    ENODEV = 19,
     EINVAL = 22,
+    ESPIPE = 29,
+    EPIPE = 32,
     EBADF = 9,
+    EAGAIN = 11,
+    EMFILE = 24,
+    EBUSY = 16,
     ENOSYS = 38,
     InvalidSyscall = 39,
     ProcessNotFound = 100,
@@ -131,8 +146,68 @@ pub const SYS_SYSFS_READ: usize = 22;
 pub const SYS_SYSFS_WRITE: usize = 23;
 pub const SYS_DEBUG_LOG: usize = 24;
 pub const SYS_DUP2: usize = 23;
+pub const SYS_FCNTL: usize = 25;
+pub const SYS_SPLICE: usize = 26;
+pub const SYS_TEE: usize = 27;
+pub const SYS_URING_SETUP: usize = 28;
+pub const SYS_URING_ENTER: usize = 29;
+pub const SYS_READV: usize = 30;
+pub const SYS_WRITEV: usize = 31;
+pub const SYS_PREADV: usize = 32;
+pub const SYS_PWRITEV: usize = 33;
+pub const SYS_SPAWN: usize = 34;
+
+// fcntl commands and file status flags, numbered as on Linux
+pub const F_GETFD: usize = 1;
+pub const F_SETFD: usize = 2;
+pub const F_GETFL: usize = 3;
+pub const F_SETFL: usize = 4;
+pub const F_SETPIPE_SZ: usize = 1031;
+pub const F_GETPIPE_SZ: usize = 1032;
+pub const O_NONBLOCK: u32 = 0o4000;
+pub const FD_CLOEXEC: usize = 1;
+pub const SPLICE_F_NONBLOCK: usize = 0x02;
+
+// mmap protection and flags, numbered as on Linux
+pub const PROT_READ: usize = 0x1;
+pub const PROT_WRITE: usize = 0x2;
+pub const PROT_EXEC: usize = 0x4;
+pub const MAP_SHARED: usize = 0x01;
+pub const MAP_PRIVATE: usize = 0x02;
+pub const MAP_FIXED: usize = 0x10;
+pub const MAP_ANONYMOUS: usize = 0x20;
+
+/// Most segments one `readv`/`writev` call accepts, as on Linux.
+pub const IOV_MAX: usize = 1024;
+
+/// One element of a userspace `struct iovec` array.
+#[derive(Debug, Clone, Copy)]
+#[repr(C)]
+pub struct IoVec {
+    pub base: usize,
+    pub len: usize,
+}
 
-pub const SYSCALL_MAX: usize = 32;
+// spawn file actions, applied in order to the child's descriptors
+pub const SPAWN_DUP2: u32 = 1;
+pub const SPAWN_CLOSE: u32 = 2;
+/// Most file actions one `spawn` call accepts.
+pub const SPAWN_ACTIONS_MAX: usize = 64;
+
+/// One userspace `struct spawn_action`: `dup2(fd, newfd)` or `close(fd)`.
+#[derive(Debug, Clone, Copy)]
+#[repr(C)]
+pub struct SpawnAction {
+    pub kind: u32,
+    pub fd: u32,
+    pub newfd: u32,
+    pub reserved: u32,
+}
+
+/// Environment a new image gets when the caller passes none.
+const DEFAULT_ENV: &[&str] = &["TERM=vt100", "COLORTERM=truecolor"];
+
+pub const SYSCALL_MAX: usize = 35;
 
 pub static SYSCALL_TABLE: [SyscallDescriptor; SYSCALL_MAX] = [
     SyscallDescriptor {
@@ -330,7 +405,7 @@ pub static SYSCALL_TABLE: [SyscallDescriptor; SYSCALL_MAX] = [
         required_capabilities: CAP_CONSOLE_IO,
         args: arg_spec(SyscallArgKind::Fd, SyscallArgKind::Fd, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
     },
-    // 24..31 reserved
+    // 24 reserved
     SyscallDescriptor {
         number: 24,
         name: "reserved24",
@@ -340,60 +415,85 @@ pub static SYSCALL_TABLE: [SyscallDescriptor; SYSCALL_MAX] = [
         args: arg_spec(SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
     },
     SyscallDescriptor {
-        number: 25,
-        name: "reserved25",
-        handler: sys_unimplemented,
+        number: SYS_FCNTL,
+        name: "fcntl",
+        handler: sys_fcntl,
         max_caller_ring: PrivilegeLevel::Ring3,
-        required_capabilities: CAP_NONE,
-        args: arg_spec(SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
+        required_capabilities: CAP_CONSOLE_IO,
+        args: arg_spec(SyscallArgKind::Fd, SyscallArgKind::Usize, SyscallArgKind::Usize, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
     },
     SyscallDescriptor {
-        number: 26,
-        name: "reserved26",
-        handler: sys_unimplemented,
+        number: SYS_SPLICE,
+        name: "splice",
+        handler: sys_splice,
         max_caller_ring: PrivilegeLevel::Ring3,
-        required_capabilities: CAP_NONE,
-        args: arg_spec(SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
+        required_capabilities: CAP_CONSOLE_IO,
+        args: arg_spec(SyscallArgKind::Fd, SyscallArgKind::Ptr, SyscallArgKind::Fd, SyscallArgKind::Ptr, SyscallArgKind::Len, SyscallArgKind::Flags),
     },
     SyscallDescriptor {
-        number: 27,
-        name: "reserved27",
-        handler: sys_unimplemented,
+        number: SYS_TEE,
+        name: "tee",
+        handler: sys_tee,
         max_caller_ring: PrivilegeLevel::Ring3,
-        required_capabilities: CAP_NONE,
-        args: arg_spec(SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
+        required_capabilities: CAP_CONSOLE_IO,
+        args: arg_spec(SyscallArgKind::Fd, SyscallArgKind::Fd, SyscallArgKind::Len, SyscallArgKind::Flags, SyscallArgKind::None, SyscallArgKind::None),
     },
     SyscallDescriptor {
-        number: 28,
-        name: "reserved28",
-        handler: sys_unimplemented,
+        number: SYS_URING_SETUP,
+        name: "uring_setup",
+        handler: uring::sys_uring_setup,
         max_caller_ring: PrivilegeLevel::Ring3,
         required_capabilities: CAP_NONE,
-        args: arg_spec(SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
+        args: arg_spec(SyscallArgKind::Ptr, SyscallArgKind::Usize, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
     },
+    // Queued entries are checked one by one against their own descriptors
     SyscallDescriptor {
-        number: 29,
-        name: "reserved29",
-        handler: sys_unimplemented,
+        number: SYS_URING_ENTER,
+        name: "uring_enter",
+        handler: uring::sys_uring_enter,
         max_caller_ring: PrivilegeLevel::Ring3,
         required_capabilities: CAP_NONE,
-        args: arg_spec(SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
+        args: arg_spec(SyscallArgKind::Usize, SyscallArgKind::Flags, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
     },
     SyscallDescriptor {
-        number: 30,
-        name: "reserved30",
-        handler: sys_unimplemented,
+        number: SYS_READV,
+        name: "readv",
+        handler: sys_readv,
         max_caller_ring: PrivilegeLevel::Ring3,
-        required_capabilities: CAP_NONE,
-        args: arg_spec(SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
+        required_capabilities: CAP_CONSOLE_IO,
+        args: arg_spec(SyscallArgKind::Fd, SyscallArgKind::Ptr, SyscallArgKind::Len, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
     },
     SyscallDescriptor {
-        number: 31,
-        name: "reserved31",
-        handler: sys_unimplemented,
+        number: SYS_WRITEV,
+        name: "writev",
+        handler: sys_writev,
         max_caller_ring: PrivilegeLevel::Ring3,
-        required_capabilities: CAP_NONE,
-        args: arg_spec(SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
+        required_capabilities: CAP_CONSOLE_IO,
+        args: arg_spec(SyscallArgKind::Fd, SyscallArgKind::Ptr, SyscallArgKind::Len, SyscallArgKind::None, SyscallArgKind::None, SyscallArgKind::None),
+    },
+    SyscallDescriptor {
+        number: SYS_PREADV,
+        name: "preadv",
+        handler: sys_positional_iov,
+        max_caller_ring: PrivilegeLevel::Ring3,
+        required_capabilities: CAP_CONSOLE_IO,
+        args: arg_spec(SyscallArgKind::Fd, SyscallArgKind::Ptr, SyscallArgKind::Len, SyscallArgKind::Offset, SyscallArgKind::None, SyscallArgKind::None),
+    },
+    SyscallDescriptor {
+        number: SYS_PWRITEV,
+        name: "pwritev",
+        handler: sys_positional_iov,
+        max_caller_ring: PrivilegeLevel::Ring3,
+        required_capabilities: CAP_CONSOLE_IO,
+        args: arg_spec(SyscallArgKind::Fd, SyscallArgKind::Ptr, SyscallArgKind::Len, SyscallArgKind::Offset, SyscallArgKind::None, SyscallArgKind::None),
+    },
+    SyscallDescriptor {
+        number: SYS_SPAWN,
+        name: "spawn",
+        handler: sys_spawn,
+        max_caller_ring: PrivilegeLevel::Ring3,
+        required_capabilities: CAP_PROC_MANAGE,
+        args: arg_spec(SyscallArgKind::CStringPtr, SyscallArgKind::CStringArrayPtr, SyscallArgKind::CStringArrayPtr, SyscallArgKind::Ptr, SyscallArgKind::Len, SyscallArgKind::None),
     },
 ];
 
@@ -411,6 +511,7 @@ struct Waiter {
 
 static USER_STDOUT: Mutex<Vec<u8>> = Mutex::new(Vec::new());
 static USER_STDIN: Mutex<VecDeque<u8>> = Mutex::new(VecDeque::new());
+static STDIN_WAIT: WaitQueue = WaitQueue::new();
 static ZOMBIE_CHILDREN: Mutex<Vec<ZombieChild>> = Mutex::new(Vec::new());
 static WAITERS: Mutex<Vec<Waiter>> = Mutex::new(Vec::new());
 
@@ -425,8 +526,39 @@ fn current_thread_snapshot() -> Result<(ThreadId, thread::Thread), Errno> {
 }
 
 fn current_process_id() -> Result<ProcessId, Errno> {
-    let (_, thread) = current_thread_snapshot()?;
-    Ok(thread.process_id)
+    let task = current::current_task().ok_or(Errno::ESRCH)?;
+    Ok(task.pid)
+}
+
+/// The running process's descriptor table; callers lock it without holding
+/// any process-table shard.
+fn current_fd_table() -> Result<process::SharedFdTable, Errno> {
+    process::file_descriptors(current_process_id()?).ok_or(Errno::ESRCH)
+}
+
+fn current_address_space() -> Result<process::AddressSpace, Errno> {
+    let pid = current_process_id()?;
+    process::PROCESS_TABLE
+        .with_process(pid, |process| process.address_space.clone())
+        .ok_or(Errno::ESRCH)
+}
+
+/// The fd's object and flags, copied out so that a blocking read or write
+/// does not sleep holding the process's fd-table lock.
+fn fd_object(fd: u32) -> Result<(FdObject, u32), Errno> {
+    let fds = current_fd_table()?;
+    let fds = fds.lock();
+    let entry = fds.get(fd).ok_or(Errno::EBADF)?;
+    Ok((entry.object.clone(), entry.flags))
+}
+
+fn pipe_errno(err: PipeError) -> Errno {
+    match err {
+        PipeError::WouldBlock => Errno::EAGAIN,
+        PipeError::BrokenPipe => Errno::EPIPE,
+        PipeError::WrongEnd => Errno::EBADF,
+        PipeError::SamePipe => Errno::EINVAL,
+    }
 }
 
 fn current_arch() -> TargetArch {
@@ -450,14 +582,14 @@ pub fn handle_syscall(syscall_number: usize, args: SyscallArgs) -> SyscallResult
     let descriptor = syscall_descriptor(syscall_number).ok_or(Errno::ENOSYS)?;
     debug_assert_eq!(descriptor.number, syscall_number);
 
-    let (_, thread) = current_thread_snapshot()?;
-    let process = process::get_process(thread.process_id).ok_or(Errno::ESRCH)?;
+    // Checked against the per-CPU cached credentials; nothing is cloned
+    let credentials = current::current_task().ok_or(Errno::ESRCH)?.credentials;
 
-    if !process.security.is_privileged_enough(descriptor.max_caller_ring) {
+    if !credentials.is_privileged_enough(descriptor.max_caller_ring) {
         return Err(Errno::EPERM);
     }
 
-    if !process.security.has_capabilities(descriptor.required_capabilities) {
+    if !credentials.has_capabilities(descriptor.required_capabilities) {
         return Err(Errno::EPERM);
     }
 
@@ -474,7 +606,12 @@ pub extern "C" fn syscall_handler(
     arg5: usize,
     arg6: usize,
 ) -> isize {
-    match handle_syscall(syscall_number, SyscallArgs::new(arg1, arg2, arg3, arg4, arg5, arg6)) {
+    let result = handle_syscall(syscall_number, SyscallArgs::new(arg1, arg2, arg3, arg4, arg5, arg6));
+    // Thread context with no locks held: safe for wakeups IRQs deferred,
+    // and for the balancer, which may allocate
+    wait_queue::run_deferred_wakeups();
+    crate::process::scheduler::periodic_balance();
+    match result {
         Ok(value) => value as isize,
         Err(errno) => -(errno as isize),
     }
@@ -488,40 +625,58 @@ fn sys_exit(args: SyscallArgs) -> SyscallResult {
 
 fn sys_fork(_: SyscallArgs) -> SyscallResult {
     let (_, thread) = current_thread_snapshot()?;
-    let parent_process = process::get_process(thread.process_id).ok_or(Errno::ESRCH)?;
-
-    let new_page_frame = allocate_frame().ok_or(Errno::ENOMEM)?;
-    let child_security = parent_process.security.clone();
-    let child_fds = parent_process.file_descriptors.inherit();
-
-    let child_pid = create_process(
-        parent_process.name.clone(),
-        new_page_frame,
-        child_security,
-        child_fds,
-    )
-    .ok_or(Errno::ENOMEM)?;
-
-    {
-        let mut table = process::PROCESS_TABLE.lock();
-        if let Some(child) = table.get_process_mut(child_pid) {
-            child.parent = Some(parent_process.id);
-            child.image = parent_process.image.clone();
-        }
-        if let Some(parent) = table.get_process_mut(parent_process.id) {
-            parent.children.push(child_pid);
-        }
-    }
-
+    let parent_pid = thread.process_id;
+    let (name, child_security, parent_fds, image, parent_space) = process::PROCESS_TABLE
+        .with_process(parent_pid, |parent| {
+            (
+                parent.name.clone(),
+                parent.security.clone(),
+                Arc::clone(&parent.file_descriptors),
+                parent.image.clone(),
+                parent.address_space.clone(),
+            )
+        })
+        .ok_or(Errno::ESRCH)?;
+
+    // The stack comes first, so a failure after the pages are shared
+    // below has only the child's own allocations to undo
     let child_stack = allocate_frame().ok_or(Errno::ENOMEM)?;
-    let child_tid = create_thread(
+    // Shares the parent's pages copy-on-write; nothing is copied here
+    let Some(child_space) = parent_space.clone_for_fork() else {
+        deallocate_frame(child_stack);
+        return Err(Errno::ENOMEM);
+    };
+    let release = |space: process::AddressSpace| {
+        // Drops the child's shares; the parent regains sole ownership
+        space.vmas.lock().clear();
+        deallocate_frame(space.page_table_frame);
+        deallocate_frame(child_stack);
+    };
+    let child_fds = parent_fds.lock().clone();
+
+    let Some(child_pid) = create_process(name, child_space.page_table_frame, child_security, child_fds) else {
+        release(child_space);
+        return Err(Errno::ENOMEM);
+    };
+    let Some(child_tid) = create_thread(
         child_pid,
         thread.priority,
         VirtAddr::new(thread.context.rip),
         VirtAddr::new(child_stack.start_address.0),
         thread.user_stack,
-    )
-    .ok_or(Errno::ENOMEM)?;
+    ) else {
+        process::PROCESS_TABLE.remove_process(child_pid);
+        release(child_space);
+        return Err(Errno::ENOMEM);
+    };
+
+    // Only a complete child is linked to its parent
+    process::PROCESS_TABLE.with_process_mut(child_pid, |child| {
+        child.parent = Some(parent_pid);
+        child.image = image;
+        child.address_space = child_space;
+    });
+    process::PROCESS_TABLE.with_process_mut(parent_pid, |parent| parent.children.push(child_pid));
 
     scheduler::add_thread(child_tid);
     Ok(child_pid.0)
@@ -545,23 +700,145 @@ fn sys_exec(args: SyscallArgs) -> SyscallResult {
 
     let image = userspace::lookup(&path, arch).ok_or(Errno::ESRCH)?;
 
-    let loaded = {
-        let mut table = process::PROCESS_TABLE.lock();
-        let env_refs: &[&str] = &["TERM=vt100", "COLORTERM=truecolor"];
-        let process = table.get_process_mut(thread.process_id).ok_or(Errno::ESRCH)?;
-        loader::exec_into_process(process, image, arch, &argv_refs, env_refs)
-            .map_err(|_| Errno::EINVAL)?
-    };
+    let loaded = process::PROCESS_TABLE
+        .with_process_mut(thread.process_id, |process| {
+            loader::exec_into_process(process, image, arch, &argv_refs, DEFAULT_ENV)
+        })
+        .ok_or(Errno::ESRCH)?
+        .map_err(|_| Errno::EINVAL)?;
 
-    let mut threads = THREAD_TABLE.lock();
-    if let Some(current) = threads.get_thread_mut(tid) {
+    THREAD_TABLE.with_thread_mut(tid, |current| {
         current.context = Context::new_user(loaded.entry_point, loaded.stack.user_sp);
         current.user_stack = Some(loaded.stack.user_sp);
-    }
+    });
+    // The ring lived in the replaced image
+    uring::unregister(thread.process_id);
+    current_fd_table()?.lock().close_on_exec();
 
     Ok(0)
 }
 
+/// `spawn(path, argv, envp, actions, nactions)`: run `path` in a new child
+/// without copying the caller first. The child inherits the caller's
+/// inheritable descriptors with `actions` applied in order, and the image
+/// is loaded straight into a fresh address space. A null `envp` passes the
+/// default environment. Nothing is created if any step fails.
+fn sys_spawn(args: SyscallArgs) -> SyscallResult {
+    let (_, thread) = current_thread_snapshot()?;
+    let parent_pid = thread.process_id;
+    let arch = current_arch();
+
+    let path = read_user_cstring(args.a1)?;
+    let mut argv = read_user_string_array(args.a2)?;
+    if argv.is_empty() {
+        argv.push(path.clone());
+    }
+    let argv_refs = argv.iter().map(|arg| arg.as_str()).collect::<Vec<_>>();
+    let envp = read_user_string_array(args.a3)?;
+    let env_refs = if args.a3 == 0 {
+        DEFAULT_ENV.to_vec()
+    } else {
+        envp.iter().map(|var| var.as_str()).collect::<Vec<_>>()
+    };
+    let actions = user_spawn_actions(args.a4, args.a5)?;
+
+    let image = userspace::lookup(&path, arch).ok_or(Errno::ESRCH)?;
+    let (security, parent_fds) = process::PROCESS_TABLE
+        .with_process(parent_pid, |parent| (parent.security.clone(), Arc::clone(&parent.file_descriptors)))
+        .ok_or(Errno::ESRCH)?;
+
+    let child_fds = spawn_fd_table(&parent_fds.lock(), &actions)?;
+
+    // Both frames come first, so nothing below can fail half way
+    let page_table = allocate_frame().ok_or(Errno::ENOMEM)?;
+    let Some(kernel_stack) = allocate_frame() else {
+        deallocate_frame(page_table);
+        return Err(Errno::ENOMEM);
+    };
+    let release = || {
+        deallocate_frame(kernel_stack);
+        deallocate_frame(page_table);
+    };
+
+    let loaded = match loader::load_executable(image, arch, &process::AddressSpace::new(page_table), &argv_refs, &env_refs) {
+        Ok(loaded) => loaded,
+        Err(_) => {
+            release();
+            return Err(Errno::EINVAL);
+        }
+    };
+
+    let Some(child_pid) = create_process(path, page_table, security, child_fds) else {
+        release();
+        return Err(Errno::ENOMEM);
+    };
+    let Some(child_tid) = create_thread(
+        child_pid,
+        thread.priority,
+        loaded.entry_point,
+        VirtAddr::new(kernel_stack.start_address.0),
+        Some(loaded.stack.user_sp),
+    ) else {
+        process::PROCESS_TABLE.remove_process(child_pid);
+        release();
+        return Err(Errno::ENOMEM);
+    };
+
+    // Only a complete child is linked to its parent
+    process::PROCESS_TABLE.with_process_mut(child_pid, |child| {
+        child.parent = Some(parent_pid);
+        child.image = Some(loaded);
+    });
+    process::PROCESS_TABLE.with_process_mut(parent_pid, |parent| parent.children.push(child_pid));
+
+    scheduler::add_thread(child_tid);
+    Ok(child_pid.0)
+}
+
+fn user_spawn_actions(ptr: usize, count: usize) -> Result<Vec<SpawnAction>, Errno> {
+    if count > SPAWN_ACTIONS_MAX || (ptr == 0 && count != 0) {
+        return Err(Errno::EINVAL);
+    }
+    if count == 0 {
+        return Ok(Vec::new());
+    }
+    let actions = unsafe { slice::from_raw_parts(ptr as *const SpawnAction, count) };
+    Ok(actions.to_vec())
+}
+
+/// The table a spawned child starts with. As in a forked child, the
+/// actions run on a full copy of the parent's table, so they may use
+/// close-on-exec fds; those are closed afterwards, as `exec` would.
+fn spawn_fd_table(parent: &FileDescriptorTable, actions: &[SpawnAction]) -> Result<FileDescriptorTable, Errno> {
+    let mut fds = parent.clone();
+    apply_spawn_actions(&mut fds, actions)?;
+    fds.close_on_exec();
+    Ok(fds)
+}
+
+/// Apply spawn file actions to a child's table, as `dup2` and `close`
+/// would in a forked child before `exec`.
+fn apply_spawn_actions(fds: &mut FileDescriptorTable, actions: &[SpawnAction]) -> Result<(), Errno> {
+    for action in actions {
+        match action.kind {
+            SPAWN_DUP2 => {
+                let entry = fds.get(action.fd).ok_or(Errno::EBADF)?;
+                let (object, flags) = (entry.object.clone(), entry.flags);
+                if action.fd != action.newfd && !fds.insert(action.newfd, flags, true, object) {
+                    return Err(Errno::EBADF);
+                }
+            }
+            SPAWN_CLOSE => {
+                if !fds.remove(action.fd) {
+                    return Err(Errno::EBADF);
+                }
+            }
+            _ => return Err(Errno::EINVAL),
+        }
+    }
+    Ok(())
+}
+
 fn sys_wait(args: SyscallArgs) -> SyscallResult {
     let (tid, thread) = current_thread_snapshot()?;
     let status_ptr = args.a2 as *mut i32;
@@ -582,37 +859,64 @@ fn sys_wait(args: SyscallArgs) -> SyscallResult {
 }
 
 fn sys_getpid(_: SyscallArgs) -> SyscallResult {
-    let (_, thread) = current_thread_snapshot()?;
-    Ok(thread.process_id.0)
+    Ok(current_process_id()?.0)
 }
 
+/// `mmap(addr, len, prot, flags, fd, offset)`. Only records the area;
+/// pages are faulted in on first touch.
 fn sys_mmap(args: SyscallArgs) -> SyscallResult {
-    let addr = args.a1;
-    let length = args.a2;
+    let (addr, len, prot, flags, fd, offset) = (args.a1, args.a2, args.a3, args.a4, args.a5, args.a6);
 
-    if length == 0 {
+    let prot = Protection::from_bits(prot as u32).ok_or(Errno::EINVAL)?;
+    let shared = match flags & (MAP_SHARED | MAP_PRIVATE) {
+        MAP_SHARED => true,
+        MAP_PRIVATE => false,
+        _ => return Err(Errno::EINVAL),
+    };
+    if len == 0 || offset % crate::memory::PAGE_SIZE != 0 {
         return Err(Errno::EINVAL);
     }
 
-    let start_page = Page::containing_address(VirtAddr::new(addr as u64));
-    let num_pages = (length + 4095) / 4096;
-
-    for i in 0..num_pages {
-        let _page = Page::containing_address(VirtAddr::new(
-            start_page.start_address.0 + (i * 4096) as u64,
-        ));
-        let _frame = allocate_frame().ok_or(Errno::ENOMEM)?;
-    }
+    let backing = if flags & MAP_ANONYMOUS != 0 && shared {
+        // Looked up by every process the area is forked into
+        VmaBacking::File { file: Arc::new(SharedAnonymous::new()), offset: 0 }
+    } else if flags & MAP_ANONYMOUS != 0 {
+        VmaBacking::Anonymous
+    } else {
+        // Console and pipe fds have no pages to map. No fd names a file
+        // until `open` exists; then its page cache goes to
+        // `VmaBacking::File` through `PageCacheFile`.
+        match fd_object(fd as u32)?.0 {
+            FdObject::Stdin | FdObject::Stdout | FdObject::Stderr | FdObject::Pipe(_) => {
+                return Err(Errno::ENODEV)
+            }
+        }
+    };
 
-    Ok(addr)
+    let mapped = current_address_space()?
+        .map(VirtAddr::new(addr as u64), len, prot, shared, flags & MAP_FIXED != 0, backing)
+        .map_err(vma_errno)?;
+    Ok(mapped.0 as usize)
 }
 
-fn sys_munmap(_: SyscallArgs) -> SyscallResult {
+fn sys_munmap(args: SyscallArgs) -> SyscallResult {
+    current_address_space()?
+        .unmap(VirtAddr::new(args.a1 as u64), args.a2)
+        .map_err(vma_errno)?;
     Ok(0)
 }
 
+/// `brk(0)` returns the break; `brk(addr)` moves it and returns the new
+/// break, or the unchanged one if `addr` is out of range.
 fn sys_brk(args: SyscallArgs) -> SyscallResult {
-    Ok(args.a1)
+    Ok(current_address_space()?.brk(VirtAddr::new(args.a1 as u64)).0 as usize)
+}
+
+fn vma_errno(err: VmaError) -> Errno {
+    match err {
+        VmaError::Overlap | VmaError::NoSpace | VmaError::OutOfMemory => Errno::ENOMEM,
+        VmaError::Invalid | VmaError::NotMapped | VmaError::Violation => Errno::EINVAL,
+    }
 }
 
 fn sys_clone(args: SyscallArgs) -> SyscallResult {
@@ -647,33 +951,8 @@ fn sys_write(args: SyscallArgs) -> SyscallResult {
         return Ok(0);
     }
 
-    let pid = current_process_id()?;
-    let mut table = process::PROCESS_TABLE.lock();
-    let process = table.get_process_mut(pid).ok_or(Errno::ESRCH)?;
-    let entry = process.file_descriptors.get(fd).ok_or(Errno::EBADF)?;
-
     let data = unsafe { slice::from_raw_parts(buf as *const u8, len) };
-
-    match &entry.object {
-        FdObject::Stdout | FdObject::Stderr => {
-            USER_STDOUT.lock().extend_from_slice(data);
-            
-            // Also write to serial port
-            let mut serial = SERIAL1.lock();
-            for &byte in data {
-                serial.send(byte);
-            }
-            
-            Ok(len)
-        }
-        FdObject::Pipe(end) => {
-            if end.kind() != crate::process::PipeEndKind::Write {
-                return Err(Errno::EBADF);
-            }
-            Ok(end.write(data))
-        }
-        _ => Err(Errno::EPERM),
-    }
+    write_segments(fd, &[data])
 }
 
 fn sys_read(args: SyscallArgs) -> SyscallResult {
@@ -685,46 +964,186 @@ fn sys_read(args: SyscallArgs) -> SyscallResult {
         return Ok(0);
     }
 
-    let mut stdin = USER_STDIN.lock();
+    let dst = unsafe { slice::from_raw_parts_mut(buf as *mut u8, len) };
+    read_segments(fd, &mut [dst])
+}
+
+fn sys_writev(args: SyscallArgs) -> SyscallResult {
+    let segments: Vec<&[u8]> = user_iovecs(args.a2, args.a3)?
+        .iter()
+        .map(|iov| unsafe { slice::from_raw_parts(iov.base as *const u8, iov.len) })
+        .collect();
+    if segments.is_empty() {
+        return Ok(0);
+    }
+    write_segments(args.a1 as u32, &segments)
+}
+
+fn sys_readv(args: SyscallArgs) -> SyscallResult {
+    let mut segments: Vec<&mut [u8]> = user_iovecs(args.a2, args.a3)?
+        .iter()
+        .map(|iov| unsafe { slice::from_raw_parts_mut(iov.base as *mut u8, iov.len) })
+        .collect();
+    if segments.is_empty() {
+        return Ok(0);
+    }
+    read_segments(args.a1 as u32, &mut segments)
+}
 
-    // If buffer is empty, block until we get data from serial
-    if stdin.is_empty() {
-        drop(stdin);
-        loop {
-            // Check serial port
-            if let Some(byte) = SERIAL1.lock().try_receive() {
-                USER_STDIN.lock().push_back(byte);
-                break;
+/// `preadv`/`pwritev`. Console and pipe fds have no file position, so
+/// after validating the arguments these fail with `ESPIPE` as on Linux.
+fn sys_positional_iov(args: SyscallArgs) -> SyscallResult {
+    user_iovecs(args.a2, args.a3)?;
+    if (args.a4 as isize) < 0 {
+        return Err(Errno::EINVAL);
+    }
+    match fd_object(args.a1 as u32)?.0 {
+        FdObject::Stdin | FdObject::Stdout | FdObject::Stderr | FdObject::Pipe(_) => Err(Errno::ESPIPE),
+    }
+}
+
+/// The caller's iovec array, rejecting more than `IOV_MAX` entries or a
+/// total that does not fit in the return value. Empty entries are
+/// dropped so their base pointer is never touched.
+fn user_iovecs(iov: usize, count: usize) -> Result<Vec<IoVec>, Errno> {
+    if count > IOV_MAX || (iov == 0 && count != 0) {
+        return Err(Errno::EINVAL);
+    }
+    if count == 0 {
+        return Ok(Vec::new());
+    }
+
+    let entries = unsafe { slice::from_raw_parts(iov as *const IoVec, count) };
+    entries
+        .iter()
+        .try_fold(0usize, |total, entry| total.checked_add(entry.len))
+        .filter(|&total| total <= isize::MAX as usize)
+        .ok_or(Errno::EINVAL)?;
+    Ok(entries.iter().copied().filter(|entry| entry.len != 0).collect())
+}
+
+/// Write the concatenation of `segments` to `fd`. Console output takes its
+/// locks once and a pipe sees one gathered write, so a header and payload
+/// from separate buffers land together.
+fn write_segments(fd: u32, segments: &[&[u8]]) -> SyscallResult {
+    let (object, flags) = fd_object(fd)?;
+
+    match object {
+        FdObject::Stdout | FdObject::Stderr => {
+            let mut stdout = USER_STDOUT.lock();
+            // Also write to serial port
+            let mut serial = SERIAL1.lock();
+            for data in segments {
+                stdout.extend_from_slice(data);
+                for &byte in *data {
+                    serial.send(byte);
+                }
             }
-            // Yield CPU while waiting
-            scheduler::yield_cpu();
+
+            Ok(segments.iter().map(|data| data.len()).sum())
+        }
+        FdObject::Pipe(end) => {
+            let result = if flags & O_NONBLOCK != 0 {
+                end.try_write_vectored(segments)
+            } else {
+                end.write_vectored(segments)
+            };
+            result.map_err(pipe_errno)
         }
-        stdin = USER_STDIN.lock();
+        _ => Err(Errno::EPERM),
     }
+}
 
-    let mut read = 0;
-    while read < len {
-        match stdin.pop_front() {
-            Some(byte) => {
-                unsafe {
-                    ((buf as *mut u8).add(read)).write(byte);
+/// Fill `segments` in order from `fd`, with `read`'s blocking rules: wait
+/// for the first byte, then take only what is already available.
+fn read_segments(fd: u32, segments: &mut [&mut [u8]]) -> SyscallResult {
+    let (object, flags) = fd_object(fd)?;
+    let nonblocking = flags & O_NONBLOCK != 0;
+
+    match object {
+        FdObject::Stdin => {
+            let mut total = 0;
+            for dst in segments.iter_mut() {
+                match read_stdin(dst, nonblocking || total > 0) {
+                    Ok(count) => {
+                        total += count;
+                        if count < dst.len() {
+                            break;
+                        }
+                    }
+                    Err(_) if total > 0 => break,
+                    Err(errno) => return Err(errno),
                 }
-                read += 1;
             }
-            None => break,
+            Ok(total)
+        }
+        FdObject::Pipe(end) => {
+            let result = if nonblocking {
+                end.try_read_vectored(segments)
+            } else {
+                end.read_vectored(segments)
+            };
+            result.map_err(pipe_errno)
+        }
+        _ => Err(Errno::EBADF),
+    }
+}
+
+/// Take buffered console input, sleeping on `STDIN_WAIT` while there is
+/// none. Woken by `feed_stdin` and `poll_serial_input`.
+fn read_stdin(dst: &mut [u8], nonblocking: bool) -> SyscallResult {
+    let mut take = || {
+        let mut stdin = USER_STDIN.lock();
+        drain_serial(&mut stdin);
+        if stdin.is_empty() {
+            return None;
+        }
+        let count = dst.len().min(stdin.len());
+        for (slot, byte) in dst.iter_mut().zip(stdin.drain(..count)) {
+            *slot = byte;
+        }
+        Some(count)
+    };
+
+    if nonblocking {
+        take().ok_or(Errno::EAGAIN)
+    } else {
+        Ok(STDIN_WAIT.wait_until(take))
+    }
+}
+
+fn drain_serial(stdin: &mut VecDeque<u8>) {
+    if let Some(mut serial) = SERIAL1.try_lock() {
+        while let Some(byte) = serial.try_receive() {
+            stdin.push_back(byte);
+        }
+    }
+}
+
+/// Move received UART bytes into the stdin buffer and have readers woken
+/// once the CPU is back in thread context. Called from the serial IRQ and
+/// the timer tick, so it only try-locks the buffer and UART and leaves the
+/// wakeup, which needs the waiter and scheduler locks, to be deferred; the
+/// next tick retries whatever it could not do.
+pub fn poll_serial_input() {
+    let pending = match USER_STDIN.try_lock() {
+        Some(mut stdin) => {
+            drain_serial(&mut stdin);
+            !stdin.is_empty()
         }
+        None => return,
+    };
+    if pending {
+        STDIN_WAIT.defer_wake_all();
     }
-    Ok(read)
 }
 
 fn sys_close(args: SyscallArgs) -> SyscallResult {
     let fd = args.a1 as u32;
-    let pid = current_process_id()?;
+    let fds = current_fd_table()?;
 
-    let mut table = process::PROCESS_TABLE.lock();
-    let process = table.get_process_mut(pid).ok_or(Errno::ESRCH)?;
-
-    if process.file_descriptors.remove(fd) {
+    let removed = fds.lock().remove(fd);
+    if removed {
         Ok(0)
     } else {
         Err(Errno::EBADF)
@@ -770,18 +1189,18 @@ fn sys_pipe(args: SyscallArgs) -> SyscallResult {
         return Err(Errno::EINVAL);
     }
 
-    let pid = current_process_id()?;
+    let fds = current_fd_table()?;
     let (read_end, write_end) = PipeEnd::new_pair();
 
-    let mut table = process::PROCESS_TABLE.lock();
-    let process = table.get_process_mut(pid).ok_or(Errno::ESRCH)?;
-
-    let read_fd = process
-        .file_descriptors
-        .allocate(0, true, FdObject::Pipe(read_end));
-    let write_fd = process
-        .file_descriptors
-        .allocate(0, true, FdObject::Pipe(write_end));
+    let (read_fd, write_fd) = {
+        let mut fds = fds.lock();
+        let read_fd = fds.allocate(0, true, FdObject::Pipe(read_end)).ok_or(Errno::EMFILE)?;
+        let Some(write_fd) = fds.allocate(0, true, FdObject::Pipe(write_end)) else {
+            fds.remove(read_fd);
+            return Err(Errno::EMFILE);
+        };
+        (read_fd, write_fd)
+    };
 
     unsafe {
         pipefd_ptr.add(0).write(read_fd);
@@ -791,30 +1210,117 @@ fn sys_pipe(args: SyscallArgs) -> SyscallResult {
     Ok(0)
 }
 
+fn sys_fcntl(args: SyscallArgs) -> SyscallResult {
+    let fd = args.a1 as u32;
+    let cmd = args.a2;
+    let arg = args.a3;
+
+    let fds = current_fd_table()?;
+    let mut fds = fds.lock();
+    let entry = fds.get_mut(fd).ok_or(Errno::EBADF)?;
+
+    match (cmd, &entry.object) {
+        (F_GETFD, _) => Ok(if entry.inheritable { 0 } else { FD_CLOEXEC }),
+        (F_SETFD, _) => {
+            entry.inheritable = arg & FD_CLOEXEC == 0;
+            Ok(0)
+        }
+        (F_GETFL, _) => Ok(entry.flags as usize),
+        (F_SETFL, _) => {
+            entry.flags = (entry.flags & !O_NONBLOCK) | (arg as u32 & O_NONBLOCK);
+            Ok(0)
+        }
+        (F_GETPIPE_SZ, FdObject::Pipe(end)) => Ok(end.capacity()),
+        (F_SETPIPE_SZ, FdObject::Pipe(end)) => end.set_capacity(arg).map_err(|err| match err {
+            PipeResizeError::TooLarge => Errno::EPERM,
+            PipeResizeError::Busy => Errno::EBUSY,
+        }),
+        (F_GETPIPE_SZ | F_SETPIPE_SZ, _) => Err(Errno::EBADF),
+        _ => Err(Errno::EINVAL),
+    }
+}
+
+/// Move data out of a pipe without a userspace buffer: into another pipe
+/// with one ring-to-ring copy, or straight from the ring to the console.
+/// Pipes have no file position, so both offsets must be null.
+fn sys_splice(args: SyscallArgs) -> SyscallResult {
+    let (fd_in, off_in, fd_out, off_out) = (args.a1 as u32, args.a2, args.a3 as u32, args.a4);
+    let len = args.a5;
+    let nonblocking = args.a6 & SPLICE_F_NONBLOCK != 0;
+
+    if off_in != 0 || off_out != 0 {
+        return Err(Errno::ESPIPE);
+    }
+
+    let (input, _) = fd_object(fd_in)?;
+    let (output, _) = fd_object(fd_out)?;
+    let FdObject::Pipe(input) = input else {
+        return Err(Errno::EINVAL);
+    };
+
+    let result = match output {
+        FdObject::Pipe(output) if nonblocking => input.try_splice_to(&output, len),
+        FdObject::Pipe(output) => input.splice_to(&output, len),
+        FdObject::Stdout | FdObject::Stderr => {
+            // Locks are taken per chunk, never across a sleep
+            let sink = |chunk: &[u8]| {
+                USER_STDOUT.lock().extend_from_slice(chunk);
+                let mut serial = SERIAL1.lock();
+                for &byte in chunk {
+                    serial.send(byte);
+                }
+            };
+            if nonblocking {
+                input.try_consume_with(len, sink)
+            } else {
+                input.consume_with(len, sink)
+            }
+        }
+        _ => return Err(Errno::EINVAL),
+    };
+    result.map_err(pipe_errno)
+}
+
+/// Duplicate up to `len` bytes from one pipe into another without
+/// consuming them.
+fn sys_tee(args: SyscallArgs) -> SyscallResult {
+    let (fd_in, fd_out, len) = (args.a1 as u32, args.a2 as u32, args.a3);
+    let nonblocking = args.a4 & SPLICE_F_NONBLOCK != 0;
+
+    let (FdObject::Pipe(input), FdObject::Pipe(output)) = (fd_object(fd_in)?.0, fd_object(fd_out)?.0) else {
+        return Err(Errno::EINVAL);
+    };
+
+    let result = if nonblocking {
+        input.try_tee_to(&output, len)
+    } else {
+        input.tee_to(&output, len)
+    };
+    result.map_err(pipe_errno)
+}
+
 fn sys_dup2(args: SyscallArgs) -> SyscallResult {
     let oldfd = args.a1 as u32;
     let newfd = args.a2 as u32;
 
-    let pid = current_process_id()?;
-
-    let mut table = process::PROCESS_TABLE.lock();
-    let process = table.get_process_mut(pid).ok_or(Errno::ESRCH)?;
+    let fds = current_fd_table()?;
+    let mut fds = fds.lock();
 
-    let entry = process.file_descriptors.get(oldfd).ok_or(Errno::EBADF)?;
+    let entry = fds.get(oldfd).ok_or(Errno::EBADF)?;
     let object = entry.object.clone();
     let flags = entry.flags;
-    let inheritable = entry.inheritable;
 
-    let _ = process.file_descriptors.remove(newfd);
-    process
-        .file_descriptors
-        .insert(newfd, flags, inheritable, object);
+    // The copy never inherits FD_CLOEXEC
+    if newfd != oldfd && !fds.insert(newfd, flags, true, object) {
+        return Err(Errno::EBADF);
+    }
 
     Ok(newfd as usize)
 }
 
 pub fn feed_stdin(bytes: &[u8]) {
     USER_STDIN.lock().extend(bytes);
+    STDIN_WAIT.wake_all();
 }
 
 pub fn take_stdout() -> Vec<u8> {
@@ -896,12 +1402,9 @@ fn take_zombie(parent: ProcessId, pid: usize) -> Option<ZombieChild> {
 
 fn record_child_exit(parent: Option<ProcessId>, child: ProcessId, status: usize) {
     if let Some(parent_pid) = parent {
-        {
-            let mut table = process::PROCESS_TABLE.lock();
-            if let Some(parent_process) = table.get_process_mut(parent_pid) {
-                parent_process.children.retain(|pid| *pid != child);
-            }
-        }
+        process::PROCESS_TABLE.with_process_mut(parent_pid, |parent_process| {
+            parent_process.children.retain(|pid| *pid != child);
+        });
 
         {
             let mut zombies = ZOMBIE_CHILDREN.lock();
@@ -930,21 +1433,27 @@ fn record_child_exit(parent: Option<ProcessId>, child: ProcessId, status: usize)
     }
 }
 
+/// End the running thread as if it had called `exit(status)`; used for
+/// faults the kernel cannot resolve.
+pub fn terminate_current(status: usize) {
+    if let Ok((tid, thread)) = current_thread_snapshot() {
+        finalize_thread(tid, thread, status);
+    }
+}
+
 fn finalize_thread(tid: ThreadId, thread: thread::Thread, exit_code: usize) {
     thread::set_thread_state(tid, ThreadState::Terminated);
     scheduler::remove_thread(tid);
-    THREAD_TABLE.lock().remove_thread(tid);
+    THREAD_TABLE.remove_thread(tid);
 
-    let mut table = process::PROCESS_TABLE.lock();
-    if let Some(process) = table.get_process_mut(thread.process_id) {
+    let exited = process::PROCESS_TABLE.remove_process_if(thread.process_id, |process| {
         process.remove_thread(tid);
-        if process.threads.is_empty() {
-            let parent = process.parent;
-            let _ = table.remove_process(thread.process_id);
-            drop(table);
-            record_child_exit(parent, thread.process_id, exit_code);
-            return;
-        }
+        process.threads.is_empty()
+    });
+    if let Some(process) = exited {
+        uring::unregister(process.id);
+        process.address_space.vmas.lock().clear();
+        record_child_exit(process.parent, process.id, exit_code);
     }
 }
 
@@ -952,13 +1461,13 @@ fn finalize_thread(tid: ThreadId, thread: thread::Thread, exit_code: usize) {
 mod tests {
     use super::*;
     use crate::memory::{frame_allocator::Frame, PhysAddr, VirtAddr};
-    use crate::process::{scheduler::SCHEDULER, thread::ThreadTable, FileDescriptorTable, ProcessTable};
+    use crate::process::{scheduler, FileDescriptorTable};
     use crate::security::{SecurityContext, CAP_CONSOLE_IO};
 
     fn reset_state() {
-        *crate::process::PROCESS_TABLE.lock() = ProcessTable::new();
-        *crate::process::thread::THREAD_TABLE.lock() = ThreadTable::new();
-        *SCHEDULER.lock() = crate::process::scheduler::Scheduler::new();
+        crate::process::PROCESS_TABLE.clear();
+        crate::process::thread::THREAD_TABLE.clear();
+        scheduler::reset();
 
         USER_STDOUT.lock().clear();
         USER_STDIN.lock().clear();
@@ -1015,6 +1524,311 @@ mod tests {
         assert_eq!(ok2, 0);
     }
 
+    #[test]
+    fn test_pipe_read_write_and_resize() {
+        reset_state();
+
+        let security = SecurityContext::as_user(1000).with_capabilities(CAP_CONSOLE_IO);
+        create_minimal_process_with_thread(security);
+
+        let mut pipefd = [0u32; 2];
+        assert_eq!(syscall_handler(SYS_PIPE, pipefd.as_mut_ptr() as usize, 0, 0, 0, 0, 0), 0);
+        let (rfd, wfd) = (pipefd[0] as usize, pipefd[1] as usize);
+
+        let fcntl = |fd, cmd, arg| syscall_handler(SYS_FCNTL, fd, cmd, arg, 0, 0, 0);
+        assert_eq!(fcntl(wfd, F_GETPIPE_SZ, 0), crate::process::pipe::PIPE_DEFAULT_SIZE as isize);
+        assert_eq!(fcntl(wfd, F_SETPIPE_SZ, 5000), 8192);
+        assert_eq!(fcntl(1, F_GETPIPE_SZ, 0), -(Errno::EBADF as isize));
+
+        // A full pipe would block the writer; make it non-blocking
+        assert_eq!(fcntl(wfd, F_SETFL, O_NONBLOCK as usize), 0);
+        assert_eq!(fcntl(wfd, F_GETFL, 0), O_NONBLOCK as isize);
+
+        let data = [7u8; 10000];
+        let written = syscall_handler(SYS_WRITE, wfd, data.as_ptr() as usize, data.len(), 0, 0, 0);
+        assert_eq!(written, 8192);
+        let again = syscall_handler(SYS_WRITE, wfd, data.as_ptr() as usize, 1, 0, 0, 0);
+        assert_eq!(again, -(Errno::EAGAIN as isize));
+        assert_eq!(fcntl(rfd, F_SETPIPE_SZ, 4096), -(Errno::EBUSY as isize));
+
+        let mut out = [0u8; 10000];
+        let read = syscall_handler(SYS_READ, rfd, out.as_mut_ptr() as usize, out.len(), 0, 0, 0);
+        assert_eq!(read, 8192);
+        assert!(out[..8192].iter().all(|&b| b == 7));
+        assert_eq!(
+            syscall_handler(SYS_READ, wfd, out.as_mut_ptr() as usize, 1, 0, 0, 0),
+            -(Errno::EBADF as isize)
+        );
+
+        // Closing the only writer turns the empty pipe into end of file
+        assert_eq!(syscall_handler(SYS_CLOSE, wfd, 0, 0, 0, 0, 0), 0);
+        assert_eq!(syscall_handler(SYS_READ, rfd, out.as_mut_ptr() as usize, 1, 0, 0, 0), 0);
+    }
+
+    #[test]
+    fn test_splice_and_tee() {
+        reset_state();
+
+        let security = SecurityContext::as_user(1000).with_capabilities(CAP_CONSOLE_IO);
+        create_minimal_process_with_thread(security);
+
+        let mut first = [0u32; 2];
+        let mut second = [0u32; 2];
+        syscall_handler(SYS_PIPE, first.as_mut_ptr() as usize, 0, 0, 0, 0, 0);
+        syscall_handler(SYS_PIPE, second.as_mut_ptr() as usize, 0, 0, 0, 0, 0);
+        let [first_r, first_w] = first.map(|fd| fd as usize);
+        let [second_r, second_w] = second.map(|fd| fd as usize);
+
+        let msg = b"log line\n";
+        syscall_handler(SYS_WRITE, first_w, msg.as_ptr() as usize, msg.len(), 0, 0, 0);
+
+        let tee = syscall_handler(SYS_TEE, first_r, second_w, 64, SPLICE_F_NONBLOCK, 0, 0);
+        assert_eq!(tee, msg.len() as isize);
+
+        // Pipe to console, no user buffer involved
+        take_stdout();
+        let spliced = syscall_handler(SYS_SPLICE, first_r, 0, 1, 0, 64, SPLICE_F_NONBLOCK);
+        assert_eq!(spliced, msg.len() as isize);
+        assert_eq!(take_stdout(), msg.to_vec());
+
+        let empty = syscall_handler(SYS_SPLICE, first_r, 0, second_w, 0, 64, SPLICE_F_NONBLOCK);
+        assert_eq!(empty, -(Errno::EAGAIN as isize));
+        let offset = 0usize;
+        let seek = syscall_handler(SYS_SPLICE, first_r, &offset as *const usize as usize, second_w, 0, 64, 0);
+        assert_eq!(seek, -(Errno::ESPIPE as isize));
+
+        let mut out = [0u8; 64];
+        let read = syscall_handler(SYS_READ, second_r, out.as_mut_ptr() as usize, out.len(), 0, 0, 0);
+        assert_eq!(&out[..read as usize], msg);
+    }
+
+    #[test]
+    fn test_readv_writev() {
+        reset_state();
+
+        let security = SecurityContext::as_user(1000).with_capabilities(CAP_CONSOLE_IO);
+        create_minimal_process_with_thread(security);
+
+        let mut pipefd = [0u32; 2];
+        syscall_handler(SYS_PIPE, pipefd.as_mut_ptr() as usize, 0, 0, 0, 0, 0);
+        let (rfd, wfd) = (pipefd[0] as usize, pipefd[1] as usize);
+
+        let header = b"GET /";
+        let body = b"index.html";
+        let iov = [
+            IoVec { base: header.as_ptr() as usize, len: header.len() },
+            IoVec { base: 0, len: 0 },
+            IoVec { base: body.as_ptr() as usize, len: body.len() },
+        ];
+        let writev = |fd, iov: &[IoVec]| syscall_handler(SYS_WRITEV, fd, iov.as_ptr() as usize, iov.len(), 0, 0, 0);
+        assert_eq!(writev(wfd, &iov), 15);
+
+        take_stdout();
+        assert_eq!(writev(1, &iov), 15);
+        assert_eq!(take_stdout(), b"GET /index.html".to_vec());
+
+        let mut first = [0u8; 3];
+        let mut second = [0u8; 32];
+        let read_iov = [
+            IoVec { base: first.as_mut_ptr() as usize, len: first.len() },
+            IoVec { base: second.as_mut_ptr() as usize, len: second.len() },
+        ];
+        let read = syscall_handler(SYS_READV, rfd, read_iov.as_ptr() as usize, 2, 0, 0, 0);
+        assert_eq!(read, 15);
+        assert_eq!(&first, b"GET");
+        assert_eq!(&second[..12], b" /index.html");
+
+        assert_eq!(writev(wfd, &[]), 0);
+        assert_eq!(
+            syscall_handler(SYS_WRITEV, wfd, iov.as_ptr() as usize, IOV_MAX + 1, 0, 0, 0),
+            -(Errno::EINVAL as isize)
+        );
+        let huge = [IoVec { base: 1, len: usize::MAX }, IoVec { base: 1, len: 1 }];
+        assert_eq!(writev(wfd, &huge), -(Errno::EINVAL as isize));
+        assert_eq!(
+            syscall_handler(SYS_PREADV, rfd, read_iov.as_ptr() as usize, 2, 0, 0, 0),
+            -(Errno::ESPIPE as isize)
+        );
+        assert_eq!(
+            syscall_handler(SYS_PWRITEV, 99, iov.as_ptr() as usize, 3, 0, 0, 0),
+            -(Errno::EBADF as isize)
+        );
+    }
+
+    #[test]
+    fn test_uring_batches_pipe_io() {
+        use uring::{UringCqe, UringHeader, UringSqe};
+
+        reset_state();
+
+        let security = SecurityContext::as_user(1000).with_capabilities(CAP_CONSOLE_IO);
+        let (pid, _) = create_minimal_process_with_thread(security);
+
+        let mut pipefd = [0u32; 2];
+        syscall_handler(SYS_PIPE, pipefd.as_mut_ptr() as usize, 0, 0, 0, 0, 0);
+        let (rfd, wfd) = (pipefd[0] as u64, pipefd[1] as u64);
+
+        const ENTRIES: u32 = 4;
+        let mut region = vec![0u64; uring::region_size(ENTRIES) / 8];
+        let base = region.as_mut_ptr() as usize;
+        assert_eq!(syscall_handler(SYS_URING_SETUP, base, 3, 0, 0, 0, 0), -(Errno::EINVAL as isize));
+        assert_eq!(syscall_handler(SYS_URING_ENTER, 1, 0, 0, 0, 0, 0), -(Errno::EBADF as isize));
+        assert_eq!(syscall_handler(SYS_URING_SETUP, base, ENTRIES as usize, 0, 0, 0, 0), 0);
+
+        let header = unsafe { &*(base as *const UringHeader) };
+        let sqes = (base + core::mem::size_of::<UringHeader>()) as *mut UringSqe;
+        let cqes = unsafe { sqes.add(ENTRIES as usize) } as *const UringCqe;
+        assert_eq!(header.cq_entries, 2 * ENTRIES);
+
+        let msg = b"batched";
+        let mut out = [0u8; 16];
+        let queue = |sqe: UringSqe| {
+            let tail = header.sq_tail.load(core::sync::atomic::Ordering::Relaxed);
+            unsafe { sqes.add((tail & header.sq_mask) as usize).write(sqe) };
+            header.sq_tail.store(tail + 1, core::sync::atomic::Ordering::Release);
+        };
+        let op = |opcode: usize, args: [u64; 6], user_data| UringSqe {
+            opcode: opcode as u32,
+            flags: 0,
+            args,
+            user_data,
+        };
+
+        queue(op(SYS_WRITE, [wfd, msg.as_ptr() as u64, msg.len() as u64, 0, 0, 0], 1));
+        queue(op(SYS_READ, [rfd, out.as_mut_ptr() as u64, out.len() as u64, 0, 0, 0], 2));
+        queue(op(SYS_FORK, [0; 6], 3));
+        queue(op(SYS_GETPID, [0; 6], 4));
+        assert_eq!(syscall_handler(SYS_URING_ENTER, 8, 0, 0, 0, 0, 0), 4);
+
+        let completions: Vec<(u64, i64)> = (0..4)
+            .map(|i| unsafe { cqes.add(i).read() })
+            .map(|cqe| (cqe.user_data, cqe.res))
+            .collect();
+        assert_eq!(
+            completions,
+            vec![
+                (1, msg.len() as i64),
+                (2, msg.len() as i64),
+                (3, -(Errno::EINVAL as i64)),
+                (4, pid.0 as i64),
+            ]
+        );
+        assert_eq!(&out[..msg.len()], msg);
+        assert_eq!(header.sq_head.load(core::sync::atomic::Ordering::Acquire), 4);
+
+        // Four unreaped completions leave room for four more, not five
+        for user_data in 5..10 {
+            queue(op(SYS_GETPID, [0; 6], user_data));
+            if user_data == 8 {
+                assert_eq!(syscall_handler(SYS_URING_ENTER, 4, 0, 0, 0, 0, 0), 4);
+            }
+        }
+        assert_eq!(syscall_handler(SYS_URING_ENTER, 1, 0, 0, 0, 0, 0), -(Errno::EBUSY as isize));
+        header.cq_head.store(8, core::sync::atomic::Ordering::Release);
+
+        // Sizes rewritten by userspace after setup are ignored
+        unsafe {
+            let header = base as *mut UringHeader;
+            (*header).sq_entries = u32::MAX;
+            (*header).cq_mask = u32::MAX;
+            (*header).cq_entries = u32::MAX;
+        }
+        assert_eq!(syscall_handler(SYS_URING_ENTER, 1, 0, 0, 0, 0, 0), 1);
+        assert_eq!(unsafe { cqes.read() }.user_data, 9);
+
+        // A second thread entering a ring that is being run backs off
+        // without consuming anything
+        queue(op(SYS_GETPID, [0; 6], 10));
+        {
+            let running = uring::running_lock(pid).unwrap();
+            let _held = running.lock();
+            assert_eq!(syscall_handler(SYS_URING_ENTER, 1, 0, 0, 0, 0, 0), -(Errno::EAGAIN as isize));
+        }
+        assert_eq!(header.sq_head.load(core::sync::atomic::Ordering::Acquire), 9);
+        assert_eq!(syscall_handler(SYS_URING_ENTER, 1, 0, 0, 0, 0, 0), 1);
+
+        assert_eq!(syscall_handler(SYS_URING_SETUP, 0, 0, 0, 0, 0, 0), 0);
+        assert_eq!(syscall_handler(SYS_URING_ENTER, 1, 0, 0, 0, 0, 0), -(Errno::EBADF as isize));
+    }
+
+    #[test]
+    fn test_mmap_munmap_brk() {
+        reset_state();
+        crate::memory::vma::init_test_frames();
+
+        let security = SecurityContext::as_user(1000).with_capabilities(CAP_VM_MANAGE | CAP_CONSOLE_IO);
+        let (pid, _) = create_minimal_process_with_thread(security);
+        let rw = PROT_READ | PROT_WRITE;
+        let anon = MAP_PRIVATE | MAP_ANONYMOUS;
+
+        let first = syscall_handler(SYS_MMAP, 0, 3 * 4096, rw, anon, usize::MAX, 0);
+        assert_eq!(first as u64, process::MMAP_BASE.0);
+        let second = syscall_handler(SYS_MMAP, 0, 100, PROT_READ, anon, usize::MAX, 0);
+        assert_eq!(second, first + 3 * 4096);
+
+        // Nothing is resident until a page is touched
+        let vmas = process::mappings(pid).unwrap();
+        let addr = VirtAddr::new(first as u64 + 4096 + 8);
+        assert!(!vmas.lock().find(addr).unwrap().is_resident(addr));
+        assert!(process::handle_page_fault(addr, true));
+        assert!(vmas.lock().find(addr).unwrap().is_resident(addr));
+        assert!(!process::handle_page_fault(VirtAddr::new(0x10), false));
+
+        assert_eq!(syscall_handler(SYS_MUNMAP, first as usize + 4096, 4096, 0, 0, 0, 0), 0);
+        assert!(!process::handle_page_fault(addr, false));
+        assert_eq!(vmas.lock().len(), 3);
+
+        let fixed = syscall_handler(SYS_MMAP, first as usize + 4096, 4096, rw, anon | MAP_FIXED, usize::MAX, 0);
+        assert_eq!(fixed, first + 4096);
+        assert_eq!(syscall_handler(SYS_MMAP, 0, 4096, rw, MAP_ANONYMOUS, 0, 0), -(Errno::EINVAL as isize));
+        assert_eq!(syscall_handler(SYS_MMAP, 0, 4096, rw, MAP_SHARED, 1, 0), -(Errno::ENODEV as isize));
+
+        let heap = syscall_handler(SYS_BRK, 0, 0, 0, 0, 0, 0);
+        assert_eq!(syscall_handler(SYS_BRK, heap as usize + 10_000, 0, 0, 0, 0, 0), heap + 10_000);
+        assert!(process::handle_page_fault(VirtAddr::new(heap as u64 + 9_000), true));
+        assert_eq!(syscall_handler(SYS_BRK, usize::MAX, 0, 0, 0, 0, 0), heap + 10_000);
+    }
+
+    #[test]
+    fn test_spawn_actions_and_failures() {
+        reset_state();
+        crate::memory::vma::init_test_frames();
+
+        let security = SecurityContext::as_user(1000).with_capabilities(CAP_PROC_MANAGE | CAP_CONSOLE_IO);
+        let (pid, _) = create_minimal_process_with_thread(security);
+        let mut pipefd = [0u32; 2];
+        assert_eq!(syscall_handler(SYS_PIPE, pipefd.as_mut_ptr() as usize, 0, 0, 0, 0, 0), 0);
+        let action = |kind, fd, newfd| SpawnAction { kind, fd, newfd, reserved: 0 };
+        let actions = [action(SPAWN_DUP2, pipefd[1], 5), action(SPAWN_CLOSE, pipefd[0], 0)];
+
+        // Actions edit the child's copy, never the caller's table. They
+        // see close-on-exec fds, which the child then loses.
+        let parent_fds = process::file_descriptors(pid).unwrap();
+        parent_fds.lock().get_mut(pipefd[1]).unwrap().inheritable = false;
+        let mut child_fds = spawn_fd_table(&parent_fds.lock(), &actions).unwrap();
+        assert!(matches!(child_fds.get(5).unwrap().object, FdObject::Pipe(_)));
+        assert!(child_fds.get(pipefd[0]).is_none());
+        assert!(child_fds.get(pipefd[1]).is_none());
+        assert!(parent_fds.lock().get(pipefd[0]).is_some());
+        assert!(parent_fds.lock().get(5).is_none());
+
+        // Targets at or above FD_MAX are refused, not allocated
+        let past_max = [action(SPAWN_DUP2, 0, u32::MAX)];
+        assert_eq!(apply_spawn_actions(&mut child_fds, &past_max), Err(Errno::EBADF));
+        assert_eq!(sys_dup2(SyscallArgs::new(0, u32::MAX as usize, 0, 0, 0, 0)), Err(Errno::EBADF));
+        assert_eq!(sys_dup2(SyscallArgs::new(0, 7, 0, 0, 0, 0)), Ok(7));
+
+        let spawn = |path: &[u8], actions: &[SpawnAction]| {
+            syscall_handler(SYS_SPAWN, path.as_ptr() as usize, 0, 0, actions.as_ptr() as usize, actions.len(), 0)
+        };
+        assert_eq!(spawn(b"/bin/sh\0", &[action(SPAWN_CLOSE, 42, 0)]), -(Errno::EBADF as isize));
+        assert_eq!(spawn(b"/bin/sh\0", &[action(7, 0, 0)]), -(Errno::EINVAL as isize));
+        assert_eq!(spawn(b"/bin/none\0", &[]), -(Errno::ESRCH as isize));
+        // Built-in images are empty placeholders in host tests
+        assert_eq!(spawn(b"/bin/sh\0", &actions), -(Errno::EINVAL as isize));
+        assert_eq!(process::PROCESS_TABLE.with_process(pid, |p| p.children.len()), Some(0));
+    }
+
     #[test]
     fn test_privilege_ring_enforcement() {
         reset_state();
@@ -1032,4 +1846,79 @@ mod tests {
         let allowed = syscall_handler(SYS_DEBUG_LOG, 0, 0, 0, 0, 0, 0);
         assert_eq!(allowed, -(Errno::ENOSYS as isize));
     }
+
+    #[test]
+    fn test_cached_credentials_follow_switches() {
+        reset_state();
+
+        let (user_pid, user_tid) = create_minimal_process_with_thread(SecurityContext::as_user(1000));
+        let (kernel_pid, kernel_tid) = create_minimal_process_with_thread(SecurityContext::kernel());
+
+        // spawn needs CAP_PROC_MANAGE; with it, the null path is the error
+        crate::process::current::set_current_thread(Some(user_tid));
+        assert_eq!(syscall_handler(SYS_GETPID, 0, 0, 0, 0, 0, 0), user_pid.0 as isize);
+        assert_eq!(syscall_handler(SYS_SPAWN, 0, 0, 0, 0, 0, 0), -(Errno::EPERM as isize));
+
+        crate::process::current::set_current_thread(Some(kernel_tid));
+        assert_eq!(syscall_handler(SYS_GETPID, 0, 0, 0, 0, 0, 0), kernel_pid.0 as isize);
+        assert_eq!(syscall_handler(SYS_SPAWN, 0, 0, 0, 0, 0, 0), -(Errno::EINVAL as isize));
+
+        crate::process::current::set_current_thread(None);
+        assert_eq!(syscall_handler(SYS_GETPID, 0, 0, 0, 0, 0, 0), -(Errno::ESRCH as isize));
+    }
+
+    /// Per-call cost of a getpid round trip through the dispatcher, against
+    /// the previous path that cloned the thread and process on every call.
+    /// Run with `cargo test --lib syscall_roundtrip_bench -- --ignored --nocapture`.
+    #[test]
+    #[ignore]
+    fn syscall_roundtrip_bench() {
+        use std::hint::black_box;
+        use std::time::Instant;
+
+        const ITERATIONS: u32 = 200_000;
+
+        reset_state();
+        let (pid, _) = create_minimal_process_with_thread(SecurityContext::as_user(1000));
+
+        // Give the process the state a shell would have
+        crate::process::PROCESS_TABLE.with_process_mut(pid, |process| {
+            process.name = "/bin/shell --interactive".into();
+            for child in 0..16 {
+                process.children.push(ProcessId(100 + child));
+            }
+            let mut fds = process.file_descriptors.lock();
+            for _ in 0..16 {
+                let (read_end, write_end) = PipeEnd::new_pair();
+                fds.allocate(0, true, FdObject::Pipe(read_end));
+                fds.allocate(0, true, FdObject::Pipe(write_end));
+            }
+        });
+
+        let descriptor = syscall_descriptor(SYS_GETPID).unwrap();
+        let start = Instant::now();
+        for _ in 0..ITERATIONS {
+            let (_, thread) = current_thread_snapshot().unwrap();
+            let process = process::get_process(thread.process_id).unwrap();
+            assert!(process.security.is_privileged_enough(descriptor.max_caller_ring));
+            assert!(process.security.has_capabilities(descriptor.required_capabilities));
+            let (_, thread) = current_thread_snapshot().unwrap();
+            black_box(thread.process_id.0);
+        }
+        let cloning = start.elapsed();
+
+        let start = Instant::now();
+        for _ in 0..ITERATIONS {
+            black_box(syscall_handler(black_box(SYS_GETPID), 0, 0, 0, 0, 0, 0));
+        }
+        let cached = start.elapsed();
+
+        let per_call = |elapsed: std::time::Duration| elapsed.as_nanos() / ITERATIONS as u128;
+        println!(
+            "syscall round trip (getpid): cloning {} ns/call, cached {} ns/call",
+            per_call(cloning),
+            per_call(cached)
+        );
+        assert_eq!(syscall_handler(SYS_GETPID, 0, 0, 0, 0, 0, 0), pid.0 as isize);
+    }
 }
@@ -0,0 +1,236 @@
+//! Batched syscall submission ring.
+//!
+//! A process registers one region of its own memory with `uring_setup`:
+//! a `UringHeader`, then `sq_entries` submission entries, then twice as many
+//! completion entries. Userspace fills SQEs and advances `sq_tail`; one
+//! `uring_enter` trap then runs every queued entry in order through the
+//! normal dispatcher (the same ring and capability checks as a direct trap)
+//! and posts a CQE for each, which userspace reaps without trapping again.
+//!
+//! Entries run synchronously inside `uring_enter`. A read on an empty pipe
+//! sleeps there just as it would as a direct call, so a batch that must not
+//! stall should use `O_NONBLOCK` fds. One thread at a time runs a ring;
+//! another thread of the process entering it meanwhile gets `-EAGAIN`.
+
+use core::sync::atomic::{AtomicU32, Ordering};
+
+#[cfg(not(test))]
+use alloc::{sync::Arc, vec::Vec};
+#[cfg(test)]
+use std::{sync::Arc, vec::Vec};
+
+use spin::Mutex;
+
+use super::{
+    current_process_id, handle_syscall, Errno, SyscallArgs, SyscallResult, SYS_CLOSE, SYS_DUP2,
+    SYS_FCNTL, SYS_GETPID, SYS_OPEN, SYS_PIPE, SYS_READ, SYS_READV, SYS_SPLICE, SYS_TEE, SYS_WRITE,
+    SYS_WRITEV,
+};
+use crate::process::ProcessId;
+
+pub const URING_MAX_ENTRIES: u32 = 4096;
+
+/// Start of the shared region. Userspace owns `sq_tail` and `cq_head`, the
+/// kernel owns `sq_head` and `cq_tail`; the sizes are written by setup for
+/// userspace to read; the kernel keeps its own copy and never reads them.
+#[repr(C)]
+pub struct UringHeader {
+    pub sq_head: AtomicU32,
+    pub sq_tail: AtomicU32,
+    pub sq_mask: u32,
+    pub sq_entries: u32,
+    pub cq_head: AtomicU32,
+    pub cq_tail: AtomicU32,
+    pub cq_mask: u32,
+    pub cq_entries: u32,
+    _reserved: [u32; 8],
+}
+
+/// One queued call: `opcode` is the syscall number, `args` its arguments.
+#[derive(Debug, Clone, Copy, Default)]
+#[repr(C)]
+pub struct UringSqe {
+    pub opcode: u32,
+    pub flags: u32,
+    pub args: [u64; 6],
+    pub user_data: u64,
+}
+
+/// Result of one SQE: its `user_data` and what the call would have returned.
+#[derive(Debug, Clone, Copy, Default)]
+#[repr(C)]
+pub struct UringCqe {
+    pub user_data: u64,
+    pub res: i64,
+}
+
+/// Bytes userspace must provide for a ring of `entries` submissions.
+pub const fn region_size(entries: u32) -> usize {
+    let entries = entries as usize;
+    core::mem::size_of::<UringHeader>()
+        + entries * core::mem::size_of::<UringSqe>()
+        + 2 * entries * core::mem::size_of::<UringCqe>()
+}
+
+/// A registered ring. `sq_entries` is fixed at setup; every index into the
+/// region is masked with values derived from it, never with the header's.
+/// `running` is held while a thread consumes SQEs and posts CQEs, so two
+/// threads never run the same entries or fill the same slots.
+#[derive(Clone)]
+struct Registration {
+    pid: ProcessId,
+    base: usize,
+    sq_entries: u32,
+    running: Arc<Mutex<()>>,
+}
+
+impl Registration {
+    fn sq_mask(&self) -> u32 {
+        self.sq_entries - 1
+    }
+
+    fn cq_entries(&self) -> u32 {
+        2 * self.sq_entries
+    }
+
+    fn cq_mask(&self) -> u32 {
+        self.cq_entries() - 1
+    }
+}
+
+static RINGS: Mutex<Vec<Registration>> = Mutex::new(Vec::new());
+
+/// Calls worth batching. Anything that replaces or ends the caller, or
+/// re-enters the ring, has to be a direct trap.
+fn batchable(opcode: usize) -> bool {
+    matches!(
+        opcode,
+        SYS_READ | SYS_WRITE | SYS_READV | SYS_WRITEV | SYS_OPEN | SYS_CLOSE | SYS_PIPE
+            | SYS_DUP2 | SYS_FCNTL | SYS_SPLICE | SYS_TEE | SYS_GETPID
+    )
+}
+
+/// `uring_setup(region, entries)`: register `region` as the caller's ring,
+/// replacing any earlier one. `entries` must be a power of two up to
+/// `URING_MAX_ENTRIES`. `uring_setup(0, 0)` unregisters.
+pub(super) fn sys_uring_setup(args: SyscallArgs) -> SyscallResult {
+    let pid = current_process_id()?;
+    let (base, entries) = (args.a1, args.a2);
+
+    if base == 0 && entries == 0 {
+        unregister(pid);
+        return Ok(0);
+    }
+    if base == 0 || base % core::mem::align_of::<UringSqe>() != 0 {
+        return Err(Errno::EINVAL);
+    }
+    let entries = u32::try_from(entries).map_err(|_| Errno::EINVAL)?;
+    if !entries.is_power_of_two() || entries > URING_MAX_ENTRIES {
+        return Err(Errno::EINVAL);
+    }
+
+    let ring = Registration {
+        pid,
+        base,
+        sq_entries: entries,
+        running: Arc::new(Mutex::new(())),
+    };
+
+    // SAFETY: the caller handed us `region_size(entries)` bytes of its memory
+    let header = unsafe { &mut *(base as *mut UringHeader) };
+    header.sq_head.store(0, Ordering::Relaxed);
+    header.sq_tail.store(0, Ordering::Relaxed);
+    header.sq_mask = ring.sq_mask();
+    header.sq_entries = ring.sq_entries;
+    header.cq_head.store(0, Ordering::Relaxed);
+    header.cq_tail.store(0, Ordering::Relaxed);
+    header.cq_mask = ring.cq_mask();
+    header.cq_entries = ring.cq_entries();
+    header._reserved = [0; 8];
+
+    let mut rings = RINGS.lock();
+    rings.retain(|ring| ring.pid != pid);
+    rings.push(ring);
+    Ok(0)
+}
+
+/// `uring_enter(to_submit, flags)`: run up to `to_submit` queued entries and
+/// return how many were consumed. Stops early when the SQ runs dry or the
+/// CQ is full; fails with `-EBUSY` if nothing could be posted at all, and
+/// with `-EAGAIN` if another thread is running the ring. That thread may
+/// be asleep in an entry, so this one does not spin on it.
+pub(super) fn sys_uring_enter(args: SyscallArgs) -> SyscallResult {
+    if args.a2 != 0 {
+        return Err(Errno::EINVAL);
+    }
+    let pid = current_process_id()?;
+    let ring = RINGS
+        .lock()
+        .iter()
+        .find(|ring| ring.pid == pid)
+        .cloned()
+        .ok_or(Errno::EBADF)?;
+    let _running = ring.running.try_lock().ok_or(Errno::EAGAIN)?;
+
+    // SAFETY: registered by this process in `sys_uring_setup`. Userspace can
+    // rewrite the header's sizes at any time, so only `ring`'s are used.
+    let header = unsafe { &*(ring.base as *const UringHeader) };
+    let sqes = (ring.base + core::mem::size_of::<UringHeader>()) as *const UringSqe;
+    let cqes = unsafe { sqes.add(ring.sq_entries as usize) } as *mut UringCqe;
+
+    let mut sq_head = header.sq_head.load(Ordering::Relaxed);
+    let sq_tail = header.sq_tail.load(Ordering::Acquire);
+    let mut cq_tail = header.cq_tail.load(Ordering::Relaxed);
+
+    let mut submitted = 0;
+    while submitted < args.a1 && sq_head != sq_tail {
+        if cq_tail.wrapping_sub(header.cq_head.load(Ordering::Acquire)) >= ring.cq_entries() {
+            break;
+        }
+
+        let sqe = unsafe { sqes.add((sq_head & ring.sq_mask()) as usize).read() };
+        sq_head = sq_head.wrapping_add(1);
+        header.sq_head.store(sq_head, Ordering::Release);
+
+        let res = match execute(&sqe) {
+            Ok(value) => value as i64,
+            Err(errno) => -(errno as i64),
+        };
+        unsafe {
+            cqes.add((cq_tail & ring.cq_mask()) as usize)
+                .write(UringCqe { user_data: sqe.user_data, res });
+        }
+        cq_tail = cq_tail.wrapping_add(1);
+        header.cq_tail.store(cq_tail, Ordering::Release);
+        submitted += 1;
+    }
+
+    if submitted == 0 && args.a1 != 0 && sq_head != sq_tail {
+        return Err(Errno::EBUSY);
+    }
+    Ok(submitted)
+}
+
+fn execute(sqe: &UringSqe) -> SyscallResult {
+    let opcode = sqe.opcode as usize;
+    if sqe.flags != 0 || !batchable(opcode) {
+        return Err(Errno::EINVAL);
+    }
+    let [a1, a2, a3, a4, a5, a6] = sqe.args.map(|arg| arg as usize);
+    handle_syscall(opcode, SyscallArgs::new(a1, a2, a3, a4, a5, a6))
+}
+
+/// Forget `pid`'s ring; called when the process exits or execs.
+pub(super) fn unregister(pid: ProcessId) {
+    RINGS.lock().retain(|ring| ring.pid != pid);
+}
+
+/// The lock `uring_enter` holds while it runs `pid`'s ring.
+#[cfg(test)]
+pub(super) fn running_lock(pid: ProcessId) -> Option<Arc<Mutex<()>>> {
+    RINGS
+        .lock()
+        .iter()
+        .find(|ring| ring.pid == pid)
+        .map(|ring| ring.running.clone())
+}
@@ -6,10 +6,11 @@
 // Forward declarations
 extern void* malloc(u64 size);
 extern void free(void* ptr);
+extern void* memset(void* ptr, int value, u64 num);
+extern void* memcpy(void* dest, const void* src, u64 num);
 extern i32 strcmp(const char* s1, const char* s2);
 extern i32 strncmp(const char* s1, const char* s2, u64 n);
 extern char* strncpy(char* dest, const char* src, u64 n);
-extern char* strtok(char* str, const char* delim);
 extern char* strrchr(const char* str, int c);
 extern u64 system_time;
 
@@ -50,6 +51,13 @@ typedef struct vfs_node {
     struct vfs_node* prev;
     struct vfs_node* parent;
     struct vfs_node* children;
+
+    // Child lookup: a directory's children are also hashed by name
+    u32 name_hash;
+    u32 child_count;
+    u32 child_buckets;
+    struct vfs_node** child_table;
+    struct vfs_node* hash_next;
 } vfs_node_t;
 
 // VFS operations structure
@@ -75,6 +83,8 @@ typedef struct vfs_ops {
     // Lookup operations
     vfs_node_t* (*lookup)(vfs_node_t* parent, const char* name);
     i32 (*readdir)(vfs_node_t* dir, u64 index, vfs_node_t* result);
+    // Batched listing from a cursor the file system owns (0 = start)
+    i32 (*getdents)(vfs_node_t* dir, u64* pos, void* buffer, u64 size);
 } vfs_ops_t;
 
 // Mount point structure
@@ -95,11 +105,39 @@ typedef struct {
     u32 reference_count;
 } file_descriptor_t;
 
+// One scatter/gather segment, laid out like struct iovec
+typedef struct {
+    void* base;
+    u64 len;
+} vfs_iovec_t;
+
+#define VFS_IOV_MAX 1024
+
 // Global VFS structures
 static vfs_node_t* vfs_root = NULL;
 static mount_point_t* mount_points = NULL;
-static file_descriptor_t file_descriptors[256];
-static u32 next_fd = 3; // 0=stdin, 1=stdout, 2=stderr
+
+// Open files, indexed by fd. The table doubles when every slot is taken,
+// up to VFS_FD_MAX. fd_used has a bit per fd and fd_full a bit per fd_used
+// word that is full, so the lowest free fd takes a few word scans however
+// many files are open.
+static file_descriptor_t* file_descriptors = NULL;
+static u64* fd_used = NULL;
+static u64* fd_full = NULL;
+static u32 fd_capacity = 0;
+
+#define VFS_FD_INITIAL 256
+#define VFS_FD_MAX     (1u << 20)
+
+static i32 vfs_fd_grow(u32 min_capacity);
+static inline bool vfs_fd_valid(u32 fd);
+
+// Directory child tables: FNV-1a name hashes, power-of-two bucket counts
+#define VFS_CHILD_BUCKETS 8
+#define VFS_HASH_SEED     2166136261u
+#define VFS_HASH_PRIME    16777619u
+
+static vfs_node_t* vfs_find_child_hashed(vfs_node_t* parent, const char* name, u64 len, u32 hash);
 
 // Standard file descriptors
 #define FD_STDIN  0
@@ -113,6 +151,7 @@ static u32 next_fd = 3; // 0=stdin, 1=stdout, 2=stderr
 #define O_TRUNC    0x00000008
 #define O_APPEND   0x00000010
 #define O_EXCL     0x00000020
+#define O_CLOEXEC  0x00000040
 
 // File types
 #define S_IFREG    0x1000
@@ -139,11 +178,9 @@ void vfs_init(void) {
     console_print("OK\n");
     
     console_print("Initializing file descriptor table... ");
-    for (u32 i = 0; i < 256; i++) {
-        file_descriptors[i].node = NULL;
-        file_descriptors[i].offset = 0;
-        file_descriptors[i].flags = 0;
-        file_descriptors[i].reference_count = 0;
+    if (vfs_fd_grow(VFS_FD_INITIAL) != ERR_SUCCESS) {
+        console_print("FAILED\n");
+        return;
     }
     console_print("OK\n");
 }
@@ -174,6 +211,11 @@ vfs_node_t* vfs_create_node(const char* name, u64 mode, u64 uid, u64 gid) {
     node->children = NULL;
     node->next = NULL;
     node->prev = NULL;
+    node->name_hash = 0;
+    node->child_count = 0;
+    node->child_buckets = 0;
+    node->child_table = NULL;
+    node->hash_next = NULL;
     
     return node;
 }
@@ -231,7 +273,7 @@ i32 vfs_open(const char* path, u32 flags) {
 
 // Close a file
 i32 vfs_close(u32 fd) {
-    if (fd >= 256 || !file_descriptors[fd].node) {
+    if (!vfs_fd_valid(fd)) {
         return ERR_INVALID;
     }
     
@@ -244,9 +286,7 @@ i32 vfs_close(u32 fd) {
             node->ops->close(node);
         }
         
-        file_descriptors[fd].node = NULL;
-        file_descriptors[fd].flags = 0;
-        file_descriptors[fd].offset = 0;
+        vfs_free_fd(fd);
     }
     
     return ERR_SUCCESS;
@@ -254,7 +294,7 @@ i32 vfs_close(u32 fd) {
 
 // Read from a file
 i32 vfs_read(u32 fd, u64 size, void* buffer) {
-    if (fd >= 256 || !file_descriptors[fd].node) {
+    if (!vfs_fd_valid(fd)) {
         return ERR_INVALID;
     }
     
@@ -279,7 +319,7 @@ i32 vfs_read(u32 fd, u64 size, void* buffer) {
 
 // Write to a file
 i32 vfs_write(u32 fd, u64 size, const void* buffer) {
-    if (fd >= 256 || !file_descriptors[fd].node) {
+    if (!vfs_fd_valid(fd)) {
         return ERR_INVALID;
     }
     
@@ -304,25 +344,172 @@ i32 vfs_write(u32 fd, u64 size, const void* buffer) {
     return bytes_written;
 }
 
-// Lookup a path
-vfs_node_t* vfs_lookup(const char* path) {
+// Scatter/gather I/O. One descriptor lookup and permission check covers
+// every segment; a short transfer ends the call like a short read/write.
+i32 vfs_preadv(u32 fd, const vfs_iovec_t* iov, u32 iovcnt, u64 offset) {
+    if (!vfs_fd_valid(fd) || iovcnt > VFS_IOV_MAX) {
+        return ERR_INVALID;
+    }
+    
+    vfs_node_t* node = file_descriptors[fd].node;
+    if (!security_check_capability(get_current_pid(), node->permissions, CAP_READ)) {
+        return ERR_PERMISSION;
+    }
+    if (!node->ops || !node->ops->read) {
+        return 0;
+    }
+    
+    i32 total = 0;
+    for (u32 i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0) {
+            continue;
+        }
+        i32 bytes_read = node->ops->read(node, offset + total, iov[i].len, iov[i].base);
+        if (bytes_read < 0) {
+            return total > 0 ? total : bytes_read;
+        }
+        total += bytes_read;
+        if ((u64)bytes_read < iov[i].len) {
+            break;
+        }
+    }
+    
+    return total;
+}
+
+i32 vfs_pwritev(u32 fd, const vfs_iovec_t* iov, u32 iovcnt, u64 offset) {
+    if (!vfs_fd_valid(fd) || iovcnt > VFS_IOV_MAX) {
+        return ERR_INVALID;
+    }
+    
+    vfs_node_t* node = file_descriptors[fd].node;
+    if (!security_check_capability(get_current_pid(), node->permissions, CAP_WRITE)) {
+        return ERR_PERMISSION;
+    }
+    if (!node->ops || !node->ops->write) {
+        return 0;
+    }
+    
+    i32 total = 0;
+    for (u32 i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0) {
+            continue;
+        }
+        i32 bytes_written = node->ops->write(node, offset + total, iov[i].len, iov[i].base);
+        if (bytes_written < 0) {
+            if (total == 0) {
+                return bytes_written;
+            }
+            break;
+        }
+        total += bytes_written;
+        if ((u64)bytes_written < iov[i].len) {
+            break;
+        }
+    }
+    
+    if (total > 0) {
+        if (offset + total > node->size) {
+            node->size = offset + total;
+        }
+        node->modify_time = system_time;
+    }
+    return total;
+}
+
+// readv/writev: the positional forms at the descriptor offset, which then
+// advances once by the whole transfer
+i32 vfs_readv(u32 fd, const vfs_iovec_t* iov, u32 iovcnt) {
+    if (!vfs_fd_valid(fd)) {
+        return ERR_INVALID;
+    }
+    
+    i32 bytes_read = vfs_preadv(fd, iov, iovcnt, file_descriptors[fd].offset);
+    if (bytes_read > 0) {
+        file_descriptors[fd].offset += bytes_read;
+    }
+    return bytes_read;
+}
+
+i32 vfs_writev(u32 fd, const vfs_iovec_t* iov, u32 iovcnt) {
+    if (!vfs_fd_valid(fd)) {
+        return ERR_INVALID;
+    }
+    
+    i32 bytes_written = vfs_pwritev(fd, iov, iovcnt, file_descriptors[fd].offset);
+    if (bytes_written > 0) {
+        file_descriptors[fd].offset += bytes_written;
+    }
+    return bytes_written;
+}
+
+// Read directory entries. The descriptor offset is the directory cursor,
+// so successive calls continue where the last one stopped.
+i32 vfs_getdents(u32 fd, void* buffer, u64 size) {
+    if (!vfs_fd_valid(fd)) {
+        return ERR_INVALID;
+    }
+    
+    vfs_node_t* node = file_descriptors[fd].node;
+    if ((node->mode & 0xF000) != S_IFDIR) {
+        return ERR_INVALID;
+    }
+    
+    if (!security_check_capability(get_current_pid(), node->permissions, CAP_READ)) {
+        return ERR_PERMISSION;
+    }
+    
+    if (!node->ops || !node->ops->getdents) {
+        return ERR_INVALID;
+    }
+    
+    return node->ops->getdents(node, &file_descriptors[fd].offset, buffer, size);
+}
+
+// Resolve the first len bytes of an absolute path (or up to its NUL). Each
+// component is hashed while it is scanned and looked up in its directory's
+// child table, so the walk copies nothing and costs one probe per level.
+static vfs_node_t* vfs_walk(const char* path, u64 len) {
     if (path[0] != '/') {
         return NULL; // Only absolute paths supported for now
     }
     
     vfs_node_t* current = vfs_root;
-    char path_copy[MAX_STRING_LEN];
-    strncpy(path_copy, path, MAX_STRING_LEN - 1);
-    
-    char* token = strtok(path_copy + 1, "/");
-    while (token && current) {
-        current = vfs_find_child(current, token);
-        token = strtok(NULL, "/");
+    u64 i = 0;
+    while (current) {
+        while (i < len && path[i] == '/') {
+            i++;
+        }
+        if (i >= len || !path[i]) {
+            break;
+        }
+        
+        const char* name = &path[i];
+        u32 hash = VFS_HASH_SEED;
+        while (i < len && path[i] && path[i] != '/') {
+            hash = (hash ^ (u8)path[i]) * VFS_HASH_PRIME;
+            i++;
+        }
+        u64 name_len = (u64)(&path[i] - name);
+        
+        if (name_len == 1 && name[0] == '.') {
+            continue;
+        }
+        if (name_len == 2 && name[0] == '.' && name[1] == '.') {
+            current = current->parent ? current->parent : current;
+            continue;
+        }
+        current = vfs_find_child_hashed(current, name, name_len, hash);
     }
     
     return current;
 }
 
+// Lookup a path
+vfs_node_t* vfs_lookup(const char* path) {
+    return vfs_walk(path, (u64)-1);
+}
+
 // Create a directory
 i32 vfs_mkdir(vfs_node_t* parent, const char* name, u64 permissions) {
     if (!parent || !name) {
@@ -345,6 +532,42 @@ i32 vfs_mkdir(vfs_node_t* parent, const char* name, u64 permissions) {
     return ERR_SUCCESS;
 }
 
+// FNV-1a over a name's bytes
+static u32 vfs_name_hash(const char* name, u64 len) {
+    u32 hash = VFS_HASH_SEED;
+    for (u64 i = 0; i < len && name[i]; i++) {
+        hash = (hash ^ (u8)name[i]) * VFS_HASH_PRIME;
+    }
+    return hash;
+}
+
+static void vfs_child_table_insert(vfs_node_t* dir, vfs_node_t* child) {
+    u32 bucket = child->name_hash & (dir->child_buckets - 1);
+    child->hash_next = dir->child_table[bucket];
+    dir->child_table[bucket] = child;
+}
+
+// Double the child table (or create it) and hash every child on the
+// list into it, so children added while no table could be allocated are
+// covered again. On allocation failure the old table stays and false is
+// returned.
+static bool vfs_child_table_grow(vfs_node_t* dir) {
+    u32 buckets = dir->child_buckets ? dir->child_buckets * 2 : VFS_CHILD_BUCKETS;
+    vfs_node_t** table = malloc(buckets * sizeof(vfs_node_t*));
+    if (!table) {
+        return false;
+    }
+    memset(table, 0, buckets * sizeof(vfs_node_t*));
+    
+    free(dir->child_table);
+    dir->child_table = table;
+    dir->child_buckets = buckets;
+    for (vfs_node_t* child = dir->children; child; child = child->next) {
+        vfs_child_table_insert(dir, child);
+    }
+    return true;
+}
+
 // Add child to parent
 void vfs_add_child(vfs_node_t* parent, vfs_node_t* child) {
     if (!parent || !child) return;
@@ -355,32 +578,59 @@ void vfs_add_child(vfs_node_t* parent, vfs_node_t* child) {
     }
     parent->children = child;
     parent->link_count++;
+    
+    // A grown table already holds the new child
+    child->name_hash = vfs_name_hash(child->name, MAX_STRING_LEN);
+    parent->child_count++;
+    if (parent->child_count > parent->child_buckets && vfs_child_table_grow(parent)) {
+        return;
+    }
+    if (parent->child_table) {
+        vfs_child_table_insert(parent, child);
+    }
+}
+
+// Find the child named by len bytes of name whose hash is already known
+static vfs_node_t* vfs_find_child_hashed(vfs_node_t* parent, const char* name, u64 len, u32 hash) {
+    if (len >= MAX_STRING_LEN) {
+        return NULL; // Longer than any stored name
+    }
+    
+    vfs_node_t* child;
+    if (parent->child_table) {
+        child = parent->child_table[hash & (parent->child_buckets - 1)];
+        while (child && (child->name_hash != hash || strncmp(child->name, name, len) != 0 || child->name[len])) {
+            child = child->hash_next;
+        }
+    } else {
+        child = parent->children;
+        while (child && (strncmp(child->name, name, len) != 0 || child->name[len])) {
+            child = child->next;
+        }
+    }
+    
+    return child;
 }
 
 // Find child by name
 vfs_node_t* vfs_find_child(vfs_node_t* parent, const char* name) {
     if (!parent || !name) return NULL;
     
-    vfs_node_t* child = parent->children;
-    while (child && strcmp(child->name, name) != 0) {
-        child = child->next;
+    u64 len = 0;
+    while (name[len]) {
+        len++;
     }
-    
-    return child;
+    return vfs_find_child_hashed(parent, name, len, vfs_name_hash(name, len));
 }
 
 // Get parent directory
 vfs_node_t* vfs_get_parent(const char* path) {
-    char path_copy[MAX_STRING_LEN];
-    strncpy(path_copy, path, MAX_STRING_LEN - 1);
-    
-    char* last_slash = strrchr(path_copy, '/');
-    if (!last_slash || last_slash == path_copy) {
+    const char* last_slash = strrchr(path, '/');
+    if (!last_slash || last_slash == path) {
         return vfs_root; // Root directory
     }
     
-    *last_slash = '\0';
-    return vfs_lookup(path_copy);
+    return vfs_walk(path, (u64)(last_slash - path));
 }
 
 // Get basename from path
@@ -429,22 +679,102 @@ i32 vfs_mount(const char* device, const char* mount_point, const char* fstype) {
     return ERR_SUCCESS;
 }
 
-// Allocate file descriptor
+// Grow the descriptor table to hold at least min_capacity fds
+static i32 vfs_fd_grow(u32 min_capacity) {
+    u32 capacity = fd_capacity ? fd_capacity : VFS_FD_INITIAL;
+    while (capacity < min_capacity) {
+        capacity *= 2;
+    }
+    if (capacity > VFS_FD_MAX) {
+        return ERR_BUSY;
+    }
+
+    u32 used_words = capacity / 64;
+    u32 full_words = (used_words + 63) / 64;
+    file_descriptor_t* table = malloc(capacity * sizeof(file_descriptor_t));
+    u64* used = malloc(used_words * sizeof(u64));
+    u64* full = malloc(full_words * sizeof(u64));
+    if (!table || !used || !full) {
+        free(table);
+        free(used);
+        free(full);
+        return ERR_NO_MEMORY;
+    }
+
+    memset(table, 0, capacity * sizeof(file_descriptor_t));
+    memset(used, 0, used_words * sizeof(u64));
+    memset(full, 0, full_words * sizeof(u64));
+    if (fd_capacity) {
+        memcpy(table, file_descriptors, fd_capacity * sizeof(file_descriptor_t));
+        memcpy(used, fd_used, fd_capacity / 64 * sizeof(u64));
+        memcpy(full, fd_full, (fd_capacity / 64 + 63) / 64 * sizeof(u64));
+        free(file_descriptors);
+        free(fd_used);
+        free(fd_full);
+    }
+
+    file_descriptors = table;
+    fd_used = used;
+    fd_full = full;
+    fd_capacity = capacity;
+    return ERR_SUCCESS;
+}
+
+static inline bool vfs_fd_valid(u32 fd) {
+    return fd < fd_capacity && file_descriptors[fd].node;
+}
+
+// Allocate the lowest free file descriptor, growing the table if needed
 u32 vfs_alloc_fd(void) {
-    for (u32 i = 0; i < 256; i++) {
-        if (file_descriptors[i].node == NULL) {
-            return i;
+    u32 used_words = fd_capacity / 64;
+    u32 fd = fd_capacity;
+
+    for (u32 i = 0; i < (used_words + 63) / 64; i++) {
+        if (fd_full[i] != ~0ULL) {
+            // A bit past the last word means every slot is taken
+            u32 word = i * 64 + __builtin_ctzll(~fd_full[i]);
+            if (word < used_words) {
+                fd = word * 64 + __builtin_ctzll(~fd_used[word]);
+            }
+            break;
         }
     }
-    return 0xFFFFFFFF; // No free descriptors
+
+    if (fd == fd_capacity && vfs_fd_grow(fd_capacity + 1) != ERR_SUCCESS) {
+        return 0xFFFFFFFF; // No free descriptors
+    }
+
+    u32 word = fd / 64;
+    fd_used[word] |= 1ULL << (fd % 64);
+    if (fd_used[word] == ~0ULL) {
+        fd_full[word / 64] |= 1ULL << (word % 64);
+    }
+    return fd;
 }
 
 // Free file descriptor
 void vfs_free_fd(u32 fd) {
-    if (fd < 256) {
+    if (fd < fd_capacity) {
         file_descriptors[fd].node = NULL;
         file_descriptors[fd].offset = 0;
         file_descriptors[fd].flags = 0;
         file_descriptors[fd].reference_count = 0;
+        fd_used[fd / 64] &= ~(1ULL << (fd % 64));
+        fd_full[fd / 64 / 64] &= ~(1ULL << (fd / 64 % 64));
+    }
+}
+
+// Close every descriptor opened with O_CLOEXEC, as exec does. Walks the
+// in-use bits rather than every slot.
+void vfs_close_on_exec(void) {
+    for (u32 word = 0; word < fd_capacity / 64; word++) {
+        u64 bits = fd_used[word];
+        while (bits) {
+            u32 fd = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (file_descriptors[fd].node && (file_descriptors[fd].flags & O_CLOEXEC)) {
+                vfs_close(fd);
+            }
+        }
     }
-}
\ No newline at end of file
+}
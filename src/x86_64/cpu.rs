@@ -174,6 +174,21 @@ pub fn enumerate_cpus() -> u32 {
     1
 }
 
+/// x2APIC ID layout from CPUID leaf 0x0B: how many low bits select the
+/// SMT thread, and how many select the thread and core together (the rest
+/// names the package). Without the leaf, every CPU is one thread in a
+/// single package.
+pub fn topology_shifts() -> (u32, u32) {
+    if !has_cpuid_leaf(0x0B) {
+        return (0, 32);
+    }
+    // Subleaf 0 is the SMT level, subleaf 1 the core level
+    let smt_shift = cpuid(0x0B, 0).eax & 0x1F;
+    let core = cpuid(0x0B, 1);
+    let package_shift = if core.ebx != 0 { core.eax & 0x1F } else { 32 };
+    (smt_shift, package_shift)
+}
+
 /// Basic ACPI MADT parsing for CPU enumeration
 /// This is simplified - full implementation would parse MADT properly
 pub struct MadtEntry {
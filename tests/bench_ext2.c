@@ -0,0 +1,976 @@
+/* ext2 Stress and Throughput Benchmarks */
+
+#include "../src/include/types.h"
+#include "../src/include/ext2.h"
+#include "../src/include/block_cache.h"
+#include "../src/include/console.h"
+
+extern void* malloc(u64 size);
+extern void free(void* ptr);
+extern void* memset(void* ptr, int value, u64 num);
+extern void* memcpy(void* dest, const void* src, u64 num);
+
+// TSC rate assumed on x86_64 when running in the kernel
+#ifndef EXT2_BENCH_TSC_MHZ
+#define EXT2_BENCH_TSC_MHZ 2000
+#endif
+
+#define BENCH_IO_SIZE 4096
+#define BENCH_SEQ_CHUNK 65536
+#define BENCH_NAME_LEN 16
+
+// Workload sizes; the defaults fit the 16 MB kernel ramdisk
+typedef struct ext2_bench_config {
+    u32 file_mb;
+    u32 random_ops;
+    u32 storm_files;
+    u32 storm_rounds;
+    u32 dir_entries;
+    u32 lookups;
+    u32 listings;
+    u32 path_depth;
+    u32 walks;
+} ext2_bench_config_t;
+
+// One workload's measurements
+typedef struct bench_result {
+    const char* name;
+    u64 ops;
+    u64 bytes;
+    u64 op_ns;
+    u64 sync_ns;
+    u64* latencies;
+    u64 errors;
+    u64 cache_hits;
+    u64 cache_misses;
+} bench_result_t;
+
+// Ramdisk under test and the cache/filesystem mounted on it
+typedef struct bench {
+    block_device_t* device;
+    block_cache_t* cache;
+    ext2_fs_t* fs;
+    u64 rng;
+} bench_t;
+
+#ifdef EXT2_BENCH_HOSTED
+#include <stdio.h>
+#include <time.h>
+
+// Results go to stdout; ext2's own console messages go to stderr
+static void bench_out(const char* str) {
+    fputs(str, stdout);
+}
+
+static void bench_out_dec(u64 num) {
+    printf("%lu", num);
+}
+
+static u64 bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#else
+static void bench_out(const char* str) {
+    console_print(str);
+}
+
+static void bench_out_dec(u64 num) {
+    console_print_dec(num);
+}
+
+#if defined(__aarch64__)
+static u64 bench_now_ns(void) {
+    u64 count, freq;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(count));
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    return (u64)((__uint128_t)count * 1000000000ULL / freq);
+}
+#else
+static u64 bench_now_ns(void) {
+    u32 lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((((u64)hi) << 32) | lo) * 1000 / EXT2_BENCH_TSC_MHZ;
+}
+#endif
+#endif
+
+static u64 bench_random(bench_t* b) {
+    // xorshift64
+    b->rng ^= b->rng << 13;
+    b->rng ^= b->rng >> 7;
+    b->rng ^= b->rng << 17;
+    return b->rng;
+}
+
+// Byte stored at a file offset, so reads can be verified
+static u8 bench_pattern(u64 offset) {
+    return (u8)(offset ^ (offset >> 12) ^ 0x5A);
+}
+
+static void bench_fill(u8* buf, u64 offset, u32 len) {
+    for (u32 i = 0; i < len; i++) {
+        buf[i] = bench_pattern(offset + i);
+    }
+}
+
+static u32 bench_check(const u8* buf, u64 offset, u32 len) {
+    for (u32 i = 0; i < len; i++) {
+        if (buf[i] != bench_pattern(offset + i)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void bench_name(char* out, const char* prefix, u32 n) {
+    u32 len = 0;
+    while (prefix[len] && len < BENCH_NAME_LEN - 7) {
+        out[len] = prefix[len];
+        len++;
+    }
+    for (i32 digit = 5; digit >= 0; digit--) {
+        out[len + digit] = '0' + n % 10;
+        n /= 10;
+    }
+    out[len + 6] = '\0';
+}
+
+static i32 bench_mount(bench_t* b) {
+    b->cache = block_cache_create(b->device, b->device->ops->get_block_size(b->device->device_data));
+    if (!b->cache) {
+        return ERR_NO_MEMORY;
+    }
+    
+    b->fs = ext2_mount(b->cache);
+    if (!b->fs) {
+        block_cache_destroy(b->cache);
+        b->cache = NULL;
+        return ERR_INVALID;
+    }
+    
+    return ERR_SUCCESS;
+}
+
+// Unmount and drop the block cache, so the next mount starts cold
+static void bench_unmount(bench_t* b) {
+    if (b->fs) {
+        ext2_umount(b->fs);
+        b->fs = NULL;
+    }
+    if (b->cache) {
+        block_cache_flush(b->cache);
+        block_cache_destroy(b->cache);
+        b->cache = NULL;
+    }
+}
+
+static void bench_begin(bench_t* b, bench_result_t* r, const char* name, u64 max_ops) {
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->latencies = (u64*)malloc(max_ops * sizeof(u64));
+    if (!r->latencies) {
+        r->errors++;
+    }
+    block_cache_stats(b->cache, &r->cache_hits, &r->cache_misses);
+}
+
+static void bench_record(bench_result_t* r, u64 start, u64 end) {
+    if (r->latencies) {
+        r->latencies[r->ops] = end - start;
+    }
+    r->ops++;
+    r->op_ns += end - start;
+}
+
+static void bench_end(bench_t* b, bench_result_t* r, bool sync) {
+    if (sync) {
+        u64 start = bench_now_ns();
+        if (ext2_sync(b->fs) < 0) {
+            r->errors++;
+        }
+        r->sync_ns = bench_now_ns() - start;
+    }
+    
+    u64 hits, misses;
+    block_cache_stats(b->cache, &hits, &misses);
+    r->cache_hits = hits - r->cache_hits;
+    r->cache_misses = misses - r->cache_misses;
+}
+
+// Sequential write of a new file in 64 KiB chunks, sync included
+static void bench_seq_write(bench_t* b, ext2_bench_config_t* cfg, bench_result_t* r) {
+    u64 size = (u64)cfg->file_mb * 1024 * 1024;
+    bench_begin(b, r, "seq_write", size / BENCH_SEQ_CHUNK + 1);
+    
+    u32 ino;
+    u8* buf = (u8*)malloc(BENCH_SEQ_CHUNK);
+    if (!buf || ext2_create(b->fs, EXT2_ROOT_INO, "seq", 0644, &ino) < 0) {
+        r->errors++;
+        free(buf);
+        return;
+    }
+    
+    ext2_inode_t inode;
+    ext2_read_inode(b->fs, ino, &inode);
+    for (u64 offset = 0; offset < size; offset += BENCH_SEQ_CHUNK) {
+        bench_fill(buf, offset, BENCH_SEQ_CHUNK);
+        u64 start = bench_now_ns();
+        i32 result = ext2_write_file(b->fs, ino, &inode, offset, BENCH_SEQ_CHUNK, buf);
+        bench_record(r, start, bench_now_ns());
+        if (result != BENCH_SEQ_CHUNK) {
+            r->errors++;
+            break;
+        }
+        r->bytes += BENCH_SEQ_CHUNK;
+    }
+    ext2_write_inode(b->fs, ino, &inode);
+    free(buf);
+    
+    bench_end(b, r, true);
+}
+
+// Sequential read of the file written above, from a cold mount
+static void bench_seq_read(bench_t* b, ext2_bench_config_t* cfg, bench_result_t* r) {
+    u64 size = (u64)cfg->file_mb * 1024 * 1024;
+    bench_unmount(b);
+    if (bench_mount(b) < 0) {
+        r->name = "seq_read";
+        r->errors++;
+        return;
+    }
+    bench_begin(b, r, "seq_read", size / BENCH_SEQ_CHUNK + 1);
+    
+    u32 ino;
+    u8* buf = (u8*)malloc(BENCH_SEQ_CHUNK);
+    if (!buf || ext2_lookup(b->fs, EXT2_ROOT_INO, "seq", &ino) < 0) {
+        r->errors++;
+        free(buf);
+        return;
+    }
+    
+    ext2_inode_t inode;
+    ext2_read_inode(b->fs, ino, &inode);
+    for (u64 offset = 0; offset < size; offset += BENCH_SEQ_CHUNK) {
+        u64 start = bench_now_ns();
+        i32 result = ext2_read_file(b->fs, ino, &inode, offset, BENCH_SEQ_CHUNK, buf);
+        bench_record(r, start, bench_now_ns());
+        if (result != BENCH_SEQ_CHUNK) {
+            r->errors++;
+            break;
+        }
+        r->errors += bench_check(buf, offset, BENCH_SEQ_CHUNK);
+        r->bytes += BENCH_SEQ_CHUNK;
+    }
+    free(buf);
+    
+    bench_end(b, r, false);
+}
+
+// 4 KiB writes at random aligned offsets of the sequential file
+static void bench_rand_write(bench_t* b, ext2_bench_config_t* cfg, bench_result_t* r) {
+    u64 pages = (u64)cfg->file_mb * 1024 * 1024 / BENCH_IO_SIZE;
+    bench_begin(b, r, "rand_write", cfg->random_ops);
+    
+    u32 ino;
+    u8* buf = (u8*)malloc(BENCH_IO_SIZE);
+    if (!buf || ext2_lookup(b->fs, EXT2_ROOT_INO, "seq", &ino) < 0) {
+        r->errors++;
+        free(buf);
+        return;
+    }
+    
+    ext2_inode_t inode;
+    ext2_read_inode(b->fs, ino, &inode);
+    for (u32 i = 0; i < cfg->random_ops; i++) {
+        u64 offset = (bench_random(b) % pages) * BENCH_IO_SIZE;
+        bench_fill(buf, offset, BENCH_IO_SIZE);
+        u64 start = bench_now_ns();
+        i32 result = ext2_write_file(b->fs, ino, &inode, offset, BENCH_IO_SIZE, buf);
+        bench_record(r, start, bench_now_ns());
+        if (result != BENCH_IO_SIZE) {
+            r->errors++;
+            break;
+        }
+        r->bytes += BENCH_IO_SIZE;
+    }
+    ext2_write_inode(b->fs, ino, &inode);
+    free(buf);
+    
+    bench_end(b, r, true);
+}
+
+// 4 KiB reads at random aligned offsets, from a cold mount
+static void bench_rand_read(bench_t* b, ext2_bench_config_t* cfg, bench_result_t* r) {
+    u64 pages = (u64)cfg->file_mb * 1024 * 1024 / BENCH_IO_SIZE;
+    bench_unmount(b);
+    if (bench_mount(b) < 0) {
+        r->name = "rand_read";
+        r->errors++;
+        return;
+    }
+    bench_begin(b, r, "rand_read", cfg->random_ops);
+    
+    u32 ino;
+    u8* buf = (u8*)malloc(BENCH_IO_SIZE);
+    if (!buf || ext2_lookup(b->fs, EXT2_ROOT_INO, "seq", &ino) < 0) {
+        r->errors++;
+        free(buf);
+        return;
+    }
+    
+    ext2_inode_t inode;
+    ext2_read_inode(b->fs, ino, &inode);
+    for (u32 i = 0; i < cfg->random_ops; i++) {
+        u64 offset = (bench_random(b) % pages) * BENCH_IO_SIZE;
+        u64 start = bench_now_ns();
+        i32 result = ext2_read_file(b->fs, ino, &inode, offset, BENCH_IO_SIZE, buf);
+        bench_record(r, start, bench_now_ns());
+        if (result != BENCH_IO_SIZE) {
+            r->errors++;
+            break;
+        }
+        r->errors += bench_check(buf, offset, BENCH_IO_SIZE);
+        r->bytes += BENCH_IO_SIZE;
+    }
+    free(buf);
+    
+    ext2_unlink(b->fs, EXT2_ROOT_INO, "seq");
+    bench_end(b, r, false);
+}
+
+// i_blocks of a file of size bytes with every block mapped
+static u32 bench_expected_blocks(ext2_fs_t* fs, u64 size) {
+    u32 per_block = fs->block_size / 4;
+    u32 data = (size + fs->block_size - 1) / fs->block_size;
+    u32 meta = 0;
+    if (data > 12) {
+        meta++;
+    }
+    if (data > 12 + per_block) {
+        meta += 1 + (data - 12 - per_block + per_block - 1) / per_block;
+    }
+    return (data + meta) * (fs->block_size / 512);
+}
+
+// A short write into a file whose delayed-allocation slot is held by
+// another file allocates its block on the spot. The rest of that block was
+// a hole and must read back as zeros, not as whatever a deleted file left
+// on disk. Returns the number of errors.
+static u32 bench_fresh_block_hole(bench_t* b) {
+    static const u8 data[10] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+    static u8 page[PAGE_CACHE_PAGE_SIZE];
+    char name[BENCH_NAME_LEN];
+    ext2_inode_t inode;
+    u32 holder;
+    u32 errors = 0;
+    
+    if (ext2_create(b->fs, EXT2_ROOT_INO, "vfs_hold", 0644, &holder) < 0) {
+        return 1;
+    }
+    ext2_read_inode(b->fs, holder, &inode);
+    if (ext2_write_file(b->fs, holder, &inode, 0, 1, data) != 1) {
+        errors++;
+    }
+    ext2_write_inode(b->fs, holder, &inode);
+    
+    // Create files until one shares the holder's slot
+    u32 created = 0;
+    u32 ino = 0;
+    while (created < EXT2_DELALLOC_SLOTS && ino % EXT2_DELALLOC_SLOTS != holder % EXT2_DELALLOC_SLOTS) {
+        bench_name(name, "hole", created);
+        if (ext2_create(b->fs, EXT2_ROOT_INO, name, 0644, &ino) < 0) {
+            break;
+        }
+        created++;
+    }
+    
+    if (created == 0 || ino % EXT2_DELALLOC_SLOTS != holder % EXT2_DELALLOC_SLOTS) {
+        errors++;
+    } else {
+        // Past EOF first, so the next write fills its page from disk
+        ext2_read_inode(b->fs, ino, &inode);
+        if (ext2_write_file(b->fs, ino, &inode, 2 * PAGE_CACHE_PAGE_SIZE, 1, data) != 1 ||
+            ext2_write_file(b->fs, ino, &inode, 100, sizeof(data), data) != sizeof(data) ||
+            ext2_read_file(b->fs, ino, &inode, 0, PAGE_CACHE_PAGE_SIZE, page) != PAGE_CACHE_PAGE_SIZE) {
+            errors++;
+        } else {
+            for (u32 i = 0; i < PAGE_CACHE_PAGE_SIZE; i++) {
+                u8 expected = (i >= 100 && i < 100 + sizeof(data)) ? data[i - 100] : 0;
+                if (page[i] != expected) {
+                    errors++;
+                    break;
+                }
+            }
+        }
+        ext2_write_inode(b->fs, ino, &inode);
+    }
+    
+    ext2_unlink(b->fs, EXT2_ROOT_INO, "vfs_hold");
+    for (u32 n = 0; n < created; n++) {
+        bench_name(name, "hole", n);
+        ext2_unlink(b->fs, EXT2_ROOT_INO, name);
+    }
+    return errors;
+}
+
+// Writes the way the VFS issues them: the inode is read before and
+// written after every call, so nothing survives in the caller between
+// writes. Chunk sizes cycle through unaligned, page and multi-page
+// lengths; the file is checked from a cold mount.
+static void bench_vfs_write(bench_t* b, ext2_bench_config_t* cfg, bench_result_t* r) {
+    static const u32 chunks[] = { 1000, BENCH_IO_SIZE, BENCH_SEQ_CHUNK };
+    u64 size = (u64)cfg->file_mb * 1024 * 1024;
+    bench_begin(b, r, "vfs_write", size / chunks[0] + 1);
+    
+    u32 ino;
+    u8* buf = (u8*)malloc(BENCH_SEQ_CHUNK);
+    if (!buf || ext2_create(b->fs, EXT2_ROOT_INO, "vfs", 0644, &ino) < 0) {
+        r->errors++;
+        free(buf);
+        return;
+    }
+    
+    ext2_inode_t inode;
+    u64 offset = 0;
+    for (u32 i = 0; offset < size; i++) {
+        u32 len = chunks[i % 3];
+        if (len > size - offset) {
+            len = size - offset;
+        }
+        bench_fill(buf, offset, len);
+        u64 start = bench_now_ns();
+        ext2_read_inode(b->fs, ino, &inode);
+        i32 result = ext2_write_file(b->fs, ino, &inode, offset, len, buf);
+        ext2_write_inode(b->fs, ino, &inode);
+        bench_record(r, start, bench_now_ns());
+        if (result != (i32)len) {
+            r->errors++;
+            break;
+        }
+        offset += len;
+        r->bytes += len;
+    }
+    
+    bench_end(b, r, true);
+    
+    bench_unmount(b);
+    if (bench_mount(b) < 0) {
+        r->errors++;
+        free(buf);
+        return;
+    }
+    
+    ext2_read_inode(b->fs, ino, &inode);
+    if (inode.i_size != size || inode.i_blocks != bench_expected_blocks(b->fs, size)) {
+        r->errors++;
+    }
+    for (offset = 0; offset < size; offset += BENCH_SEQ_CHUNK) {
+        if (ext2_read_file(b->fs, ino, &inode, offset, BENCH_SEQ_CHUNK, buf) != BENCH_SEQ_CHUNK) {
+            r->errors++;
+            break;
+        }
+        r->errors += bench_check(buf, offset, BENCH_SEQ_CHUNK);
+    }
+    free(buf);
+    
+    // A page mapped into a process outlives the unlinked file's cache
+    page_cache_mapping_t* mapping = page_cache_get_mapping(b->fs->page_cache, ino, true);
+    u8* mapped = (u8*)page_cache_map_page(mapping, 0);
+    ext2_unlink(b->fs, EXT2_ROOT_INO, "vfs");
+    if (!mapped || page_cache_get_mapping(b->fs->page_cache, ino, false)) {
+        r->errors++;
+    } else {
+        r->errors += bench_check(mapped, 0, PAGE_CACHE_PAGE_SIZE);
+        page_cache_unmap_page(mapping, 0, true);
+    }
+    
+    // The unlinked file's blocks are free again, data and all
+    r->errors += bench_fresh_block_hole(b);
+    if (ext2_sync(b->fs) < 0) {
+        r->errors++;
+    }
+}
+
+// Rounds of creating small files and unlinking them again; each create
+// and each unlink is one op
+static void bench_create_unlink(bench_t* b, ext2_bench_config_t* cfg, bench_result_t* r) {
+    bench_begin(b, r, "create_unlink", (u64)cfg->storm_files * cfg->storm_rounds * 2);
+    
+    u32 dir;
+    if (ext2_mkdir(b->fs, EXT2_ROOT_INO, "storm", 0755, &dir) < 0) {
+        r->errors++;
+        return;
+    }
+    
+    u8 data[256];
+    bench_fill(data, 0, sizeof(data));
+    char name[BENCH_NAME_LEN];
+    
+    for (u32 round = 0; round < cfg->storm_rounds; round++) {
+        for (u32 i = 0; i < cfg->storm_files; i++) {
+            bench_name(name, "f", i);
+            u64 start = bench_now_ns();
+            u32 ino;
+            i32 result = ext2_create(b->fs, dir, name, 0644, &ino);
+            if (result == ERR_SUCCESS) {
+                ext2_inode_t inode;
+                ext2_read_inode(b->fs, ino, &inode);
+                ext2_write_file(b->fs, ino, &inode, 0, sizeof(data), data);
+                ext2_write_inode(b->fs, ino, &inode);
+            }
+            bench_record(r, start, bench_now_ns());
+            if (result < 0) {
+                r->errors++;
+            }
+        }
+        
+        // A full directory and the dot entries must survive unlink
+        if (round == 0 &&
+            (ext2_unlink(b->fs, EXT2_ROOT_INO, "storm") != ERR_NOT_EMPTY ||
+             ext2_unlink(b->fs, dir, ".") != ERR_INVALID ||
+             ext2_unlink(b->fs, dir, "..") != ERR_INVALID)) {
+            r->errors++;
+        }
+        
+        for (u32 i = 0; i < cfg->storm_files; i++) {
+            bench_name(name, "f", i);
+            u64 start = bench_now_ns();
+            i32 result = ext2_unlink(b->fs, dir, name);
+            bench_record(r, start, bench_now_ns());
+            if (result < 0) {
+                r->errors++;
+            }
+        }
+    }
+    
+    if (ext2_unlink(b->fs, EXT2_ROOT_INO, "storm") < 0) {
+        r->errors++;
+    }
+    bench_end(b, r, true);
+}
+
+// Random name lookups in one large directory
+static void bench_dir_lookup(bench_t* b, ext2_bench_config_t* cfg, bench_result_t* r) {
+    bench_begin(b, r, "dir_lookup", cfg->lookups);
+    
+    u32 dir;
+    if (ext2_mkdir(b->fs, EXT2_ROOT_INO, "big", 0755, &dir) < 0) {
+        r->errors++;
+        return;
+    }
+    
+    char name[BENCH_NAME_LEN];
+    for (u32 i = 0; i < cfg->dir_entries; i++) {
+        u32 ino;
+        bench_name(name, "entry", i);
+        if (ext2_create(b->fs, dir, name, 0644, &ino) < 0) {
+            r->errors++;
+            break;
+        }
+    }
+    
+    for (u32 i = 0; i < cfg->lookups; i++) {
+        bench_name(name, "entry", bench_random(b) % cfg->dir_entries);
+        u32 ino;
+        u64 start = bench_now_ns();
+        i32 result = ext2_lookup(b->fs, dir, name, &ino);
+        bench_record(r, start, bench_now_ns());
+        if (result < 0) {
+            r->errors++;
+        }
+    }
+    
+    for (u32 i = 0; i < cfg->dir_entries; i++) {
+        bench_name(name, "entry", i);
+        ext2_unlink(b->fs, dir, name);
+    }
+    ext2_unlink(b->fs, EXT2_ROOT_INO, "big");
+    
+    bench_end(b, r, true);
+}
+
+// Full listings of one large directory with getdents; each listing is
+// one op and must return every entry plus . and ..
+static void bench_dir_list(bench_t* b, ext2_bench_config_t* cfg, bench_result_t* r) {
+    bench_begin(b, r, "dir_list", cfg->listings);
+    
+    u32 dir;
+    u8* buffer = (u8*)malloc(BENCH_IO_SIZE);
+    if (!buffer || ext2_mkdir(b->fs, EXT2_ROOT_INO, "list", 0755, &dir) < 0) {
+        free(buffer);
+        r->errors++;
+        return;
+    }
+    
+    char name[BENCH_NAME_LEN];
+    for (u32 i = 0; i < cfg->dir_entries; i++) {
+        u32 ino;
+        bench_name(name, "entry", i);
+        if (ext2_create(b->fs, dir, name, 0644, &ino) < 0) {
+            r->errors++;
+            break;
+        }
+    }
+    
+    for (u32 i = 0; i < cfg->listings; i++) {
+        u64 pos = 0;
+        u32 entries = 0;
+        u64 start = bench_now_ns();
+        i32 used;
+        while ((used = ext2_getdents(b->fs, dir, &pos, buffer, BENCH_IO_SIZE)) > 0) {
+            for (i32 off = 0; off < used; off += ((ext2_dirent_t*)(buffer + off))->d_reclen) {
+                entries++;
+            }
+            r->bytes += used;
+        }
+        bench_record(r, start, bench_now_ns());
+        if (used < 0 || entries != cfg->dir_entries + 2) {
+            r->errors++;
+        }
+    }
+    
+    for (u32 i = 0; i < cfg->dir_entries; i++) {
+        bench_name(name, "entry", i);
+        ext2_unlink(b->fs, dir, name);
+    }
+    ext2_unlink(b->fs, EXT2_ROOT_INO, "list");
+    free(buffer);
+    
+    bench_end(b, r, true);
+}
+
+// Resolve a deep path component by component from the root
+static void bench_path_walk(bench_t* b, ext2_bench_config_t* cfg, bench_result_t* r) {
+    bench_begin(b, r, "path_walk", cfg->walks);
+    
+    u32* chain = (u32*)malloc((cfg->path_depth + 1) * sizeof(u32));
+    if (!chain) {
+        r->errors++;
+        return;
+    }
+    
+    char name[BENCH_NAME_LEN];
+    chain[0] = EXT2_ROOT_INO;
+    u32 depth = 0;
+    while (depth < cfg->path_depth) {
+        bench_name(name, "d", depth);
+        if (ext2_mkdir(b->fs, chain[depth], name, 0755, &chain[depth + 1]) < 0) {
+            r->errors++;
+            break;
+        }
+        depth++;
+    }
+    
+    for (u32 i = 0; i < cfg->walks; i++) {
+        u64 start = bench_now_ns();
+        u32 ino = EXT2_ROOT_INO;
+        for (u32 level = 0; level < depth; level++) {
+            bench_name(name, "d", level);
+            if (ext2_lookup(b->fs, ino, name, &ino) < 0) {
+                break;
+            }
+        }
+        bench_record(r, start, bench_now_ns());
+        if (ino != chain[depth]) {
+            r->errors++;
+        }
+    }
+    
+    while (depth > 0) {
+        depth--;
+        bench_name(name, "d", depth);
+        ext2_unlink(b->fs, chain[depth], name);
+    }
+    free(chain);
+    
+    bench_end(b, r, true);
+}
+
+// Heap sort, for latency percentiles
+static void bench_sift(u64* a, u64 root, u64 n) {
+    for (;;) {
+        u64 child = root * 2 + 1;
+        if (child >= n) {
+            return;
+        }
+        if (child + 1 < n && a[child + 1] > a[child]) {
+            child++;
+        }
+        if (a[root] >= a[child]) {
+            return;
+        }
+        u64 tmp = a[root];
+        a[root] = a[child];
+        a[child] = tmp;
+        root = child;
+    }
+}
+
+static void bench_sort(u64* a, u64 n) {
+    for (u64 i = n / 2; i > 0; i--) {
+        bench_sift(a, i - 1, n);
+    }
+    for (u64 end = n; end > 1; end--) {
+        u64 tmp = a[0];
+        a[0] = a[end - 1];
+        a[end - 1] = tmp;
+        bench_sift(a, 0, end - 1);
+    }
+}
+
+static u64 bench_percentile(u64* sorted, u64 n, u32 pct) {
+    if (n == 0) {
+        return 0;
+    }
+    u64 index = (n * pct + 99) / 100;
+    return sorted[index > 0 ? index - 1 : 0];
+}
+
+// Print value / 1000 with three decimals
+static void print_milli(u64 milli) {
+    bench_out_dec(milli / 1000);
+    bench_out(".");
+    u64 frac = milli % 1000;
+    if (frac < 100) bench_out("0");
+    if (frac < 10) bench_out("0");
+    bench_out_dec(frac);
+}
+
+static void print_field(const char* key, u64 value, bool comma) {
+    bench_out("\"");
+    bench_out(key);
+    bench_out("\": ");
+    bench_out_dec(value);
+    if (comma) bench_out(", ");
+}
+
+static void print_result(bench_result_t* r, bool last) {
+    u64 total_ns = r->op_ns + r->sync_ns;
+    
+    bench_out("    {\"name\": \"");
+    bench_out(r->name);
+    bench_out("\", ");
+    print_field("ops", r->ops, true);
+    print_field("bytes", r->bytes, true);
+    print_field("op_ns", r->op_ns, true);
+    print_field("sync_ns", r->sync_ns, true);
+    
+    // MB/s includes the sync, so write-back cost is not hidden
+    bench_out("\"mb_s\": ");
+    print_milli(total_ns ? r->bytes * 1000000000ULL / total_ns * 1000 / (1024 * 1024) : 0);
+    bench_out(", \"ops_s\": ");
+    print_milli(r->op_ns ? r->ops * 1000000000ULL * 1000 / r->op_ns : 0);
+    bench_out(", ");
+    
+    if (r->latencies && r->ops > 0) {
+        bench_sort(r->latencies, r->ops);
+        bench_out("\"latency_ns\": {");
+        print_field("p50", bench_percentile(r->latencies, r->ops, 50), true);
+        print_field("p90", bench_percentile(r->latencies, r->ops, 90), true);
+        print_field("p99", bench_percentile(r->latencies, r->ops, 99), true);
+        print_field("max", r->latencies[r->ops - 1], false);
+        bench_out("}, ");
+    }
+    
+    print_field("cache_hits", r->cache_hits, true);
+    print_field("cache_misses", r->cache_misses, true);
+    print_field("errors", r->errors, false);
+    bench_out(last ? "}\n" : "},\n");
+}
+
+typedef void (*bench_fn_t)(bench_t* b, ext2_bench_config_t* cfg, bench_result_t* r);
+
+static const bench_fn_t bench_workloads[] = {
+    bench_seq_write,
+    bench_seq_read,
+    bench_rand_write,
+    bench_rand_read,
+    bench_vfs_write,
+    bench_create_unlink,
+    bench_dir_lookup,
+    bench_dir_list,
+    bench_path_walk,
+};
+
+#define BENCH_NUM_WORKLOADS (sizeof(bench_workloads) / sizeof(bench_workloads[0]))
+
+void ext2_bench_default_config(ext2_bench_config_t* cfg) {
+    cfg->file_mb = 4;
+    cfg->random_ops = 2048;
+    cfg->storm_files = 256;
+    cfg->storm_rounds = 4;
+    cfg->dir_entries = 1024;
+    cfg->lookups = 4096;
+    cfg->listings = 64;
+    cfg->path_depth = 32;
+    cfg->walks = 1024;
+}
+
+// Run every workload in turn on a freshly formatted ext2 ramdisk and
+// print the results as JSON. Returns the total number of errors.
+u64 ext2_run_bench(block_device_t* device, ext2_bench_config_t* cfg) {
+    bench_t b;
+    memset(&b, 0, sizeof(b));
+    b.device = device;
+    b.rng = 0x9E3779B97F4A7C15ULL;
+    
+    if (bench_mount(&b) < 0) {
+        bench_out("{\"suite\": \"ext2\", \"error\": \"mount failed\"}\n");
+        return 1;
+    }
+    
+    bench_out("{\"suite\": \"ext2\", ");
+    print_field("block_size", b.fs->block_size, true);
+    print_field("blocks", b.fs->superblock->s_blocks_count, true);
+    print_field("file_mb", cfg->file_mb, true);
+    bench_out("\"results\": [\n");
+    
+    u64 errors = 0;
+    for (u32 i = 0; i < BENCH_NUM_WORKLOADS; i++) {
+        bench_result_t r;
+        memset(&r, 0, sizeof(r));
+        bench_workloads[i](&b, cfg, &r);
+        print_result(&r, i == BENCH_NUM_WORKLOADS - 1);
+        errors += r.errors;
+        free(r.latencies);
+    }
+    
+    bench_unmount(&b);
+    bench_out("]}\n");
+    return errors;
+}
+
+#ifdef EXT2_BENCH_HOSTED
+// Hosted build: the ext2 sources linked into a Linux program, with a
+// ramdisk loaded from an image file made by mkfs_ext2.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+u64 system_time = 0;
+
+void console_putchar(char c) { fputc(c, stderr); }
+void console_clear(void) {}
+void console_print(const char* str) { fputs(str, stderr); }
+void console_print_hex(u64 num) { fprintf(stderr, "0x%lx", num); }
+void console_print_dec(u64 num) { fprintf(stderr, "%lu", num); }
+
+u64 frame_alloc_page(void) {
+    return (u64)(uintptr_t)aligned_alloc(4096, 4096);
+}
+
+void frame_free_page(u64 addr) {
+    free((void*)(uintptr_t)addr);
+}
+
+typedef struct {
+    u8* data;
+    u64 size;
+    u64 block_size;
+} ramdisk_t;
+
+static i32 ramdisk_read(void* device, u64 block_num, void* buffer) {
+    ramdisk_t* rd = (ramdisk_t*)device;
+    if ((block_num + 1) * rd->block_size > rd->size) {
+        return ERR_INVALID;
+    }
+    memcpy(buffer, rd->data + block_num * rd->block_size, rd->block_size);
+    return rd->block_size;
+}
+
+static i32 ramdisk_write(void* device, u64 block_num, const void* buffer) {
+    ramdisk_t* rd = (ramdisk_t*)device;
+    if ((block_num + 1) * rd->block_size > rd->size) {
+        return ERR_INVALID;
+    }
+    memcpy(rd->data + block_num * rd->block_size, buffer, rd->block_size);
+    return rd->block_size;
+}
+
+static i32 ramdisk_block_size(void* device) {
+    return ((ramdisk_t*)device)->block_size;
+}
+
+static i32 ramdisk_num_blocks(void* device) {
+    ramdisk_t* rd = (ramdisk_t*)device;
+    return rd->size / rd->block_size;
+}
+
+static block_device_ops_t ramdisk_ops = {
+    .read_block = ramdisk_read,
+    .write_block = ramdisk_write,
+    .get_block_size = ramdisk_block_size,
+    .get_num_blocks = ramdisk_num_blocks,
+};
+
+int main(int argc, char** argv) {
+    ext2_bench_config_t cfg;
+    ext2_bench_default_config(&cfg);
+    const char* out_path = NULL;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "f:r:s:d:p:o:")) != -1) {
+        switch (opt) {
+            case 'f': cfg.file_mb = atoi(optarg); break;
+            case 'r': cfg.random_ops = atoi(optarg); break;
+            case 's': cfg.storm_files = atoi(optarg); break;
+            case 'd': cfg.dir_entries = atoi(optarg); break;
+            case 'p': cfg.path_depth = atoi(optarg); break;
+            case 'o': out_path = optarg; break;
+            default: optind = argc + 1; break;
+        }
+    }
+    
+    if (optind != argc - 1 || cfg.file_mb == 0 || cfg.dir_entries == 0) {
+        fprintf(stderr, "Usage: %s [-f file_mb] [-r random_ops] [-s storm_files] [-d dir_entries]\n"
+                        "       [-p path_depth] [-o result_image] <image_file>\n", argv[0]);
+        return 2;
+    }
+    
+    FILE* fp = fopen(argv[optind], "rb");
+    if (!fp) {
+        perror("Failed to open image");
+        return 2;
+    }
+    fseek(fp, 0, SEEK_END);
+    ramdisk_t rd = { NULL, (u64)ftell(fp), 1024 };
+    fseek(fp, 0, SEEK_SET);
+    rd.data = malloc(rd.size);
+    if (!rd.data || fread(rd.data, 1, rd.size, fp) != rd.size) {
+        fprintf(stderr, "Failed to read image\n");
+        return 2;
+    }
+    fclose(fp);
+    
+    // The ext2 driver handles 1024-byte blocks only; s_log_block_size is
+    // the seventh superblock field
+    u32 log_block_size;
+    memcpy(&log_block_size, rd.data + 1024 + 24, sizeof(u32));
+    if (log_block_size != 0) {
+        fprintf(stderr, "Image must use 1024-byte blocks\n");
+        return 2;
+    }
+    rd.block_size = 1024;
+    
+    block_device_t device = { &rd, &ramdisk_ops };
+    
+    setvbuf(stderr, NULL, _IOFBF, 1 << 16);
+    u64 errors = ext2_run_bench(&device, &cfg);
+    fflush(stdout);
+    
+    if (out_path) {
+        fp = fopen(out_path, "wb");
+        if (!fp || fwrite(rd.data, 1, rd.size, fp) != rd.size) {
+            perror("Failed to write result image");
+            return 2;
+        }
+        fclose(fp);
+    }
+    
+    free(rd.data);
+    return errors ? 1 : 0;
+}
+#endif
@@ -2549,6 +2549,42 @@ static int exec_external(const char **argv) {
     exit(127);
 }
 
+// Like exec_external, but starts the command in a new process without
+// forking the shell first. Returns the child's pid, or -1 if no candidate
+// path could be started.
+static int spawn_external(const char **argv) {
+    const char *cmd = argv[0];
+    int pid = -1;
+
+    if (!cmd || !cmd[0]) {
+        return -1;
+    }
+
+    for (const char *p = cmd; *p; ++p) {
+        if (*p == '/') {
+            return posix_spawn(&pid, cmd, 0, argv, 0) == 0 ? pid : -1;
+        }
+    }
+
+    const char *paths[] = {"/bin/", "/usr/bin/", "/sbin/", 0};
+    for (int i = 0; paths[i]; ++i) {
+        char full[128];
+        size_t pn = strlen(paths[i]);
+        size_t cn = strlen(cmd);
+        if (pn + cn + 1 >= sizeof(full)) {
+            continue;
+        }
+        memcpy(full, paths[i], pn);
+        memcpy(full + pn, cmd, cn);
+        full[pn + cn] = '\0';
+        if (posix_spawn(&pid, full, 0, argv, 0) == 0) {
+            return pid;
+        }
+    }
+
+    return -1;
+}
+
 static int apply_redirs(Redirect *redirs, int nredirs) {
     for (int i = 0; i < nredirs; ++i) {
         Redirect *r = &redirs[i];
@@ -2672,6 +2708,18 @@ static int exec_simple(Shell *sh, ShArena *arena, Ast *node, int in_child, int d
         }
     }
 
+    // Plain external commands skip fork+exec: the shell is not copied only
+    // to be replaced. Redirections still need a forked child to apply them.
+    if (!in_child && !fn && node->u.simple.nredirs == 0) {
+        int pid = spawn_external(argv);
+        int st = 127;
+        if (pid > 0) {
+            wait_status(pid, &st);
+        }
+        sh->last_status = st;
+        return st;
+    }
+
     int pid = fork();
     if (pid == 0) {
         if (apply_redirs(node->u.simple.redirs, node->u.simple.nredirs)) {
@@ -3212,23 +3260,16 @@ int execute_external_command(int argc, char **argv) {
         strcpy(path, argv[0]);
     }
     
-    // Fork and execute
-    int pid = fork();
-    if (pid == 0) {
-        // Child process
-        exec(path, (const char *const *)argv);
-        // If we get here, exec failed
+    // Start the program directly; no need to fork the shell first
+    int pid;
+    if (posix_spawn(&pid, path, 0, (const char *const *)argv, 0) != 0) {
         printf("%s: command not found\n", argv[0]);
-        exit(127);
-    } else if (pid > 0) {
-        // Parent process - wait for child
-        int status;
-        wait(pid);
-        return WEXITSTATUS(status);
-    } else {
-        printf("fork failed\n");
-        return 1;
+        return 127;
     }
+
+    int status = 0;
+    waitpid(pid, &status);
+    return WEXITSTATUS(status);
 }
 
 int execute_builtin(int builtin_index, int argc, char **argv) {
@@ -12,10 +12,128 @@ int exec(const char *path, const char *const argv[]);
 int wait(int pid);
 int waitpid(int pid, int *status);
 
+// Start a program in a new process without forking the caller first. File
+// actions run in order on the child's copy of the caller's descriptors; a
+// NULL envp passes the default environment.
+#define SPAWN_MAX_ACTIONS 8
+#define SPAWN_DUP2  1
+#define SPAWN_CLOSE 2
+
+struct spawn_action {
+    uint32_t kind;
+    uint32_t fd;
+    uint32_t newfd;
+    uint32_t reserved;
+};
+
+typedef struct {
+    int count;
+    struct spawn_action actions[SPAWN_MAX_ACTIONS];
+} posix_spawn_file_actions_t;
+
+int posix_spawn_file_actions_init(posix_spawn_file_actions_t *actions);
+int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *actions);
+int posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *actions, int fd, int newfd);
+int posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *actions, int fd);
+int posix_spawn(int *pid, const char *path, const posix_spawn_file_actions_t *actions,
+                const char *const argv[], const char *const envp[]);
+
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+#define IOV_MAX 1024
+
+long readv(int fd, const struct iovec *iov, int iovcnt);
+long writev(int fd, const struct iovec *iov, int iovcnt);
+long preadv(int fd, const struct iovec *iov, int iovcnt, long offset);
+long pwritev(int fd, const struct iovec *iov, int iovcnt, long offset);
+
+// mmap protection and flags, numbered as on Linux
+#define PROT_NONE     0x0
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_FAILED    ((void *)-1)
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, long offset);
+int munmap(void *addr, size_t len);
+
 int pipe(int pipefd[2]);
 int dup2(int oldfd, int newfd);
 int close(int fd);
 
+// fcntl commands and flags, numbered as on Linux
+#define F_GETFD      1
+#define F_SETFD      2
+#define FD_CLOEXEC   1
+#define F_GETFL      3
+#define F_SETFL      4
+#define O_NONBLOCK   04000
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+
+int fcntl(int fd, int cmd, long arg);
+
+#define SPLICE_F_NONBLOCK 0x02
+
+long splice(int fd_in, long *off_in, int fd_out, long *off_out, size_t len, unsigned flags);
+long tee(int fd_in, int fd_out, size_t len, unsigned flags);
+
+// Batched submission ring: queue calls in shared memory and run them all
+// with one trap. The caller provides URING_REGION_SIZE(entries) bytes,
+// 8-byte aligned; entries is a power of two, at most 4096.
+struct uring_header {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    uint32_t cq_mask;
+    uint32_t cq_entries;
+    uint32_t reserved[8];
+};
+
+struct uring_sqe {
+    uint32_t opcode;
+    uint32_t flags;
+    uint64_t args[6];
+    uint64_t user_data;
+};
+
+struct uring_cqe {
+    uint64_t user_data;
+    int64_t res;
+};
+
+#define URING_REGION_SIZE(entries)                                        \
+    (sizeof(struct uring_header) + (size_t)(entries) * sizeof(struct uring_sqe) + \
+     2 * (size_t)(entries) * sizeof(struct uring_cqe))
+
+struct uring {
+    struct uring_header *header;
+    struct uring_sqe *sqes;
+    struct uring_cqe *cqes;
+    uint32_t pending;
+};
+
+int uring_init(struct uring *ring, void *region, unsigned entries);
+void uring_exit(struct uring *ring);
+struct uring_sqe *uring_get_sqe(struct uring *ring);
+void uring_prep_read(struct uring_sqe *sqe, int fd, void *buf, size_t len, uint64_t user_data);
+void uring_prep_write(struct uring_sqe *sqe, int fd, const void *buf, size_t len, uint64_t user_data);
+void uring_prep_open(struct uring_sqe *sqe, const char *path, int flags, uint64_t user_data);
+void uring_prep_close(struct uring_sqe *sqe, int fd, uint64_t user_data);
+int uring_submit(struct uring *ring);
+struct uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
 int getpid(void);
 void exit(int code) __attribute__((noreturn));
 
@@ -31,6 +31,20 @@ typedef long pid_t;
 #define SYS_CLOSE  12
 #define SYS_PIPE   13
 #define SYS_DUP2   23
+#define SYS_FCNTL  25
+#define SYS_SPLICE 26
+#define SYS_TEE    27
+#define SYS_URING_SETUP 28
+#define SYS_URING_ENTER 29
+#define SYS_READV  30
+#define SYS_WRITEV 31
+#define SYS_PREADV 32
+#define SYS_PWRITEV 33
+#define SYS_SPAWN  34
+
+// errno values returned by the posix_spawn family, as on Linux
+#define EBADF  9
+#define ENOMEM 12
 
 static long __syscall6(long number, long a1, long a2, long a3, long a4, long a5, long a6) {
 #ifdef __x86_64__
@@ -65,6 +79,8 @@ static void *heap_current = NULL;
 void *malloc(size_t size) {
     if (!heap_start) {
         heap_start = __syscall6(SYS_BRK, 0, 0, 0, 0, 0, 0);
+        // Claim the arena; its pages are faulted in on first use
+        __syscall6(SYS_BRK, (long)heap_start + 4096, 0, 0, 0, 0, 0);
         heap_current = heap_start;
     }
     
@@ -1426,6 +1442,35 @@ long read(int fd, void *buf, size_t len) {
     return __syscall6(SYS_READ, fd, (long)buf, len, 0, 0, 0);
 }
 
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, long offset) {
+    long ret = __syscall6(SYS_MMAP, (long)addr, (long)len, prot, flags, fd, offset);
+    // Errors come back as -errno, which no mapping address can be
+    if (ret < 0 && ret > -4096) {
+        return MAP_FAILED;
+    }
+    return (void *)ret;
+}
+
+int munmap(void *addr, size_t len) {
+    return (int)__syscall6(SYS_MUNMAP, (long)addr, (long)len, 0, 0, 0, 0);
+}
+
+long readv(int fd, const struct iovec *iov, int iovcnt) {
+    return __syscall6(SYS_READV, fd, (long)iov, iovcnt, 0, 0, 0);
+}
+
+long writev(int fd, const struct iovec *iov, int iovcnt) {
+    return __syscall6(SYS_WRITEV, fd, (long)iov, iovcnt, 0, 0, 0);
+}
+
+long preadv(int fd, const struct iovec *iov, int iovcnt, long offset) {
+    return __syscall6(SYS_PREADV, fd, (long)iov, iovcnt, offset, 0, 0);
+}
+
+long pwritev(int fd, const struct iovec *iov, int iovcnt, long offset) {
+    return __syscall6(SYS_PWRITEV, fd, (long)iov, iovcnt, offset, 0, 0);
+}
+
 int fork(void) {
     return (int)__syscall6(SYS_FORK, 0, 0, 0, 0, 0, 0);
 }
@@ -1434,6 +1479,53 @@ int exec(const char *path, const char *const argv[]) {
     return (int)__syscall6(SYS_EXEC, (long)path, (long)argv, 0, 0, 0, 0);
 }
 
+int posix_spawn_file_actions_init(posix_spawn_file_actions_t *actions) {
+    actions->count = 0;
+    return 0;
+}
+
+int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *actions) {
+    actions->count = 0;
+    return 0;
+}
+
+static int spawn_add_action(posix_spawn_file_actions_t *actions, uint32_t kind, int fd, int newfd) {
+    if (fd < 0 || newfd < 0) {
+        return EBADF;
+    }
+    if (actions->count >= SPAWN_MAX_ACTIONS) {
+        return ENOMEM;
+    }
+    struct spawn_action *a = &actions->actions[actions->count++];
+    a->kind = kind;
+    a->fd = (uint32_t)fd;
+    a->newfd = (uint32_t)newfd;
+    a->reserved = 0;
+    return 0;
+}
+
+int posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *actions, int fd, int newfd) {
+    return spawn_add_action(actions, SPAWN_DUP2, fd, newfd);
+}
+
+int posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *actions, int fd) {
+    return spawn_add_action(actions, SPAWN_CLOSE, fd, 0);
+}
+
+// Returns 0 and the child's pid in *pid, or a positive errno as POSIX does
+int posix_spawn(int *pid, const char *path, const posix_spawn_file_actions_t *actions,
+                const char *const argv[], const char *const envp[]) {
+    long ret = __syscall6(SYS_SPAWN, (long)path, (long)argv, (long)envp,
+                          actions ? (long)actions->actions : 0, actions ? actions->count : 0, 0);
+    if (ret < 0) {
+        return (int)-ret;
+    }
+    if (pid) {
+        *pid = (int)ret;
+    }
+    return 0;
+}
+
 int wait(int pid) {
     return (int)__syscall6(SYS_WAIT, pid, 0, 0, 0, 0, 0);
 }
@@ -1454,6 +1546,96 @@ int close(int fd) {
     return (int)__syscall6(SYS_CLOSE, fd, 0, 0, 0, 0, 0);
 }
 
+int fcntl(int fd, int cmd, long arg) {
+    return (int)__syscall6(SYS_FCNTL, fd, cmd, arg, 0, 0, 0);
+}
+
+long splice(int fd_in, long *off_in, int fd_out, long *off_out, size_t len, unsigned flags) {
+    return __syscall6(SYS_SPLICE, fd_in, (long)off_in, fd_out, (long)off_out, (long)len, flags);
+}
+
+long tee(int fd_in, int fd_out, size_t len, unsigned flags) {
+    return __syscall6(SYS_TEE, fd_in, fd_out, (long)len, flags, 0, 0);
+}
+
+int uring_init(struct uring *ring, void *region, unsigned entries) {
+    long ret = __syscall6(SYS_URING_SETUP, (long)region, entries, 0, 0, 0, 0);
+    if (ret < 0) {
+        return (int)ret;
+    }
+    ring->header = region;
+    ring->sqes = (struct uring_sqe *)(ring->header + 1);
+    ring->cqes = (struct uring_cqe *)(ring->sqes + entries);
+    ring->pending = 0;
+    return 0;
+}
+
+void uring_exit(struct uring *ring) {
+    __syscall6(SYS_URING_SETUP, 0, 0, 0, 0, 0, 0);
+    ring->header = NULL;
+}
+
+// NULL when every slot is queued but not yet consumed by uring_submit
+struct uring_sqe *uring_get_sqe(struct uring *ring) {
+    struct uring_header *h = ring->header;
+    uint32_t tail = h->sq_tail + ring->pending;
+    if (tail - __atomic_load_n(&h->sq_head, __ATOMIC_ACQUIRE) >= h->sq_entries) {
+        return NULL;
+    }
+    ring->pending++;
+    struct uring_sqe *sqe = &ring->sqes[tail & h->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_prep(struct uring_sqe *sqe, uint32_t opcode, long a1, long a2, long a3, uint64_t user_data) {
+    sqe->opcode = opcode;
+    sqe->args[0] = (uint64_t)a1;
+    sqe->args[1] = (uint64_t)a2;
+    sqe->args[2] = (uint64_t)a3;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_read(struct uring_sqe *sqe, int fd, void *buf, size_t len, uint64_t user_data) {
+    uring_prep(sqe, SYS_READ, fd, (long)buf, (long)len, user_data);
+}
+
+void uring_prep_write(struct uring_sqe *sqe, int fd, const void *buf, size_t len, uint64_t user_data) {
+    uring_prep(sqe, SYS_WRITE, fd, (long)buf, (long)len, user_data);
+}
+
+void uring_prep_open(struct uring_sqe *sqe, const char *path, int flags, uint64_t user_data) {
+    uring_prep(sqe, SYS_OPEN, (long)path, flags, 0, user_data);
+}
+
+void uring_prep_close(struct uring_sqe *sqe, int fd, uint64_t user_data) {
+    uring_prep(sqe, SYS_CLOSE, fd, 0, 0, user_data);
+}
+
+// Publish queued entries and run them; returns how many the kernel consumed
+int uring_submit(struct uring *ring) {
+    struct uring_header *h = ring->header;
+    __atomic_store_n(&h->sq_tail, h->sq_tail + ring->pending, __ATOMIC_RELEASE);
+    ring->pending = 0;
+    uint32_t queued = h->sq_tail - __atomic_load_n(&h->sq_head, __ATOMIC_ACQUIRE);
+    return (int)__syscall6(SYS_URING_ENTER, queued, 0, 0, 0, 0, 0);
+}
+
+// Oldest unreaped completion, or NULL; release it with uring_cqe_seen
+struct uring_cqe *uring_peek_cqe(struct uring *ring) {
+    struct uring_header *h = ring->header;
+    uint32_t head = h->cq_head;
+    if (head == __atomic_load_n(&h->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & h->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    struct uring_header *h = ring->header;
+    __atomic_store_n(&h->cq_head, h->cq_head + 1, __ATOMIC_RELEASE);
+}
+
 int getpid(void) {
     return (int)__syscall6(SYS_GETPID, 0, 0, 0, 0, 0, 0);
 }